@@ -0,0 +1,10 @@
+  ld b, 0
+  ld c, 8
+: rlca
+  ld d, a
+  ld a, b
+  adc a, 0
+  ld b, a
+  ld a, d
+  dec c
+  jr nz, :-
@@ -0,0 +1,7 @@
+  ld hl, src
+  ld b, 0
+  xor a, a
+: add a, [hl]
+  inc hl
+  dec b
+  jr nz, :-
@@ -0,0 +1,188 @@
+#include "gb-sim.h"
+#include <time.h>
+
+
+// Times parsing, per-instruction execution, whole programs and state resets,
+// and prints the results as JSON.  Each measurement repeats until it has run
+// for at least min_seconds, so results are stable across machines of very
+// different speeds.
+
+
+double min_seconds = 0.1;
+
+double seconds()
+{ struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// nanoseconds per call of f
+double measure(void (*f)(void *), void *arg)
+{ size_t n = 1;
+  for (;;)
+  { double t0 = seconds();
+    for (size_t i = 0; i < n; i++) f(arg);
+    double t = seconds() - t0;
+    if (min_seconds <= t) return t * 1e9 / n;
+    n *= 2;
+  }
+}
+
+
+struct symbol symbols[] =
+{ "dst", 0xc000
+, "src", 0x0100
+, "len", 5
+};
+
+char *corpus[] =
+{ "sim-hello.asm"
+, "sim-negate.asm"
+, "sim-extend.asm"
+, "sim-bcd.asm"
+, "bench-sum.asm"
+, "bench-popcount.asm"
+};
+
+char *opcodes[] =
+{ "nop"
+, "ld a, b"
+, "ld a, [hl]"
+, "ld [hli], a"
+, "ld a, [de]"
+, "add a, b"
+, "adc a, 3"
+, "sub a, c"
+, "and a, d"
+, "xor a, a"
+, "cp a, e"
+, "inc b"
+, "dec c"
+, "inc hl"
+, "add hl, de"
+, "daa"
+, "cpl"
+, "rla"
+, "sla b"
+, "swap a"
+};
+
+
+// register states cycled through by the throughput runs
+struct registers inputs[256];
+size_t next_input;
+
+void seed_inputs()
+{ srand(1);
+  for (int i = 0; i < listsize(inputs); i++)
+  { uint8_t *r = (uint8_t *)&inputs[i];
+    for (int j = 0; j < sizeof(struct registers); j++) r[j] = rand();
+    inputs[i].f &= 0xf0;
+  }
+}
+
+
+void parse_one(void *filename)
+{ free(parse_program_file(symbols, listsize(symbols), filename)); }
+
+void run_one(void *program)
+{ reg = inputs[next_input++ % listsize(inputs)];
+  run_program(program);
+}
+
+void run_straight(void *program)
+{ reg.hl = 0xc000;
+  reg.de = 0x0100;
+  run_program(program);
+}
+
+void setup_input(size_t run, void *unused)
+{ reg = inputs[run % listsize(inputs)]; }
+
+void reset_mem(void *unused)
+{ memset(mem, 0, sizeof(mem)); }
+
+void reset_snapshot(void *snapshot)
+{ restore_snapshot(snapshot); }
+
+
+int main(int argc, char **argv)
+{ seed_inputs();
+
+  printf("{\n  \"parse\": [\n");
+  for (int i = 0; i < listsize(corpus); i++)
+  { double ns = measure(parse_one, corpus[i]);
+    printf
+    ( "    { \"file\": \"%s\", \"ns\": %.0f }%s\n"
+    , corpus[i], ns, i + 1 < listsize(corpus) ? "," : ""
+    );
+  }
+
+  // each instruction repeated to dilute the loop around it
+  size_t repeat = 4096;
+  printf("  ],\n  \"opcodes\": [\n");
+  for (int i = 0; i < listsize(opcodes); i++)
+  { char line[64];
+    snprintf(line, sizeof(line), "%s\n", opcodes[i]);
+    struct program *one = parse_program(symbols, listsize(symbols), line);
+    if (1 != one->length) panic;
+    struct program *program =
+      malloc(sizeof(struct program) + repeat * sizeof(struct instruction));
+    program->length = repeat;
+    for (size_t j = 0; j < repeat; j++)
+      program->instructions[j] = one->instructions[0];
+    double ns = measure(run_straight, program) / repeat;
+    printf
+    ( "    { \"instruction\": \"%s\", \"ns\": %.2f, \"cycles\": %.0f }%s\n"
+    , opcodes[i], ns, (double)cycles / repeat
+    , i + 1 < listsize(opcodes) ? "," : ""
+    );
+    free(program);
+    free(one);
+  }
+
+  printf("  ],\n  \"programs\": [\n");
+  for (int i = 0; i < listsize(corpus); i++)
+  { struct program *program =
+      parse_program_file(symbols, listsize(symbols), corpus[i]);
+
+    uint64_t n_instructions = 0, n_cycles = 0;
+    for (int j = 0; j < listsize(inputs); j++)
+    { reg = inputs[j];
+      n_instructions += run_program_counting(program);
+      n_cycles += cycles;
+    }
+
+    next_input = 0;
+    double ns = measure(run_one, program);
+    double per_run = (double)n_instructions / listsize(inputs);
+    double cycles_per_run = (double)n_cycles / listsize(inputs);
+    printf
+    ( "    { \"file\": \"%s\", \"ns\": %.1f"
+      ", \"instructions\": %.1f, \"cycles\": %.1f"
+      ", \"instructions_per_second\": %.0f, \"cycles_per_second\": %.0f"
+    , corpus[i], ns, per_run, cycles_per_run
+    , per_run * 1e9 / ns, cycles_per_run * 1e9 / ns
+    );
+
+    // per simulated instruction, null where the counter is unavailable
+    struct host_profile p = profile_program(program, 1 << 16, setup_input, NULL);
+    for (int j = 0; j < N_HOST_COUNTERS; j++)
+      if (p.available[j])
+        printf(", \"%s\": %.2f", host_counter_names[j], (double)p.counts[j] / p.instructions);
+      else
+        printf(", \"%s\": null", host_counter_names[j]);
+    printf(" }%s\n", i + 1 < listsize(corpus) ? "," : "");
+    free(program);
+  }
+
+  struct snapshot *snapshot = malloc(sizeof(struct snapshot));
+  save_snapshot(snapshot);
+  printf("  ],\n  \"reset\": {\n");
+  printf("    \"memset_ns\": %.0f,\n", measure(reset_mem, NULL));
+  printf("    \"restore_snapshot_ns\": %.0f\n", measure(reset_snapshot, snapshot));
+  printf("  }\n}\n");
+  free(snapshot);
+
+  return 0;
+}
@@ -0,0 +1,125 @@
+#include "gb-sim.h"
+
+
+// Show how the cycles a routine takes are spread over its inputs, and which
+// inputs take the most.
+//
+//   gb-cycles routine.asm [in=a,e,c000:2] [call=label] [samples=n] [name=value ...]
+//
+// Registers are a f b c d e h l and the pairs af bc de hl.  Memory is
+// address:length.  Inputs default to the registers the routine may read from
+// where it starts, and every value of them is run unless samples (decimal)
+// are asked for.  Inputs on which it panics or runs too long are reported,
+// and fail the run.  With call, the routine is called at a label rather than run
+// from the start.  Other assignments are symbols for the routine.  Values
+// are hexadecimal.
+
+static uint16_t inputs;
+static struct mem_range *input_mem;
+static size_t n_input_mem;
+
+static bool parse_locs(char *list)
+{ static struct { char *name; uint16_t locs; } names[] =
+  { "a", LOC_A, "f", LOC_F
+  , "b", LOC_B, "c", LOC_C
+  , "d", LOC_D, "e", LOC_E
+  , "h", LOC_H, "l", LOC_L
+  , "af", LOC_A | LOC_F, "bc", LOC_BC
+  , "de", LOC_DE, "hl", LOC_HL
+  };
+  for (char *item = strtok(list, ","); item; item = strtok(NULL, ","))
+  { char *colon = strchr(item, ':');
+    if (colon)
+    { input_mem[n_input_mem++] = (struct mem_range)
+        { strtol(item, NULL, 16), strtol(colon + 1, NULL, 16) };
+      continue;
+    }
+    int i = 0;
+    while (i < listsize(names) && strcmp(item, names[i].name)) i++;
+    if (listsize(names) == i) return false;
+    inputs |= names[i].locs;
+  }
+  return true;
+}
+
+// in the order compare_programs counts them, then memory
+static void set_input(uint64_t v)
+{ if (LOC_A & inputs) reg.a = v, v >>= 8;
+  if (LOC_B & inputs) reg.b = v, v >>= 8;
+  if (LOC_C & inputs) reg.c = v, v >>= 8;
+  if (LOC_D & inputs) reg.d = v, v >>= 8;
+  if (LOC_E & inputs) reg.e = v, v >>= 8;
+  if (LOC_H & inputs) reg.h = v, v >>= 8;
+  if (LOC_L & inputs) reg.l = v, v >>= 8;
+  if (LOC_F & inputs) reg.f = (v & 0x0f) << 4, v >>= 4;
+  for (size_t i = 0; i < n_input_mem; i++)
+  { struct mem_range m = input_mem[i];
+    for (int j = 0; j < m.length; j++, v >>= 8) mem[m.addr + j] = v;
+  }
+}
+
+
+int main(int argc, char **argv)
+{ if (2 > argc)
+  { printf("usage: %s routine.asm [in=...] [call=label] [samples=n] [name=value ...]\n", argv[0]);
+    return 1;
+  }
+
+  struct mem_range ranges[argc];
+  struct symbol symbols[argc];
+  size_t n_symbols = 0;
+  input_mem = ranges;
+  char *label = NULL;
+  uint64_t samples = 0;
+  bool in = false;
+  for (int i = 2; i < argc; i++)
+  { char *value = strchr(argv[i], '=');
+    bool ok = value;
+    if (!value);
+    else if (!strncmp(argv[i], "in=", 3))
+    { in = true;
+      ok = parse_locs(value + 1);
+    }
+    else if (!strncmp(argv[i], "call=", 5)) label = value + 1;
+    else if (!strncmp(argv[i], "samples=", 8)) samples = strtoull(value + 1, NULL, 10);
+    else if (value - argv[i] < sizeof(symbols->name))
+    { *value = 0;
+      strcpy(symbols[n_symbols].name, argv[i]);
+      symbols[n_symbols++].value = strtol(value + 1, NULL, 16);
+    }
+    else ok = false;
+    if (!ok)
+    { printf("bad argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  struct module *module = parse_module_file(symbols, n_symbols, argv[1]);
+  module = link_modules(1, &module);
+  int entry = label ? find_label(module, label) : 0;
+  if (0 > entry)
+  { printf("no label %s\n", label);
+    return 1;
+  }
+  if (!in) inputs = live_inputs_from(module->program, entry) & LOC_ALL & ~LOC_SP;
+
+  struct cycle_profile *p = calloc(1, sizeof(struct cycle_profile));
+  p->program = module->program;
+  p->entry = entry;
+  p->input = set_input;
+  p->samples = samples;
+  for (int i = 0; i < 8; i++)
+    if (1 << i & inputs) p->bits += LOC_F == 1 << i ? 4 : 8;
+  for (size_t i = 0; i < n_input_mem; i++) p->bits += 8 * input_mem[i].length;
+  if (32 < p->bits && !samples || 63 < p->bits)
+  { printf("%d bits of input is too many to cover, without samples\n", p->bits);
+    return 1;
+  }
+
+  reg.sp = 0xfffe;
+  profile_cycles(p);
+  print_cycle_profile(p);
+  int failed = p->panics || p->workers_died;
+  free(p);
+  return failed;
+}
@@ -0,0 +1,163 @@
+#include "gb-sim.h"
+
+
+// Check that two routines leave the same outputs behind for every input, and
+// compare their cycle counts.
+//
+//   gb-equiv old.asm new.asm [in=a,f,c000:2] [out=hl,zf,cf,c100:4] [name=value ...]
+//
+// Registers are a f b c d e h l, the pairs af bc de hl, and sp; zf nf hf cf
+// are single flags where f is all four.  Memory is address:length.
+// Inputs default to the registers either routine reads, and outputs to every
+// register and flag.  Other assignments are symbols for the routines.  Values
+// are hexadecimal.
+
+static bool parse_locs
+( char *list, uint16_t *locs, uint8_t *flags
+, struct mem_range *ranges, size_t *n_ranges
+)
+{ static struct { char *name; uint16_t locs; uint8_t flags; } names[] =
+  { "a", LOC_A, 0, "f", LOC_F, 0xf0
+  , "b", LOC_B, 0, "c", LOC_C, 0
+  , "d", LOC_D, 0, "e", LOC_E, 0
+  , "h", LOC_H, 0, "l", LOC_L, 0
+  , "af", LOC_A | LOC_F, 0xf0, "bc", LOC_BC, 0
+  , "de", LOC_DE, 0, "hl", LOC_HL, 0
+  , "sp", LOC_SP, 0
+  , "zf", 0, FLAG_Z, "nf", 0, FLAG_N
+  , "hf", 0, FLAG_H, "cf", 0, FLAG_C
+  };
+  for (char *item = strtok(list, ","); item; item = strtok(NULL, ","))
+  { char *colon = strchr(item, ':');
+    if (colon)
+    { ranges[(*n_ranges)++] = (struct mem_range)
+        { strtol(item, NULL, 16), strtol(colon + 1, NULL, 16) };
+      continue;
+    }
+    int i = 0;
+    while (i < listsize(names) && strcmp(item, names[i].name)) i++;
+    if (listsize(names) == i) return false;
+    *locs |= names[i].locs;
+    *flags |= names[i].flags;
+  }
+  return true;
+}
+
+static void print_memory(struct mem_range *ranges, size_t n)
+{ for (size_t i = 0; i < n; i++)
+  { printf("%04x:", ranges[i].addr);
+    for (int j = 0; j < ranges[i].length; j++) printf(" %02x", mem[ranges[i].addr + j]);
+    printf("\n");
+  }
+}
+
+
+int main(int argc, char **argv)
+{ if (3 > argc)
+  { printf("usage: %s old.asm new.asm [in=...] [out=...] [name=value ...]\n", argv[0]);
+    return 1;
+  }
+
+  struct mem_range input_mem[argc], output_mem[argc];
+  struct symbol symbols[argc];
+  size_t n_input_mem = 0, n_output_mem = 0, n_symbols = 0;
+  uint16_t inputs = 0, outputs = 0;
+  uint8_t input_flags = 0, output_flags = 0;
+  bool in = false, out = false;
+  for (int i = 3; i < argc; i++)
+  { char *value = strchr(argv[i], '=');
+    bool ok = value;
+    if (!value);
+    else if (!strncmp(argv[i], "in=", 3))
+    { in = true;
+      ok = parse_locs(value + 1, &inputs, &input_flags, input_mem, &n_input_mem);
+    }
+    else if (!strncmp(argv[i], "out=", 4))
+    { out = true;
+      ok = parse_locs(value + 1, &outputs, &output_flags, output_mem, &n_output_mem);
+    }
+    else if (value - argv[i] < sizeof(symbols->name))
+    { *value = 0;
+      strcpy(symbols[n_symbols].name, argv[i]);
+      symbols[n_symbols++].value = strtol(value + 1, NULL, 16);
+    }
+    else ok = false;
+    if (!ok)
+    { printf("bad argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  struct program *a = parse_program_file(symbols, n_symbols, argv[1]);
+  struct program *b = parse_program_file(symbols, n_symbols, argv[2]);
+  if (!in) inputs = (live_inputs(a) | live_inputs(b)) & LOC_ALL;
+  if (!out)
+  { outputs = LOC_ALL & ~LOC_F;
+    output_flags = 0xf0;
+  }
+
+  struct equivalence e =
+  { a, b
+  , inputs, input_flags, input_mem, n_input_mem
+  , outputs & ~LOC_F, output_flags, output_mem, n_output_mem
+  };
+  int bits = equivalence_bits(&e);
+  if (32 < bits)
+  { printf("%d bits of input is too many to cover\n", bits);
+    return 1;
+  }
+
+  reg.sp = 0xfffe;
+  bool same = check_equivalence(&e);
+  if (e.workers_died)
+  { printf("%d workers died, so not every input was checked\n", e.workers_died);
+    return 1;
+  }
+  printf
+  ( "%llu inputs, %llu differ (%llu by panicking or running too long)\n"
+  , (unsigned long long)e.n, (unsigned long long)e.mismatches
+  , (unsigned long long)e.panics
+  );
+  if (!same)
+  { printf("first differing inputs:\n");
+    status();
+    print_memory(input_mem, n_input_mem);
+    struct program *programs[] = { a, b };
+    char *names[] = { "old", "new" };
+    for (int i = 0; i < 2; i++)
+    { set_equivalence_input(&e, e.first_mismatch);
+      jmp_buf jump;
+      if (setjmp(jump))
+      { panic_jump = NULL;
+        cycle_limit = UINT32_MAX;
+        printf("%s panics or runs too long, after %d cycles\n", names[i], cycles);
+        continue;
+      }
+      panic_jump = &jump;
+      cycle_limit = e.max_cycles;
+      run_program(programs[i]);
+      panic_jump = NULL;
+      cycle_limit = UINT32_MAX;
+      printf("%s outputs, %d cycles:\n", names[i], cycles);
+      status();
+      print_memory(output_mem, n_output_mem);
+    }
+  }
+
+  printf
+  ( "cycles: old %u to %u (mean %.2f), new %u to %u (mean %.2f)\n"
+  , e.min_a, e.max_a, (double)e.cycles_a / e.n
+  , e.min_b, e.max_b, (double)e.cycles_b / e.n
+  );
+  printf("difference (new less old), in inputs:\n");
+  for (int i = 0; i < listsize(e.deltas); i++)
+    if (e.deltas[i])
+    { int delta = i - EQUIV_MAX_DELTA;
+      printf
+      ( "  %s%+d: %llu\n"
+      , abs(delta) == EQUIV_MAX_DELTA ? "beyond " : "", delta
+      , (unsigned long long)e.deltas[i]
+      );
+    }
+  return !same;
+}
@@ -0,0 +1,68 @@
+#include "gb-sim.h"
+
+
+// List instruction sequences in source files which have cheaper equivalents,
+// with the cycles each rewrite saves.
+//
+//   gb-peephole file.asm [more.asm ...] [name=value ...]
+//
+// The files are linked together as one program, so labels may be used across
+// them.  Assignments are symbols for the files.  Values are hexadecimal.
+
+int main(int argc, char **argv)
+{ if (2 > argc)
+  { printf("usage: %s file.asm [more.asm ...] [name=value ...]\n", argv[0]);
+    return 1;
+  }
+
+  struct symbol symbols[argc];
+  char *files[argc];
+  size_t n_symbols = 0, n_files = 0;
+  for (int i = 1; i < argc; i++)
+  { char *value = strchr(argv[i], '=');
+    if (!value) files[n_files++] = argv[i];
+    else if (value - argv[i] < sizeof(symbols->name))
+    { *value = 0;
+      strcpy(symbols[n_symbols].name, argv[i]);
+      symbols[n_symbols++].value = strtol(value + 1, NULL, 16);
+    }
+    else
+    { printf("bad argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  struct module *modules[argc];
+  for (size_t i = 0; i < n_files; i++)
+    modules[i] = parse_module_file(symbols, n_symbols, files[i]);
+  struct module *module = link_modules(n_files, modules);
+
+  reg.sp = 0xfffe;
+  struct peephole *peepholes;
+  size_t n = suggest_peepholes(module->program, &peepholes);
+  int total = 0;
+  for (size_t i = 0; i < n; i++)
+  { struct peephole *p = &peepholes[i];
+    char buf[32];
+    printf("%s:%d: ", module->files[p->isn], module->lines[p->isn]);
+    for (int j = 0; j < p->length; j++)
+      printf("%s%s", j ? "; " : "", format_instruction(buf, module->program->instructions[p->isn + j]));
+    printf(" -> ");
+    for (int j = 0; j < p->n_with; j++)
+      printf("%s%s", j ? "; " : "", format_instruction(buf, p->with[j]));
+    printf(", saves %d cycle%s", p->cycles_saved, 1 == p->cycles_saved ? "" : "s");
+    if (p->flags)
+    { printf(" (");
+      static const char *names[] = { "cf", "hf", "nf", "zf" };
+      for (int f = 3, first = 1; 0 <= f; f--)
+        if (0x10 << f & p->flags)
+          printf("%s%s", first ? "" : ", ", names[f]), first = 0;
+      printf(" dead)");
+    }
+    printf("\n");
+    total += p->cycles_saved;
+  }
+  printf("%zu suggestions, %d cycles\n", n, total);
+  free(peepholes);
+  return 0;
+}
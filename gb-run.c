@@ -0,0 +1,57 @@
+#include "gb-sim.h"
+
+
+// Run a routine from a ROM image until it returns, and print the registers.
+//
+//   gb-run game.gb game.sym Routine [a=12 hl=c000 ...]
+//
+// Register values are hexadecimal.
+
+static uint16_t *register_named(char *name, bool *wide)
+{ static struct { char *name; void *p; bool wide; } registers[] =
+  { "a", &reg.a, false, "f", &reg.f, false
+  , "b", &reg.b, false, "c", &reg.c, false
+  , "d", &reg.d, false, "e", &reg.e, false
+  , "h", &reg.h, false, "l", &reg.l, false
+  , "af", &reg.af, true, "bc", &reg.bc, true
+  , "de", &reg.de, true, "hl", &reg.hl, true
+  , "sp", &reg.sp, true
+  };
+  for (int i = 0; i < listsize(registers); i++)
+    if (!strcmp(name, registers[i].name))
+    { *wide = registers[i].wide;
+      return registers[i].p;
+    }
+  return NULL;
+}
+
+
+int main(int argc, char **argv)
+{ if (4 > argc)
+  { printf("usage: %s rom sym routine [register=value ...]\n", argv[0]);
+    return 1;
+  }
+
+  struct rom *rom = load_rom(argv[1], argv[2]);
+
+  reg.sp = 0xfffe;
+  for (int i = 4; i < argc; i++)
+  { char *value = strchr(argv[i], '=');
+    bool wide;
+    uint16_t *r = value ? (*value++ = 0, register_named(argv[i], &wide)) : NULL;
+    if (!r)
+    { printf("bad register assignment: %s\n", argv[i]);
+      return 1;
+    }
+    if (wide) *r = strtol(value, NULL, 16);
+    else *(uint8_t *)r = strtol(value, NULL, 16);
+  }
+
+  if (!call_rom_routine(rom, argv[3]))
+  { printf("no symbol %s\n", argv[3]);
+    return 1;
+  }
+  printf("%d cycles\n", cycles);
+  status();
+  return 0;
+}
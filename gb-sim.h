@@ -1,13 +1,26 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <setjmp.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-struct
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+struct registers
 { union
   { struct { uint8_t f, a; };
     uint16_t af;
@@ -28,7 +41,7 @@ struct
   uint16_t sp;
 } reg;
 
-uint16_t cycles = 0;
+uint32_t cycles = 0;
 
 enum flag
 { FLAG_Z = 1 << 7
@@ -55,6 +68,258 @@ enum r16
 
 uint8_t mem[1 << 16];
 
+#define listsize(list) (sizeof(list) / sizeof(*list))
+
+
+// memory map
+
+
+// Addresses resolve through tables of 256-byte pages, so that ROM banks and
+// other storage can be mapped in without copying.  A page is either a direct
+// pointer, or NULL, in which case its handler is called instead (to trap ROM
+// writes, give IO registers side effects, or catch illegal accesses).  Every
+// page maps to mem until something else is mapped over it.
+
+#define _PAGES_4(i) \
+  mem + ((i) << 8), mem + ((i) + 1 << 8), mem + ((i) + 2 << 8), mem + ((i) + 3 << 8)
+#define _PAGES_16(i) _PAGES_4(i), _PAGES_4((i) + 4), _PAGES_4((i) + 8), _PAGES_4((i) + 12)
+#define _PAGES_64(i) _PAGES_16(i), _PAGES_16((i) + 16), _PAGES_16((i) + 32), _PAGES_16((i) + 48)
+#define _PAGES_256 _PAGES_64(0), _PAGES_64(64), _PAGES_64(128), _PAGES_64(192)
+
+uint8_t *read_pages[256] = { _PAGES_256 };
+uint8_t *write_pages[256] = { _PAGES_256 };
+uint8_t (*read_handlers[256])(uint16_t addr);
+void (*write_handlers[256])(uint16_t addr, uint8_t val);
+
+// writes to pages mapped here are lost
+uint8_t ignored_writes[256];
+
+
+struct program;
+
+// The instruction running, for the shadow memory, watchpoints and faults to
+// report against.  The runners set running_program as they start, and
+// running_isn before each instruction.
+struct program *running_program;   // NULL under run_machine,
+uint16_t running_isn;              // where this is the address of the instruction
+
+#define _RUNNING(program, isn) (running_program = (program), running_isn = (isn))
+
+
+// Built with SHADOW_MEMORY defined, a bit is kept for each byte of mem, set
+// once the byte is written by the program or marked by the harness
+// (mark_initialized), and reads of bytes without it are recorded against the
+// instruction making them.  The lowest reg.sp the program reaches is kept
+// too.  Without SHADOW_MEMORY, none of it is compiled in.
+
+#ifdef SHADOW_MEMORY
+
+#define SHADOW_REPORTS 64
+
+// the first read of uninitialized memory by each instruction
+struct uninitialized_read
+{ struct program *program;   // NULL under run_machine,
+  uint16_t isn;              // where this is the address of the instruction
+  uint16_t addr;
+};
+
+uint8_t shadow[1 << 13];
+uint16_t lowest_sp = 0xffff;
+struct uninitialized_read uninitialized_reads[SHADOW_REPORTS];
+size_t n_uninitialized_reads;
+uint64_t uninitialized_read_count;   // of every read, kept or not
+
+#define _SHADOWING true
+
+void mark_initialized(uint16_t addr, size_t length)
+{ for (size_t i = 0; i < length; i++)
+  { uint16_t a = addr + i;
+    shadow[a >> 3] |= 1 << (7 & a);
+  }
+}
+
+// forget every mark and report, and the lowest SP
+void clear_shadow()
+{ memset(shadow, 0, sizeof(shadow));
+  lowest_sp = 0xffff;
+  n_uninitialized_reads = 0;
+  uninitialized_read_count = 0;
+}
+
+static void _shadow_read(uint8_t *byte, uint16_t addr)
+{ if (byte < mem || byte >= mem + sizeof(mem)) return;
+  size_t at = byte - mem;
+  if (shadow[at >> 3] & 1 << (7 & at)) return;
+  uninitialized_read_count++;
+  for (size_t i = 0; i < n_uninitialized_reads; i++)
+  { struct uninitialized_read *r = &uninitialized_reads[i];
+    if (running_program == r->program && running_isn == r->isn) return;
+  }
+  if (SHADOW_REPORTS > n_uninitialized_reads)
+    uninitialized_reads[n_uninitialized_reads++] =
+      (struct uninitialized_read){ running_program, running_isn, addr };
+}
+
+static inline void _shadow_write(uint8_t *byte)
+{ if (byte < mem || byte >= mem + sizeof(mem)) return;
+  size_t at = byte - mem;
+  shadow[at >> 3] |= 1 << (7 & at);
+}
+
+#define _SHADOW_READ(byte, addr) _shadow_read(byte, addr)
+#define _SHADOW_WRITE(byte) _shadow_write(byte)
+#define _SHADOW_SP() (reg.sp < lowest_sp ? lowest_sp = reg.sp : 0)
+
+#else
+
+#define _SHADOWING false
+#define _SHADOW_READ(byte, addr)
+#define _SHADOW_WRITE(byte)
+#define _SHADOW_SP()
+
+static inline void mark_initialized(uint16_t addr, size_t length) {}
+
+#endif
+
+
+static inline uint8_t read8(uint16_t addr)
+{ uint8_t *page = read_pages[addr >> 8];
+  if (page)
+  { _SHADOW_READ(&page[0xff & addr], addr);
+    return page[0xff & addr];
+  }
+  return read_handlers[addr >> 8](addr);
+}
+
+static inline void write8(uint16_t addr, uint8_t val)
+{ uint8_t *page = write_pages[addr >> 8];
+  if (page)
+  { page[0xff & addr] = val;
+    _SHADOW_WRITE(&page[0xff & addr]);
+  }
+  else write_handlers[addr >> 8](addr, val);
+}
+
+// map size bytes at addr (both multiples of 256) to data for reading, writing,
+// or both; a NULL write map discards writes
+void map_read(uint16_t addr, size_t size, uint8_t *data)
+{ for (size_t i = 0; i < size >> 8; i++)
+    read_pages[(addr >> 8) + i & 0xff] = data + (i << 8);
+}
+
+void map_write(uint16_t addr, size_t size, uint8_t *data)
+{ for (size_t i = 0; i < size >> 8; i++)
+    write_pages[(addr >> 8) + i & 0xff] = data ? data + (i << 8) : ignored_writes;
+}
+
+void map_memory(uint16_t addr, size_t size, uint8_t *data)
+{ map_read(addr, size, data);
+  map_write(addr, size, data);
+}
+
+// route accesses to size bytes at addr through handlers; a NULL handler leaves
+// that direction as it is
+void map_handlers
+( uint16_t addr, size_t size
+, uint8_t (*read)(uint16_t addr), void (*write)(uint16_t addr, uint8_t val)
+)
+{ for (size_t i = 0; i < size >> 8; i++)
+  { int page = (addr >> 8) + i & 0xff;
+    if (read) { read_pages[page] = NULL; read_handlers[page] = read; }
+    if (write) { write_pages[page] = NULL; write_handlers[page] = write; }
+  }
+}
+
+void reset_memory_map()
+{ map_memory(0, 1 << 16, mem); }
+
+
+// accesses to memory mapped with map_faults, for tests to check
+struct memory_fault
+{ struct program *program;   // NULL under run_machine,
+  uint16_t isn;              // where this is the address of the instruction
+  uint16_t addr;
+  bool write;
+};
+
+size_t n_memory_faults;
+struct memory_fault memory_faults[64];  // the first few
+bool print_memory_faults;
+
+static void _memory_fault(uint16_t addr, bool write)
+{ char *kind = write ? "write" : "read";
+  if (print_memory_faults && running_program)
+    printf("illegal %s of %04x at instruction %d\n", kind, addr, running_isn);
+  else if (print_memory_faults)
+    printf("illegal %s of %04x at %04x\n", kind, addr, running_isn);
+  if (n_memory_faults < listsize(memory_faults))
+    memory_faults[n_memory_faults] =
+      (struct memory_fault){ running_program, running_isn, addr, write };
+  n_memory_faults++;
+}
+
+uint8_t fault_read(uint16_t addr)
+{ _memory_fault(addr, false);
+  return 0xff;
+}
+
+void fault_write(uint16_t addr, uint8_t val)
+{ _memory_fault(addr, true); }
+
+void map_faults(uint16_t addr, size_t size, bool reads, bool writes)
+{ map_handlers(addr, size, reads ? fault_read : NULL, writes ? fault_write : NULL); }
+
+
+// IO registers (and HRAM and IE, which share their page) with side effects
+uint8_t (*io_read_hooks[256])(uint16_t addr);
+void (*io_write_hooks[256])(uint16_t addr, uint8_t val);
+
+static uint8_t _io_read(uint16_t addr)
+{ uint8_t (*hook)(uint16_t) = io_read_hooks[0xff & addr];
+  return hook ? hook(addr) : mem[addr];
+}
+
+static void _io_write(uint16_t addr, uint8_t val)
+{ void (*hook)(uint16_t, uint8_t) = io_write_hooks[0xff & addr];
+  if (hook) hook(addr, val);
+  else mem[addr] = val;
+}
+
+// Give an IO register (0xff00-0xffff) a read and/or write hook.  Registers
+// without hooks keep their value in mem; until the first hook, so does the
+// whole page, without going through a handler.
+void hook_io
+( uint16_t addr
+, uint8_t (*read)(uint16_t addr), void (*write)(uint16_t addr, uint8_t val)
+)
+{ io_read_hooks[0xff & addr] = read;
+  io_write_hooks[0xff & addr] = write;
+  map_handlers(0xff00, 0x100, _io_read, _io_write);
+}
+
+
+// OAM, and the unusable area after it
+static uint8_t _oam_read(uint16_t addr)
+{ return 0xfea0 > addr ? mem[addr] : fault_read(addr); }
+
+static void _oam_write(uint16_t addr, uint8_t val)
+{ if (0xfea0 > addr) mem[addr] = val;
+  else fault_write(addr, val);
+}
+
+// Lay out memory as the hardware does: writes to ROM are faults (until a
+// cartridge is mapped), echo RAM mirrors WRAM, and the unusable area after OAM
+// faults.  IO registers go through hook_io.
+void map_hardware_layout()
+{ reset_memory_map();
+  map_faults(0x0000, 0x8000, false, true);
+  map_read(0xe000, 0x1e00, mem + 0xc000);
+  map_write(0xe000, 0x1e00, mem + 0xc000);
+  map_handlers(0xfe00, 0x100, _oam_read, _oam_write);
+  map_handlers(0xff00, 0x100, _io_read, _io_write);
+}
+
+
 enum op
 { OP_ADC_A_R8
 , OP_ADC_A_IHL
@@ -170,10 +435,65 @@ enum op
 , OP_NOP
 , OP_SCF
 , OP_STOP
+
+  // fused loop idioms, substituted for the head of the loop by fuse_idioms
+, OP_COPY_DE_HLI
+, OP_COPY_HLI_DE
+, OP_FILL_HLI
+, OP_CMP_DE_HL
+
+  // variants which leave F alone, substituted by optimize_flags
+, OP_ADC_A_R8_NF
+, OP_ADC_A_IHL_NF
+, OP_ADC_A_N8_NF
+, OP_ADD_A_R8_NF
+, OP_ADD_A_IHL_NF
+, OP_ADD_A_N8_NF
+, OP_AND_A_R8_NF
+, OP_AND_A_IHL_NF
+, OP_AND_A_N8_NF
+, OP_CP_A_R8_NF
+, OP_CP_A_IHL_NF
+, OP_CP_A_N8_NF
+, OP_OR_A_R8_NF
+, OP_OR_A_IHL_NF
+, OP_OR_A_N8_NF
+, OP_SBC_A_R8_NF
+, OP_SBC_A_IHL_NF
+, OP_SBC_A_N8_NF
+, OP_SUB_A_R8_NF
+, OP_SUB_A_IHL_NF
+, OP_SUB_A_N8_NF
+, OP_XOR_A_R8_NF
+, OP_XOR_A_IHL_NF
+, OP_XOR_A_N8_NF
+, OP_DEC_R8_NF
+, OP_DEC_IHL_NF
+, OP_INC_R8_NF
+, OP_INC_IHL_NF
+, OP_ADD_HL_R16_NF
+, OP_RL_R8_NF
+, OP_RLC_R8_NF
+, OP_RR_R8_NF
+, OP_RRC_R8_NF
+, OP_SLA_R8_NF
+, OP_SRA_R8_NF
+, OP_SRL_R8_NF
+, OP_SWAP_R8_NF
+, OP_RLA_NF
+, OP_RLCA_NF
+, OP_RRA_NF
+, OP_RRCA_NF
+
+  // a breakpoint, substituted by set_breakpoint for the instruction it holds
+, OP_BREAK
 };
 
 enum cc
 { CC_NZ
+, CC_Z
+, CC_NC
+, CC_C
 };
 
 struct instruction
@@ -192,15 +512,405 @@ struct symbol
 };
 
 
+// where a panic goes, if set, instead of exiting; setjmp returns the line
+jmp_buf *panic_jump;
+
 noreturn
 void _panic(int line)
-{ printf("PANIC: %d\n", line);
+{ if (panic_jump) longjmp(*panic_jump, line);
+  printf("PANIC: %d\n", line);
   exit(-1);
 }
 
 #define panic _panic(__LINE__)
 
 
+// interrupts and events
+
+
+// Hardware events (timer overflow, VBlank, STAT and LYC) are kept in a
+// min-heap by time, and only looked at once cycles reaches the earliest of
+// them (event_horizon), rather than the hardware being ticked every cycle.
+// Time is in M-cycles: epoch counts those of earlier runs, cycles the current.
+
+#define R_DIV 0xff04
+#define R_TIMA 0xff05
+#define R_TMA 0xff06
+#define R_TAC 0xff07
+#define R_IF 0xff0f
+#define R_LCDC 0xff40
+#define R_STAT 0xff41
+#define R_LY 0xff44
+#define R_LYC 0xff45
+#define R_IE 0xffff
+
+enum interrupt
+{ INT_VBLANK = 1 << 0
+, INT_STAT = 1 << 1
+, INT_TIMER = 1 << 2
+, INT_SERIAL = 1 << 3
+, INT_JOYPAD = 1 << 4
+};
+
+enum event
+{ EVENT_TIMER
+, EVENT_LYC
+, EVENT_VBLANK
+, EVENT_STAT
+, N_EVENTS
+};
+
+uint64_t epoch;
+uint32_t event_horizon = UINT32_MAX;
+uint32_t cycle_limit = UINT32_MAX;   // a run reaching this many cycles panics
+
+bool ime;
+int ei_delay;           // instructions until ei takes effect
+bool dispatching;       // whether the runner can take interrupts
+bool trapped;           // a breakpoint or watchpoint has stopped the run
+
+uint64_t event_at[N_EVENTS];
+enum event event_heap[N_EVENTS];
+int event_index[N_EVENTS] = { -1, -1, -1, -1 };
+int n_events;
+
+static inline uint64_t current_time()
+{ return epoch + cycles; }
+
+static inline bool interrupt_pending()
+{ return mem[R_IE] & mem[R_IF] & 0x1f; }
+
+// recompute when service_events is next due
+static void _update_horizon()
+{ if (trapped || ei_delay || dispatching && ime && interrupt_pending())
+    event_horizon = cycles;
+  else if (!n_events)
+    event_horizon = UINT32_MAX;
+  else if (event_at[event_heap[0]] <= epoch)
+    event_horizon = 0;
+  else if (event_at[event_heap[0]] - epoch >= UINT32_MAX)
+    event_horizon = UINT32_MAX;
+  else
+    event_horizon = event_at[event_heap[0]] - epoch;
+  if (cycle_limit < event_horizon) event_horizon = cycle_limit;
+}
+
+// begin a run, carrying the cycles of the last one into epoch
+static inline void start_cycles()
+{ epoch += cycles;
+  cycles = 0;
+  _update_horizon();
+}
+
+
+static void _swap_events(int i, int j)
+{ enum event e = event_heap[i];
+  event_heap[i] = event_heap[j];
+  event_heap[j] = e;
+  event_index[event_heap[i]] = i;
+  event_index[event_heap[j]] = j;
+}
+
+static void _sift_events(int i)
+{ while (i && event_at[event_heap[i]] < event_at[event_heap[(i - 1) / 2]])
+  { _swap_events(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  for (;;)
+  { int min = i;
+    for (int j = 2 * i + 1; j <= 2 * i + 2 && j < n_events; j++)
+      if (event_at[event_heap[j]] < event_at[event_heap[min]]) min = j;
+    if (min == i) break;
+    _swap_events(i, min);
+    i = min;
+  }
+}
+
+void schedule_event(enum event e, uint64_t at)
+{ event_at[e] = at;
+  if (0 > event_index[e])
+  { event_index[e] = n_events;
+    event_heap[n_events++] = e;
+  }
+  _sift_events(event_index[e]);
+  _update_horizon();
+}
+
+void cancel_event(enum event e)
+{ int i = event_index[e];
+  if (0 > i) return;
+  _swap_events(i, --n_events);
+  event_index[e] = -1;
+  if (i < n_events) _sift_events(i);
+  _update_horizon();
+}
+
+void request_interrupt(enum interrupt i)
+{ mem[R_IF] |= i;
+  _update_horizon();
+}
+
+
+// timer
+
+static const int _timer_periods[4] = { 256, 4, 16, 64 };
+static uint64_t _div_base;
+static uint64_t _tima_base;
+static uint8_t _tima_value;
+
+static uint8_t _tima_now()
+{ if (!(4 & mem[R_TAC])) return _tima_value;
+  return _tima_value + (current_time() - _tima_base) / _timer_periods[3 & mem[R_TAC]];
+}
+
+static void _schedule_timer()
+{ _tima_base = current_time();
+  if (4 & mem[R_TAC])
+    schedule_event
+    ( EVENT_TIMER
+    , _tima_base + (256 - _tima_value) * _timer_periods[3 & mem[R_TAC]]
+    );
+  else cancel_event(EVENT_TIMER);
+}
+
+static uint8_t _read_div(uint16_t addr)
+{ return (current_time() - _div_base) / 64; }
+
+static void _write_div(uint16_t addr, uint8_t val)
+{ _div_base = current_time(); }
+
+static uint8_t _read_tima(uint16_t addr)
+{ return _tima_now(); }
+
+static void _write_tima(uint16_t addr, uint8_t val)
+{ _tima_value = val;
+  _schedule_timer();
+}
+
+static void _write_tac(uint16_t addr, uint8_t val)
+{ _tima_value = _tima_now();
+  mem[R_TAC] = val;
+  _schedule_timer();
+}
+
+static void _timer_overflow()
+{ _tima_value = mem[R_TMA];
+  uint64_t at = event_at[EVENT_TIMER];
+  _tima_base = at;
+  schedule_event(EVENT_TIMER, at + (256 - _tima_value) * _timer_periods[3 & mem[R_TAC]]);
+  request_interrupt(INT_TIMER);
+}
+
+
+// LCD timing: 154 lines of 114 M-cycles, VBlank from line 144, and in each
+// visible line 20 cycles of mode 2, 43 of mode 3 (at its shortest) and 51 of
+// mode 0.  LY and the STAT mode are worked out from the time when they are
+// read; only the edges that raise interrupts are scheduled.
+
+#define LINE_CYCLES 114
+#define FRAME_CYCLES (154 * LINE_CYCLES)
+
+static uint32_t _lcd_phase;  // added to the time, gives the position in the frame
+
+static inline bool _lcd_on()
+{ return 0x80 & mem[R_LCDC]; }
+
+static inline uint32_t _lcd_position(uint64_t t)
+{ return (t + _lcd_phase) % FRAME_CYCLES; }
+
+// M-cycles from t until the frame is next at position
+static inline uint32_t _lcd_until(uint64_t t, uint32_t position)
+{ return (position + FRAME_CYCLES - _lcd_position(t)) % FRAME_CYCLES; }
+
+static inline int _lcd_mode(uint64_t t)
+{ uint32_t f = _lcd_position(t);
+  if (144 * LINE_CYCLES <= f) return 1;
+  f %= LINE_CYCLES;
+  return 20 > f ? 2 : 63 > f ? 3 : 0;
+}
+
+// the next mode 2 or mode 0 edge after now that STAT is set to interrupt on
+static void _schedule_stat()
+{ uint8_t enabled = 0x28 & mem[R_STAT];
+  if (!_lcd_on() || !enabled)
+  { cancel_event(EVENT_STAT);
+    return;
+  }
+  uint64_t t = current_time() + 1;
+  uint32_t f = _lcd_position(t);
+  uint32_t until = FRAME_CYCLES;
+  for (int i = 0; i < 2; i++)
+  { uint32_t edge = i ? 63 : 0;
+    if (!((i ? 0x08 : 0x20) & enabled)) continue;
+    uint32_t line = f / LINE_CYCLES + (f % LINE_CYCLES > edge);
+    if (144 <= line) line = 0;
+    uint32_t u = _lcd_until(t, line * LINE_CYCLES + edge);
+    if (u < until) until = u;
+  }
+  schedule_event(EVENT_STAT, t + until);
+}
+
+// the start of line LYC, if STAT is set to interrupt on it
+static void _schedule_lyc()
+{ if (!_lcd_on() || !(0x40 & mem[R_STAT]) || 154 <= mem[R_LYC])
+  { cancel_event(EVENT_LYC);
+    return;
+  }
+  uint64_t t = current_time();
+  schedule_event(EVENT_LYC, t + _lcd_until(t, mem[R_LYC] * LINE_CYCLES));
+}
+
+static void _schedule_lcd()
+{ if (_lcd_on())
+  { uint64_t t = current_time();
+    schedule_event(EVENT_VBLANK, t + _lcd_until(t, 144 * LINE_CYCLES));
+  }
+  else cancel_event(EVENT_VBLANK);
+  _schedule_lyc();
+  _schedule_stat();
+}
+
+static void _lyc()
+{ schedule_event(EVENT_LYC, event_at[EVENT_LYC] + FRAME_CYCLES);
+  request_interrupt(INT_STAT);
+}
+
+static void _vblank()
+{ schedule_event(EVENT_VBLANK, event_at[EVENT_VBLANK] + FRAME_CYCLES);
+  request_interrupt(INT_VBLANK);
+  if (0x10 & mem[R_STAT]) request_interrupt(INT_STAT);
+}
+
+static uint8_t _read_ly(uint16_t addr)
+{ return _lcd_on() ? _lcd_position(current_time()) / LINE_CYCLES : 0; }
+
+static uint8_t _read_stat(uint16_t addr)
+{ uint8_t stat = 0x78 & mem[R_STAT] | 0x80;
+  if (!_lcd_on()) return stat;
+  return stat | (_read_ly(R_LY) == mem[R_LYC] ? 4 : 0) | _lcd_mode(current_time());
+}
+
+static void _write_stat(uint16_t addr, uint8_t val)
+{ mem[R_STAT] = 0x78 & val;
+  _schedule_lyc();
+  _schedule_stat();
+}
+
+static void _write_lyc(uint16_t addr, uint8_t val)
+{ mem[R_LYC] = val;
+  _schedule_lyc();
+}
+
+// Turn the LCD on as if it had been running, and had just reached dot (0-455)
+// of line ly, so that what runs next starts at that point in the frame.
+void start_lcd_at(int ly, int dot)
+{ if (154 <= ly || 456 <= dot) panic;
+  uint64_t t = current_time();
+  uint32_t position = ly * LINE_CYCLES + dot / 4;
+  _lcd_phase = (position + FRAME_CYCLES - t % FRAME_CYCLES) % FRAME_CYCLES;
+  mem[R_LCDC] |= 0x80;
+  _schedule_lcd();
+}
+
+static void _write_lcdc(uint16_t addr, uint8_t val)
+{ bool was_on = _lcd_on();
+  mem[R_LCDC] = val;
+  if (_lcd_on() && !was_on) start_lcd_at(0, 0);
+  else _schedule_lcd();
+}
+
+
+// The CPU cannot reach VRAM in mode 3, or OAM in modes 2 and 3: reads give
+// 0xff and writes are lost.  map_lcd_access makes such accesses faults (along
+// with the unusable area after OAM), so that a routine can be checked against
+// the window it is meant to run in.  An access is timed from the start of its
+// instruction.
+
+static bool _lcd_blocked(uint16_t addr)
+{ if (!_lcd_on()) return false;
+  int mode = _lcd_mode(current_time());
+  return 3 == mode || 2 == mode && 0xfe00 <= addr;
+}
+
+static uint8_t _lcd_read(uint16_t addr)
+{ if (0xfea0 <= addr || _lcd_blocked(addr)) return fault_read(addr);
+  return mem[addr];
+}
+
+static void _lcd_write(uint16_t addr, uint8_t val)
+{ if (0xfea0 <= addr || _lcd_blocked(addr)) fault_write(addr, val);
+  else mem[addr] = val;
+}
+
+void map_lcd_access()
+{ map_handlers(0x8000, 0x2000, _lcd_read, _lcd_write);
+  map_handlers(0xfe00, 0x100, _lcd_read, _lcd_write);
+}
+
+
+static void _write_interrupts(uint16_t addr, uint8_t val)
+{ mem[addr] = val;
+  _update_horizon();
+}
+
+
+// Run every event that is due, and let a pending ei take effect.  The runners
+// call this once cycles reaches event_horizon.
+void service_events()
+{ if (cycles >= cycle_limit) panic;
+  uint64_t t = current_time();
+  while (n_events && event_at[event_heap[0]] <= t)
+    switch (event_heap[0])
+    { case EVENT_TIMER: _timer_overflow(); break;
+      case EVENT_LYC: _lyc(); break;
+      case EVENT_VBLANK: _vblank(); break;
+      case EVENT_STAT: _schedule_stat(); request_interrupt(INT_STAT); break;
+      default: panic;
+    }
+  if (ei_delay && !--ei_delay) ime = true;
+  _update_horizon();
+}
+
+// Skip ahead to the next event until an interrupt is pending, as halt does.
+void wait_for_interrupt()
+{ while (!interrupt_pending())
+  { if (!n_events) panic;   // halt with no interrupt to wake it
+    uint64_t at = event_at[event_heap[0]];
+    if (at > current_time()) cycles += at - current_time();
+    service_events();
+  }
+}
+
+
+// Reset the timer, LCD and interrupt registers and model them from now on:
+// DIV, TIMA, TMA, TAC, IF, LCDC, STAT, LY, LYC and IE.  The LCD starts off.
+void reset_hardware()
+{ ime = false;
+  ei_delay = 0;
+  while (n_events) cancel_event(event_heap[0]);
+  static const uint16_t registers[] =
+    { R_DIV, R_TIMA, R_TMA, R_TAC, R_IF, R_LCDC, R_STAT, R_LY, R_LYC, R_IE };
+  for (int i = 0; i < listsize(registers); i++)
+  { mem[registers[i]] = 0;
+    mark_initialized(registers[i], 1);
+  }
+  _div_base = current_time();
+  _tima_value = 0;
+  _tima_base = current_time();
+
+  hook_io(R_DIV, _read_div, _write_div);
+  hook_io(R_TIMA, _read_tima, _write_tima);
+  hook_io(R_TAC, NULL, _write_tac);
+  hook_io(R_IF, NULL, _write_interrupts);
+  hook_io(R_IE, NULL, _write_interrupts);
+  hook_io(R_LCDC, NULL, _write_lcdc);
+  hook_io(R_STAT, _read_stat, _write_stat);
+  hook_io(R_LY, _read_ly, NULL);
+  hook_io(R_LYC, NULL, _write_lyc);
+  _update_horizon();
+}
+
+
 void status()
 { char
     z = reg.f & FLAG_Z ? 'Z' : '-'
@@ -291,7 +1001,7 @@ void adc_a_r8(enum r8 src)
 { _adc(_get_r8(src)); cycles += 1; }
 
 void adc_a_ihl()
-{ _adc(mem[reg.hl]); cycles += 2; }
+{ _adc(read8(reg.hl)); cycles += 2; }
 
 void adc_a_n8(uint8_t val)
 { _adc(val); cycles += 2; }
@@ -311,7 +1021,7 @@ void add_a_r8(enum r8 src)
 { _add(_get_r8(src)); cycles += 1; }
 
 void add_a_ihl()
-{ _add(mem[reg.hl]); cycles += 2; }
+{ _add(read8(reg.hl)); cycles += 2; }
 
 void add_a_n8(uint8_t val)
 { _add(val); cycles += 2; }
@@ -329,13 +1039,12 @@ void and_a_r8(enum r8 src)
 { _and(_get_r8(src)); cycles += 1; }
 
 void and_a_ihl()
-{ _and(mem[reg.hl]); cycles += 2; }
+{ _and(read8(reg.hl)); cycles += 2; }
 
 void and_a_n8(uint8_t val)
 { _and(val); cycles += 2; }
 
 
-// TODO: validate carry and half-carry
 static inline void _cp(uint8_t val)
 { uint16_t tmp = reg.a - val;
   reg.f =
@@ -350,7 +1059,7 @@ void cp_a_r8(enum r8 src)
 { _cp(_get_r8(src)); cycles += 1; }
 
 void cp_a_ihl()
-{ _cp(mem[reg.hl]); cycles += 2; }
+{ _cp(read8(reg.hl)); cycles += 2; }
 
 void cp_a_n8(uint8_t val)
 { _cp(val); cycles += 2; }
@@ -371,7 +1080,7 @@ void dec_r8(enum r8 dst)
 { _set_r8(dst, _dec(_get_r8(dst))); cycles += 1; }
 
 void dec_ihl()
-{ mem[reg.hl] = _dec(mem[reg.hl]); cycles += 3; }
+{ write8(reg.hl, _dec(read8(reg.hl))); cycles += 3; }
 
 
 static inline uint8_t _inc(uint8_t val)
@@ -388,7 +1097,7 @@ void inc_r8(enum r8 dst)
 { _set_r8(dst, _inc(_get_r8(dst))); cycles += 1; }
 
 void inc_ihl()
-{ mem[reg.hl] = _inc(mem[reg.hl]); cycles += 3; }
+{ write8(reg.hl, _inc(read8(reg.hl))); cycles += 3; }
 
 
 static inline void _or(uint8_t val)
@@ -402,7 +1111,7 @@ void or_a_r8(enum r8 src)
 { _or(_get_r8(src)); cycles += 1; }
 
 void or_a_ihl()
-{ _or(mem[reg.hl]); cycles += 2; }
+{ _or(read8(reg.hl)); cycles += 2; }
 
 void or_a_n8(uint8_t val)
 { _or(val); cycles += 2; }
@@ -423,7 +1132,7 @@ void sbc_a_r8(enum r8 src)
 { _sbc(_get_r8(src)); cycles += 1; }
 
 void sbc_a_ihl()
-{ _sbc(mem[reg.hl]); cycles += 2; }
+{ _sbc(read8(reg.hl)); cycles += 2; }
 
 void sbc_a_n8(uint8_t val)
 { _sbc(val); cycles += 2; }
@@ -444,7 +1153,7 @@ void sub_a_r8(enum r8 src)
 { _sub(_get_r8(src)); cycles += 1; }
 
 void sub_a_ihl()
-{ _sub(mem[reg.hl]); cycles += 2; }
+{ _sub(read8(reg.hl)); cycles += 2; }
 
 void sub_a_n8(uint8_t val)
 { _sub(val); cycles += 2; }
@@ -461,7 +1170,7 @@ void xor_a_r8(enum r8 src)
 { _xor(_get_r8(src)); cycles += 1; }
 
 void xor_a_ihl()
-{ _xor(mem[reg.hl]); cycles += 2; }
+{ _xor(read8(reg.hl)); cycles += 2; }
 
 void xor_a_n8(uint8_t val)
 { _xor(val); cycles += 2; }
@@ -521,7 +1230,7 @@ void bit_u3_r8(uint8_t bit, enum r8 r)
 { _bit(bit, _get_r8(r)); cycles += 2; }
 
 void bit_u3_ihl(uint8_t bit)
-{ _bit(bit, mem[reg.hl]); cycles += 3; }
+{ _bit(bit, read8(reg.hl)); cycles += 3; }
 
 
 static inline uint8_t _res(uint8_t bit, uint8_t val)
@@ -533,7 +1242,7 @@ void res_u3_r8(uint8_t bit, enum r8 r)
 { _set_r8(r, _res(bit, _get_r8(r))); cycles += 2; }
 
 void res_u3_ihl(uint8_t bit)
-{ mem[reg.hl] = _res(bit, mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _res(bit, read8(reg.hl))); cycles += 4; }
 
 
 static inline uint8_t _set(uint8_t bit, uint8_t val)
@@ -545,7 +1254,7 @@ void set_u3_r8(uint8_t bit, enum r8 r)
 { _set_r8(r, _set(bit, _get_r8(r))); cycles += 2; }
 
 void set_u3_ihl(uint8_t bit)
-{ mem[reg.hl] = _set(bit, mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _set(bit, read8(reg.hl))); cycles += 4; }
 
 
 static inline uint8_t _swap(uint8_t val)
@@ -559,7 +1268,7 @@ void swap_r8(enum r8 r)
 { _set_r8(r, _swap(_get_r8(r))); cycles += 2; }
 
 void swap_ihl()
-{ mem[reg.hl] = _swap(mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _swap(read8(reg.hl))); cycles += 4; }
 
 
 // bit shift instructions
@@ -578,7 +1287,7 @@ void rl_r8(enum r8 r)
 { _set_r8(r, _rl(_get_r8(r))); cycles += 2; }
 
 void rl_ihl()
-{ mem[reg.hl] = _rl(mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _rl(read8(reg.hl))); cycles += 4; }
 
 void rla()
 { uint16_t tmp = reg.a << 1 | (FLAG_C & reg.f ? 1 : 0);
@@ -603,7 +1312,7 @@ void rlc_r8(enum r8 r)
 { _set_r8(r, _rlc(_get_r8(r))); cycles += 2; }
 
 void rlc_ihl()
-{ mem[reg.hl] = _rlc(mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _rlc(read8(reg.hl))); cycles += 4; }
 
 void rlca()
 { uint16_t tmp = reg.a << 1 | (0x80 & reg.a ? 1 : 0);
@@ -629,7 +1338,7 @@ void rr_r8(enum r8 r)
 { _set_r8(r, _rr(_get_r8(r))); cycles += 2; }
 
 void rr_ihl()
-{ mem[reg.hl] = _rr(mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _rr(read8(reg.hl))); cycles += 4; }
 
 void rra()
 { bool carry = 1 & reg.a;
@@ -655,7 +1364,7 @@ void rrc_r8(enum r8 r)
 { _set_r8(r, _rrc(_get_r8(r))); cycles += 2; }
 
 void rrc_ihl()
-{ mem[reg.hl] = _rrc(mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _rrc(read8(reg.hl))); cycles += 4; }
 
 void rrca()
 { bool carry = 1 & reg.a;
@@ -680,7 +1389,7 @@ void sla_r8(enum r8 r)
 { _set_r8(r, _sla(_get_r8(r))); cycles += 2; }
 
 void sla_ihl()
-{ mem[reg.hl] = _sla(mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _sla(read8(reg.hl))); cycles += 4; }
 
 
 static inline uint8_t _sra(uint8_t val)
@@ -697,7 +1406,7 @@ void sra_r8(enum r8 r)
 { _set_r8(r, _sra(_get_r8(r))); cycles += 2; }
 
 void sra_ihl()
-{ mem[reg.hl] = _sra(mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _sra(read8(reg.hl))); cycles += 4; }
 
 
 static inline uint8_t _srl(uint8_t val)
@@ -714,7 +1423,7 @@ void srl_r8(enum r8 r)
 { _set_r8(r, _srl(_get_r8(r))); cycles += 2; }
 
 void srl_ihl()
-{ mem[reg.hl] = _srl(mem[reg.hl]); cycles += 4; }
+{ write8(reg.hl, _srl(read8(reg.hl))); cycles += 4; }
 
 
 // load instructions
@@ -737,81 +1446,81 @@ void ld_r16_n16(enum r16 dst, uint16_t val)
 
 
 void ld_ihl_r8(enum r8 src)
-{ mem[reg.hl] = _get_r8(src);
+{ write8(reg.hl, _get_r8(src));
   cycles += 2;
 }
 
 void ld_ihl_n8(uint8_t val)
-{ mem[reg.hl] = val;
+{ write8(reg.hl, val);
   cycles += 3;
 }
 
 void ld_r8_ihl(enum r8 dst)
-{ _set_r8(dst, mem[reg.hl]);
+{ _set_r8(dst, read8(reg.hl));
   cycles += 2;
 }
 
 
 void ld_ir16_a(enum r16 idst)
-{ mem[_get_r16(idst)] = reg.a;
+{ write8(_get_r16(idst), reg.a);
   cycles += 2;
 }
 
 void ld_in16_a(uint16_t idst)
-{ mem[idst] = reg.a;
+{ write8(idst, reg.a);
   cycles += 4;
 }
 
 void ldh_in16_a(uint16_t idst)
 { if (0xff00 > idst || 0xffff < idst) panic;
-  mem[idst] = reg.a;
+  write8(idst, reg.a);
   cycles += 3;
 }
 
 void ldh_ic_a()
-{ mem[0xff00 | reg.c] = reg.a;
+{ write8(0xff00 | reg.c, reg.a);
   cycles += 2;
 }
 
 void ld_a_ir16(enum r16 isrc)
-{ reg.a = mem[_get_r16(isrc)];
+{ reg.a = read8(_get_r16(isrc));
   cycles += 2;
 }
 
 void ld_a_in16(uint16_t isrc)
-{ reg.a = mem[isrc];
+{ reg.a = read8(isrc);
   cycles += 4;
 }
 
 void ldh_a_in16(uint16_t isrc)
 { if (0xff00 > isrc || 0xffff < isrc) panic;
-  reg.a = mem[isrc];
+  reg.a = read8(isrc);
   cycles += 3;
 }
 
 void ldh_a_ic()
-{ reg.a = mem[0xff00 | reg.c];
+{ reg.a = read8(0xff00 | reg.c);
   cycles += 2;
 }
 
 
 void ld_ihli_a()
-{ mem[reg.hl++] = reg.a;
+{ write8(reg.hl++, reg.a);
   cycles += 2;
 }
 
 void ld_ihld_a()
-{ mem[reg.hl--] = reg.a;
+{ write8(reg.hl--, reg.a);
   cycles += 2;
 }
 
 void ld_a_ihli()
-{ reg.a = mem[reg.hl++];
+{ reg.a = read8(reg.hl++);
   cycles += 2;
 }
 
 void ld_a_ihld()
-{ reg.a = mem[reg.hl--];
+{ reg.a = read8(reg.hl--);
   cycles += 2;
 }
 
@@ -832,22 +1541,22 @@ void add_hl_sp()
 { _add_hl(reg.sp); cycles += 2; }
 
 void add_sp_e8(int8_t val)
-{ reg.sp = _spe8(val); cycles += 4; }
+{ reg.sp = _spe8(val); _SHADOW_SP(); cycles += 4; }
 
 
 void dec_sp()
-{ reg.sp--; cycles += 2; }
+{ reg.sp--; _SHADOW_SP(); cycles += 2; }
 
 void inc_sp()
-{ reg.sp++; cycles += 2; }
+{ reg.sp++; _SHADOW_SP(); cycles += 2; }
 
 
 void ld_sp_n16(uint16_t val)
-{ reg.sp = val; cycles += 3; }
+{ reg.sp = val; _SHADOW_SP(); cycles += 3; }
 
 void ld_in16_sp(uint16_t idst)
-{ mem[idst+0 & 0xffff] = reg.sp;
-  mem[idst+1 & 0xffff] = reg.sp >> 8;
+{ write8(idst+0, reg.sp);
+  write8(idst+1, reg.sp >> 8);
   cycles += 5;
 }
 
@@ -855,12 +1564,13 @@ void ld_hl_spe8(int8_t val)
 { reg.hl = _spe8(val); cycles += 3; }
 
 void ld_sp_hl()
-{ reg.sp = reg.hl; cycles += 2; }
+{ reg.sp = reg.hl; _SHADOW_SP(); cycles += 2; }
 
 
 static inline uint16_t _pop()
-{ uint16_t tmp = mem[reg.sp++];
-  tmp |= mem[reg.sp++] << 8;
+{ uint16_t tmp = read8(reg.sp++);
+  tmp |= read8(reg.sp++) << 8;
+  _SHADOW_SP();
   return tmp;
 }
 
@@ -872,8 +1582,9 @@ void pop_r16(enum r16 r)
 
 
 static inline void _push(uint16_t val)
-{ mem[--reg.sp] = val >> 8;
-  mem[--reg.sp] = val;
+{ write8(--reg.sp, val >> 8);
+  write8(--reg.sp, val);
+  _SHADOW_SP();
 }
 
 void push_af()
@@ -901,27 +1612,44 @@ void cpl()
 }
 
 void daa()
-{ uint16_t tmp = reg.a;
-  tmp += ((0x0f & tmp) > 0x09) || (FLAG_H & reg.f) ? 0x06 : 0;
-  tmp += ((0xf0 & tmp) > 0x90) || (FLAG_C & reg.f) ? 0x60 : 0;
+{ uint8_t adj = 0;
+  bool carry = FLAG_C & reg.f;
+  if (FLAG_N & reg.f)
+  { adj |= carry ? 0x60 : 0;
+    adj |= FLAG_H & reg.f ? 0x06 : 0;
+    reg.a -= adj;
+  }
+  else
+  { if (carry || reg.a > 0x99) { adj |= 0x60; carry = true; }
+    adj |= (FLAG_H & reg.f) || (0x0f & reg.a) > 0x09 ? 0x06 : 0;
+    reg.a += adj;
+  }
   reg.f =
-    (0xff & tmp ? 0 : FLAG_Z)
+    (reg.a ? 0 : FLAG_Z)
   | FLAG_N & reg.f
-  | (0x100 & tmp ? FLAG_C : 0)
+  | (carry ? FLAG_C : 0)
   ;
-  reg.a = tmp;
   cycles += 1;
 }
 
 
 void di()
-{ panic; }
+{ ime = false;
+  ei_delay = 0;
+  cycles += 1;
+}
 
+// IME is set after the instruction that follows
 void ei()
-{ panic; }
+{ if (!ime) ei_delay = 2;
+  cycles += 1;
+  _update_horizon();
+}
 
 void halt()
-{ panic; }
+{ cycles += 1;
+  wait_for_interrupt();
+}
 
 
 void nop()
@@ -940,694 +1668,2552 @@ void stop()
 { panic; }
 
 
-#define listsize(list) (sizeof(list) / sizeof(*list))
+// flag-dead variants
 
 
-void run_program(struct program *program)
-{ cycles = 0;
-  uint16_t pc = 0;
-  while (program->length > pc)
-  { struct instruction *x = &program->instructions[pc++];
-    switch (x->op)
-    { case OP_ADC_A_R8: adc_a_r8(x->p1); break;
-      case OP_ADC_A_IHL: adc_a_ihl(); break;
-      case OP_ADC_A_N8: adc_a_n8(x->p1); break;
-      case OP_ADD_A_R8: add_a_r8(x->p1); break;
-      case OP_ADD_A_IHL: add_a_ihl(); break;
-      case OP_ADD_A_N8: add_a_n8(x->p1); break;
-      case OP_AND_A_R8: and_a_r8(x->p1); break;
-      case OP_AND_A_IHL: and_a_ihl(); break;
-      case OP_AND_A_N8: and_a_n8(x->p1); break;
-      case OP_CP_A_R8: cp_a_r8(x->p1); break;
-      case OP_CP_A_IHL: cp_a_ihl(); break;
-      case OP_CP_A_N8: cp_a_n8(x->p1); break;
-      case OP_DEC_R8: dec_r8(x->p1); break;
-      case OP_DEC_IHL: dec_ihl(); break;
-      case OP_INC_R8: inc_r8(x->p1); break;
-      case OP_INC_IHL: inc_ihl(); break;
-      case OP_OR_A_R8: or_a_r8(x->p1); break;
-      case OP_OR_A_IHL: or_a_ihl(); break;
-      case OP_OR_A_N8: or_a_n8(x->p1); break;
-      case OP_SBC_A_R8: sbc_a_r8(x->p1); break;
-      case OP_SBC_A_IHL: sbc_a_ihl(); break;
-      case OP_SBC_A_N8: sbc_a_n8(x->p1); break;
-      case OP_SUB_A_R8: sub_a_r8(x->p1); break;
-      case OP_SUB_A_IHL: sub_a_ihl(); break;
-      case OP_SUB_A_N8: sub_a_n8(x->p1); break;
-      case OP_XOR_A_R8: xor_a_r8(x->p1); break;
-      case OP_XOR_A_IHL: xor_a_ihl(); break;
-      case OP_XOR_A_N8: xor_a_n8(x->p1); break;
-
-      case OP_ADD_HL_R16: add_hl_r16(x->p1); break;
-      case OP_DEC_R16: dec_r16(x->p1); break;
-      case OP_INC_R16: inc_r16(x->p1); break;
-
-      case OP_BIT_U3_R8: bit_u3_r8(x->p1, x->p2); break;
-      case OP_BIT_U3_IHL: bit_u3_ihl(x->p1); break;
-      case OP_RES_U3_R8: res_u3_r8(x->p1, x->p2); break;
-      case OP_RES_U3_IHL: res_u3_ihl(x->p1); break;
-      case OP_SET_U3_R8: set_u3_r8(x->p1, x->p2); break;
-      case OP_SET_U3_IHL: set_u3_ihl(x->p1); break;
-      case OP_SWAP_R8: swap_r8(x->p1); break;
-      case OP_SWAP_IHL: swap_ihl(); break;
-
-      case OP_RL_R8: rl_r8(x->p1); break;
-      case OP_RL_IHL: rl_ihl(); break;
-      case OP_RLA: rla(); break;
-      case OP_RLC_R8: rlc_r8(x->p1); break;
-      case OP_RLC_IHL: rlc_ihl(); break;
-      case OP_RLCA: rlca(); break;
-      case OP_RR_R8: rr_r8(x->p1); break;
-      case OP_RR_IHL: rr_ihl(); break;
-      case OP_RRA: rra(); break;
-      case OP_RRC_R8: rrc_r8(x->p1); break;
-      case OP_RRC_IHL: rrc_ihl(); break;
-      case OP_RRCA: rrca(); break;
-      case OP_SLA_R8: sla_r8(x->p1); break;
-      case OP_SLA_IHL: sla_ihl(); break;
-      case OP_SRA_R8: sra_r8(x->p1); break;
-      case OP_SRA_IHL: sra_ihl(); break;
-      case OP_SRL_R8: srl_r8(x->p1); break;
-      case OP_SRL_IHL: srl_ihl(); break;
-
-      case OP_LD_R8_R8: ld_r8_r8(x->p1, x->p2); break;
-      case OP_LD_R8_N8: ld_r8_n8(x->p1, x->p2); break;
-      case OP_LD_R16_N16: ld_r16_n16(x->p1, x->p2); break;
-      case OP_LD_IHL_R8: ld_ihl_r8(x->p1); break;
-      case OP_LD_IHL_N8: ld_ihl_n8(x->p1); break;
-      case OP_LD_R8_IHL: ld_r8_ihl(x->p1); break;
-      case OP_LD_IR16_A: ld_ir16_a(x->p1); break;
-      case OP_LD_IN16_A: ld_in16_a(x->p1); break;
-      case OP_LDH_IN16_A: ldh_in16_a(x->p1); break;
-      case OP_LDH_IC_A: ldh_ic_a(); break;
-      case OP_LD_A_IR16: ld_a_ir16(x->p1); break;
-      case OP_LD_A_IN16: ld_a_in16(x->p1); break;
-      case OP_LDH_A_IN16: ldh_a_in16(x->p1); break;
-      case OP_LDH_A_IC: ldh_a_ic(); break;
-      case OP_LD_IHLI_A: ld_ihli_a(); break;
-      case OP_LD_IHLD_A: ld_ihld_a(); break;
-      case OP_LD_A_IHLI: ld_a_ihli(); break;
-      case OP_LD_A_IHLD: ld_a_ihld(); break;
-
-      case OP_CALL_N16: panic;
-      case OP_CALL_CC_N16: panic;
-      case OP_JP_HL: panic;
-      case OP_JP_N16: panic;
-      case OP_JP_CC_N16: panic;
-      case OP_JR_E8: pc += x->p1; cycles += 3; break;
-      case OP_JR_CC_E8:
-      { bool flag = false;
-        switch (x->p1)
-        { case CC_NZ: flag = !(FLAG_Z & reg.f); break;
-          default: panic;
-        }
-        if (flag) { pc += x->p2; cycles += 3; } else { cycles += 2; }
-      } break;
-      case OP_RET_CC: panic;
-      case OP_RET: panic;
-      case OP_RETI: panic;
-      case OP_RST_VEC: panic;
-
-      case OP_ADD_HL_SP: add_hl_sp(); break;
-      case OP_ADD_SP_E8: add_sp_e8(x->p1); break;
-      case OP_DEC_SP: dec_sp(); break;
-      case OP_INC_SP: inc_sp(); break;
-      case OP_LD_SP_N16: ld_sp_n16(x->p1); break;
-      case OP_LD_IN16_SP: ld_in16_sp(x->p1); break;
-      case OP_LD_HL_SPE8: ld_hl_spe8(x->p1); break;
-      case OP_LD_SP_HL: ld_sp_hl(); break;
-      case OP_POP_AF: pop_af(); break;
-      case OP_POP_R16: pop_r16(x->p1); break;
-      case OP_PUSH_AF: push_af(); break;
-      case OP_PUSH_R16: push_r16(x->p1); break;
-
-      case OP_CCF: ccf(); break;
-      case OP_CPL: cpl(); break;
-      case OP_DAA: daa(); break;
-      case OP_DI: di(); break;
-      case OP_EI: ei(); break;
-      case OP_HALT: halt(); break;
-      case OP_NOP: nop(); break;
-      case OP_SCF: scf(); break;
-      case OP_STOP: stop(); break;
+void adc_a_r8_nf(enum r8 src)
+{ reg.a += _get_r8(src) + (FLAG_C & reg.f ? 1 : 0); cycles += 1; }
 
-      default: panic;
-    }
-  }
-  // printf("cycles: %d\n", cycles);
-}
+void adc_a_ihl_nf()
+{ reg.a += read8(reg.hl) + (FLAG_C & reg.f ? 1 : 0); cycles += 2; }
 
+void adc_a_n8_nf(uint8_t val)
+{ reg.a += val + (FLAG_C & reg.f ? 1 : 0); cycles += 2; }
 
-enum isn_token
-{ ADC_TOK
-, ADD_TOK
-, AND_TOK
-, CP_TOK
-, DEC_TOK
-, INC_TOK
-, OR_TOK
-, SBC_TOK
-, SUB_TOK
-, XOR_TOK
+void add_a_r8_nf(enum r8 src)
+{ reg.a += _get_r8(src); cycles += 1; }
 
-, BIT_TOK
-, RES_TOK
-, SET_TOK
-, SWAP_TOK
+void add_a_ihl_nf()
+{ reg.a += read8(reg.hl); cycles += 2; }
 
-, RL_TOK
-, RLA_TOK
-, RLC_TOK
-, RLCA_TOK
-, RR_TOK
-, RRA_TOK
-, RRC_TOK
-, RRCA_TOK
-, SLA_TOK
-, SRA_TOK
-, SRL_TOK
+void add_a_n8_nf(uint8_t val)
+{ reg.a += val; cycles += 2; }
 
-, LD_TOK
-, LDH_TOK
+void and_a_r8_nf(enum r8 src)
+{ reg.a &= _get_r8(src); cycles += 1; }
 
-, CALL_TOK
-, JP_TOK
-, JR_TOK
-, RET_TOK
-, RETI_TOK
-, RST_TOK
+void and_a_ihl_nf()
+{ reg.a &= read8(reg.hl); cycles += 2; }
 
-, POP_TOK
-, PUSH_TOK
+void and_a_n8_nf(uint8_t val)
+{ reg.a &= val; cycles += 2; }
 
-, CCF_TOK
-, CPL_TOK
-, DAA_TOK
-, DI_TOK
-, EI_TOK
-, HALT_TOK
-, NOP_TOK
-, SCF_TOK
-, STOP_TOK
+void cp_a_r8_nf(enum r8 src)
+{ cycles += 1; }
 
-, N_ISN_TOKEN
-};
+void cp_a_ihl_nf()
+{ cycles += 2; }
 
-struct
-{ char string[8];
-  enum isn_token value;
-} isn_tokens[] =
-{ "adc", ADC_TOK
-, "add", ADD_TOK
-, "and", AND_TOK
-, "cp", CP_TOK
-, "dec", DEC_TOK
-, "inc", INC_TOK
-, "or", OR_TOK
-, "sbc", SBC_TOK
-, "sub", SUB_TOK
-, "xor", XOR_TOK
+void cp_a_n8_nf(uint8_t val)
+{ cycles += 2; }
 
-, "bit", BIT_TOK
-, "res", RES_TOK
-, "set", SET_TOK
-, "swap", SWAP_TOK
+void or_a_r8_nf(enum r8 src)
+{ reg.a |= _get_r8(src); cycles += 1; }
 
-, "rl", RL_TOK
-, "rla", RLA_TOK
-, "rlc", RLC_TOK
-, "rlca", RLCA_TOK
-, "rr", RR_TOK
-, "rra", RRA_TOK
-, "rrc", RRC_TOK
-, "rrca", RRCA_TOK
-, "sla", SLA_TOK
-, "sra", SRA_TOK
-, "srl", SRL_TOK
+void or_a_ihl_nf()
+{ reg.a |= read8(reg.hl); cycles += 2; }
 
-, "ld", LD_TOK
-, "ldh", LDH_TOK
+void or_a_n8_nf(uint8_t val)
+{ reg.a |= val; cycles += 2; }
 
-, "call", CALL_TOK
-, "jp", JP_TOK
-, "jr", JR_TOK
-, "ret", RET_TOK
-, "reti", RETI_TOK
-, "rst", RST_TOK
+void sbc_a_r8_nf(enum r8 src)
+{ reg.a -= _get_r8(src) + (FLAG_C & reg.f ? 1 : 0); cycles += 1; }
 
-, "pop", POP_TOK
-, "push", PUSH_TOK
+void sbc_a_ihl_nf()
+{ reg.a -= read8(reg.hl) + (FLAG_C & reg.f ? 1 : 0); cycles += 2; }
 
-, "ccf", CCF_TOK
-, "cpl", CPL_TOK
-, "daa", DAA_TOK
-, "di", DI_TOK
-, "ei", EI_TOK
-, "halt", HALT_TOK
-, "nop", NOP_TOK
-, "scf", SCF_TOK
-, "stop", STOP_TOK
-};
-size_t n_isn_tokens = listsize(isn_tokens);
+void sbc_a_n8_nf(uint8_t val)
+{ reg.a -= val + (FLAG_C & reg.f ? 1 : 0); cycles += 2; }
 
-enum arg_token_type
-{ NONE_TOK_TYPE
-, N_TOK_TYPE
-, R16_TOK_TYPE
-, R8_TOK_TYPE
-, IR16_TOK_TYPE
-, IHLI_TOK_TYPE
-, CC_TOK_TYPE
-, ANON_LABEL_TOK_TYPE
-, IHL_TOK_TYPE
-, IN16_TOK_TYPE
-, IC_TOK_TYPE
-, IHLD_TOK_TYPE
-, SP_TOK_TYPE
-, SPE8_TOK_TYPE
-, AF_TOK_TYPE
-, VEC_TOK_TYPE
-, N_ARG_TOKEN_TYPE
-};
+void sub_a_r8_nf(enum r8 src)
+{ reg.a -= _get_r8(src); cycles += 1; }
 
-struct arg_token
-{ enum arg_token_type type;
-  int32_t value;
-  int n; char *s;
-};
+void sub_a_ihl_nf()
+{ reg.a -= read8(reg.hl); cycles += 2; }
 
-struct
-{ char string[8];
-  enum arg_token_type type;
-  int32_t value;
-} arg_tokens[] =
-{ "", NONE_TOK_TYPE, 0
-, "a", R8_TOK_TYPE, R8_A
-, "b", R8_TOK_TYPE, R8_B
-, "c", R8_TOK_TYPE, R8_C
-, "d", R8_TOK_TYPE, R8_D
-, "e", R8_TOK_TYPE, R8_E
-, "h", R8_TOK_TYPE, R8_H
-, "l", R8_TOK_TYPE, R8_L
-, "bc", R16_TOK_TYPE, R16_BC
-, "de", R16_TOK_TYPE, R16_DE
-, "hl", R16_TOK_TYPE, R16_HL
-, "[bc]", IR16_TOK_TYPE, R16_BC
-, "[de]", IR16_TOK_TYPE, R16_DE
-, "[hl]", IHL_TOK_TYPE, 0
-, "[hli]", IHLI_TOK_TYPE, 0
-, "[hld]", IHLD_TOK_TYPE, 0
-, "nz", CC_TOK_TYPE, CC_NZ
-, "sp", SP_TOK_TYPE, 0
-, "af", AF_TOK_TYPE, 0
-, ":-", ANON_LABEL_TOK_TYPE, -1
-, ":--", ANON_LABEL_TOK_TYPE, -2
-, ":+", ANON_LABEL_TOK_TYPE, 0
-, ":++", ANON_LABEL_TOK_TYPE, 1
-};
-size_t n_arg_tokens = listsize(arg_tokens);
+void sub_a_n8_nf(uint8_t val)
+{ reg.a -= val; cycles += 2; }
 
+void xor_a_r8_nf(enum r8 src)
+{ reg.a ^= _get_r8(src); cycles += 1; }
 
-bool streq(char *s0, int n, char *s)
-{ return n == strlen(s0) && !strncmp(s0, s, n); }
+void xor_a_ihl_nf()
+{ reg.a ^= read8(reg.hl); cycles += 2; }
 
+void xor_a_n8_nf(uint8_t val)
+{ reg.a ^= val; cycles += 2; }
 
-int next_newline(char *text)
-{ for (int n = 0; 0 != text[n]; n++)
-  if ('\n' == text[n])
-    return n;
-  return -1;
-}
+void dec_r8_nf(enum r8 dst)
+{ _set_r8(dst, _get_r8(dst) - 1); cycles += 1; }
 
+void dec_ihl_nf()
+{ write8(reg.hl, read8(reg.hl) - 1); cycles += 3; }
 
-void trim_leading_space(int *n, char **s)
-{ while (*n && ' ' == **s) (*s)++, (*n)--; }
+void inc_r8_nf(enum r8 dst)
+{ _set_r8(dst, _get_r8(dst) + 1); cycles += 1; }
 
+void inc_ihl_nf()
+{ write8(reg.hl, read8(reg.hl) + 1); cycles += 3; }
 
-void trim_trailing_space(int *n, char **s)
-{ while (*n && ' ' == (*s)[*n-1]) (*n)--; }
+void add_hl_r16_nf(enum r16 src)
+{ reg.hl += _get_r16(src); cycles += 2; }
 
 
-int char_in_range(char c, int n, char *s)
-{ for (int i = 0; i < n; i++)
-  if (c == s[i])
-    return i;
-  return -1;
+static inline uint8_t _rl_nf(uint8_t val)
+{ return val << 1 | (FLAG_C & reg.f ? 1 : 0); }
+
+void rl_r8_nf(enum r8 r)
+{ _set_r8(r, _rl_nf(_get_r8(r))); cycles += 2; }
+
+static inline uint8_t _rlc_nf(uint8_t val)
+{ return val << 1 | val >> 7; }
+
+void rlc_r8_nf(enum r8 r)
+{ _set_r8(r, _rlc_nf(_get_r8(r))); cycles += 2; }
+
+static inline uint8_t _rr_nf(uint8_t val)
+{ return val >> 1 | (FLAG_C & reg.f ? 0x80 : 0); }
+
+void rr_r8_nf(enum r8 r)
+{ _set_r8(r, _rr_nf(_get_r8(r))); cycles += 2; }
+
+static inline uint8_t _rrc_nf(uint8_t val)
+{ return val >> 1 | val << 7; }
+
+void rrc_r8_nf(enum r8 r)
+{ _set_r8(r, _rrc_nf(_get_r8(r))); cycles += 2; }
+
+static inline uint8_t _sla_nf(uint8_t val)
+{ return val << 1; }
+
+void sla_r8_nf(enum r8 r)
+{ _set_r8(r, _sla_nf(_get_r8(r))); cycles += 2; }
+
+static inline uint8_t _sra_nf(uint8_t val)
+{ return 0x80 & val | val >> 1; }
+
+void sra_r8_nf(enum r8 r)
+{ _set_r8(r, _sra_nf(_get_r8(r))); cycles += 2; }
+
+static inline uint8_t _srl_nf(uint8_t val)
+{ return val >> 1; }
+
+void srl_r8_nf(enum r8 r)
+{ _set_r8(r, _srl_nf(_get_r8(r))); cycles += 2; }
+
+static inline uint8_t _swap_nf(uint8_t val)
+{ return val << 4 | val >> 4; }
+
+void swap_r8_nf(enum r8 r)
+{ _set_r8(r, _swap_nf(_get_r8(r))); cycles += 2; }
+
+void rla_nf()
+{ reg.a = _rl_nf(reg.a); cycles += 1; }
+
+void rlca_nf()
+{ reg.a = _rlc_nf(reg.a); cycles += 1; }
+
+void rra_nf()
+{ reg.a = _rr_nf(reg.a); cycles += 1; }
+
+void rrca_nf()
+{ reg.a = _rrc_nf(reg.a); cycles += 1; }
+
+
+// fused loop idioms
+
+
+// Bulk copy and fill through the memory map, a run of bytes within one page
+// at a time.  Copies are forward, byte by byte, where that matters: when dst
+// lies just past src the copy repeats itself.  A copy returns the last byte
+// it read, which the loop leaves in A.
+static uint8_t _copy_mem(uint16_t dst, uint16_t src, int n)
+{ uint8_t last = 0;
+  if ((uint16_t)(dst - src - 1) < n - 1)
+  { for (int i = 0; i < n; i++)
+      write8(dst + i, last = read8(src + i));
+    return last;
+  }
+  while (n)
+  { int k = n;
+    if (0x100 - (0xff & src) < k) k = 0x100 - (0xff & src);
+    if (0x100 - (0xff & dst) < k) k = 0x100 - (0xff & dst);
+    if (!_SHADOWING && write_pages[dst >> 8] && read_pages[src >> 8])
+    { last = read_pages[src >> 8][(0xff & src) + k - 1];
+      memmove
+      ( &write_pages[dst >> 8][0xff & dst]
+      , &read_pages[src >> 8][0xff & src]
+      , k
+      );
+    }
+    else
+      for (int i = 0; i < k; i++) write8(dst + i, last = read8(src + i));
+    src += k; dst += k; n -= k;
+  }
+  return last;
 }
 
+static void _fill_mem(uint16_t dst, uint8_t val, int n)
+{ while (n)
+  { int k = n;
+    if (0x100 - (0xff & dst) < k) k = 0x100 - (0xff & dst);
+    if (!_SHADOWING && write_pages[dst >> 8])
+      memset(&write_pages[dst >> 8][0xff & dst], val, k);
+    else
+      for (int i = 0; i < k; i++) write8(dst + i, val);
+    dst += k; n -= k;
+  }
+}
 
-uint32_t parse_base10(int n, char *s)
-{ uint32_t x = 0;
-  for (int i = 0; i < n; i++)
-    x = s[i] - '0' + x * 10;
-  return x;
+// : ld a, [de] / ld [hli], a / inc de / dec c / jr nz, :-
+void copy_de_hli()
+{ int n = reg.c ? reg.c : 256;
+  uint16_t src = reg.de, dst = reg.hl;
+  reg.a = _copy_mem(dst, src, n);
+  reg.de += n;
+  reg.hl += n;
+  reg.c = 0;
+  reg.f = FLAG_Z | FLAG_N | FLAG_C & reg.f;
+  cycles += 10 * n - 1;
 }
 
+// : ld a, [hli] / ld [de], a / inc de / dec c / jr nz, :-
+void copy_hli_de()
+{ int n = reg.c ? reg.c : 256;
+  uint16_t src = reg.hl, dst = reg.de;
+  reg.a = _copy_mem(dst, src, n);
+  reg.de += n;
+  reg.hl += n;
+  reg.c = 0;
+  reg.f = FLAG_Z | FLAG_N | FLAG_C & reg.f;
+  cycles += 10 * n - 1;
+}
 
-uint32_t parse_base2(int n, char *s)
-{ uint32_t x = 0;
-  for (int i = 0; i < n; i++)
-    x = (s[i] - '0') | (x << 1);
-  return x;
+// : ld [hli], a / dec c / jr nz, :-
+void fill_hli()
+{ int n = reg.c ? reg.c : 256;
+  _fill_mem(reg.hl, reg.a, n);
+  reg.hl += n;
+  reg.c = 0;
+  reg.f = FLAG_Z | FLAG_N | FLAG_C & reg.f;
+  cycles += 6 * n - 1;
 }
 
+// : ld a, [de] / cp [hl] / jr nz, exit / inc de / inc hl / dec c / jr nz, :-
+// returns whether the loop left through exit
+bool cmp_de_hl()
+{ int n = reg.c ? reg.c : 256;
+  int i = 0;
+  while (i < n && read8(reg.de + i) == read8(reg.hl + i)) i++;
+  if (i < n)
+  { reg.de += i;
+    reg.hl += i;
+    reg.c -= i;
+    reg.a = read8(reg.de);
+    cycles += 14 * i;
+    _cp(read8(reg.hl));
+    cycles += 7;
+    return true;
+  }
+  reg.a = read8(reg.de + n - 1);
+  reg.de += n;
+  reg.hl += n;
+  reg.c = 0;
+  reg.f = FLAG_Z | FLAG_N;
+  cycles += 14 * n - 1;
+  return false;
+}
 
-uint32_t parse_base16(int n, char *s)
-{ uint32_t x = 0;
-  for (int i = 0; i < n; i++)
-    x = (s[i] > '9' ? 10 + s[i] - 'a' : s[i] - '0') | (x << 4);
-  return x;
+
+static const struct idiom
+{ enum op op;
+  size_t length;
+  struct instruction pattern[8];
+  int exit;  // index of a jr leaving the loop, or 0
+} idioms[] =
+{ { OP_COPY_DE_HLI, 5,
+    { { OP_LD_A_IR16, R16_DE }
+    , { OP_LD_IHLI_A }
+    , { OP_INC_R16, R16_DE }
+    , { OP_DEC_R8, R8_C }
+    , { OP_JR_CC_E8, CC_NZ, -5 }
+    } }
+, { OP_COPY_HLI_DE, 5,
+    { { OP_LD_A_IHLI }
+    , { OP_LD_IR16_A, R16_DE }
+    , { OP_INC_R16, R16_DE }
+    , { OP_DEC_R8, R8_C }
+    , { OP_JR_CC_E8, CC_NZ, -5 }
+    } }
+, { OP_FILL_HLI, 3,
+    { { OP_LD_IHLI_A }
+    , { OP_DEC_R8, R8_C }
+    , { OP_JR_CC_E8, CC_NZ, -3 }
+    } }
+, { OP_CMP_DE_HL, 7,
+    { { OP_LD_A_IR16, R16_DE }
+    , { OP_CP_A_IHL }
+    , { OP_JR_CC_E8, CC_NZ }
+    , { OP_INC_R16, R16_DE }
+    , { OP_INC_R16, R16_HL }
+    , { OP_DEC_R8, R8_C }
+    , { OP_JR_CC_E8, CC_NZ, -7 }
+    }, 2 }
+};
+
+
+static inline const struct idiom *_idiom(enum op op)
+{ for (int i = 0; i < listsize(idioms); i++)
+    if (op == idioms[i].op) return &idioms[i];
+  return NULL;
 }
 
+// breakpoints and watchpoints
 
-char *parse_error_s0;
 
+// Neither costs anything while unset.  A breakpoint replaces an instruction
+// with OP_BREAK, which holds the index of the displaced instruction in
+// breakpoints; a watchpoint routes the pages it covers through a handler.
+// Under advance_run, either stops the run (before a breakpoint, after the
+// access of a watchpoint) by way of the event horizon, which the runners
+// already check; elsewhere they call on_breakpoint or on_watch, if set.
 
-noreturn
-void parse_error(char *error, int n, char *s)
-{ int l0 = 1;
-  char *s1 = parse_error_s0;
+enum run_status
+{ RUN_DONE        // ran off the end of the program
+, RUN_BUDGET      // used up its instructions or cycles
+, RUN_BREAKPOINT  // reached a breakpoint, which has yet to run
+, RUN_WATCHPOINT  // accessed watched memory
+};
 
-  while (true)
-  { int n1 = next_newline(s1);
-    if (s <= n1 + s1) break;
-    s1 += 1+n1; l0++;
+struct breakpoint
+{ struct program *program;  // NULL for an unused entry
+  uint16_t isn;
+  struct instruction saved;
+};
+
+struct breakpoint *breakpoints;
+size_t n_breakpoints;
+
+void (*on_breakpoint)(struct program *program, uint16_t isn);
+
+bool stop_on_traps;        // set by advance_run
+bool stepping_over;        // resuming at a breakpoint, so run it this once
+enum run_status trap_status;
+
+static void _trap(enum run_status status)
+{ trap_status = status;
+  trapped = true;
+  _update_horizon();
+}
+
+// whether to stop before the breakpoint at isn, rather than run its instruction
+static bool _breakpoint(int i, uint16_t isn)
+{ if (stepping_over)
+  { stepping_over = false;
+    return false;
   }
+  if (stop_on_traps)
+  { _trap(RUN_BREAKPOINT);
+    return true;
+  }
+  if (on_breakpoint) on_breakpoint(breakpoints[i].program, isn);
+  return false;
+}
 
-  int n1 = next_newline(s1);
 
-  char markings[n1];
-  for (int i = 0; i < n1; i++)
-    markings[i] = ( s <= i + s1 && n + s > i + s1 ) ? '~' : ' ';
+struct watchpoint
+{ uint16_t addr;
+  uint32_t size;   // 0 for an unused entry
+  bool reads, writes;
+};
 
-  printf("%s at line %d\n\n%.*s\n%.*s\n", error, l0, n1, s1, n1, markings);
-  exit(1);
+struct watchpoint watchpoints[16];
+
+// the access to trip a watchpoint: under advance_run, the first since the run
+// went on, and otherwise the last
+struct watch_hit
+{ struct program *program;   // NULL under run_machine,
+  uint16_t isn;              // where this is the address of the instruction
+  uint16_t addr;
+  bool write;
+  uint8_t val;
+} watch_hit;
+
+void (*on_watch)(struct watch_hit hit);
+
+// what watched pages were mapped to before
+static uint8_t *_watched_read_pages[256];
+static uint8_t *_watched_write_pages[256];
+static uint8_t (*_watched_read_handlers[256])(uint16_t addr);
+static void (*_watched_write_handlers[256])(uint16_t addr, uint8_t val);
+static bool _watched[256];
+static bool _watching;        // any watchpoint is set, so fused loops unfuse
+
+static void _watch_access(uint16_t addr, bool write, uint8_t val)
+{ for (int i = 0; i < listsize(watchpoints); i++)
+  { struct watchpoint *w = &watchpoints[i];
+    if (!w->size || addr - w->addr >= w->size || !(write ? w->writes : w->reads))
+      continue;
+    // the first access stops the run, so keep it over any others before then
+    if (stop_on_traps && trapped) return;
+    watch_hit =
+      (struct watch_hit){ running_program, running_isn, addr, write, val };
+    if (stop_on_traps) _trap(RUN_WATCHPOINT);
+    else if (on_watch) on_watch(watch_hit);
+    return;
+  }
 }
 
+static uint8_t _watch_read(uint16_t addr)
+{ uint8_t *page = _watched_read_pages[addr >> 8];
+  uint8_t val = page ? page[0xff & addr] : _watched_read_handlers[addr >> 8](addr);
+  _watch_access(addr, false, val);
+  return val;
+}
 
-enum isn_token parse_isn_token(int n, char *s)
-{ for (int i = 0; i < n_isn_tokens; i++)
-  if (streq(isn_tokens[i].string, n, s))
-    return i;
+static void _watch_write(uint16_t addr, uint8_t val)
+{ uint8_t *page = _watched_write_pages[addr >> 8];
+  if (page) page[0xff & addr] = val;
+  else _watched_write_handlers[addr >> 8](addr, val);
+  _watch_access(addr, true, val);
+}
 
-  parse_error("invalid instruction", n, s);
+// Watch reads and/or writes of size bytes at addr, returning the watchpoint's
+// index.  Mapping something else over a watched page drops the watch on it.
+int watch_memory(uint16_t addr, uint32_t size, bool reads, bool writes)
+{ int i = 0;
+  while (watchpoints[i].size)
+    if (listsize(watchpoints) == ++i) panic;
+  if (!size || 0x10000 < addr + size) panic;
+  watchpoints[i] = (struct watchpoint){ addr, size, reads, writes };
+  _watching = true;
+
+  for (int page = addr >> 8; page <= addr + size - 1 >> 8; page++)
+  { if (_watched[page]) continue;
+    _watched[page] = true;
+    _watched_read_pages[page] = read_pages[page];
+    _watched_write_pages[page] = write_pages[page];
+    _watched_read_handlers[page] = read_handlers[page];
+    _watched_write_handlers[page] = write_handlers[page];
+    map_handlers(page << 8, 0x100, _watch_read, _watch_write);
+  }
+  return i;
 }
 
+void unwatch_memory(int i)
+{ watchpoints[i].size = 0;
+  _watching = false;
+  for (int j = 0; j < listsize(watchpoints); j++)
+    _watching |= 0 != watchpoints[j].size;
+  for (int page = 0; page < 256; page++)
+  { if (!_watched[page]) continue;
+    uint32_t start = page << 8, end = start + 0xff;
+    bool used = false;
+    for (int j = 0; j < listsize(watchpoints); j++)
+    { struct watchpoint *w = &watchpoints[j];
+      used |= w->size && w->addr <= end && w->addr + w->size - 1 >= start;
+    }
+    if (used) continue;
+    _watched[page] = false;
+    read_pages[page] = _watched_read_pages[page];
+    write_pages[page] = _watched_write_pages[page];
+    read_handlers[page] = _watched_read_handlers[page];
+    write_handlers[page] = _watched_write_handlers[page];
+  }
+}
 
-struct arg_token parse_arg_token
-( int n_symbols, struct symbol *symbols
-, int n, char *s
-)
-{ int i;
 
-  if (!n) panic;
+// the instruction which a fused idiom or a breakpoint replaced
+static inline struct instruction unfuse(struct instruction x)
+{ if (OP_BREAK == x.op) x = breakpoints[x.p1].saved;
+  if (OP_COPY_DE_HLI > x.op) return x;
+  const struct idiom *idiom = _idiom(x.op);
+  return idiom ? idiom->pattern[0] : x;
+}
 
-  for (i = 0; n > i; i++)
-    if ('0' > s[i] || '9' < s[i]) break;
-  if (n == i)
-    return (struct arg_token){ N_TOK_TYPE, parse_base10(n, s), n, s };
 
-  if ('%' == *s)
-  { for (i = 1; n > i; i++)
-      if ('0' > s[i] || '1' < s[i]) break;
-    if (n == i)
-      return (struct arg_token){ N_TOK_TYPE, parse_base2(n-1, 1+s), n, s };
-  }
+static const enum op flagless_ops[][2] =
+{ { OP_ADC_A_R8, OP_ADC_A_R8_NF }
+, { OP_ADC_A_IHL, OP_ADC_A_IHL_NF }
+, { OP_ADC_A_N8, OP_ADC_A_N8_NF }
+, { OP_ADD_A_R8, OP_ADD_A_R8_NF }
+, { OP_ADD_A_IHL, OP_ADD_A_IHL_NF }
+, { OP_ADD_A_N8, OP_ADD_A_N8_NF }
+, { OP_AND_A_R8, OP_AND_A_R8_NF }
+, { OP_AND_A_IHL, OP_AND_A_IHL_NF }
+, { OP_AND_A_N8, OP_AND_A_N8_NF }
+, { OP_CP_A_R8, OP_CP_A_R8_NF }
+, { OP_CP_A_IHL, OP_CP_A_IHL_NF }
+, { OP_CP_A_N8, OP_CP_A_N8_NF }
+, { OP_OR_A_R8, OP_OR_A_R8_NF }
+, { OP_OR_A_IHL, OP_OR_A_IHL_NF }
+, { OP_OR_A_N8, OP_OR_A_N8_NF }
+, { OP_SBC_A_R8, OP_SBC_A_R8_NF }
+, { OP_SBC_A_IHL, OP_SBC_A_IHL_NF }
+, { OP_SBC_A_N8, OP_SBC_A_N8_NF }
+, { OP_SUB_A_R8, OP_SUB_A_R8_NF }
+, { OP_SUB_A_IHL, OP_SUB_A_IHL_NF }
+, { OP_SUB_A_N8, OP_SUB_A_N8_NF }
+, { OP_XOR_A_R8, OP_XOR_A_R8_NF }
+, { OP_XOR_A_IHL, OP_XOR_A_IHL_NF }
+, { OP_XOR_A_N8, OP_XOR_A_N8_NF }
+, { OP_DEC_R8, OP_DEC_R8_NF }
+, { OP_DEC_IHL, OP_DEC_IHL_NF }
+, { OP_INC_R8, OP_INC_R8_NF }
+, { OP_INC_IHL, OP_INC_IHL_NF }
+, { OP_ADD_HL_R16, OP_ADD_HL_R16_NF }
+, { OP_RL_R8, OP_RL_R8_NF }
+, { OP_RLC_R8, OP_RLC_R8_NF }
+, { OP_RR_R8, OP_RR_R8_NF }
+, { OP_RRC_R8, OP_RRC_R8_NF }
+, { OP_SLA_R8, OP_SLA_R8_NF }
+, { OP_SRA_R8, OP_SRA_R8_NF }
+, { OP_SRL_R8, OP_SRL_R8_NF }
+, { OP_SWAP_R8, OP_SWAP_R8_NF }
+, { OP_RLA, OP_RLA_NF }
+, { OP_RLCA, OP_RLCA_NF }
+, { OP_RRA, OP_RRA_NF }
+, { OP_RRCA, OP_RRCA_NF }
+};
 
-  if ('$' == *s)
-  { for (i = 1; n > i; i++)
-      if
-      (  '0' > s[i]
-      || '9' < s[i] && 'a' > s[i]
-      || 'f' < s[i]
-      ) break;
-    if (n == i)
-      return (struct arg_token){ N_TOK_TYPE, parse_base16(n-1, 1+s), n, s };
-  }
+// the variant of an op which skips computing flags, or the op itself
+static inline enum op flagless_op(enum op op)
+{ for (int i = 0; i < listsize(flagless_ops); i++)
+    if (op == flagless_ops[i][0]) return flagless_ops[i][1];
+  return op;
+}
 
-  for (int i = 0; i < n_arg_tokens; i++)
-  if (streq(arg_tokens[i].string, n, s))
-    return (struct arg_token)
-      { arg_tokens[i].type
-      , arg_tokens[i].value
-      , n, s
-      };
+// the op which a flag-dead variant stands in for
+static inline enum op flagged_op(enum op op)
+{ for (int i = 0; i < listsize(flagless_ops); i++)
+    if (op == flagless_ops[i][1]) return flagless_ops[i][0];
+  return op;
+}
 
-  for (int i = 0; i < n_symbols; i++)
-  if (streq(symbols[i].name, n, s))
-    return (struct arg_token){ N_TOK_TYPE, symbols[i].value, n, s };
 
-  parse_error("invalid argument", n, s);
+static inline int _jr_target(struct instruction x, int pc)
+{ return 1 + pc + (int16_t)(OP_JR_E8 == x.op ? x.p1 : x.p2); }
+
+
+static inline bool _test_condition(enum cc cc, uint8_t f)
+{ switch (cc)
+  { case CC_NZ: return !(FLAG_Z & f);
+    case CC_Z: return FLAG_Z & f;
+    case CC_NC: return !(FLAG_C & f);
+    case CC_C: return FLAG_C & f;
+    default: panic;
+  }
 }
 
+static inline bool _condition(enum cc cc)
+{ return _test_condition(cc, reg.f); }
+
+
+static inline uint16_t execute(struct instruction *x, uint16_t pc)
+{ again:
+  switch (x->op)
+  { case OP_ADC_A_R8: adc_a_r8(x->p1); break;
+    case OP_ADC_A_IHL: adc_a_ihl(); break;
+    case OP_ADC_A_N8: adc_a_n8(x->p1); break;
+    case OP_ADD_A_R8: add_a_r8(x->p1); break;
+    case OP_ADD_A_IHL: add_a_ihl(); break;
+    case OP_ADD_A_N8: add_a_n8(x->p1); break;
+    case OP_AND_A_R8: and_a_r8(x->p1); break;
+    case OP_AND_A_IHL: and_a_ihl(); break;
+    case OP_AND_A_N8: and_a_n8(x->p1); break;
+    case OP_CP_A_R8: cp_a_r8(x->p1); break;
+    case OP_CP_A_IHL: cp_a_ihl(); break;
+    case OP_CP_A_N8: cp_a_n8(x->p1); break;
+    case OP_DEC_R8: dec_r8(x->p1); break;
+    case OP_DEC_IHL: dec_ihl(); break;
+    case OP_INC_R8: inc_r8(x->p1); break;
+    case OP_INC_IHL: inc_ihl(); break;
+    case OP_OR_A_R8: or_a_r8(x->p1); break;
+    case OP_OR_A_IHL: or_a_ihl(); break;
+    case OP_OR_A_N8: or_a_n8(x->p1); break;
+    case OP_SBC_A_R8: sbc_a_r8(x->p1); break;
+    case OP_SBC_A_IHL: sbc_a_ihl(); break;
+    case OP_SBC_A_N8: sbc_a_n8(x->p1); break;
+    case OP_SUB_A_R8: sub_a_r8(x->p1); break;
+    case OP_SUB_A_IHL: sub_a_ihl(); break;
+    case OP_SUB_A_N8: sub_a_n8(x->p1); break;
+    case OP_XOR_A_R8: xor_a_r8(x->p1); break;
+    case OP_XOR_A_IHL: xor_a_ihl(); break;
+    case OP_XOR_A_N8: xor_a_n8(x->p1); break;
+
+    case OP_ADD_HL_R16: add_hl_r16(x->p1); break;
+    case OP_DEC_R16: dec_r16(x->p1); break;
+    case OP_INC_R16: inc_r16(x->p1); break;
+
+    case OP_BIT_U3_R8: bit_u3_r8(x->p1, x->p2); break;
+    case OP_BIT_U3_IHL: bit_u3_ihl(x->p1); break;
+    case OP_RES_U3_R8: res_u3_r8(x->p1, x->p2); break;
+    case OP_RES_U3_IHL: res_u3_ihl(x->p1); break;
+    case OP_SET_U3_R8: set_u3_r8(x->p1, x->p2); break;
+    case OP_SET_U3_IHL: set_u3_ihl(x->p1); break;
+    case OP_SWAP_R8: swap_r8(x->p1); break;
+    case OP_SWAP_IHL: swap_ihl(); break;
+
+    case OP_RL_R8: rl_r8(x->p1); break;
+    case OP_RL_IHL: rl_ihl(); break;
+    case OP_RLA: rla(); break;
+    case OP_RLC_R8: rlc_r8(x->p1); break;
+    case OP_RLC_IHL: rlc_ihl(); break;
+    case OP_RLCA: rlca(); break;
+    case OP_RR_R8: rr_r8(x->p1); break;
+    case OP_RR_IHL: rr_ihl(); break;
+    case OP_RRA: rra(); break;
+    case OP_RRC_R8: rrc_r8(x->p1); break;
+    case OP_RRC_IHL: rrc_ihl(); break;
+    case OP_RRCA: rrca(); break;
+    case OP_SLA_R8: sla_r8(x->p1); break;
+    case OP_SLA_IHL: sla_ihl(); break;
+    case OP_SRA_R8: sra_r8(x->p1); break;
+    case OP_SRA_IHL: sra_ihl(); break;
+    case OP_SRL_R8: srl_r8(x->p1); break;
+    case OP_SRL_IHL: srl_ihl(); break;
+
+    case OP_LD_R8_R8: ld_r8_r8(x->p1, x->p2); break;
+    case OP_LD_R8_N8: ld_r8_n8(x->p1, x->p2); break;
+    case OP_LD_R16_N16: ld_r16_n16(x->p1, x->p2); break;
+    case OP_LD_IHL_R8: ld_ihl_r8(x->p1); break;
+    case OP_LD_IHL_N8: ld_ihl_n8(x->p1); break;
+    case OP_LD_R8_IHL: ld_r8_ihl(x->p1); break;
+    case OP_LD_IR16_A: ld_ir16_a(x->p1); break;
+    case OP_LD_IN16_A: ld_in16_a(x->p1); break;
+    case OP_LDH_IN16_A: ldh_in16_a(x->p1); break;
+    case OP_LDH_IC_A: ldh_ic_a(); break;
+    case OP_LD_A_IR16: ld_a_ir16(x->p1); break;
+    case OP_LD_A_IN16: ld_a_in16(x->p1); break;
+    case OP_LDH_A_IN16: ldh_a_in16(x->p1); break;
+    case OP_LDH_A_IC: ldh_a_ic(); break;
+    case OP_LD_IHLI_A: ld_ihli_a(); break;
+    case OP_LD_IHLD_A: ld_ihld_a(); break;
+    case OP_LD_A_IHLI: ld_a_ihli(); break;
+    case OP_LD_A_IHLD: ld_a_ihld(); break;
+
+    case OP_CALL_N16: _push(pc); pc = x->p1; cycles += 6; break;
+    case OP_CALL_CC_N16:
+      if (_condition(x->p1)) { _push(pc); pc = x->p2; cycles += 6; } else { cycles += 3; }
+      break;
+    case OP_JP_HL: pc = reg.hl; cycles += 1; break;
+    case OP_JP_N16: pc = x->p1; cycles += 4; break;
+    case OP_JP_CC_N16:
+      if (_condition(x->p1)) { pc = x->p2; cycles += 4; } else { cycles += 3; }
+      break;
+    case OP_JR_E8: pc += x->p1; cycles += 3; break;
+    case OP_JR_CC_E8:
+      if (_condition(x->p1)) { pc += x->p2; cycles += 3; } else { cycles += 2; }
+      break;
+    case OP_RET_CC:
+      if (_condition(x->p1)) { pc = _pop(); cycles += 5; } else { cycles += 2; }
+      break;
+    case OP_RET: pc = _pop(); cycles += 4; break;
+    case OP_RETI: pc = _pop(); cycles += 4; ime = true; _update_horizon(); break;
+    case OP_RST_VEC: panic;  // there are no vectors among instruction indices
+
+    case OP_ADD_HL_SP: add_hl_sp(); break;
+    case OP_ADD_SP_E8: add_sp_e8(x->p1); break;
+    case OP_DEC_SP: dec_sp(); break;
+    case OP_INC_SP: inc_sp(); break;
+    case OP_LD_SP_N16: ld_sp_n16(x->p1); break;
+    case OP_LD_IN16_SP: ld_in16_sp(x->p1); break;
+    case OP_LD_HL_SPE8: ld_hl_spe8(x->p1); break;
+    case OP_LD_SP_HL: ld_sp_hl(); break;
+    case OP_POP_AF: pop_af(); break;
+    case OP_POP_R16: pop_r16(x->p1); break;
+    case OP_PUSH_AF: push_af(); break;
+    case OP_PUSH_R16: push_r16(x->p1); break;
+
+    case OP_CCF: ccf(); break;
+    case OP_CPL: cpl(); break;
+    case OP_DAA: daa(); break;
+    case OP_DI: di(); break;
+    case OP_EI: ei(); break;
+    case OP_HALT: halt(); break;
+    case OP_NOP: nop(); break;
+    case OP_SCF: scf(); break;
+    case OP_STOP: stop(); break;
+
+    case OP_COPY_DE_HLI:
+      if (_watching) goto unfused;
+      copy_de_hli(); pc += 4; break;
+    case OP_COPY_HLI_DE:
+      if (_watching) goto unfused;
+      copy_hli_de(); pc += 4; break;
+    case OP_FILL_HLI:
+      if (_watching) goto unfused;
+      fill_hli(); pc += 2; break;
+    case OP_CMP_DE_HL:
+      if (_watching) goto unfused;
+      pc += cmp_de_hl() ? (int16_t)x->p1 : 6; break;
+
+    case OP_ADC_A_R8_NF: adc_a_r8_nf(x->p1); break;
+    case OP_ADC_A_IHL_NF: adc_a_ihl_nf(); break;
+    case OP_ADC_A_N8_NF: adc_a_n8_nf(x->p1); break;
+    case OP_ADD_A_R8_NF: add_a_r8_nf(x->p1); break;
+    case OP_ADD_A_IHL_NF: add_a_ihl_nf(); break;
+    case OP_ADD_A_N8_NF: add_a_n8_nf(x->p1); break;
+    case OP_AND_A_R8_NF: and_a_r8_nf(x->p1); break;
+    case OP_AND_A_IHL_NF: and_a_ihl_nf(); break;
+    case OP_AND_A_N8_NF: and_a_n8_nf(x->p1); break;
+    case OP_CP_A_R8_NF: cp_a_r8_nf(x->p1); break;
+    case OP_CP_A_IHL_NF: cp_a_ihl_nf(); break;
+    case OP_CP_A_N8_NF: cp_a_n8_nf(x->p1); break;
+    case OP_OR_A_R8_NF: or_a_r8_nf(x->p1); break;
+    case OP_OR_A_IHL_NF: or_a_ihl_nf(); break;
+    case OP_OR_A_N8_NF: or_a_n8_nf(x->p1); break;
+    case OP_SBC_A_R8_NF: sbc_a_r8_nf(x->p1); break;
+    case OP_SBC_A_IHL_NF: sbc_a_ihl_nf(); break;
+    case OP_SBC_A_N8_NF: sbc_a_n8_nf(x->p1); break;
+    case OP_SUB_A_R8_NF: sub_a_r8_nf(x->p1); break;
+    case OP_SUB_A_IHL_NF: sub_a_ihl_nf(); break;
+    case OP_SUB_A_N8_NF: sub_a_n8_nf(x->p1); break;
+    case OP_XOR_A_R8_NF: xor_a_r8_nf(x->p1); break;
+    case OP_XOR_A_IHL_NF: xor_a_ihl_nf(); break;
+    case OP_XOR_A_N8_NF: xor_a_n8_nf(x->p1); break;
+    case OP_DEC_R8_NF: dec_r8_nf(x->p1); break;
+    case OP_DEC_IHL_NF: dec_ihl_nf(); break;
+    case OP_INC_R8_NF: inc_r8_nf(x->p1); break;
+    case OP_INC_IHL_NF: inc_ihl_nf(); break;
+    case OP_ADD_HL_R16_NF: add_hl_r16_nf(x->p1); break;
+    case OP_RL_R8_NF: rl_r8_nf(x->p1); break;
+    case OP_RLC_R8_NF: rlc_r8_nf(x->p1); break;
+    case OP_RR_R8_NF: rr_r8_nf(x->p1); break;
+    case OP_RRC_R8_NF: rrc_r8_nf(x->p1); break;
+    case OP_SLA_R8_NF: sla_r8_nf(x->p1); break;
+    case OP_SRA_R8_NF: sra_r8_nf(x->p1); break;
+    case OP_SRL_R8_NF: srl_r8_nf(x->p1); break;
+    case OP_SWAP_R8_NF: swap_r8_nf(x->p1); break;
+    case OP_RLA_NF: rla_nf(); break;
+    case OP_RLCA_NF: rlca_nf(); break;
+    case OP_RRA_NF: rra_nf(); break;
+    case OP_RRCA_NF: rrca_nf(); break;
+
+    case OP_BREAK:
+      if (_breakpoint(x->p1, pc - 1)) return pc - 1;
+      x = &breakpoints[x->p1].saved;
+      goto again;
+
+    // a watched access has to be seen one at a time, by the instruction
+    // making it, so run the head of the loop as written; the rest is in place
+    unfused:
+      x = (struct instruction *)&_idiom(x->op)->pattern[0];
+      goto again;
 
-enum args
-{ ARGS_INVALID
-, ARGS_R8
-, ARGS_IHL
-, ARGS_N8
-, ARGS_A_R8
-, ARGS_A_IHL
-, ARGS_A_N8
-, ARGS_HL_R16
-, ARGS_R16
-, ARGS_U3_R8
-, ARGS_U3_IHL
-, ARGS_NONE
-, ARGS_R8_R8
-, ARGS_R8_N8
-, ARGS_R16_N16
-, ARGS_IHL_R8
-, ARGS_IHL_N8
-, ARGS_R8_IHL
-, ARGS_IR16_A
-, ARGS_IN16_A
-, ARGS_IC_A
-, ARGS_A_IR16
-, ARGS_A_IN16
-, ARGS_A_IC
-, ARGS_IHLI_A
-, ARGS_IHLD_A
-, ARGS_A_IHLI
-, ARGS_A_IHLD
-, ARGS_N16
-, ARGS_CC_N16
-, ARGS_HL
-, ARGS_E8
-, ARGS_CC_E8
-, ARGS_CC
-, ARGS_VEC
-, ARGS_HL_SP
-, ARGS_SP_E8
-, ARGS_SP
-, ARGS_SP_N16
-, ARGS_IN16_SP
-, ARGS_HL_SPE8
-, ARGS_SP_HL
-, ARGS_AF
-};
+    default: panic;
+  }
+  return pc;
+}
 
 
-static const struct instruction_signature {
-  enum op op;
-  enum args args;
-} instruction_signatures[N_ISN_TOKEN][N_ARG_TOKEN_TYPE][N_ARG_TOKEN_TYPE] =
-  { [ADC_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_ADC_A_R8,   ARGS_R8     }
-  , [ADC_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_ADC_A_IHL,  ARGS_IHL    }
-  , [ADC_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_ADC_A_N8,   ARGS_N8     }
-  , [ADC_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_ADC_A_R8,   ARGS_A_R8   }
-  , [ADC_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_ADC_A_IHL,  ARGS_A_IHL  }
-  , [ADC_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_ADC_A_N8,   ARGS_A_N8   }
+// run a program from instruction pc until it runs off the end
+void run_program_from(struct program *program, uint16_t pc)
+{ start_cycles();
+  running_program = program;
+  while (program->length > pc)
+  { running_isn = pc;
+    struct instruction *x = &program->instructions[pc++];
+    pc = execute(x, pc);
+    if (cycles >= event_horizon) service_events();
+  }
+  // printf("cycles: %d\n", cycles);
+}
 
-  , [ADD_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_ADD_A_R8,   ARGS_R8     }
-  , [ADD_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_ADD_A_IHL,  ARGS_IHL    }
-  , [ADD_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_ADD_A_N8,   ARGS_N8     }
-  , [ADD_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_ADD_A_R8,   ARGS_A_R8   }
-  , [ADD_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_ADD_A_IHL,  ARGS_A_IHL  }
-  , [ADD_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_ADD_A_N8,   ARGS_A_N8   }
+void run_program(struct program *program)
+{ run_program_from(program, 0); }
 
-  , [AND_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_AND_A_R8,   ARGS_R8     }
-  , [AND_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_AND_A_IHL,  ARGS_IHL    }
-  , [AND_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_AND_A_N8,   ARGS_N8     }
-  , [AND_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_AND_A_R8,   ARGS_A_R8   }
-  , [AND_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_AND_A_IHL,  ARGS_A_IHL  }
-  , [AND_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_AND_A_N8,   ARGS_A_N8   }
+// Call the routine at instruction entry (see find_label), and run it until it
+// returns.  The return address pushed is the end of the program.
+void call_program(struct program *program, uint16_t entry)
+{ _push(program->length);
+  run_program_from(program, entry);
+}
 
-  , [CP_TOK ][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_CP_A_R8,    ARGS_R8     }
-  , [CP_TOK ][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_CP_A_IHL,   ARGS_IHL    }
-  , [CP_TOK ][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_CP_A_N8,    ARGS_N8     }
-  , [CP_TOK ][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_CP_A_R8,    ARGS_A_R8   }
-  , [CP_TOK ][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_CP_A_IHL,   ARGS_A_IHL  }
-  , [CP_TOK ][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_CP_A_N8,    ARGS_A_N8   }
+// call_program, returning false if it panics or reaches max_cycles
+static bool _call_guarded(struct program *program, uint16_t entry, uint32_t max_cycles)
+{ jmp_buf jump;
+  bool ok = !setjmp(jump);
+  if (ok)
+  { panic_jump = &jump;
+    cycle_limit = max_cycles;
+    call_program(program, entry);
+  }
+  panic_jump = NULL;
+  cycle_limit = UINT32_MAX;
+  return ok;
+}
 
-  , [DEC_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_DEC_R8,     ARGS_R8     }
-  , [DEC_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_DEC_IHL,    ARGS_IHL    }
 
-  , [INC_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_INC_R8,     ARGS_R8     }
-  , [INC_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_INC_IHL,    ARGS_IHL    }
+// resumable runs, for interleaving programs or bounding how long a step takes
 
-  , [OR_TOK ][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_OR_A_R8,    ARGS_R8     }
-  , [OR_TOK ][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_OR_A_IHL,   ARGS_IHL    }
-  , [OR_TOK ][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_OR_A_N8,    ARGS_N8     }
-  , [OR_TOK ][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_OR_A_R8,    ARGS_A_R8   }
-  , [OR_TOK ][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_OR_A_IHL,   ARGS_A_IHL  }
-  , [OR_TOK ][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_OR_A_N8,    ARGS_A_N8   }
+struct run
+{ struct program *program;
+  uint16_t pc;
+  struct registers reg;   // while not running
+  uint64_t cycles;        // in total so far
+  uint64_t instructions;
+  bool at_breakpoint;     // stopped at the breakpoint at pc
+};
 
-  , [SBC_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SBC_A_R8,   ARGS_R8     }
-  , [SBC_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_SBC_A_IHL,  ARGS_IHL    }
-  , [SBC_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SBC_A_N8,   ARGS_N8     }
-  , [SBC_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_SBC_A_R8,   ARGS_A_R8   }
-  , [SBC_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_SBC_A_IHL,  ARGS_A_IHL  }
-  , [SBC_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_SBC_A_N8,   ARGS_A_N8   }
+// begin a run of program at instruction pc, with the current registers
+void start_run(struct run *run, struct program *program, uint16_t pc)
+{ *run = (struct run){ program, pc, reg }; }
 
-  , [SUB_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SUB_A_R8,   ARGS_R8     }
-  , [SUB_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_SUB_A_IHL,  ARGS_IHL    }
-  , [SUB_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SUB_A_N8,   ARGS_N8     }
-  , [SUB_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_SUB_A_R8,   ARGS_A_R8   }
-  , [SUB_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_SUB_A_IHL,  ARGS_A_IHL  }
-  , [SUB_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_SUB_A_N8,   ARGS_A_N8   }
+// begin a run which calls the routine at entry, as call_program does
+void start_call(struct run *run, struct program *program, uint16_t entry)
+{ _push(program->length);
+  start_run(run, program, entry);
+}
 
-  , [XOR_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_XOR_A_R8,   ARGS_R8     }
-  , [XOR_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_XOR_A_IHL,  ARGS_IHL    }
-  , [XOR_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_XOR_A_N8,   ARGS_N8     }
-  , [XOR_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_XOR_A_R8,   ARGS_A_R8   }
-  , [XOR_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_XOR_A_IHL,  ARGS_A_IHL  }
-  , [XOR_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_XOR_A_N8,   ARGS_A_N8   }
+// Continue a run for up to max_instructions instructions and max_cycles
+// cycles (0 for no limit), with its registers in reg.  It stops at the first
+// instruction boundary past either, so a fused loop counts as one, or at a
+// breakpoint or watchpoint.  Runs share mem and the hardware; cycles is left
+// with those of this step alone.
+enum run_status advance_run
+( struct run *run
+, uint64_t max_instructions, uint32_t max_cycles
+)
+{ struct program *program = run->program;
+  uint16_t pc = run->pc;
+  uint64_t n = 0;
+  if (!max_instructions) max_instructions = UINT64_MAX;
+  if (!max_cycles) max_cycles = UINT32_MAX;
+  enum run_status status = RUN_DONE;
+
+  reg = run->reg;
+  stop_on_traps = true;
+  stepping_over = run->at_breakpoint;
+  start_cycles();
+  running_program = program;
+  while (program->length > pc)
+  { running_isn = pc;
+    struct instruction *x = &program->instructions[pc++];
+    pc = execute(x, pc);
+    n++;
+    if (cycles >= event_horizon)
+    { service_events();
+      if (trapped)
+      { trapped = false;
+        _update_horizon();
+        status = trap_status;
+        if (RUN_BREAKPOINT == status) n--;
+        break;
+      }
+    }
+    if (n >= max_instructions || cycles >= max_cycles)
+    { status = program->length > pc ? RUN_BUDGET : RUN_DONE;
+      break;
+    }
+  }
 
-  , [ADD_TOK][R16_TOK_TYPE][R16_TOK_TYPE ] = { OP_ADD_HL_R16, ARGS_HL_R16 }
-  , [DEC_TOK][R16_TOK_TYPE][NONE_TOK_TYPE] = { OP_DEC_R16,    ARGS_R16    }
-  , [INC_TOK][R16_TOK_TYPE][NONE_TOK_TYPE] = { OP_INC_R16,    ARGS_R16    }
+  stop_on_traps = false;
+  stepping_over = false;
+  run->at_breakpoint = RUN_BREAKPOINT == status;
+  run->pc = pc;
+  run->reg = reg;
+  run->cycles += cycles;
+  run->instructions += n;
+  return status;
+}
 
-  , [BIT_TOK ][N_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_BIT_U3_R8,  ARGS_U3_R8  }
-  , [BIT_TOK ][N_TOK_TYPE  ][IHL_TOK_TYPE ] = { OP_BIT_U3_IHL, ARGS_U3_IHL }
-  , [RES_TOK ][N_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_RES_U3_R8,  ARGS_U3_R8  }
-  , [RES_TOK ][N_TOK_TYPE  ][IHL_TOK_TYPE ] = { OP_RES_U3_IHL, ARGS_U3_IHL }
-  , [SET_TOK ][N_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_SET_U3_R8,  ARGS_U3_R8  }
-  , [SET_TOK ][N_TOK_TYPE  ][IHL_TOK_TYPE ] = { OP_SET_U3_IHL, ARGS_U3_IHL }
-  , [SWAP_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SWAP_R8,    ARGS_R8     }
-  , [SWAP_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_SWAP_IHL,   ARGS_IHL    }
 
-  , [RL_TOK  ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RL_R8,   ARGS_R8   }
-  , [RL_TOK  ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RL_IHL,  ARGS_IHL  }
-  , [RLA_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RLA,     ARGS_NONE }
-  , [RLC_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RLC_R8,  ARGS_R8   }
-  , [RLC_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RLC_IHL, ARGS_IHL  }
-  , [RLCA_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RLCA,    ARGS_NONE }
-  , [RR_TOK  ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RR_R8,   ARGS_R8   }
-  , [RR_TOK  ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RR_IHL,  ARGS_IHL  }
-  , [RRA_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RRA,     ARGS_NONE }
-  , [RRC_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RRC_R8,  ARGS_R8   }
-  , [RRC_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RRC_IHL, ARGS_IHL  }
-  , [RRCA_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RRCA,    ARGS_NONE }
-  , [SLA_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SLA_R8,  ARGS_R8   }
-  , [SLA_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SLA_IHL, ARGS_IHL  }
-  , [SRA_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SRA_R8,  ARGS_R8   }
-  , [SRA_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SRA_IHL, ARGS_IHL  }
-  , [SRL_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SRL_R8,  ARGS_R8   }
-  , [SRL_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SRL_IHL, ARGS_IHL  }
+// Set a breakpoint on instruction isn, returning its index in breakpoints.
+// A fused loop around isn goes back to running an iteration at a time, so
+// that the breakpoint is reached.
+int set_breakpoint(struct program *program, uint16_t isn)
+{ if (program->length <= isn) panic;
+  struct instruction *x = &program->instructions[isn];
+  if (OP_BREAK == x->op) return x->p1;
 
-  , [LD_TOK ][R8_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_LD_R8_R8,   ARGS_R8_R8   }
-  , [LD_TOK ][R8_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_LD_R8_N8,   ARGS_R8_N8   }
-  , [LD_TOK ][R16_TOK_TYPE ][N_TOK_TYPE   ] = { OP_LD_R16_N16, ARGS_R16_N16 }
-  , [LD_TOK ][IHL_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_LD_IHL_R8,  ARGS_IHL_R8  }
-  , [LD_TOK ][IHL_TOK_TYPE ][N_TOK_TYPE   ] = { OP_LD_IHL_N8,  ARGS_IHL_N8  }
-  , [LD_TOK ][R8_TOK_TYPE  ][IHL_TOK_TYPE ] = { OP_LD_R8_IHL,  ARGS_R8_IHL  }
-  , [LD_TOK ][IR16_TOK_TYPE][R8_TOK_TYPE  ] = { OP_LD_IR16_A,  ARGS_IR16_A  }
-  , [LD_TOK ][IN16_TOK_TYPE][R8_TOK_TYPE  ] = { OP_LD_IN16_A,  ARGS_IN16_A  }
-  , [LDH_TOK][N_TOK_TYPE   ][R8_TOK_TYPE  ] = { OP_LDH_IN16_A, ARGS_IN16_A  }
-  , [LDH_TOK][IC_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_LDH_IC_A,   ARGS_IC_A    }
-  , [LD_TOK ][R8_TOK_TYPE  ][IR16_TOK_TYPE] = { OP_LD_A_IR16,  ARGS_A_IR16  }
-  , [LD_TOK ][R8_TOK_TYPE  ][IN16_TOK_TYPE] = { OP_LD_A_IN16,  ARGS_A_IN16  }
-  , [LDH_TOK][R8_TOK_TYPE  ][IN16_TOK_TYPE] = { OP_LDH_A_IN16, ARGS_A_IN16  }
-  , [LDH_TOK][R8_TOK_TYPE  ][IC_TOK_TYPE  ] = { OP_LDH_A_IC,   ARGS_A_IC    }
-  , [LD_TOK ][IHLI_TOK_TYPE][R8_TOK_TYPE  ] = { OP_LD_IHLI_A,  ARGS_IHLI_A  }
-  , [LD_TOK ][IHLD_TOK_TYPE][R8_TOK_TYPE  ] = { OP_LD_IHLD_A,  ARGS_IHLD_A  }
-  , [LD_TOK ][R8_TOK_TYPE  ][IHLI_TOK_TYPE] = { OP_LD_A_IHLI,  ARGS_A_IHLI  }
-  , [LD_TOK ][R8_TOK_TYPE  ][IHLD_TOK_TYPE] = { OP_LD_A_IHLD,  ARGS_A_IHLD  }
+  for (int i = 0; i < isn; i++)
+  { struct instruction *head = &program->instructions[i];
+    if (OP_BREAK == head->op) head = &breakpoints[head->p1].saved;
+    const struct idiom *idiom = _idiom(head->op);
+    if (idiom && i + idiom->length > isn) *head = idiom->pattern[0];
+  }
 
-  , [CALL_TOK][N_TOK_TYPE   ][NONE_TOK_TYPE] = { OP_CALL_N16,    ARGS_N16     }
-  , [CALL_TOK][CC_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_CALL_CC_N16, ARGS_CC_N16  }
-  , [JP_TOK  ][R16_TOK_TYPE ][NONE_TOK_TYPE] = { OP_JP_HL,       ARGS_HL      }
-  , [JP_TOK  ][N_TOK_TYPE   ][NONE_TOK_TYPE] = { OP_JP_N16,      ARGS_N16     }
-  , [JP_TOK  ][CC_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_JP_CC_N16,   ARGS_CC_N16  }
-  , [JR_TOK  ][N_TOK_TYPE   ][NONE_TOK_TYPE] = { OP_JR_E8,       ARGS_E8      }
-  , [JR_TOK][ANON_LABEL_TOK_TYPE][NONE_TOK_TYPE] = { OP_JR_E8, ARGS_E8 }
-  , [JR_TOK  ][CC_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_JR_CC_E8,    ARGS_CC_E8   }
-  , [JR_TOK][CC_TOK_TYPE][ANON_LABEL_TOK_TYPE] = { OP_JR_CC_E8, ARGS_CC_E8 }
-  , [RET_TOK ][CC_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RET_CC,      ARGS_CC      }
-  , [RET_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RET,         ARGS_NONE    }
-  , [RETI_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RETI,        ARGS_NONE    }
-  , [RST_TOK ][VEC_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RST_VEC,     ARGS_VEC     }
+  size_t i = 0;
+  while (n_breakpoints > i && breakpoints[i].program) i++;
+  if (0xffff < i) panic;
+  if (n_breakpoints == i)
+    breakpoints = realloc(breakpoints, ++n_breakpoints * sizeof(struct breakpoint));
+  breakpoints[i] = (struct breakpoint){ program, isn, *x };
+  *x = (struct instruction){ OP_BREAK, i };
+  return i;
+}
 
-  , [ADD_TOK ][R16_TOK_TYPE ][SP_TOK_TYPE  ] = { OP_ADD_HL_SP,  ARGS_HL_SP   }
-  , [ADD_TOK ][SP_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_ADD_SP_E8,  ARGS_SP_E8   }
-  , [DEC_TOK ][SP_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_DEC_SP,     ARGS_SP      }
-  , [INC_TOK ][SP_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_INC_SP,     ARGS_SP      }
-  , [LD_TOK  ][SP_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_LD_SP_N16,  ARGS_SP_N16  }
-  , [LD_TOK  ][IN16_TOK_TYPE][SP_TOK_TYPE  ] = { OP_LD_IN16_SP, ARGS_IN16_SP }
-  , [LD_TOK  ][R16_TOK_TYPE ][SPE8_TOK_TYPE] = { OP_LD_HL_SPE8, ARGS_HL_SPE8 }
-  , [LD_TOK  ][SP_TOK_TYPE  ][R16_TOK_TYPE ] = { OP_LD_SP_HL,   ARGS_SP_HL   }
-  , [POP_TOK ][AF_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_POP_AF,     ARGS_AF      }
-  , [POP_TOK ][R16_TOK_TYPE ][NONE_TOK_TYPE] = { OP_POP_R16,    ARGS_R16     }
-  , [PUSH_TOK][AF_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_PUSH_AF,    ARGS_AF      }
-  , [PUSH_TOK][R16_TOK_TYPE ][NONE_TOK_TYPE] = { OP_PUSH_R16,   ARGS_R16     }
+void clear_breakpoint(struct program *program, uint16_t isn)
+{ struct instruction *x = &program->instructions[isn];
+  if (OP_BREAK != x->op) return;
+  breakpoints[x->p1].program = NULL;
+  *x = breakpoints[x->p1].saved;
+}
 
-  , [CCF_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_CCF,        ARGS_NONE    }
-  , [CPL_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_CPL,        ARGS_NONE    }
-  , [DAA_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_DAA,        ARGS_NONE    }
-  , [DI_TOK  ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_DI,         ARGS_NONE    }
-  , [EI_TOK  ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_EI,         ARGS_NONE    }
-  , [HALT_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_HALT,       ARGS_NONE    }
-  , [NOP_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_NOP,        ARGS_NONE    }
-  , [SCF_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_SCF,        ARGS_NONE    }
-  , [STOP_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_STOP,       ARGS_NONE    }
-  };
 
+// run_program, also returning the number of instructions dispatched
+uint64_t run_program_counting(struct program *program)
+{ uint64_t n = 0;
+  start_cycles();
+  running_program = program;
+  uint16_t pc = 0;
+  while (program->length > pc)
+  { running_isn = pc;
+    struct instruction *x = &program->instructions[pc++];
+    pc = execute(x, pc);
+    if (cycles >= event_horizon) service_events();
+    n++;
+  }
+  return n;
+}
 
-static inline void n8_arg(struct arg_token arg_token)
-{ if (arg_token.value < -128 || arg_token.value > 255)
-    parse_error("argument must be 8-bit", arg_token.n, arg_token.s);
+
+// table-driven ALU
+
+
+struct alu_result
+{ uint8_t a, f;
+};
+
+enum shift
+{ SHIFT_RL
+, SHIFT_RLC
+, SHIFT_RR
+, SHIFT_RRC
+, SHIFT_SLA
+, SHIFT_SRA
+, SHIFT_SRL
+, SHIFT_SWAP
+, SHIFT_RLA
+, SHIFT_RLCA
+, SHIFT_RRA
+, SHIFT_RRCA
+, N_SHIFT
+};
+
+// indexed by carry in, A and operand
+struct alu_result alu_add[2][256][256];
+struct alu_result alu_sub[2][256][256];
+struct alu_result alu_and[256][256];
+struct alu_result alu_or[256][256];
+struct alu_result alu_xor[256][256];
+// indexed by the high nibble of F and A
+struct alu_result alu_daa[16][256];
+// indexed by shift, carry in and operand
+struct alu_result alu_shift[N_SHIFT][2][256];
+
+
+// reference semantics, written independently of the handlers from gbz80(7)
+
+static struct alu_result _ref_add(uint8_t a, uint8_t b, bool c)
+{ int r = a + b + c;
+  return (struct alu_result)
+    { r
+    , (0xff & r ? 0 : FLAG_Z)
+    | ((0x0f & a) + (0x0f & b) + c > 0x0f ? FLAG_H : 0)
+    | (r > 0xff ? FLAG_C : 0)
+    };
 }
-static inline void a_arg(struct arg_token arg_token)
-{ if (arg_token.value != R8_A)
-    parse_error("argument must be register A", arg_token.n, arg_token.s);
+
+static struct alu_result _ref_sub(uint8_t a, uint8_t b, bool c)
+{ int r = a - b - c;
+  return (struct alu_result)
+    { r
+    , (0xff & r ? 0 : FLAG_Z)
+    | FLAG_N
+    | ((0x0f & a) < (0x0f & b) + c ? FLAG_H : 0)
+    | (r < 0 ? FLAG_C : 0)
+    };
 }
-static inline void hl_arg(struct arg_token arg_token)
-{ if (arg_token.value != R16_HL)
-    parse_error("argument must be register HL", arg_token.n, arg_token.s);
+
+static struct alu_result _ref_logic(uint8_t r, uint8_t f)
+{ return (struct alu_result){ r, (r ? 0 : FLAG_Z) | f }; }
+
+// what daa should leave after x + y + c (or x - y - c) on BCD bytes: the
+// decimal sum (or difference) in BCD, carrying (or borrowing) past 99
+static struct alu_result _ref_daa(int x, int y, bool c, bool subtract)
+{ int d = (x >> 4) * 10 + (0x0f & x), e = (y >> 4) * 10 + (0x0f & y);
+  int r = subtract ? d - e - c : d + e + c;
+  bool carry = 0 > r || 99 < r;
+  r = (r + 100) % 100;
+  uint8_t bcd = r / 10 << 4 | r % 10;
+  return (struct alu_result)
+    { bcd, (bcd ? 0 : FLAG_Z) | (subtract ? FLAG_N : 0) | (carry ? FLAG_C : 0) };
 }
-static inline void u3_arg(struct arg_token arg_token)
-{ if (arg_token.value < 0 || arg_token.value > 7)
-    parse_error("argument must be 3-bit unsigned", arg_token.n, arg_token.s);
+
+static struct alu_result _ref_shift(enum shift shift, uint8_t v, bool c)
+{ uint8_t r;
+  bool out;
+  switch (shift)
+  { case SHIFT_RL: case SHIFT_RLA: r = v << 1 | c; out = v >> 7; break;
+    case SHIFT_RLC: case SHIFT_RLCA: r = v << 1 | v >> 7; out = v >> 7; break;
+    case SHIFT_RR: case SHIFT_RRA: r = v >> 1 | c << 7; out = 1 & v; break;
+    case SHIFT_RRC: case SHIFT_RRCA: r = v >> 1 | v << 7; out = 1 & v; break;
+    case SHIFT_SLA: r = v << 1; out = v >> 7; break;
+    case SHIFT_SRA: r = 0x80 & v | v >> 1; out = 1 & v; break;
+    case SHIFT_SRL: r = v >> 1; out = 1 & v; break;
+    case SHIFT_SWAP: r = v << 4 | v >> 4; out = false; break;
+    default: panic;
+  }
+  bool z = !r && SHIFT_RLA > shift;
+  return (struct alu_result){ r, (z ? FLAG_Z : 0) | (out ? FLAG_C : 0) };
 }
-static inline void n16_arg(struct arg_token arg_token)
-{ if (arg_token.value < -32768 || arg_token.value > 65535)
-    parse_error("argument must be 16-bit", arg_token.n, arg_token.s);
+
+// inc, dec and bit leave carry as it was
+static struct alu_result _ref_inc(uint8_t v, uint8_t f)
+{ uint8_t r = v + 1;
+  return (struct alu_result)
+    { r, (r ? 0 : FLAG_Z) | (0x0f == (0x0f & v) ? FLAG_H : 0) | FLAG_C & f };
 }
-static inline void e8_arg(struct arg_token arg_token)
-{ if (arg_token.value < -128 || arg_token.value > 127)
-    parse_error("argument must be 8-bit offset", arg_token.n, arg_token.s);
+
+static struct alu_result _ref_dec(uint8_t v, uint8_t f)
+{ uint8_t r = v - 1;
+  return (struct alu_result)
+    { r, (r ? 0 : FLAG_Z) | FLAG_N | (0x0f & v ? 0 : FLAG_H) | FLAG_C & f };
 }
 
+static uint8_t _ref_bit(int bit, uint8_t v, uint8_t f)
+{ return (v >> bit & 1 ? 0 : FLAG_Z) | FLAG_H | FLAG_C & f; }
 
-static inline struct instruction parse_instruction
-( enum isn_token isn_token, struct arg_token arg_tokens[2]
-, int instruction_n, char *instruction_s
-)
-{ const struct instruction_signature *signature =
-    &instruction_signatures[isn_token][arg_tokens[0].type][arg_tokens[1].type];
-  enum op op = signature->op;
-  enum args args = signature->args;
+// add hl, r16 leaves zero as it was, and carries out of bits 11 and 15
+static uint8_t _ref_add_hl(uint16_t hl, uint16_t v, uint8_t f)
+{ return
+    FLAG_Z & f
+  | ((0x0fff & hl) + (0x0fff & v) > 0x0fff ? FLAG_H : 0)
+  | (hl + v > 0xffff ? FLAG_C : 0);
+}
 
-  switch (args)
-  { case ARGS_R8:
-    case ARGS_R16:
-    case ARGS_R8_IHL:
-    case ARGS_CC:
-    case ARGS_VEC:
-    case ARGS_IN16_SP:
-      return (struct instruction){ op, arg_tokens[0].value, 0 };
-    case ARGS_IHL:
+// add sp, e8 and ld hl, sp + e8 carry as an unsigned add to the low byte
+static uint8_t _ref_spe8(uint16_t sp, uint8_t e)
+{ return
+    ((0x0f & sp) + (0x0f & e) > 0x0f ? FLAG_H : 0)
+  | ((0xff & sp) + e > 0xff ? FLAG_C : 0);
+}
+
+
+static size_t _check_alu(char *name, struct alu_result r, struct alu_result ref, int a, int b, int f)
+{ if (r.a == ref.a && r.f == ref.f) return 0;
+  printf
+  ( "%s a=%02x b=%02x f=%02x: got %02x %02x, expected %02x %02x\n"
+  , name, a, b, f, r.a, r.f, ref.a, ref.f
+  );
+  return 1;
+}
+
+static size_t _check_alu16(char *name, uint16_t r, uint8_t f, uint16_t ref, uint8_t ref_f, int a, int b)
+{ if (r == ref && f == ref_f) return 0;
+  printf
+  ( "%s %04x, %04x: got %04x f=%02x, expected %04x f=%02x\n"
+  , name, a, b, r, f, ref, ref_f
+  );
+  return 1;
+}
+
+static struct alu_result _run_alu(void (*f)(uint8_t), uint8_t a, uint8_t b, uint8_t flags)
+{ reg.a = a; reg.f = flags;
+  f(b);
+  return (struct alu_result){ reg.a, reg.f };
+}
+
+static void _adc_helper(uint8_t b) { _adc(b); }
+static void _add_helper(uint8_t b) { _add(b); }
+static void _sbc_helper(uint8_t b) { _sbc(b); }
+static void _sub_helper(uint8_t b) { _sub(b); }
+static void _cp_helper(uint8_t b) { _cp(b); }
+static void _and_helper(uint8_t b) { _and(b); }
+static void _or_helper(uint8_t b) { _or(b); }
+static void _xor_helper(uint8_t b) { _xor(b); }
+
+
+// Fill the ALU tables from the handlers, cross-checking every entry against
+// the reference semantics.  Returns the number of disagreements, the first
+// few of which are printed.
+size_t build_alu_tables()
+{ struct registers r0 = reg;
+  uint32_t c0 = cycles;
+  size_t errors = 0;
+
+  for (int a = 0; a < 256; a++)
+  for (int b = 0; b < 256; b++)
+  { struct alu_result r;
+    for (int c = 0; c < 2; c++)
+    { uint8_t f = c ? FLAG_C : 0;
+      r = alu_add[c][a][b] = _run_alu(_adc_helper, a, b, f);
+      errors += _check_alu("adc", r, _ref_add(a, b, c), a, b, f);
+      r = alu_sub[c][a][b] = _run_alu(_sbc_helper, a, b, f);
+      errors += _check_alu("sbc", r, _ref_sub(a, b, c), a, b, f);
+    }
+    r = _run_alu(_add_helper, a, b, FLAG_C);
+    errors += _check_alu("add", r, _ref_add(a, b, 0), a, b, FLAG_C);
+    r = _run_alu(_sub_helper, a, b, FLAG_C);
+    errors += _check_alu("sub", r, _ref_sub(a, b, 0), a, b, FLAG_C);
+    r = _run_alu(_cp_helper, a, b, FLAG_C);
+    errors += _check_alu("cp", r, (struct alu_result){ a, _ref_sub(a, b, 0).f }, a, b, FLAG_C);
+    r = alu_and[a][b] = _run_alu(_and_helper, a, b, 0);
+    errors += _check_alu("and", r, _ref_logic(a & b, FLAG_H), a, b, 0);
+    r = alu_or[a][b] = _run_alu(_or_helper, a, b, 0);
+    errors += _check_alu("or", r, _ref_logic(a | b, 0), a, b, 0);
+    r = alu_xor[a][b] = _run_alu(_xor_helper, a, b, 0);
+    errors += _check_alu("xor", r, _ref_logic(a ^ b, 0), a, b, 0);
+  }
+
+  for (int f = 0; f < 16; f++)
+  for (int a = 0; a < 256; a++)
+  { reg.a = a; reg.f = f << 4;
+    daa();
+    alu_daa[f][a] = (struct alu_result){ reg.a, reg.f };
+  }
+  // daa only means something after adding or subtracting BCD bytes, so it is
+  // checked there, against the decimal sum or difference
+  for (int x = 0; x < 100; x++)
+  for (int y = 0; y < 100; y++)
+  for (int c = 0; c < 2; c++)
+  for (int subtract = 0; subtract < 2; subtract++)
+  { uint8_t bx = x / 10 << 4 | x % 10, by = y / 10 << 4 | y % 10;
+    struct alu_result in = subtract ? _ref_sub(bx, by, c) : _ref_add(bx, by, c);
+    errors += _check_alu
+      ( "daa", alu_daa[in.f >> 4][in.a], _ref_daa(bx, by, c, subtract)
+      , in.a, 0, in.f
+      );
+  }
+
+  static char *names[N_SHIFT] =
+    { "rl", "rlc", "rr", "rrc", "sla", "sra", "srl", "swap"
+    , "rla", "rlca", "rra", "rrca"
+    };
+  static uint8_t (*const helpers[SHIFT_RLA])(uint8_t) =
+    { _rl, _rlc, _rr, _rrc, _sla, _sra, _srl, _swap };
+  static void (*const a_helpers[N_SHIFT - SHIFT_RLA])() =
+    { rla, rlca, rra, rrca };
+  for (enum shift s = 0; s < N_SHIFT; s++)
+  for (int c = 0; c < 2; c++)
+  for (int v = 0; v < 256; v++)
+  { uint8_t f = c ? FLAG_C : 0;
+    reg.a = v; reg.f = f;
+    if (SHIFT_RLA > s) reg.a = helpers[s](v);
+    else a_helpers[s - SHIFT_RLA]();
+    struct alu_result r = alu_shift[s][c][v] = (struct alu_result){ reg.a, reg.f };
+    errors += _check_alu(names[s], r, _ref_shift(s, v, c), v, 0, f);
+  }
+
+  // the helpers which have no table are checked too, since the engines
+  // share them
+  for (int f = 0; f < 0x100; f += 0x10)
+  for (int v = 0; v < 256; v++)
+  { reg.f = f;
+    uint8_t r = _inc(v);
+    errors += _check_alu("inc", (struct alu_result){ r, reg.f }, _ref_inc(v, f), v, 0, f);
+    reg.f = f;
+    r = _dec(v);
+    errors += _check_alu("dec", (struct alu_result){ r, reg.f }, _ref_dec(v, f), v, 0, f);
+    for (int bit = 0; bit < 8; bit++)
+    { reg.f = f;
+      _bit(bit, v);
+      errors += _check_alu
+        ( "bit", (struct alu_result){ 0, reg.f }
+        , (struct alu_result){ 0, _ref_bit(bit, v, f) }, v, bit, f
+        );
+    }
+  }
+
+  static const uint16_t operands[] =
+    { 0x0000, 0x0001, 0x000f, 0x0010, 0x00ff, 0x0100, 0x0fff, 0x1000
+    , 0x7fff, 0x8000, 0x8001, 0xf000, 0xff00, 0xfff0, 0xfffe, 0xffff
+    };
+  for (int hl = 0; hl < 0x10000; hl++)
+  for (int i = 0; i < listsize(operands); i++)
+  for (int z = 0; z < 2; z++)
+  { reg.hl = hl; reg.f = z ? FLAG_Z : 0;
+    _add_hl(operands[i]);
+    errors += _check_alu16
+      ( "add hl", reg.hl, reg.f, hl + operands[i]
+      , _ref_add_hl(hl, operands[i], z ? FLAG_Z : 0), hl, operands[i]
+      );
+  }
+
+  for (int sp = 0; sp < 0x10000; sp++)
+  for (int e = 0; e < 256; e++)
+  { reg.sp = sp; reg.f = 0xf0;
+    uint16_t r = _spe8(e);
+    errors += _check_alu16
+      ("add sp", r, reg.f, sp + (int8_t)e, _ref_spe8(sp, e), sp, e);
+  }
+
+  reg = r0;
+  cycles = c0;
+  return errors;
+}
+
+
+static inline void _alu_a(struct alu_result r)
+{ reg.a = r.a; reg.f = r.f; }
+
+static inline uint8_t _alu_shift(enum shift s, uint8_t val)
+{ struct alu_result r = alu_shift[s][FLAG_C & reg.f ? 1 : 0][val];
+  reg.f = r.f;
+  return r.a;
+}
+
+static inline uint16_t execute_alu_tables(struct instruction *x, uint16_t pc)
+{ int c = FLAG_C & reg.f ? 1 : 0;
+  switch (x->op)
+  { case OP_ADC_A_R8: _alu_a(alu_add[c][reg.a][_get_r8(x->p1)]); cycles += 1; break;
+    case OP_ADC_A_IHL: _alu_a(alu_add[c][reg.a][read8(reg.hl)]); cycles += 2; break;
+    case OP_ADC_A_N8: _alu_a(alu_add[c][reg.a][0xff & x->p1]); cycles += 2; break;
+    case OP_ADD_A_R8: _alu_a(alu_add[0][reg.a][_get_r8(x->p1)]); cycles += 1; break;
+    case OP_ADD_A_IHL: _alu_a(alu_add[0][reg.a][read8(reg.hl)]); cycles += 2; break;
+    case OP_ADD_A_N8: _alu_a(alu_add[0][reg.a][0xff & x->p1]); cycles += 2; break;
+    case OP_AND_A_R8: _alu_a(alu_and[reg.a][_get_r8(x->p1)]); cycles += 1; break;
+    case OP_AND_A_IHL: _alu_a(alu_and[reg.a][read8(reg.hl)]); cycles += 2; break;
+    case OP_AND_A_N8: _alu_a(alu_and[reg.a][0xff & x->p1]); cycles += 2; break;
+    case OP_CP_A_R8: reg.f = alu_sub[0][reg.a][_get_r8(x->p1)].f; cycles += 1; break;
+    case OP_CP_A_IHL: reg.f = alu_sub[0][reg.a][read8(reg.hl)].f; cycles += 2; break;
+    case OP_CP_A_N8: reg.f = alu_sub[0][reg.a][0xff & x->p1].f; cycles += 2; break;
+    case OP_OR_A_R8: _alu_a(alu_or[reg.a][_get_r8(x->p1)]); cycles += 1; break;
+    case OP_OR_A_IHL: _alu_a(alu_or[reg.a][read8(reg.hl)]); cycles += 2; break;
+    case OP_OR_A_N8: _alu_a(alu_or[reg.a][0xff & x->p1]); cycles += 2; break;
+    case OP_SBC_A_R8: _alu_a(alu_sub[c][reg.a][_get_r8(x->p1)]); cycles += 1; break;
+    case OP_SBC_A_IHL: _alu_a(alu_sub[c][reg.a][read8(reg.hl)]); cycles += 2; break;
+    case OP_SBC_A_N8: _alu_a(alu_sub[c][reg.a][0xff & x->p1]); cycles += 2; break;
+    case OP_SUB_A_R8: _alu_a(alu_sub[0][reg.a][_get_r8(x->p1)]); cycles += 1; break;
+    case OP_SUB_A_IHL: _alu_a(alu_sub[0][reg.a][read8(reg.hl)]); cycles += 2; break;
+    case OP_SUB_A_N8: _alu_a(alu_sub[0][reg.a][0xff & x->p1]); cycles += 2; break;
+    case OP_XOR_A_R8: _alu_a(alu_xor[reg.a][_get_r8(x->p1)]); cycles += 1; break;
+    case OP_XOR_A_IHL: _alu_a(alu_xor[reg.a][read8(reg.hl)]); cycles += 2; break;
+    case OP_XOR_A_N8: _alu_a(alu_xor[reg.a][0xff & x->p1]); cycles += 2; break;
+
+    case OP_RL_R8: _set_r8(x->p1, _alu_shift(SHIFT_RL, _get_r8(x->p1))); cycles += 2; break;
+    case OP_RL_IHL: write8(reg.hl, _alu_shift(SHIFT_RL, read8(reg.hl))); cycles += 4; break;
+    case OP_RLA: reg.a = _alu_shift(SHIFT_RLA, reg.a); cycles += 1; break;
+    case OP_RLC_R8: _set_r8(x->p1, _alu_shift(SHIFT_RLC, _get_r8(x->p1))); cycles += 2; break;
+    case OP_RLC_IHL: write8(reg.hl, _alu_shift(SHIFT_RLC, read8(reg.hl))); cycles += 4; break;
+    case OP_RLCA: reg.a = _alu_shift(SHIFT_RLCA, reg.a); cycles += 1; break;
+    case OP_RR_R8: _set_r8(x->p1, _alu_shift(SHIFT_RR, _get_r8(x->p1))); cycles += 2; break;
+    case OP_RR_IHL: write8(reg.hl, _alu_shift(SHIFT_RR, read8(reg.hl))); cycles += 4; break;
+    case OP_RRA: reg.a = _alu_shift(SHIFT_RRA, reg.a); cycles += 1; break;
+    case OP_RRC_R8: _set_r8(x->p1, _alu_shift(SHIFT_RRC, _get_r8(x->p1))); cycles += 2; break;
+    case OP_RRC_IHL: write8(reg.hl, _alu_shift(SHIFT_RRC, read8(reg.hl))); cycles += 4; break;
+    case OP_RRCA: reg.a = _alu_shift(SHIFT_RRCA, reg.a); cycles += 1; break;
+    case OP_SLA_R8: _set_r8(x->p1, _alu_shift(SHIFT_SLA, _get_r8(x->p1))); cycles += 2; break;
+    case OP_SLA_IHL: write8(reg.hl, _alu_shift(SHIFT_SLA, read8(reg.hl))); cycles += 4; break;
+    case OP_SRA_R8: _set_r8(x->p1, _alu_shift(SHIFT_SRA, _get_r8(x->p1))); cycles += 2; break;
+    case OP_SRA_IHL: write8(reg.hl, _alu_shift(SHIFT_SRA, read8(reg.hl))); cycles += 4; break;
+    case OP_SRL_R8: _set_r8(x->p1, _alu_shift(SHIFT_SRL, _get_r8(x->p1))); cycles += 2; break;
+    case OP_SRL_IHL: write8(reg.hl, _alu_shift(SHIFT_SRL, read8(reg.hl))); cycles += 4; break;
+    case OP_SWAP_R8: _set_r8(x->p1, _alu_shift(SHIFT_SWAP, _get_r8(x->p1))); cycles += 2; break;
+    case OP_SWAP_IHL: write8(reg.hl, _alu_shift(SHIFT_SWAP, read8(reg.hl))); cycles += 4; break;
+
+    case OP_DAA: _alu_a(alu_daa[reg.f >> 4][reg.a]); cycles += 1; break;
+
+    default: return execute(x, pc);
+  }
+  return pc;
+}
+
+
+// run_program, with 8-bit ALU results and flags looked up in tables
+void run_program_alu_tables(struct program *program)
+{ static bool built = false;
+  if (!built)
+  { build_alu_tables();
+    built = true;
+  }
+
+  start_cycles();
+  running_program = program;
+  uint16_t pc = 0;
+  while (program->length > pc)
+  { running_isn = pc;
+    struct instruction *x = &program->instructions[pc++];
+    pc = execute_alu_tables(x, pc);
+    if (cycles >= event_horizon) service_events();
+  }
+}
+
+
+// host counters
+
+
+enum host_counter
+{ HOST_CYCLES
+, HOST_INSTRUCTIONS
+, HOST_BRANCH_MISSES
+, HOST_L1D_MISSES
+, N_HOST_COUNTERS
+};
+
+char *host_counter_names[N_HOST_COUNTERS] =
+{ "host_cycles"
+, "host_instructions"
+, "branch_misses"
+, "l1d_misses"
+};
+
+struct host_profile
+{ uint64_t runs;
+  // simulated
+  uint64_t instructions, cycles;
+  // host, where available
+  bool available[N_HOST_COUNTERS];
+  uint64_t counts[N_HOST_COUNTERS];
+  int error;
+};
+
+#ifdef __linux__
+static int _open_host_counter(enum host_counter counter)
+{ static const struct { uint32_t type; uint64_t config; } events[N_HOST_COUNTERS] =
+  { [HOST_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES }
+  , [HOST_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS }
+  , [HOST_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+  , [HOST_L1D_MISSES] =
+    { PERF_TYPE_HW_CACHE
+    , PERF_COUNT_HW_CACHE_L1D
+    | PERF_COUNT_HW_CACHE_OP_READ << 8
+    | PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+    }
+  };
+  struct perf_event_attr attr =
+  { .type = events[counter].type
+  , .size = sizeof(attr)
+  , .config = events[counter].config
+  , .disabled = 1
+  , .exclude_kernel = 1
+  , .exclude_hv = 1
+  };
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#else
+static int _open_host_counter(enum host_counter counter)
+{ errno = ENOSYS;
+  return -1;
+}
+#endif
+
+
+// Run a program `runs` times under whichever host counters the kernel allows,
+// calling setup (if any) before each run to establish its inputs.  The setup
+// is counted along with the program, so it should be cheap.  A second pass
+// repeats the runs to count simulated instructions and cycles.
+struct host_profile profile_program
+( struct program *program, size_t runs
+, void (*setup)(size_t run, void *arg), void *arg
+)
+{ struct host_profile p = { runs };
+  int fds[N_HOST_COUNTERS];
+  for (int i = 0; i < N_HOST_COUNTERS; i++)
+  { fds[i] = _open_host_counter(i);
+    p.available[i] = 0 <= fds[i];
+    if (!p.available[i] && !p.error) p.error = errno;
+  }
+
+#ifdef __linux__
+  for (int i = 0; i < N_HOST_COUNTERS; i++)
+    if (p.available[i]) ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+  for (int i = 0; i < N_HOST_COUNTERS; i++)
+    if (p.available[i]) ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+
+  for (size_t run = 0; run < runs; run++)
+  { if (setup) setup(run, arg);
+    run_program(program);
+  }
+
+#ifdef __linux__
+  for (int i = 0; i < N_HOST_COUNTERS; i++)
+    if (p.available[i]) ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
+
+  for (int i = 0; i < N_HOST_COUNTERS; i++)
+  { if (!p.available[i]) continue;
+    if (sizeof(uint64_t) != read(fds[i], &p.counts[i], sizeof(uint64_t)))
+      p.available[i] = false;
+    close(fds[i]);
+  }
+
+  for (size_t run = 0; run < runs; run++)
+  { if (setup) setup(run, arg);
+    p.instructions += run_program_counting(program);
+    p.cycles += cycles;
+  }
+
+  return p;
+}
+
+
+void print_host_profile(struct host_profile *p)
+{ printf
+  ( "%llu runs, %llu instructions, %llu cycles\n"
+  , (unsigned long long)p->runs
+  , (unsigned long long)p->instructions
+  , (unsigned long long)p->cycles
+  );
+  for (int i = 0; i < N_HOST_COUNTERS; i++)
+  { if (!p->available[i])
+    { printf("%-18s unavailable\n", host_counter_names[i]);
+      continue;
+    }
+    printf
+    ( "%-18s %14llu  %8.2f/instruction  %8.2f/cycle\n"
+    , host_counter_names[i], (unsigned long long)p->counts[i]
+    , (double)p->counts[i] / (p->instructions ? p->instructions : 1)
+    , (double)p->counts[i] / (p->cycles ? p->cycles : 1)
+    );
+  }
+  if (p->error)
+    printf("(some counters could not be opened: %s)\n", strerror(p->error));
+}
+
+
+// machine code
+
+
+// The program counter is real here: programs are encoded as SM83 bytes in mem,
+// and run by fetching and decoding from reg.pc.
+
+enum immediate
+{ IMM_NONE
+, IMM_N8
+, IMM_E8
+, IMM_N16
+, IMM_HN8  // ldh, 0xff00 + n8
+};
+
+// the kind of immediate operand an op takes, and which of p1/p2 holds it
+static inline enum immediate _immediate(enum op op, int *slot)
+{ *slot = 1;
+  switch (op)
+  { case OP_ADC_A_N8: case OP_ADD_A_N8: case OP_AND_A_N8: case OP_CP_A_N8:
+    case OP_OR_A_N8: case OP_SBC_A_N8: case OP_SUB_A_N8: case OP_XOR_A_N8:
+    case OP_LD_IHL_N8:
+      return IMM_N8;
+    case OP_LD_R8_N8:
+      *slot = 2; return IMM_N8;
+    case OP_JR_E8: case OP_ADD_SP_E8: case OP_LD_HL_SPE8:
+      return IMM_E8;
+    case OP_JR_CC_E8:
+      *slot = 2; return IMM_E8;
+    case OP_LD_IN16_A: case OP_LD_A_IN16: case OP_CALL_N16: case OP_JP_N16:
+    case OP_LD_SP_N16: case OP_LD_IN16_SP:
+      return IMM_N16;
+    case OP_LD_R16_N16: case OP_CALL_CC_N16: case OP_JP_CC_N16:
+      *slot = 2; return IMM_N16;
+    case OP_LDH_IN16_A: case OP_LDH_A_IN16:
+      return IMM_HN8;
+    default:
+      *slot = 0; return IMM_NONE;
+  }
+}
+
+// register numbering in opcodes: b c d e h l [hl] a
+static inline uint8_t _hw_r8(enum r8 r)
+{ return R8_A == r ? 7 : r - 1; }
+
+
+// opcode of the r8 form of an 8-bit arithmetic or logic op
+static inline uint8_t _alu_opcode(enum op op)
+{ switch (op)
+  { case OP_ADD_A_R8: case OP_ADD_A_IHL: case OP_ADD_A_N8: return 0x80;
+    case OP_ADC_A_R8: case OP_ADC_A_IHL: case OP_ADC_A_N8: return 0x88;
+    case OP_SUB_A_R8: case OP_SUB_A_IHL: case OP_SUB_A_N8: return 0x90;
+    case OP_SBC_A_R8: case OP_SBC_A_IHL: case OP_SBC_A_N8: return 0x98;
+    case OP_AND_A_R8: case OP_AND_A_IHL: case OP_AND_A_N8: return 0xa0;
+    case OP_XOR_A_R8: case OP_XOR_A_IHL: case OP_XOR_A_N8: return 0xa8;
+    case OP_OR_A_R8: case OP_OR_A_IHL: case OP_OR_A_N8: return 0xb0;
+    case OP_CP_A_R8: case OP_CP_A_IHL: case OP_CP_A_N8: return 0xb8;
+    default: panic;
+  }
+}
+
+
+// Encode an instruction into out, returning its length in bytes, or 0 if it
+// has none (bad operands).  Fused and flag-dead instructions are encoded as
+// the instruction they replaced.  Relative jump offsets are taken as bytes.
+int encode_instruction(struct instruction x, uint8_t out[3])
+{ x = unfuse(x);
+  x.op = flagged_op(x.op);
+  int slot;
+  enum immediate imm = _immediate(x.op, &slot);
+  uint16_t v = 1 == slot ? x.p1 : x.p2;
+
+  // operands other than the immediate, checked for range
+  uint16_t a = 1 == slot ? 0 : x.p1;
+  uint16_t b = 2 == slot ? 0 : x.p2;
+  #define R8(r) if (R8_L < (r)) return 0
+  #define R16(r) if (R16_HL < (r)) return 0
+  #define CC(c) if (CC_C < (c)) return 0
+
+  int n = 1;
+  switch (x.op)
+  { case OP_ADC_A_R8: case OP_ADD_A_R8: case OP_AND_A_R8: case OP_CP_A_R8:
+    case OP_OR_A_R8: case OP_SBC_A_R8: case OP_SUB_A_R8: case OP_XOR_A_R8:
+      R8(a); out[0] = _alu_opcode(x.op) | _hw_r8(a); break;
+    case OP_ADC_A_IHL: case OP_ADD_A_IHL: case OP_AND_A_IHL: case OP_CP_A_IHL:
+    case OP_OR_A_IHL: case OP_SBC_A_IHL: case OP_SUB_A_IHL: case OP_XOR_A_IHL:
+      out[0] = _alu_opcode(x.op) | 6; break;
+    case OP_ADC_A_N8: case OP_ADD_A_N8: case OP_AND_A_N8: case OP_CP_A_N8:
+    case OP_OR_A_N8: case OP_SBC_A_N8: case OP_SUB_A_N8: case OP_XOR_A_N8:
+      out[0] = 0x40 | _alu_opcode(x.op) | 6; break;
+    case OP_DEC_R8: R8(a); out[0] = 0x05 | _hw_r8(a) << 3; break;
+    case OP_DEC_IHL: out[0] = 0x35; break;
+    case OP_INC_R8: R8(a); out[0] = 0x04 | _hw_r8(a) << 3; break;
+    case OP_INC_IHL: out[0] = 0x34; break;
+
+    case OP_ADD_HL_R16: R16(a); out[0] = 0x09 | a << 4; break;
+    case OP_DEC_R16: R16(a); out[0] = 0x0b | a << 4; break;
+    case OP_INC_R16: R16(a); out[0] = 0x03 | a << 4; break;
+
+    case OP_BIT_U3_R8: case OP_RES_U3_R8: case OP_SET_U3_R8:
+    { static const uint8_t base[] = { 0x40, 0, 0x80, 0, 0xc0 };
+      if (7 < a) return 0;
+      R8(b);
+      out[0] = 0xcb;
+      out[1] = base[x.op - OP_BIT_U3_R8] | a << 3 | _hw_r8(b);
+      n = 2;
+    } break;
+    case OP_BIT_U3_IHL: case OP_RES_U3_IHL: case OP_SET_U3_IHL:
+    { static const uint8_t base[] = { 0, 0x40, 0, 0x80, 0, 0xc0 };
+      if (7 < a) return 0;
+      out[0] = 0xcb;
+      out[1] = base[x.op - OP_BIT_U3_R8] | a << 3 | 6;
+      n = 2;
+    } break;
+
+    case OP_SWAP_R8: case OP_RL_R8: case OP_RLC_R8: case OP_RR_R8:
+    case OP_RRC_R8: case OP_SLA_R8: case OP_SRA_R8: case OP_SRL_R8:
+    case OP_SWAP_IHL: case OP_RL_IHL: case OP_RLC_IHL: case OP_RR_IHL:
+    case OP_RRC_IHL: case OP_SLA_IHL: case OP_SRA_IHL: case OP_SRL_IHL:
+    { uint8_t r = 6;
+      uint8_t base;
+      switch (x.op)
+      { case OP_SWAP_R8: R8(a); r = _hw_r8(a); case OP_SWAP_IHL: base = 0x30; break;
+        case OP_RL_R8: R8(a); r = _hw_r8(a); case OP_RL_IHL: base = 0x10; break;
+        case OP_RLC_R8: R8(a); r = _hw_r8(a); case OP_RLC_IHL: base = 0x00; break;
+        case OP_RR_R8: R8(a); r = _hw_r8(a); case OP_RR_IHL: base = 0x18; break;
+        case OP_RRC_R8: R8(a); r = _hw_r8(a); case OP_RRC_IHL: base = 0x08; break;
+        case OP_SLA_R8: R8(a); r = _hw_r8(a); case OP_SLA_IHL: base = 0x20; break;
+        case OP_SRA_R8: R8(a); r = _hw_r8(a); case OP_SRA_IHL: base = 0x28; break;
+        case OP_SRL_R8: R8(a); r = _hw_r8(a); case OP_SRL_IHL: base = 0x38; break;
+        default: panic;
+      }
+      out[0] = 0xcb;
+      out[1] = base | r;
+      n = 2;
+    } break;
+    case OP_RLA: out[0] = 0x17; break;
+    case OP_RLCA: out[0] = 0x07; break;
+    case OP_RRA: out[0] = 0x1f; break;
+    case OP_RRCA: out[0] = 0x0f; break;
+
+    case OP_LD_R8_R8: R8(a); R8(b); out[0] = 0x40 | _hw_r8(a) << 3 | _hw_r8(b); break;
+    case OP_LD_R8_N8: R8(a); out[0] = 0x06 | _hw_r8(a) << 3; break;
+    case OP_LD_R16_N16: R16(a); out[0] = 0x01 | a << 4; break;
+    case OP_LD_IHL_R8: R8(a); out[0] = 0x70 | _hw_r8(a); break;
+    case OP_LD_IHL_N8: out[0] = 0x36; break;
+    case OP_LD_R8_IHL: R8(a); out[0] = 0x46 | _hw_r8(a) << 3; break;
+    case OP_LD_IR16_A: if (R16_DE < a) return 0; out[0] = 0x02 | a << 4; break;
+    case OP_LD_IN16_A: out[0] = 0xea; break;
+    case OP_LDH_IN16_A: out[0] = 0xe0; break;
+    case OP_LDH_IC_A: out[0] = 0xe2; break;
+    case OP_LD_A_IR16: if (R16_DE < a) return 0; out[0] = 0x0a | a << 4; break;
+    case OP_LD_A_IN16: out[0] = 0xfa; break;
+    case OP_LDH_A_IN16: out[0] = 0xf0; break;
+    case OP_LDH_A_IC: out[0] = 0xf2; break;
+    case OP_LD_IHLI_A: out[0] = 0x22; break;
+    case OP_LD_IHLD_A: out[0] = 0x32; break;
+    case OP_LD_A_IHLI: out[0] = 0x2a; break;
+    case OP_LD_A_IHLD: out[0] = 0x3a; break;
+
+    case OP_CALL_N16: out[0] = 0xcd; break;
+    case OP_CALL_CC_N16: CC(a); out[0] = 0xc4 | a << 3; break;
+    case OP_JP_HL: out[0] = 0xe9; break;
+    case OP_JP_N16: out[0] = 0xc3; break;
+    case OP_JP_CC_N16: CC(a); out[0] = 0xc2 | a << 3; break;
+    case OP_JR_E8: out[0] = 0x18; break;
+    case OP_JR_CC_E8: CC(a); out[0] = 0x20 | a << 3; break;
+    case OP_RET_CC: CC(a); out[0] = 0xc0 | a << 3; break;
+    case OP_RET: out[0] = 0xc9; break;
+    case OP_RETI: out[0] = 0xd9; break;
+    case OP_RST_VEC: if (0x38 < a || 7 & a) return 0; out[0] = 0xc7 | a; break;
+
+    case OP_ADD_HL_SP: out[0] = 0x39; break;
+    case OP_ADD_SP_E8: out[0] = 0xe8; break;
+    case OP_DEC_SP: out[0] = 0x3b; break;
+    case OP_INC_SP: out[0] = 0x33; break;
+    case OP_LD_SP_N16: out[0] = 0x31; break;
+    case OP_LD_IN16_SP: out[0] = 0x08; break;
+    case OP_LD_HL_SPE8: out[0] = 0xf8; break;
+    case OP_LD_SP_HL: out[0] = 0xf9; break;
+    case OP_POP_AF: out[0] = 0xf1; break;
+    case OP_POP_R16: R16(a); out[0] = 0xc1 | a << 4; break;
+    case OP_PUSH_AF: out[0] = 0xf5; break;
+    case OP_PUSH_R16: R16(a); out[0] = 0xc5 | a << 4; break;
+
+    case OP_CCF: out[0] = 0x3f; break;
+    case OP_CPL: out[0] = 0x2f; break;
+    case OP_DAA: out[0] = 0x27; break;
+    case OP_DI: out[0] = 0xf3; break;
+    case OP_EI: out[0] = 0xfb; break;
+    case OP_HALT: out[0] = 0x76; break;
+    case OP_NOP: out[0] = 0x00; break;
+    case OP_SCF: out[0] = 0x37; break;
+    case OP_STOP: out[0] = 0x10; out[1] = 0x00; n = 2; break;
+
+    default: return 0;
+  }
+  #undef R8
+  #undef R16
+  #undef CC
+
+  switch (imm)
+  { case IMM_NONE: break;
+    case IMM_N8:
+    case IMM_E8: out[n++] = v; break;
+    case IMM_N16: out[n++] = v; out[n++] = v >> 8; break;
+    case IMM_HN8: if (0xff00 > v) return 0; out[n++] = v; break;
+  }
+  return n;
+}
+
+
+// Encode a program into mem at origin, returning the address just past it.
+// Relative jumps are converted from instruction to byte offsets, and panic if
+// they don't reach; call and jp targets from instruction indices to addresses.
+uint16_t assemble_program(struct program *program, uint16_t origin)
+{ size_t n = program->length;
+  uint16_t *addr = malloc((n + 1) * sizeof(uint16_t));
+  uint8_t bytes[3];
+
+  addr[0] = origin;
+  for (size_t i = 0; i < n; i++)
+  { int length = encode_instruction(program->instructions[i], bytes);
+    if (!length) panic;
+    addr[i + 1] = addr[i] + length;
+  }
+
+  for (size_t i = 0; i < n; i++)
+  { struct instruction x = unfuse(program->instructions[i]);
+    x.op = flagged_op(x.op);
+    if (OP_JR_E8 == x.op || OP_JR_CC_E8 == x.op)
+    { int t = _jr_target(x, i);
+      if (0 > t || n < t) panic;
+      int offset = (int16_t)(addr[t] - addr[i + 1]);
+      if (-128 > offset || 127 < offset)
+      { printf("jr out of range at instruction %zu (%d bytes)\n", i, offset);
+        free(addr);
+        panic;
+      }
+      *(OP_JR_E8 == x.op ? &x.p1 : &x.p2) = offset;
+    }
+    if (OP_CALL_N16 == x.op || OP_JP_N16 == x.op)
+    { if (n < x.p1) panic;
+      x.p1 = addr[x.p1];
+    }
+    if (OP_CALL_CC_N16 == x.op || OP_JP_CC_N16 == x.op)
+    { if (n < x.p2) panic;
+      x.p2 = addr[x.p2];
+    }
+    int length = encode_instruction(x, bytes);
+    for (int j = 0; j < length; j++)
+      mem[addr[i] + j & 0xffff] = bytes[j];
+    mark_initialized(addr[i], length);
+  }
+
+  uint16_t end = addr[n];
+  free(addr);
+  return end;
+}
+
+
+struct decoding
+{ enum op op;
+  uint8_t p1, p2;
+  uint8_t length;  // 0 for an unused opcode
+  uint8_t imm, slot;
+};
+
+struct decoding decode_primary[256];
+struct decoding decode_cb[256];
+
+// Fill the decode tables by encoding every instruction with every operand,
+// keeping the first (lowest) operands found for each opcode.
+void build_decode_tables()
+{ uint8_t bytes[3];
+  for (enum op op = 0; op < OP_COPY_DE_HLI; op++)
+  { int slot;
+    enum immediate imm = _immediate(op, &slot);
+    for (int p1 = 0; p1 <= 0x38; p1++)
+    for (int p2 = 0; p2 < 8; p2++)
+    { if (1 == slot && p1 || 2 == slot && p2) continue;
+      struct instruction x = { op, p1, p2 };
+      if (IMM_HN8 == imm) x.p1 = 0xff00;
+      int length = encode_instruction(x, bytes);
+      if (!length) continue;
+      struct decoding *d =
+        0xcb == bytes[0] ? &decode_cb[bytes[1]] : &decode_primary[bytes[0]];
+      if (d->length) continue;
+      *d = (struct decoding){ op, p1, p2, length, imm, slot };
+    }
+  }
+}
+
+
+// decode the instruction at addr, setting length to its size in bytes
+static inline struct instruction decode_instruction(uint16_t addr, int *length)
+{ uint8_t opcode = read8(addr);
+  struct decoding *d =
+    0xcb == opcode ? &decode_cb[read8(addr + 1)] : &decode_primary[opcode];
+  if (!d->length) panic;
+
+  struct instruction x = { d->op, d->p1, d->p2 };
+  uint16_t v = 0;
+  switch (d->imm)
+  { case IMM_NONE: break;
+    case IMM_N8: v = read8(addr + 1); break;
+    case IMM_E8: v = (int8_t)read8(addr + 1); break;
+    case IMM_N16: v = read8(addr + 1) | read8(addr + 2) << 8; break;
+    case IMM_HN8: v = 0xff00 | read8(addr + 1); break;
+  }
+  if (1 == d->slot) x.p1 = v;
+  if (2 == d->slot) x.p2 = v;
+  *length = d->length;
+  return x;
+}
+
+
+// fetch, decode and execute one instruction at reg.pc
+static inline void step_machine()
+{ _RUNNING(NULL, reg.pc);
+  int length;
+  struct instruction x = decode_instruction(reg.pc, &length);
+  uint16_t pc = reg.pc + length;
+  if (OP_RST_VEC == x.op) { _push(pc); pc = x.p1; cycles += 4; }
+  else pc = execute(&x, pc);
+  reg.pc = pc;
+}
+
+
+// call the handler of the highest priority pending interrupt, if IME is set
+static inline void _dispatch_interrupt()
+{ if (!ime || !interrupt_pending()) return;
+  int i = 0;
+  while (!(mem[R_IE] & mem[R_IF] & 1 << i)) i++;
+  mem[R_IF] &= ~(1 << i);
+  ime = false;
+  _push(reg.pc);
+  reg.pc = 0x40 + 8 * i;
+  cycles += 5;
+  _update_horizon();
+}
+
+
+// run the machine code at reg.pc until the program counter reaches end
+void run_machine(uint16_t end)
+{ static bool built = false;
+  if (!built)
+  { build_decode_tables();
+    built = true;
+  }
+
+  bool was_dispatching = dispatching;
+  dispatching = true;
+  start_cycles();
+  while (end != reg.pc)
+  { step_machine();
+    if (cycles >= event_horizon)
+    { service_events();
+      _dispatch_interrupt();
+    }
+  }
+  dispatching = was_dispatching;
+  _update_horizon();
+}
+
+// returning here ends call_machine
+#define RETURN_ADDRESS 0xffff
+
+// call the machine code at addr, and run it until it returns
+void call_machine(uint16_t addr)
+{ _push(RETURN_ADDRESS);
+  reg.pc = addr;
+  run_machine(RETURN_ADDRESS);
+}
+
+
+// ROM images
+
+
+struct rom_symbol
+{ char name[64];
+  uint16_t bank, addr;
+};
+
+struct rom
+{ uint8_t *data;  // mapped read-only from the file
+  size_t size;
+  struct rom_symbol *symbols;
+  size_t n_symbols;
+};
+
+
+// Map a ROM image (a .gb file, or rgblink output) from a file, and read its
+// symbols (rgblink -n) if sym_filename isn't NULL.
+struct rom *load_rom(char *filename, char *sym_filename)
+{ int f = open(filename, O_RDONLY);
+  struct stat st;
+  if (0 > f || fstat(f, &st))
+  { perror(filename);
+    exit(1);
+  }
+  if (!st.st_size || st.st_size % 0x4000)
+  { printf("%s: not a whole number of 16 KiB banks\n", filename);
+    exit(1);
+  }
+
+  struct rom *rom = calloc(1, sizeof(struct rom));
+  rom->size = st.st_size;
+  rom->data = mmap(NULL, rom->size, PROT_READ, MAP_PRIVATE, f, 0);
+  if (MAP_FAILED == rom->data) panic;
+  close(f);
+
+  if (!sym_filename) return rom;
+  FILE *sym = fopen(sym_filename, "r");
+  if (!sym)
+  { perror(sym_filename);
+    exit(1);
+  }
+  size_t max_symbols = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), sym))
+  { struct rom_symbol s;
+    if (3 != sscanf(line, "%hx:%hx %63s", &s.bank, &s.addr, s.name)) continue;
+    if (rom->n_symbols == max_symbols)
+    { max_symbols = max_symbols ? 2 * max_symbols : 256;
+      rom->symbols = realloc(rom->symbols, max_symbols * sizeof(struct rom_symbol));
+    }
+    rom->symbols[rom->n_symbols++] = s;
+  }
+  fclose(sym);
+  return rom;
+}
+
+
+struct rom_symbol *find_rom_symbol(struct rom *rom, char *name)
+{ for (size_t i = 0; i < rom->n_symbols; i++)
+    if (!strcmp(name, rom->symbols[i].name)) return &rom->symbols[i];
+  return NULL;
+}
+
+
+// memory bank controllers
+
+
+enum mbc_type
+{ MBC_NONE
+, MBC_1
+, MBC_5
+};
+
+// the cartridge mapped in by map_cartridge, and its bank registers
+struct mbc
+{ enum mbc_type type;
+  struct rom *rom;
+  uint16_t bank;  // MBC1: low 5 bits of the ROM bank; MBC5: all 9
+  uint8_t bank2;  // MBC1: RAM bank or high 2 bits of ROM bank; MBC5: RAM bank
+  bool mode;      // MBC1: bank2 applies to 0x0000 and RAM
+  bool ram_enabled;
+  uint8_t *ram;
+  size_t ram_size;
+} mbc;
+
+// what reads of disabled or missing cartridge RAM return
+uint8_t open_bus[0x2000];
+
+void mbc_write(uint16_t addr, uint8_t val);
+
+
+// Point the ROM windows and cartridge RAM at the banks the registers select.
+// Only the page tables change, 96 pointers at most, however large the banks.
+static void _map_banks()
+{ size_t rom_banks = mbc.rom->size / 0x4000;
+  unsigned low = 0, high = mbc.bank, ram_bank = 0;
+  switch (mbc.type)
+  { case MBC_NONE:
+      high = 1;
+      break;
+    case MBC_1:
+      high = mbc.bank2 << 5 | (0x1f & mbc.bank ? 0x1f & mbc.bank : 1);
+      if (mbc.mode)
+      { low = mbc.bank2 << 5;
+        ram_bank = mbc.bank2;
+      }
+      break;
+    case MBC_5:
+      ram_bank = mbc.bank2;
+      break;
+  }
+
+  map_read(0x0000, 0x4000, mbc.rom->data + 0x4000 * (low % rom_banks));
+  if (1 < rom_banks)
+    map_read(0x4000, 0x4000, mbc.rom->data + 0x4000 * (high % rom_banks));
+  map_handlers(0x0000, 0x8000, NULL, mbc_write);
+
+  if (mbc.ram && mbc.ram_enabled)
+    map_memory(0xa000, 0x2000, mbc.ram + 0x2000 * (ram_bank % (mbc.ram_size / 0x2000)));
+  else
+  { map_read(0xa000, 0x2000, open_bus);
+    map_write(0xa000, 0x2000, NULL);
+  }
+}
+
+
+// MBC register writes
+void mbc_write(uint16_t addr, uint8_t val)
+{ if (MBC_NONE == mbc.type) return;
+  switch (addr >> 13)
+  { case 0:
+      mbc.ram_enabled = 0x0a == (0x0f & val);
+      break;
+    case 1:
+      if (MBC_1 == mbc.type) mbc.bank = 0x1f & val;
+      else if (0x3000 > addr) mbc.bank = 0x100 & mbc.bank | val;
+      else mbc.bank = (1 & val) << 8 | 0xff & mbc.bank;
+      break;
+    case 2:
+      mbc.bank2 = MBC_1 == mbc.type ? 3 & val : 0x0f & val;
+      break;
+    case 3:
+      if (MBC_1 == mbc.type) mbc.mode = 1 & val;
+      break;
+  }
+  _map_banks();
+}
+
+
+// Map a ROM image as a cartridge, with the mapper and RAM its header names
+// (MBC1 and MBC5 are modelled, anything else is treated as having no mapper).
+void map_cartridge(struct rom *rom)
+{ free(mbc.ram);
+  mbc = (struct mbc){ MBC_NONE, rom, 1 };
+  uint8_t type = 0x147 < rom->size ? rom->data[0x147] : 0;
+  if (0x01 <= type && 0x03 >= type) mbc.type = MBC_1;
+  if (0x19 <= type && 0x1e >= type) mbc.type = MBC_5;
+
+  static const size_t ram_sizes[] = { 0, 0x2000, 0x2000, 0x8000, 0x20000, 0x10000 };
+  uint8_t ram = 0x149 < rom->size ? rom->data[0x149] : 0;
+  mbc.ram_size = ram < listsize(ram_sizes) ? ram_sizes[ram] : 0;
+  if (mbc.ram_size) mbc.ram = calloc(1, mbc.ram_size);
+
+  memset(open_bus, 0xff, sizeof(open_bus));
+  _map_banks();
+}
+
+
+// Select a ROM bank for 0x4000 directly, as a write to the bank register would
+void select_rom_bank(unsigned bank)
+{ if (bank >= mbc.rom->size / 0x4000 && 1 < bank) panic;   // no such bank
+  if (MBC_1 == mbc.type)
+  { mbc.bank = 0x1f & bank;
+    mbc.bank2 = 3 & bank >> 5;
+  }
+  else mbc.bank = bank;
+  _map_banks();
+}
+
+
+// Call a routine by name, with its bank mapped, and run it until it returns.
+// Returns false if there is no such symbol.
+bool call_rom_routine(struct rom *rom, char *name)
+{ struct rom_symbol *s = find_rom_symbol(rom, name);
+  if (!s) return false;
+  if (rom != mbc.rom) map_cartridge(rom);
+  if (s->bank) select_rom_bank(s->bank);
+  call_machine(s->addr);
+  return true;
+}
+
+enum isn_token
+{ ADC_TOK
+, ADD_TOK
+, AND_TOK
+, CP_TOK
+, DEC_TOK
+, INC_TOK
+, OR_TOK
+, SBC_TOK
+, SUB_TOK
+, XOR_TOK
+
+, BIT_TOK
+, RES_TOK
+, SET_TOK
+, SWAP_TOK
+
+, RL_TOK
+, RLA_TOK
+, RLC_TOK
+, RLCA_TOK
+, RR_TOK
+, RRA_TOK
+, RRC_TOK
+, RRCA_TOK
+, SLA_TOK
+, SRA_TOK
+, SRL_TOK
+
+, LD_TOK
+, LDH_TOK
+
+, CALL_TOK
+, JP_TOK
+, JR_TOK
+, RET_TOK
+, RETI_TOK
+, RST_TOK
+
+, POP_TOK
+, PUSH_TOK
+
+, CCF_TOK
+, CPL_TOK
+, DAA_TOK
+, DI_TOK
+, EI_TOK
+, HALT_TOK
+, NOP_TOK
+, SCF_TOK
+, STOP_TOK
+
+, N_ISN_TOKEN
+};
+
+struct
+{ char string[8];
+  enum isn_token value;
+} isn_tokens[] =
+{ "adc", ADC_TOK
+, "add", ADD_TOK
+, "and", AND_TOK
+, "cp", CP_TOK
+, "dec", DEC_TOK
+, "inc", INC_TOK
+, "or", OR_TOK
+, "sbc", SBC_TOK
+, "sub", SUB_TOK
+, "xor", XOR_TOK
+
+, "bit", BIT_TOK
+, "res", RES_TOK
+, "set", SET_TOK
+, "swap", SWAP_TOK
+
+, "rl", RL_TOK
+, "rla", RLA_TOK
+, "rlc", RLC_TOK
+, "rlca", RLCA_TOK
+, "rr", RR_TOK
+, "rra", RRA_TOK
+, "rrc", RRC_TOK
+, "rrca", RRCA_TOK
+, "sla", SLA_TOK
+, "sra", SRA_TOK
+, "srl", SRL_TOK
+
+, "ld", LD_TOK
+, "ldh", LDH_TOK
+
+, "call", CALL_TOK
+, "jp", JP_TOK
+, "jr", JR_TOK
+, "ret", RET_TOK
+, "reti", RETI_TOK
+, "rst", RST_TOK
+
+, "pop", POP_TOK
+, "push", PUSH_TOK
+
+, "ccf", CCF_TOK
+, "cpl", CPL_TOK
+, "daa", DAA_TOK
+, "di", DI_TOK
+, "ei", EI_TOK
+, "halt", HALT_TOK
+, "nop", NOP_TOK
+, "scf", SCF_TOK
+, "stop", STOP_TOK
+};
+size_t n_isn_tokens = listsize(isn_tokens);
+
+enum arg_token_type
+{ NONE_TOK_TYPE
+, N_TOK_TYPE
+, R16_TOK_TYPE
+, R8_TOK_TYPE
+, IR16_TOK_TYPE
+, IHLI_TOK_TYPE
+, CC_TOK_TYPE
+, ANON_LABEL_TOK_TYPE
+, LABEL_TOK_TYPE
+, IHL_TOK_TYPE
+, IN16_TOK_TYPE
+, IC_TOK_TYPE
+, IHLD_TOK_TYPE
+, SP_TOK_TYPE
+, SPE8_TOK_TYPE
+, AF_TOK_TYPE
+, VEC_TOK_TYPE
+, N_ARG_TOKEN_TYPE
+};
+
+struct arg_token
+{ enum arg_token_type type;
+  int32_t value;
+  int n; char *s;
+};
+
+struct
+{ char string[8];
+  enum arg_token_type type;
+  int32_t value;
+} arg_tokens[] =
+{ "", NONE_TOK_TYPE, 0
+, "a", R8_TOK_TYPE, R8_A
+, "b", R8_TOK_TYPE, R8_B
+, "c", R8_TOK_TYPE, R8_C
+, "d", R8_TOK_TYPE, R8_D
+, "e", R8_TOK_TYPE, R8_E
+, "h", R8_TOK_TYPE, R8_H
+, "l", R8_TOK_TYPE, R8_L
+, "bc", R16_TOK_TYPE, R16_BC
+, "de", R16_TOK_TYPE, R16_DE
+, "hl", R16_TOK_TYPE, R16_HL
+, "[bc]", IR16_TOK_TYPE, R16_BC
+, "[de]", IR16_TOK_TYPE, R16_DE
+, "[hl]", IHL_TOK_TYPE, 0
+, "[hli]", IHLI_TOK_TYPE, 0
+, "[hld]", IHLD_TOK_TYPE, 0
+, "nz", CC_TOK_TYPE, CC_NZ
+, "z", CC_TOK_TYPE, CC_Z
+, "nc", CC_TOK_TYPE, CC_NC
+, "sp", SP_TOK_TYPE, 0
+, "af", AF_TOK_TYPE, 0
+, ":-", ANON_LABEL_TOK_TYPE, -1
+, ":--", ANON_LABEL_TOK_TYPE, -2
+, ":+", ANON_LABEL_TOK_TYPE, 0
+, ":++", ANON_LABEL_TOK_TYPE, 1
+};
+size_t n_arg_tokens = listsize(arg_tokens);
+
+
+bool streq(char *s0, int n, char *s)
+{ return n == strlen(s0) && !strncmp(s0, s, n); }
+
+
+int next_newline(char *text)
+{ for (int n = 0; 0 != text[n]; n++)
+  if ('\n' == text[n])
+    return n;
+  return -1;
+}
+
+
+void trim_leading_space(int *n, char **s)
+{ while (*n && ' ' == **s) (*s)++, (*n)--; }
+
+
+void trim_trailing_space(int *n, char **s)
+{ while (*n && ' ' == (*s)[*n-1]) (*n)--; }
+
+
+int char_in_range(char c, int n, char *s)
+{ for (int i = 0; i < n; i++)
+  if (c == s[i])
+    return i;
+  return -1;
+}
+
+
+uint32_t parse_base10(int n, char *s)
+{ uint32_t x = 0;
+  for (int i = 0; i < n; i++)
+    x = s[i] - '0' + x * 10;
+  return x;
+}
+
+
+uint32_t parse_base2(int n, char *s)
+{ uint32_t x = 0;
+  for (int i = 0; i < n; i++)
+    x = (s[i] - '0') | (x << 1);
+  return x;
+}
+
+
+uint32_t parse_base16(int n, char *s)
+{ uint32_t x = 0;
+  for (int i = 0; i < n; i++)
+    x = (s[i] > '9' ? 10 + s[i] - 'a' : s[i] - '0') | (x << 4);
+  return x;
+}
+
+
+char *parse_error_s0;
+
+
+noreturn
+void parse_error(char *error, int n, char *s)
+{ int l0 = 1;
+  char *s1 = parse_error_s0;
+
+  while (true)
+  { int n1 = next_newline(s1);
+    if (s <= n1 + s1) break;
+    s1 += 1+n1; l0++;
+  }
+
+  int n1 = next_newline(s1);
+
+  printf("%s at line %d\n\n%.*s\n", error, l0, n1, s1);
+  for (int i = 0; i < n1; i++)
+    putchar(( s <= i + s1 && n + s > i + s1 ) ? '~' : ' ');
+  printf("\n");
+  exit(1);
+}
+
+
+// whether s is a name that can be given to a label
+bool is_label(int n, char *s)
+{ if (!n || n >= sizeof(((struct symbol *)0)->name) || '0' <= *s && '9' >= *s)
+    return false;
+  for (int i = 0; i < n; i++)
+    if
+    ( !('a' <= s[i] && 'z' >= s[i] || 'A' <= s[i] && 'Z' >= s[i])
+    && !('0' <= s[i] && '9' >= s[i]) && '_' != s[i] && '.' != s[i]
+    ) return false;
+  return true;
+}
+
+
+enum isn_token parse_isn_token(int n, char *s)
+{ for (int i = 0; i < n_isn_tokens; i++)
+  if (streq(isn_tokens[i].string, n, s))
+    return i;
+
+  parse_error("invalid instruction", n, s);
+}
+
+
+struct arg_token parse_arg_token
+( int n_symbols, struct symbol *symbols
+, int n, char *s
+)
+{ int i;
+
+  if (!n) panic;
+
+  for (i = 0; n > i; i++)
+    if ('0' > s[i] || '9' < s[i]) break;
+  if (n == i)
+    return (struct arg_token){ N_TOK_TYPE, parse_base10(n, s), n, s };
+
+  if ('%' == *s)
+  { for (i = 1; n > i; i++)
+      if ('0' > s[i] || '1' < s[i]) break;
+    if (n == i)
+      return (struct arg_token){ N_TOK_TYPE, parse_base2(n-1, 1+s), n, s };
+  }
+
+  if ('$' == *s)
+  { for (i = 1; n > i; i++)
+      if
+      (  '0' > s[i]
+      || '9' < s[i] && 'a' > s[i]
+      || 'f' < s[i]
+      ) break;
+    if (n == i)
+      return (struct arg_token){ N_TOK_TYPE, parse_base16(n-1, 1+s), n, s };
+  }
+
+  for (int i = 0; i < n_arg_tokens; i++)
+  if (streq(arg_tokens[i].string, n, s))
+    return (struct arg_token)
+      { arg_tokens[i].type
+      , arg_tokens[i].value
+      , n, s
+      };
+
+  for (int i = 0; i < n_symbols; i++)
+  if (streq(symbols[i].name, n, s))
+    return (struct arg_token){ N_TOK_TYPE, symbols[i].value, n, s };
+
+  if (is_label(n, s))
+    return (struct arg_token){ LABEL_TOK_TYPE, 0, n, s };
+
+  parse_error("invalid argument", n, s);
+}
+
+
+enum args
+{ ARGS_INVALID
+, ARGS_R8
+, ARGS_IHL
+, ARGS_N8
+, ARGS_A_R8
+, ARGS_A_IHL
+, ARGS_A_N8
+, ARGS_HL_R16
+, ARGS_R16
+, ARGS_U3_R8
+, ARGS_U3_IHL
+, ARGS_NONE
+, ARGS_R8_R8
+, ARGS_R8_N8
+, ARGS_R16_N16
+, ARGS_IHL_R8
+, ARGS_IHL_N8
+, ARGS_R8_IHL
+, ARGS_IR16_A
+, ARGS_IN16_A
+, ARGS_IC_A
+, ARGS_A_IR16
+, ARGS_A_IN16
+, ARGS_A_IC
+, ARGS_IHLI_A
+, ARGS_IHLD_A
+, ARGS_A_IHLI
+, ARGS_A_IHLD
+, ARGS_N16
+, ARGS_CC_N16
+, ARGS_HL
+, ARGS_E8
+, ARGS_CC_E8
+, ARGS_CC
+, ARGS_VEC
+, ARGS_HL_SP
+, ARGS_SP_E8
+, ARGS_SP
+, ARGS_SP_N16
+, ARGS_IN16_SP
+, ARGS_HL_SPE8
+, ARGS_SP_HL
+, ARGS_AF
+};
+
+
+static const struct instruction_signature {
+  enum op op;
+  enum args args;
+} instruction_signatures[N_ISN_TOKEN][N_ARG_TOKEN_TYPE][N_ARG_TOKEN_TYPE] =
+  { [ADC_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_ADC_A_R8,   ARGS_R8     }
+  , [ADC_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_ADC_A_IHL,  ARGS_IHL    }
+  , [ADC_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_ADC_A_N8,   ARGS_N8     }
+  , [ADC_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_ADC_A_R8,   ARGS_A_R8   }
+  , [ADC_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_ADC_A_IHL,  ARGS_A_IHL  }
+  , [ADC_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_ADC_A_N8,   ARGS_A_N8   }
+
+  , [ADD_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_ADD_A_R8,   ARGS_R8     }
+  , [ADD_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_ADD_A_IHL,  ARGS_IHL    }
+  , [ADD_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_ADD_A_N8,   ARGS_N8     }
+  , [ADD_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_ADD_A_R8,   ARGS_A_R8   }
+  , [ADD_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_ADD_A_IHL,  ARGS_A_IHL  }
+  , [ADD_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_ADD_A_N8,   ARGS_A_N8   }
+
+  , [AND_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_AND_A_R8,   ARGS_R8     }
+  , [AND_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_AND_A_IHL,  ARGS_IHL    }
+  , [AND_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_AND_A_N8,   ARGS_N8     }
+  , [AND_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_AND_A_R8,   ARGS_A_R8   }
+  , [AND_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_AND_A_IHL,  ARGS_A_IHL  }
+  , [AND_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_AND_A_N8,   ARGS_A_N8   }
+
+  , [CP_TOK ][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_CP_A_R8,    ARGS_R8     }
+  , [CP_TOK ][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_CP_A_IHL,   ARGS_IHL    }
+  , [CP_TOK ][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_CP_A_N8,    ARGS_N8     }
+  , [CP_TOK ][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_CP_A_R8,    ARGS_A_R8   }
+  , [CP_TOK ][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_CP_A_IHL,   ARGS_A_IHL  }
+  , [CP_TOK ][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_CP_A_N8,    ARGS_A_N8   }
+
+  , [DEC_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_DEC_R8,     ARGS_R8     }
+  , [DEC_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_DEC_IHL,    ARGS_IHL    }
+
+  , [INC_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_INC_R8,     ARGS_R8     }
+  , [INC_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_INC_IHL,    ARGS_IHL    }
+
+  , [OR_TOK ][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_OR_A_R8,    ARGS_R8     }
+  , [OR_TOK ][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_OR_A_IHL,   ARGS_IHL    }
+  , [OR_TOK ][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_OR_A_N8,    ARGS_N8     }
+  , [OR_TOK ][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_OR_A_R8,    ARGS_A_R8   }
+  , [OR_TOK ][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_OR_A_IHL,   ARGS_A_IHL  }
+  , [OR_TOK ][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_OR_A_N8,    ARGS_A_N8   }
+
+  , [SBC_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SBC_A_R8,   ARGS_R8     }
+  , [SBC_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_SBC_A_IHL,  ARGS_IHL    }
+  , [SBC_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SBC_A_N8,   ARGS_N8     }
+  , [SBC_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_SBC_A_R8,   ARGS_A_R8   }
+  , [SBC_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_SBC_A_IHL,  ARGS_A_IHL  }
+  , [SBC_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_SBC_A_N8,   ARGS_A_N8   }
+
+  , [SUB_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SUB_A_R8,   ARGS_R8     }
+  , [SUB_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_SUB_A_IHL,  ARGS_IHL    }
+  , [SUB_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SUB_A_N8,   ARGS_N8     }
+  , [SUB_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_SUB_A_R8,   ARGS_A_R8   }
+  , [SUB_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_SUB_A_IHL,  ARGS_A_IHL  }
+  , [SUB_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_SUB_A_N8,   ARGS_A_N8   }
+
+  , [XOR_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_XOR_A_R8,   ARGS_R8     }
+  , [XOR_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_XOR_A_IHL,  ARGS_IHL    }
+  , [XOR_TOK][N_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_XOR_A_N8,   ARGS_N8     }
+  , [XOR_TOK][R8_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_XOR_A_R8,   ARGS_A_R8   }
+  , [XOR_TOK][R8_TOK_TYPE ][IHL_TOK_TYPE ] = { OP_XOR_A_IHL,  ARGS_A_IHL  }
+  , [XOR_TOK][R8_TOK_TYPE ][N_TOK_TYPE   ] = { OP_XOR_A_N8,   ARGS_A_N8   }
+
+  , [ADD_TOK][R16_TOK_TYPE][R16_TOK_TYPE ] = { OP_ADD_HL_R16, ARGS_HL_R16 }
+  , [DEC_TOK][R16_TOK_TYPE][NONE_TOK_TYPE] = { OP_DEC_R16,    ARGS_R16    }
+  , [INC_TOK][R16_TOK_TYPE][NONE_TOK_TYPE] = { OP_INC_R16,    ARGS_R16    }
+
+  , [BIT_TOK ][N_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_BIT_U3_R8,  ARGS_U3_R8  }
+  , [BIT_TOK ][N_TOK_TYPE  ][IHL_TOK_TYPE ] = { OP_BIT_U3_IHL, ARGS_U3_IHL }
+  , [RES_TOK ][N_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_RES_U3_R8,  ARGS_U3_R8  }
+  , [RES_TOK ][N_TOK_TYPE  ][IHL_TOK_TYPE ] = { OP_RES_U3_IHL, ARGS_U3_IHL }
+  , [SET_TOK ][N_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_SET_U3_R8,  ARGS_U3_R8  }
+  , [SET_TOK ][N_TOK_TYPE  ][IHL_TOK_TYPE ] = { OP_SET_U3_IHL, ARGS_U3_IHL }
+  , [SWAP_TOK][R8_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SWAP_R8,    ARGS_R8     }
+  , [SWAP_TOK][IHL_TOK_TYPE][NONE_TOK_TYPE] = { OP_SWAP_IHL,   ARGS_IHL    }
+
+  , [RL_TOK  ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RL_R8,   ARGS_R8   }
+  , [RL_TOK  ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RL_IHL,  ARGS_IHL  }
+  , [RLA_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RLA,     ARGS_NONE }
+  , [RLC_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RLC_R8,  ARGS_R8   }
+  , [RLC_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RLC_IHL, ARGS_IHL  }
+  , [RLCA_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RLCA,    ARGS_NONE }
+  , [RR_TOK  ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RR_R8,   ARGS_R8   }
+  , [RR_TOK  ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RR_IHL,  ARGS_IHL  }
+  , [RRA_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RRA,     ARGS_NONE }
+  , [RRC_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RRC_R8,  ARGS_R8   }
+  , [RRC_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RRC_IHL, ARGS_IHL  }
+  , [RRCA_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RRCA,    ARGS_NONE }
+  , [SLA_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SLA_R8,  ARGS_R8   }
+  , [SLA_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SLA_IHL, ARGS_IHL  }
+  , [SRA_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SRA_R8,  ARGS_R8   }
+  , [SRA_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SRA_IHL, ARGS_IHL  }
+  , [SRL_TOK ][R8_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_SRL_R8,  ARGS_R8   }
+  , [SRL_TOK ][IHL_TOK_TYPE ][NONE_TOK_TYPE] = { OP_SRL_IHL, ARGS_IHL  }
+
+  , [LD_TOK ][R8_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_LD_R8_R8,   ARGS_R8_R8   }
+  , [LD_TOK ][R8_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_LD_R8_N8,   ARGS_R8_N8   }
+  , [LD_TOK ][R16_TOK_TYPE ][N_TOK_TYPE   ] = { OP_LD_R16_N16, ARGS_R16_N16 }
+  , [LD_TOK ][IHL_TOK_TYPE ][R8_TOK_TYPE  ] = { OP_LD_IHL_R8,  ARGS_IHL_R8  }
+  , [LD_TOK ][IHL_TOK_TYPE ][N_TOK_TYPE   ] = { OP_LD_IHL_N8,  ARGS_IHL_N8  }
+  , [LD_TOK ][R8_TOK_TYPE  ][IHL_TOK_TYPE ] = { OP_LD_R8_IHL,  ARGS_R8_IHL  }
+  , [LD_TOK ][IR16_TOK_TYPE][R8_TOK_TYPE  ] = { OP_LD_IR16_A,  ARGS_IR16_A  }
+  , [LD_TOK ][IN16_TOK_TYPE][R8_TOK_TYPE  ] = { OP_LD_IN16_A,  ARGS_IN16_A  }
+  , [LDH_TOK][N_TOK_TYPE   ][R8_TOK_TYPE  ] = { OP_LDH_IN16_A, ARGS_IN16_A  }
+  , [LDH_TOK][IC_TOK_TYPE  ][R8_TOK_TYPE  ] = { OP_LDH_IC_A,   ARGS_IC_A    }
+  , [LD_TOK ][R8_TOK_TYPE  ][IR16_TOK_TYPE] = { OP_LD_A_IR16,  ARGS_A_IR16  }
+  , [LD_TOK ][R8_TOK_TYPE  ][IN16_TOK_TYPE] = { OP_LD_A_IN16,  ARGS_A_IN16  }
+  , [LDH_TOK][R8_TOK_TYPE  ][IN16_TOK_TYPE] = { OP_LDH_A_IN16, ARGS_A_IN16  }
+  , [LDH_TOK][R8_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_LDH_A_IN16, ARGS_A_IN16  }
+  , [LDH_TOK][R8_TOK_TYPE  ][IC_TOK_TYPE  ] = { OP_LDH_A_IC,   ARGS_A_IC    }
+  , [LD_TOK ][IHLI_TOK_TYPE][R8_TOK_TYPE  ] = { OP_LD_IHLI_A,  ARGS_IHLI_A  }
+  , [LD_TOK ][IHLD_TOK_TYPE][R8_TOK_TYPE  ] = { OP_LD_IHLD_A,  ARGS_IHLD_A  }
+  , [LD_TOK ][R8_TOK_TYPE  ][IHLI_TOK_TYPE] = { OP_LD_A_IHLI,  ARGS_A_IHLI  }
+  , [LD_TOK ][R8_TOK_TYPE  ][IHLD_TOK_TYPE] = { OP_LD_A_IHLD,  ARGS_A_IHLD  }
+
+  , [CALL_TOK][LABEL_TOK_TYPE][NONE_TOK_TYPE] = { OP_CALL_N16, ARGS_N16 }
+  , [CALL_TOK][ANON_LABEL_TOK_TYPE][NONE_TOK_TYPE] = { OP_CALL_N16, ARGS_N16 }
+  , [CALL_TOK][CC_TOK_TYPE][LABEL_TOK_TYPE] = { OP_CALL_CC_N16, ARGS_CC_N16 }
+  , [CALL_TOK][CC_TOK_TYPE][ANON_LABEL_TOK_TYPE] = { OP_CALL_CC_N16, ARGS_CC_N16 }
+  , [JP_TOK  ][R16_TOK_TYPE ][NONE_TOK_TYPE] = { OP_JP_HL,       ARGS_HL      }
+  , [JP_TOK][LABEL_TOK_TYPE][NONE_TOK_TYPE] = { OP_JP_N16, ARGS_N16 }
+  , [JP_TOK][ANON_LABEL_TOK_TYPE][NONE_TOK_TYPE] = { OP_JP_N16, ARGS_N16 }
+  , [JP_TOK][CC_TOK_TYPE][LABEL_TOK_TYPE] = { OP_JP_CC_N16, ARGS_CC_N16 }
+  , [JP_TOK][CC_TOK_TYPE][ANON_LABEL_TOK_TYPE] = { OP_JP_CC_N16, ARGS_CC_N16 }
+  , [JR_TOK  ][N_TOK_TYPE   ][NONE_TOK_TYPE] = { OP_JR_E8,       ARGS_E8      }
+  , [JR_TOK][ANON_LABEL_TOK_TYPE][NONE_TOK_TYPE] = { OP_JR_E8, ARGS_E8 }
+  , [JR_TOK][LABEL_TOK_TYPE][NONE_TOK_TYPE] = { OP_JR_E8, ARGS_E8 }
+  , [JR_TOK  ][CC_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_JR_CC_E8,    ARGS_CC_E8   }
+  , [JR_TOK][CC_TOK_TYPE][ANON_LABEL_TOK_TYPE] = { OP_JR_CC_E8, ARGS_CC_E8 }
+  , [JR_TOK][CC_TOK_TYPE][LABEL_TOK_TYPE] = { OP_JR_CC_E8, ARGS_CC_E8 }
+  , [RET_TOK ][CC_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_RET_CC,      ARGS_CC      }
+  , [RET_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RET,         ARGS_NONE    }
+  , [RETI_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_RETI,        ARGS_NONE    }
+  , [RST_TOK ][VEC_TOK_TYPE ][NONE_TOK_TYPE] = { OP_RST_VEC,     ARGS_VEC     }
+
+  , [ADD_TOK ][R16_TOK_TYPE ][SP_TOK_TYPE  ] = { OP_ADD_HL_SP,  ARGS_HL_SP   }
+  , [ADD_TOK ][SP_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_ADD_SP_E8,  ARGS_SP_E8   }
+  , [DEC_TOK ][SP_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_DEC_SP,     ARGS_SP      }
+  , [INC_TOK ][SP_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_INC_SP,     ARGS_SP      }
+  , [LD_TOK  ][SP_TOK_TYPE  ][N_TOK_TYPE   ] = { OP_LD_SP_N16,  ARGS_SP_N16  }
+  , [LD_TOK  ][IN16_TOK_TYPE][SP_TOK_TYPE  ] = { OP_LD_IN16_SP, ARGS_IN16_SP }
+  , [LD_TOK  ][R16_TOK_TYPE ][SPE8_TOK_TYPE] = { OP_LD_HL_SPE8, ARGS_HL_SPE8 }
+  , [LD_TOK  ][SP_TOK_TYPE  ][R16_TOK_TYPE ] = { OP_LD_SP_HL,   ARGS_SP_HL   }
+  , [POP_TOK ][AF_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_POP_AF,     ARGS_AF      }
+  , [POP_TOK ][R16_TOK_TYPE ][NONE_TOK_TYPE] = { OP_POP_R16,    ARGS_R16     }
+  , [PUSH_TOK][AF_TOK_TYPE  ][NONE_TOK_TYPE] = { OP_PUSH_AF,    ARGS_AF      }
+  , [PUSH_TOK][R16_TOK_TYPE ][NONE_TOK_TYPE] = { OP_PUSH_R16,   ARGS_R16     }
+
+  , [CCF_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_CCF,        ARGS_NONE    }
+  , [CPL_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_CPL,        ARGS_NONE    }
+  , [DAA_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_DAA,        ARGS_NONE    }
+  , [DI_TOK  ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_DI,         ARGS_NONE    }
+  , [EI_TOK  ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_EI,         ARGS_NONE    }
+  , [HALT_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_HALT,       ARGS_NONE    }
+  , [NOP_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_NOP,        ARGS_NONE    }
+  , [SCF_TOK ][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_SCF,        ARGS_NONE    }
+  , [STOP_TOK][NONE_TOK_TYPE][NONE_TOK_TYPE] = { OP_STOP,       ARGS_NONE    }
+  };
+
+
+static inline void n8_arg(struct arg_token arg_token)
+{ if (arg_token.value < -128 || arg_token.value > 255)
+    parse_error("argument must be 8-bit", arg_token.n, arg_token.s);
+}
+static inline void a_arg(struct arg_token arg_token)
+{ if (arg_token.value != R8_A)
+    parse_error("argument must be register A", arg_token.n, arg_token.s);
+}
+static inline void hl_arg(struct arg_token arg_token)
+{ if (arg_token.value != R16_HL)
+    parse_error("argument must be register HL", arg_token.n, arg_token.s);
+}
+static inline void u3_arg(struct arg_token arg_token)
+{ if (arg_token.value < 0 || arg_token.value > 7)
+    parse_error("argument must be 3-bit unsigned", arg_token.n, arg_token.s);
+}
+static inline void n16_arg(struct arg_token arg_token)
+{ if (arg_token.value < -32768 || arg_token.value > 65535)
+    parse_error("argument must be 16-bit", arg_token.n, arg_token.s);
+}
+static inline void e8_arg(struct arg_token arg_token)
+{ if (arg_token.value < -128 || arg_token.value > 127)
+    parse_error("argument must be 8-bit offset", arg_token.n, arg_token.s);
+}
+
+
+static inline struct instruction parse_instruction
+( enum isn_token isn_token, struct arg_token arg_tokens[2]
+, int instruction_n, char *instruction_s
+)
+{ // c is a register, except as the condition of a jump, call or return
+  if
+  (  (JR_TOK == isn_token || JP_TOK == isn_token || CALL_TOK == isn_token || RET_TOK == isn_token)
+  && R8_TOK_TYPE == arg_tokens[0].type && R8_C == arg_tokens[0].value
+  && (RET_TOK == isn_token || NONE_TOK_TYPE != arg_tokens[1].type)
+  ) arg_tokens[0] = (struct arg_token){ CC_TOK_TYPE, CC_C, arg_tokens[0].n, arg_tokens[0].s };
+
+  const struct instruction_signature *signature =
+    &instruction_signatures[isn_token][arg_tokens[0].type][arg_tokens[1].type];
+  enum op op = signature->op;
+  enum args args = signature->args;
+
+  switch (args)
+  { case ARGS_R8:
+    case ARGS_R16:
+    case ARGS_R8_IHL:
+    case ARGS_CC:
+    case ARGS_VEC:
+    case ARGS_IN16_SP:
+      return (struct instruction){ op, arg_tokens[0].value, 0 };
+    case ARGS_IHL:
     case ARGS_NONE:
     case ARGS_SP:
     case ARGS_AF:
@@ -1636,259 +4222,4077 @@ static inline struct instruction parse_instruction
     { n8_arg(arg_tokens[0]);
       return (struct instruction){ op, arg_tokens[0].value, 0 };
     }
-    case ARGS_A_R8:
-    case ARGS_A_IR16:
-    case ARGS_A_IN16:
-    { a_arg(arg_tokens[0]);
-      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    case ARGS_A_R8:
+    case ARGS_A_IR16:
+    case ARGS_A_IN16:
+    { a_arg(arg_tokens[0]);
+      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    }
+    case ARGS_A_IHL:
+    case ARGS_A_IC:
+    case ARGS_A_IHLI:
+    case ARGS_A_IHLD:
+    { a_arg(arg_tokens[0]);
+      return (struct instruction){ op, 0, 0 };
+    }
+    case ARGS_A_N8:
+    { a_arg(arg_tokens[0]);
+      n8_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    }
+    case ARGS_HL_R16:
+    { hl_arg(arg_tokens[0]);
+      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    }
+    case ARGS_U3_R8:
+    { u3_arg(arg_tokens[0]);
+      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+    }
+    case ARGS_U3_IHL:
+    { u3_arg(arg_tokens[0]);
+      return (struct instruction){ op, arg_tokens[0].value, 0 };
+    }
+    case ARGS_R8_R8:
+      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+    case ARGS_R8_N8:
+    { n8_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+    }
+    case ARGS_R16_N16:
+    case ARGS_CC_N16:
+    { n16_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+    }
+    case ARGS_IHL_R8:
+      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    case ARGS_IHL_N8:
+    { n8_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    }
+    case ARGS_IR16_A:
+    case ARGS_IN16_A:
+    { a_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[0].value, 0 };
+    }
+    case ARGS_IC_A:
+    case ARGS_IHLI_A:
+    case ARGS_IHLD_A:
+    { a_arg(arg_tokens[1]);
+      return (struct instruction){ op, 0, 0 };
+    }
+    case ARGS_N16:
+    { n16_arg(arg_tokens[0]);
+      return (struct instruction){ op, arg_tokens[0].value, 0 };
+    }
+    case ARGS_HL:
+    case ARGS_HL_SP:
+    { hl_arg(arg_tokens[0]);
+      return (struct instruction){ op, 0, 0 };
+    }
+    case ARGS_E8:
+    { e8_arg(arg_tokens[0]);
+      return (struct instruction){ op, arg_tokens[0].value, 0 };
+    }
+    case ARGS_CC_E8:
+    { e8_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+    }
+    case ARGS_SP_E8:
+    { e8_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    }
+    case ARGS_SP_N16:
+    { n16_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    }
+    case ARGS_HL_SPE8:
+    { hl_arg(arg_tokens[0]);
+      e8_arg(arg_tokens[1]);
+      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    }
+    case ARGS_SP_HL:
+    { hl_arg(arg_tokens[1]);
+      return (struct instruction){ op, 0, 0 };
+    }
+    case ARGS_INVALID:
+      for (int i = 0; i < 2; i++)
+        if (LABEL_TOK_TYPE == arg_tokens[i].type)
+          parse_error("invalid argument", arg_tokens[i].n, arg_tokens[i].s);
+      parse_error
+      ( "invalid arguments for instruction"
+      , instruction_n, instruction_s
+      );
+    default:
+      panic;
+  }
+}
+
+
+// the operands which an op takes, or ARGS_INVALID for fused and flagless ops
+enum args op_args(enum op op)
+{ for (int i = 0; i < N_ISN_TOKEN; i++)
+  for (int t0 = 0; t0 < N_ARG_TOKEN_TYPE; t0++)
+  for (int t1 = 0; t1 < N_ARG_TOKEN_TYPE; t1++)
+  { const struct instruction_signature *s = &instruction_signatures[i][t0][t1];
+    if (ARGS_INVALID != s->args && op == s->op) return s->args;
+  }
+  return ARGS_INVALID;
+}
+
+// Write an instruction back out as source (into at least 32 bytes), in a
+// form the parser reads where there is one, and with a written out where
+// there is a choice.  Jumps are written with their offsets and instruction
+// indices, as they have no labels.
+char *format_instruction(char *buf, struct instruction x)
+{ static const char *r8[] = { "a", "b", "c", "d", "e", "h", "l" };
+  static const char *r16[] = { "bc", "de", "hl" };
+  static const char *cc[] = { "nz", "z", "nc", "c" };
+  x = unfuse(x);
+  x.op = flagged_op(x.op);
+
+  const char *name = NULL;
+  enum args args = ARGS_INVALID;
+  bool bare = false;   // an address as a plain number, as for ldh
+  int best = -1;
+  for (int i = 0; i < N_ISN_TOKEN; i++)
+  for (int t0 = 0; t0 < N_ARG_TOKEN_TYPE; t0++)
+  for (int t1 = 0; t1 < N_ARG_TOKEN_TYPE; t1++)
+  { const struct instruction_signature *s = &instruction_signatures[i][t0][t1];
+    if (ARGS_INVALID == s->args || x.op != s->op) continue;
+    bool unread =
+      IN16_TOK_TYPE == t0 || IC_TOK_TYPE == t0 || SPE8_TOK_TYPE == t0
+    || IN16_TOK_TYPE == t1 || IC_TOK_TYPE == t1 || SPE8_TOK_TYPE == t1;
+    int score = (unread ? 0 : 2) + (NONE_TOK_TYPE != t1);
+    if (score <= best) continue;
+    best = score;
+    args = s->args;
+    bare = N_TOK_TYPE == t0 && ARGS_IN16_A == args || N_TOK_TYPE == t1 && ARGS_A_IN16 == args;
+    for (int j = 0; j < n_isn_tokens; j++)
+      if (i == isn_tokens[j].value) name = isn_tokens[j].string;
+  }
+  if (!name) panic;
+
+  switch (args)
+  { case ARGS_R8: sprintf(buf, "%s %s", name, r8[x.p1]); break;
+    case ARGS_IHL: sprintf(buf, "%s [hl]", name); break;
+    case ARGS_N8: sprintf(buf, "%s $%02x", name, x.p1); break;
+    case ARGS_A_R8: sprintf(buf, "%s a, %s", name, r8[x.p1]); break;
+    case ARGS_A_IHL: sprintf(buf, "%s a, [hl]", name); break;
+    case ARGS_A_N8: sprintf(buf, "%s a, $%02x", name, x.p1); break;
+    case ARGS_HL_R16: sprintf(buf, "%s hl, %s", name, r16[x.p1]); break;
+    case ARGS_R16: sprintf(buf, "%s %s", name, r16[x.p1]); break;
+    case ARGS_U3_R8: sprintf(buf, "%s %d, %s", name, x.p1, r8[x.p2]); break;
+    case ARGS_U3_IHL: sprintf(buf, "%s %d, [hl]", name, x.p1); break;
+    case ARGS_NONE: sprintf(buf, "%s", name); break;
+    case ARGS_R8_R8: sprintf(buf, "%s %s, %s", name, r8[x.p1], r8[x.p2]); break;
+    case ARGS_R8_N8: sprintf(buf, "%s %s, $%02x", name, r8[x.p1], x.p2); break;
+    case ARGS_R16_N16: sprintf(buf, "%s %s, $%04x", name, r16[x.p1], x.p2); break;
+    case ARGS_IHL_R8: sprintf(buf, "%s [hl], %s", name, r8[x.p1]); break;
+    case ARGS_IHL_N8: sprintf(buf, "%s [hl], $%02x", name, x.p1); break;
+    case ARGS_R8_IHL: sprintf(buf, "%s %s, [hl]", name, r8[x.p1]); break;
+    case ARGS_IR16_A: sprintf(buf, "%s [%s], a", name, r16[x.p1]); break;
+    case ARGS_IN16_A: sprintf(buf, bare ? "%s $%04x, a" : "%s [$%04x], a", name, x.p1); break;
+    case ARGS_IC_A: sprintf(buf, "%s [c], a", name); break;
+    case ARGS_A_IR16: sprintf(buf, "%s a, [%s]", name, r16[x.p1]); break;
+    case ARGS_A_IN16: sprintf(buf, bare ? "%s a, $%04x" : "%s a, [$%04x]", name, x.p1); break;
+    case ARGS_A_IC: sprintf(buf, "%s a, [c]", name); break;
+    case ARGS_IHLI_A: sprintf(buf, "%s [hli], a", name); break;
+    case ARGS_IHLD_A: sprintf(buf, "%s [hld], a", name); break;
+    case ARGS_A_IHLI: sprintf(buf, "%s a, [hli]", name); break;
+    case ARGS_A_IHLD: sprintf(buf, "%s a, [hld]", name); break;
+    case ARGS_N16: sprintf(buf, "%s %d", name, x.p1); break;
+    case ARGS_CC_N16: sprintf(buf, "%s %s, %d", name, cc[x.p1], x.p2); break;
+    case ARGS_HL: sprintf(buf, "%s hl", name); break;
+    case ARGS_E8: sprintf(buf, "%s %d", name, (int16_t)x.p1); break;
+    case ARGS_CC_E8: sprintf(buf, "%s %s, %d", name, cc[x.p1], (int16_t)x.p2); break;
+    case ARGS_CC: sprintf(buf, "%s %s", name, cc[x.p1]); break;
+    case ARGS_VEC: sprintf(buf, "%s $%02x", name, x.p1); break;
+    case ARGS_HL_SP: sprintf(buf, "%s hl, sp", name); break;
+    case ARGS_SP_E8: sprintf(buf, "%s sp, %d", name, (int16_t)x.p1); break;
+    case ARGS_SP: sprintf(buf, "%s sp", name); break;
+    case ARGS_SP_N16: sprintf(buf, "%s sp, $%04x", name, x.p1); break;
+    case ARGS_IN16_SP: sprintf(buf, "%s [$%04x], sp", name, x.p1); break;
+    case ARGS_HL_SPE8: sprintf(buf, "%s hl, sp + %d", name, (int16_t)x.p1); break;
+    case ARGS_SP_HL: sprintf(buf, "%s sp, hl", name); break;
+    case ARGS_AF: sprintf(buf, "%s af", name); break;
+    default: panic;
+  }
+  return buf;
+}
+
+
+// whether each instruction (and the end) is jumped to, by instruction index
+bool *jump_targets(struct program *program)
+{ size_t n = program->length;
+  bool *target = calloc(n + 1, sizeof(bool));
+  for (int i = 0; i < n; i++)
+  { struct instruction x = program->instructions[i];
+    int t;
+    switch (x.op)
+    { case OP_JR_E8: case OP_JR_CC_E8: t = _jr_target(x, i); break;
+      case OP_CALL_N16: case OP_JP_N16: t = x.p1; break;
+      case OP_CALL_CC_N16: case OP_JP_CC_N16: t = x.p2; break;
+      default: continue;
+    }
+    if (0 <= t && n >= t) target[t] = true;
+  }
+  return target;
+}
+
+// Replace the head of each recognized loop with a fused instruction, which
+// runs every iteration at once.  The rest of the loop is left in place.
+void fuse_idioms(struct program *program)
+{ size_t n = program->length;
+  bool *target = jump_targets(program);
+
+  for (int i = 0; i < n; i++)
+  for (int j = 0; j < listsize(idioms); j++)
+  { const struct idiom *idiom = &idioms[j];
+    if (n - i < idiom->length) continue;
+
+    bool match = true;
+    for (int k = 0; match && k < idiom->length; k++)
+    { struct instruction x = program->instructions[i+k];
+      struct instruction y = idiom->pattern[k];
+      match =
+        x.op == y.op && x.p1 == y.p1
+      && (x.p2 == y.p2 || k && k == idiom->exit)
+      && (!k || !target[i+k]);
+    }
+    if (!match) continue;
+
+    // the exit has to leave the loop, and is kept relative to the head
+    int16_t exit = 0;
+    if (idiom->exit)
+    { int t = _jr_target(program->instructions[i + idiom->exit], i + idiom->exit);
+      if (t > i && t < i + idiom->length) continue;
+      exit = t - i - 1;
+    }
+
+    program->instructions[i] = (struct instruction){ idiom->op, exit };
+    break;
+  }
+
+  free(target);
+}
+
+
+// a use of a named label which is not defined in the same file, for
+// link_modules to resolve
+struct reference
+{ char name[16];
+  uint16_t isn;
+  uint8_t arg;  // 0 for p1, 1 for p2
+};
+
+// A parsed source file, before linking.  Labels are instruction indices: jr
+// offsets are relative to the jump, and call and jp targets are absolute.
+struct module
+{ struct program *program;
+  uint16_t *lines;  // the source line of each instruction
+  char **files;     // and its file, or NULL
+  size_t n_labels;
+  struct symbol *labels;
+  size_t n_references;
+  struct reference *references;
+};
+
+
+// the instruction index of a label, or -1
+int find_label(struct module *module, char *name)
+{ for (size_t i = 0; i < module->n_labels; i++)
+    if (!strcmp(module->labels[i].name, name))
+      return module->labels[i].value;
+  return -1;
+}
+
+
+// point the label argument of the instruction at isn to instruction target
+static void _patch_label(struct program *program, int isn, int arg, int target)
+{ struct instruction *x = &program->instructions[isn];
+  uint16_t *p = arg ? &x->p2 : &x->p1;
+  *p = OP_JR_E8 == x->op || OP_JR_CC_E8 == x->op ? target - isn - 1 : target;
+}
+
+
+struct module *parse_module
+( struct symbol *symbols, size_t n_symbols
+, char *text
+)
+{ int max_instructions = 255;
+  struct program *program =
+    malloc(sizeof(struct program) + max_instructions * sizeof(struct instruction));
+  program->length = 0;
+  int max_anonymous_labels = max_instructions;
+
+  int labels[max_anonymous_labels];
+  int n_labels = 0;
+  uint16_t *lines = malloc(max_instructions * sizeof(uint16_t));
+  struct symbol *named_labels = malloc(max_instructions * sizeof(struct symbol));
+  int n_named_labels = 0;
+  struct label_reference {
+    int isn, arg;
+    bool named;
+    int n;
+    char *s;
+  } label_references[2 * max_instructions];
+  int n_label_references = 0;
+
+  parse_error_s0 = text;
+
+  { // parse lines
+
+    int l = 1;
+    char *s = text;
+    int n = next_newline(text);
+    while (-1 != n)
+    { char *s1 = s;
+      int n1 = n;
+
+      { // trim comment
+        int n2 = char_in_range(';', n1, s1);
+        n1 = -1 != n2 ? n2 : n1;
+      }
+
+      trim_trailing_space(&n1, &s1);
+      trim_leading_space(&n1, &s1);
+
+      // parse label
+      if (':' == *s1)
+      { if (max_anonymous_labels == n_labels) panic;
+        labels[n_labels++] = program->length;
+        s1++; n1--;
+        trim_leading_space(&n1, &s1);
+      }
+      else
+      { int n2 = char_in_range(':', n1, s1);
+        if (0 < n2 && is_label(n2, s1))
+        { if (LABEL_TOK_TYPE != parse_arg_token(n_symbols, symbols, n2, s1).type)
+            parse_error("label name already in use", n2, s1);
+          for (int i = 0; i < n_named_labels; i++)
+            if (streq(named_labels[i].name, n2, s1))
+              parse_error("label defined twice", n2, s1);
+          if (max_instructions == n_named_labels) panic;
+          struct symbol *label = &named_labels[n_named_labels++];
+          memcpy(label->name, s1, n2);
+          label->name[n2] = 0;
+          label->value = program->length;
+          s1 += 1 + n2; n1 -= 1 + n2;
+          trim_leading_space(&n1, &s1);
+        }
+      }
+
+      if (n1)
+      { // parse instruction
+
+        enum isn_token isn_token;
+        struct arg_token arg_tokens[2] = { { 0, 0 }, { 0, 0 } };
+        int n_arg_tokens = 0;
+
+        int instruction_n = n1;
+        char *instruction_s = s1;
+
+        int n2 = char_in_range(' ', n1, s1);
+        isn_token = parse_isn_token(-1 != n2 ? n2 : n1, s1);
+
+        while (-1 != n2)
+        { // parse argument
+
+          s1 += 1 + n2;
+          n1 -= 1 + n2;
+          trim_leading_space(&n1, &s1);
+
+          if (2 == n_arg_tokens)
+            parse_error("too many argumnets", n1, s1);
+
+          n2 = char_in_range(',', n1, s1);
+
+          int n3 = -1 != n2 ? n2 : n1;
+          while (' ' == s1[n3-1]) n3--;
+
+          arg_tokens[n_arg_tokens++] = parse_arg_token(n_symbols, symbols, n3, s1);
+        }
+
+        if (max_instructions == program->length) panic;
+        lines[program->length] = l;
+        program->instructions[program->length++] = parse_instruction
+        ( isn_token, arg_tokens
+        , instruction_n, instruction_s
+        );
+
+        for (int i = 0; i < n_arg_tokens; i++)
+        { enum arg_token_type type = arg_tokens[i].type;
+          if (ANON_LABEL_TOK_TYPE != type && LABEL_TOK_TYPE != type) continue;
+          if (listsize(label_references) == n_label_references) panic;
+          label_references[n_label_references++] = (struct label_reference)
+            { .isn = program->length-1
+            , .arg = i
+            , .named = LABEL_TOK_TYPE == type
+            , .n = LABEL_TOK_TYPE == type ? arg_tokens[i].n : instruction_n
+            , .s = LABEL_TOK_TYPE == type ? arg_tokens[i].s : instruction_s
+            };
+        }
+      }
+
+      l++;
+      s += 1 + n;
+      n = next_newline(s);
+    }
+
+    // patch up anonymous label references
+    for (int i = 0, j = 0; i < n_label_references; i++)
+    { if (label_references[i].named) continue;
+      int isn = label_references[i].isn;
+      struct instruction *x = &program->instructions[isn];
+      uint16_t *p = label_references[i].arg ? &x->p2 : &x->p1;
+
+      while (n_labels != j && labels[j] < isn)
+        j++;
+
+      int k = (int16_t)*p + j;
+      if (0 > k || n_labels <= k)
+        parse_error
+        ( "anonymous label does not exist"
+        , label_references[i].n, label_references[i].s
+        );
+
+      _patch_label(program, isn, label_references[i].arg, labels[k]);
+    }
+  }
+
+  struct module *module = calloc(1, sizeof(struct module));
+  module->program = program;
+  module->lines = lines;
+  module->files = calloc(max_instructions, sizeof(char *));
+  module->labels = named_labels;
+  module->n_labels = n_named_labels;
+  module->references = malloc(n_label_references * sizeof(struct reference));
+
+  // patch up named label references, keeping those defined elsewhere
+  for (int i = 0; i < n_label_references; i++)
+  { struct label_reference *r = &label_references[i];
+    if (!r->named) continue;
+    char name[16];
+    memcpy(name, r->s, r->n);
+    name[r->n] = 0;
+    int target = find_label(module, name);
+    if (0 <= target)
+      _patch_label(program, r->isn, r->arg, target);
+    else
+    { struct reference *e = &module->references[module->n_references++];
+      strcpy(e->name, name);
+      e->isn = r->isn;
+      e->arg = r->arg;
+    }
+  }
+
+  return module;
+}
+
+
+// Combine modules into one program, in order, resolving the references each
+// makes to labels defined in the others.  Idioms are fused once linked, as a
+// jump from anywhere may land in the middle of a loop.  A label defined twice,
+// or not at all, panics.
+struct module *link_modules(size_t n_modules, struct module **modules)
+{ size_t length = 0, n_labels = 0;
+  for (size_t i = 0; i < n_modules; i++)
+  { length += modules[i]->program->length;
+    n_labels += modules[i]->n_labels;
+  }
+  if (0xffff <= length) panic;
+
+  struct module *linked = calloc(1, sizeof(struct module));
+  linked->program =
+    malloc(sizeof(struct program) + length * sizeof(struct instruction));
+  linked->program->length = length;
+  linked->lines = malloc(length * sizeof(uint16_t));
+  linked->files = malloc(length * sizeof(char *));
+  linked->labels = malloc(n_labels * sizeof(struct symbol));
+
+  size_t *base = malloc(n_modules * sizeof(size_t));
+  size_t at = 0;
+  for (size_t i = 0; i < n_modules; i++)
+  { struct module *m = modules[i];
+    base[i] = at;
+    for (size_t j = 0; j < m->program->length; j++)
+    { struct instruction x = m->program->instructions[j];
+      switch (x.op)
+      { case OP_CALL_N16: case OP_JP_N16: x.p1 += at; break;
+        case OP_CALL_CC_N16: case OP_JP_CC_N16: x.p2 += at; break;
+        default: break;
+      }
+      linked->program->instructions[at + j] = x;
+      linked->lines[at + j] = m->lines[j];
+      linked->files[at + j] = m->files[j];
+    }
+    for (size_t j = 0; j < m->n_labels; j++)
+    { if (0 <= find_label(linked, m->labels[j].name))
+      { printf("label %s defined twice\n", m->labels[j].name);
+        panic;
+      }
+      linked->labels[linked->n_labels] = m->labels[j];
+      linked->labels[linked->n_labels++].value += at;
+    }
+    at += m->program->length;
+  }
+
+  for (size_t i = 0; i < n_modules; i++)
+  for (size_t j = 0; j < modules[i]->n_references; j++)
+  { struct reference *r = &modules[i]->references[j];
+    int target = find_label(linked, r->name);
+    if (0 > target)
+    { printf("label %s does not exist\n", r->name);
+      panic;
+    }
+    _patch_label(linked->program, base[i] + r->isn, r->arg, target);
+  }
+
+  free(base);
+  fuse_idioms(linked->program);
+  return linked;
+}
+
+// Free a module, and its program if it still has one.  The file names are
+// left, as modules linked from it share them.
+void free_module(struct module *module)
+{ free(module->program);
+  free(module->lines);
+  free(module->files);
+  free(module->labels);
+  free(module->references);
+  free(module);
+}
+
+// link a single module, keeping only its program
+static struct program *_link_program(struct module *module)
+{ struct module *linked = link_modules(1, &module);
+  struct program *program = linked->program;
+  linked->program = NULL;
+  free_module(linked);
+  free_module(module);
+  return program;
+}
+
+
+// Set a breakpoint on the first instruction at or after line of file (any
+// file, if NULL), returning its index in breakpoints, or -1 if there is none.
+int break_at_line(struct module *module, char *file, int line)
+{ for (size_t i = 0; i < module->program->length; i++)
+  { if (file && (!module->files[i] || strcmp(file, module->files[i]))) continue;
+    if (line <= module->lines[i]) return set_breakpoint(module->program, i);
+  }
+  return -1;
+}
+
+
+struct program *parse_program
+( struct symbol *symbols, size_t n_symbols
+, char *text
+)
+{ return _link_program(parse_module(symbols, n_symbols, text)); }
+
+
+struct module *parse_module_file
+( struct symbol *symbols, size_t n_symbols
+, char *filename
+)
+{ char code[1 << 16];
+  int f = open(filename, O_RDONLY);
+  if (!f) panic;
+  size_t n = read(f, code, sizeof(code));
+  if (sizeof(code) == n) panic;
+  code[n] = 0;
+  close(f);
+  struct module *module = parse_module(symbols, n_symbols, code);
+  char *file = strdup(filename);
+  for (size_t i = 0; i < module->program->length; i++)
+    module->files[i] = file;
+  return module;
+}
+
+
+struct program *parse_program_file
+( struct symbol *symbols, size_t n_symbols
+, char *filename
+)
+{ struct module *module = parse_module_file(symbols, n_symbols, filename);
+  char *file = module->program->length ? module->files[0] : NULL;
+  struct program *program = _link_program(module);
+  free(file);
+  return program;
+}
+
+
+// static analysis
+
+
+enum loc
+{ LOC_A = 1 << R8_A
+, LOC_B = 1 << R8_B
+, LOC_C = 1 << R8_C
+, LOC_D = 1 << R8_D
+, LOC_E = 1 << R8_E
+, LOC_H = 1 << R8_H
+, LOC_L = 1 << R8_L
+, LOC_F = 1 << 7
+, LOC_SP = 1 << 8
+
+, LOC_BC = LOC_B | LOC_C
+, LOC_DE = LOC_D | LOC_E
+, LOC_HL = LOC_H | LOC_L
+, LOC_ALL = 0x1ff
+};
+
+enum addr
+{ ADDR_NONE
+, ADDR_HL
+, ADDR_BC
+, ADDR_DE
+, ADDR_N16
+, ADDR_C
+, ADDR_SP
+};
+
+// registers, flags and memory touched by a single instruction
+// f_reads and f_writes cover all of F, including the low nibble
+struct access
+{ uint16_t reads, writes;
+  uint8_t f_reads, f_writes;
+  enum addr addr;
+  uint8_t mem_reads, mem_writes;
+  bool branch;
+};
+
+
+static inline uint16_t _loc_r8(enum r8 r)
+{ return 1 << r; }
+
+static inline uint16_t _loc_r16(enum r16 r)
+{ switch (r)
+  { case R16_BC: return LOC_BC;
+    case R16_DE: return LOC_DE;
+    case R16_HL: return LOC_HL;
+    default: panic;
+  }
+}
+
+static inline uint8_t _cc_flags(enum cc cc)
+{ switch (cc)
+  { case CC_NZ: case CC_Z: return FLAG_Z;
+    case CC_NC: case CC_C: return FLAG_C;
+    default: panic;
+  }
+}
+
+
+struct access instruction_access(struct instruction x)
+{ struct access a = { 0 };
+  x = unfuse(x);
+  bool flagless = flagged_op(x.op) != x.op;
+  x.op = flagged_op(x.op);
+  switch (x.op)
+  { case OP_ADC_A_R8:
+    case OP_SBC_A_R8:
+      a.f_reads = FLAG_C;
+    case OP_ADD_A_R8:
+    case OP_AND_A_R8:
+    case OP_OR_A_R8:
+    case OP_SUB_A_R8:
+    case OP_XOR_A_R8:
+      a.writes = LOC_A;
+    case OP_CP_A_R8:
+      a.reads = LOC_A | _loc_r8(x.p1);
+      a.f_writes = 0xff;
+      break;
+    case OP_ADC_A_IHL:
+    case OP_SBC_A_IHL:
+      a.f_reads = FLAG_C;
+    case OP_ADD_A_IHL:
+    case OP_AND_A_IHL:
+    case OP_OR_A_IHL:
+    case OP_SUB_A_IHL:
+    case OP_XOR_A_IHL:
+      a.writes = LOC_A;
+    case OP_CP_A_IHL:
+      a.reads = LOC_A | LOC_HL;
+      a.f_writes = 0xff;
+      a.addr = ADDR_HL; a.mem_reads = 1;
+      break;
+    case OP_ADC_A_N8:
+    case OP_SBC_A_N8:
+      a.f_reads = FLAG_C;
+    case OP_ADD_A_N8:
+    case OP_AND_A_N8:
+    case OP_OR_A_N8:
+    case OP_SUB_A_N8:
+    case OP_XOR_A_N8:
+      a.writes = LOC_A;
+    case OP_CP_A_N8:
+      a.reads = LOC_A;
+      a.f_writes = 0xff;
+      break;
+
+    case OP_DEC_R8:
+    case OP_INC_R8:
+      a.reads = a.writes = _loc_r8(x.p1);
+      a.f_writes = 0xff & ~FLAG_C;
+      break;
+    case OP_DEC_IHL:
+    case OP_INC_IHL:
+      a.reads = LOC_HL;
+      a.f_writes = 0xff & ~FLAG_C;
+      a.addr = ADDR_HL; a.mem_reads = a.mem_writes = 1;
+      break;
+
+    case OP_ADD_HL_R16:
+      a.reads = LOC_HL | _loc_r16(x.p1);
+      a.writes = LOC_HL;
+      a.f_writes = 0xff & ~FLAG_Z;
+      break;
+    case OP_DEC_R16:
+    case OP_INC_R16:
+      a.reads = a.writes = _loc_r16(x.p1);
+      break;
+
+    case OP_BIT_U3_R8:
+      a.reads = _loc_r8(x.p2);
+      a.f_writes = 0xff & ~FLAG_C;
+      break;
+    case OP_BIT_U3_IHL:
+      a.reads = LOC_HL;
+      a.f_writes = 0xff & ~FLAG_C;
+      a.addr = ADDR_HL; a.mem_reads = 1;
+      break;
+    case OP_RES_U3_R8:
+    case OP_SET_U3_R8:
+      a.reads = a.writes = _loc_r8(x.p2);
+      break;
+    case OP_RES_U3_IHL:
+    case OP_SET_U3_IHL:
+      a.reads = LOC_HL;
+      a.addr = ADDR_HL; a.mem_reads = a.mem_writes = 1;
+      break;
+
+    case OP_RL_R8:
+    case OP_RR_R8:
+      a.f_reads = FLAG_C;
+    case OP_SWAP_R8:
+    case OP_RLC_R8:
+    case OP_RRC_R8:
+    case OP_SLA_R8:
+    case OP_SRA_R8:
+    case OP_SRL_R8:
+      a.reads = a.writes = _loc_r8(x.p1);
+      a.f_writes = 0xff;
+      break;
+    case OP_RL_IHL:
+    case OP_RR_IHL:
+      a.f_reads = FLAG_C;
+    case OP_SWAP_IHL:
+    case OP_RLC_IHL:
+    case OP_RRC_IHL:
+    case OP_SLA_IHL:
+    case OP_SRA_IHL:
+    case OP_SRL_IHL:
+      a.reads = LOC_HL;
+      a.f_writes = 0xff;
+      a.addr = ADDR_HL; a.mem_reads = a.mem_writes = 1;
+      break;
+    case OP_RLA:
+    case OP_RRA:
+      a.f_reads = FLAG_C;
+    case OP_RLCA:
+    case OP_RRCA:
+      a.reads = a.writes = LOC_A;
+      a.f_writes = 0xff;
+      break;
+
+    case OP_LD_R8_R8:
+      a.reads = _loc_r8(x.p2);
+      a.writes = _loc_r8(x.p1);
+      break;
+    case OP_LD_R8_N8:
+      a.writes = _loc_r8(x.p1);
+      break;
+    case OP_LD_R16_N16:
+      a.writes = _loc_r16(x.p1);
+      break;
+    case OP_LD_IHL_R8:
+      a.reads = LOC_HL | _loc_r8(x.p1);
+      a.addr = ADDR_HL; a.mem_writes = 1;
+      break;
+    case OP_LD_IHL_N8:
+      a.reads = LOC_HL;
+      a.addr = ADDR_HL; a.mem_writes = 1;
+      break;
+    case OP_LD_R8_IHL:
+      a.reads = LOC_HL;
+      a.writes = _loc_r8(x.p1);
+      a.addr = ADDR_HL; a.mem_reads = 1;
+      break;
+    case OP_LD_IR16_A:
+      a.reads = LOC_A | _loc_r16(x.p1);
+      a.addr = R16_BC == x.p1 ? ADDR_BC : R16_DE == x.p1 ? ADDR_DE : ADDR_HL;
+      a.mem_writes = 1;
+      break;
+    case OP_LD_IN16_A:
+    case OP_LDH_IN16_A:
+      a.reads = LOC_A;
+      a.addr = ADDR_N16; a.mem_writes = 1;
+      break;
+    case OP_LDH_IC_A:
+      a.reads = LOC_A | LOC_C;
+      a.addr = ADDR_C; a.mem_writes = 1;
+      break;
+    case OP_LD_A_IR16:
+      a.reads = _loc_r16(x.p1);
+      a.writes = LOC_A;
+      a.addr = R16_BC == x.p1 ? ADDR_BC : R16_DE == x.p1 ? ADDR_DE : ADDR_HL;
+      a.mem_reads = 1;
+      break;
+    case OP_LD_A_IN16:
+    case OP_LDH_A_IN16:
+      a.writes = LOC_A;
+      a.addr = ADDR_N16; a.mem_reads = 1;
+      break;
+    case OP_LDH_A_IC:
+      a.reads = LOC_C;
+      a.writes = LOC_A;
+      a.addr = ADDR_C; a.mem_reads = 1;
+      break;
+    case OP_LD_IHLI_A:
+    case OP_LD_IHLD_A:
+      a.reads = LOC_HL | LOC_A;
+      a.writes = LOC_HL;
+      a.addr = ADDR_HL; a.mem_writes = 1;
+      break;
+    case OP_LD_A_IHLI:
+    case OP_LD_A_IHLD:
+      a.reads = LOC_HL;
+      a.writes = LOC_HL | LOC_A;
+      a.addr = ADDR_HL; a.mem_reads = 1;
+      break;
+
+    case OP_JR_E8:
+      a.branch = true;
+      break;
+    case OP_JR_CC_E8:
+      a.f_reads = _cc_flags(x.p1);
+      a.branch = true;
+      break;
+    case OP_JP_CC_N16:
+      a.f_reads = _cc_flags(x.p1);
+      a.branch = true;
+      break;
+    case OP_CALL_CC_N16:
+      a.f_reads = _cc_flags(x.p1);
+    case OP_CALL_N16:
+    case OP_RST_VEC:
+      a.reads = a.writes = LOC_SP;
+      a.addr = ADDR_SP; a.mem_writes = 2;
+      a.branch = true;
+      break;
+    case OP_RET_CC:
+      a.f_reads = _cc_flags(x.p1);
+    case OP_RET:
+    case OP_RETI:
+      a.reads = a.writes = LOC_SP;
+      a.addr = ADDR_SP; a.mem_reads = 2;
+      a.branch = true;
+      break;
+    case OP_JP_HL:
+      a.reads = LOC_HL;
+      a.branch = true;
+      break;
+    case OP_JP_N16:
+      a.branch = true;
+      break;
+
+    case OP_ADD_HL_SP:
+      a.reads = LOC_HL | LOC_SP;
+      a.writes = LOC_HL;
+      a.f_writes = 0xff & ~FLAG_Z;
+      break;
+    case OP_ADD_SP_E8:
+      a.reads = a.writes = LOC_SP;
+      a.f_writes = 0xff;
+      break;
+    case OP_DEC_SP:
+    case OP_INC_SP:
+      a.reads = a.writes = LOC_SP;
+      break;
+    case OP_LD_SP_N16:
+      a.writes = LOC_SP;
+      break;
+    case OP_LD_IN16_SP:
+      a.reads = LOC_SP;
+      a.addr = ADDR_N16; a.mem_writes = 2;
+      break;
+    case OP_LD_HL_SPE8:
+      a.reads = LOC_SP;
+      a.writes = LOC_HL;
+      a.f_writes = 0xff;
+      break;
+    case OP_LD_SP_HL:
+      a.reads = LOC_HL;
+      a.writes = LOC_SP;
+      break;
+    case OP_POP_AF:
+      a.reads = LOC_SP;
+      a.writes = LOC_SP | LOC_A;
+      a.f_writes = 0xff;
+      a.addr = ADDR_SP; a.mem_reads = 2;
+      break;
+    case OP_POP_R16:
+      a.reads = LOC_SP;
+      a.writes = LOC_SP | _loc_r16(x.p1);
+      a.addr = ADDR_SP; a.mem_reads = 2;
+      break;
+    case OP_PUSH_AF:
+      a.reads = a.writes = LOC_SP;
+      a.reads |= LOC_A;
+      a.f_reads = 0xff;
+      a.addr = ADDR_SP; a.mem_writes = 2;
+      break;
+    case OP_PUSH_R16:
+      a.reads = a.writes = LOC_SP;
+      a.reads |= _loc_r16(x.p1);
+      a.addr = ADDR_SP; a.mem_writes = 2;
+      break;
+
+    case OP_CCF:
+      a.f_reads = FLAG_C;
+      a.f_writes = 0xff & ~FLAG_Z;
+      break;
+    case OP_CPL:
+      a.reads = a.writes = LOC_A;
+      a.f_writes = FLAG_N | FLAG_H;
+      break;
+    case OP_DAA:
+      a.reads = a.writes = LOC_A;
+      a.f_reads = FLAG_N | FLAG_H | FLAG_C;
+      a.f_writes = 0xff & ~FLAG_N;
+      break;
+    case OP_SCF:
+      a.f_writes = 0xff & ~FLAG_Z;
+      break;
+    case OP_DI:
+    case OP_EI:
+    case OP_HALT:
+    case OP_NOP:
+    case OP_STOP:
+      break;
+
+    default: panic;
+  }
+  if (flagless) a.f_writes = 0;
+  if (a.f_reads || a.f_writes && 0xff != a.f_writes) a.reads |= LOC_F;
+  if (a.f_writes) a.writes |= LOC_F;
+  return a;
+}
+
+
+// first byte touched by a memory access, given the current registers
+static inline uint16_t access_address(struct instruction x, struct access a)
+{ switch (a.addr)
+  { case ADDR_HL: return reg.hl;
+    case ADDR_BC: return reg.bc;
+    case ADDR_DE: return reg.de;
+    case ADDR_N16: return x.p1;
+    case ADDR_C: return 0xff00 | reg.c;
+    case ADDR_SP: return a.mem_writes ? reg.sp - 2 : reg.sp;
+    default: panic;
+  }
+}
+
+static inline uint16_t _addr_locs(enum addr addr)
+{ switch (addr)
+  { case ADDR_HL: return LOC_HL;
+    case ADDR_BC: return LOC_BC;
+    case ADDR_DE: return LOC_DE;
+    case ADDR_C: return LOC_C;
+    case ADDR_SP: return LOC_SP;
+    default: return 0;
+  }
+}
+
+
+// registers (and F, as a whole) whose incoming values may be read, running
+// from instruction isn
+uint16_t live_inputs_from(struct program *program, uint16_t isn)
+{ size_t n = program->length;
+  uint16_t *live = calloc(n + 1, sizeof(uint16_t));
+  bool changed = true;
+  while (changed)
+  { changed = false;
+    for (int i = n - 1; 0 <= i; i--)
+    { struct instruction x = program->instructions[i];
+      struct access a = instruction_access(x);
+      uint16_t out = 0;
+      if (OP_JR_E8 != x.op) out |= live[i+1];
+      if (OP_JR_E8 == x.op || OP_JR_CC_E8 == x.op)
+      { int t = _jr_target(x, i);
+        out |= 0 <= t && n >= t ? live[t] : 0;
+      }
+      else if (a.branch) out = LOC_ALL & ~LOC_SP;
+      uint16_t in = a.reads | out & ~a.writes;
+      if (in != live[i]) { live[i] = in; changed = true; }
+    }
+  }
+  uint16_t in = n >= isn ? live[isn] : 0;
+  free(live);
+  return in;
+}
+
+uint16_t live_inputs(struct program *program)
+{ return live_inputs_from(program, 0); }
+
+
+// simulator state, for running several programs from the same starting point
+struct snapshot
+{ struct registers reg;
+  uint32_t cycles;
+  uint8_t mem[1 << 16];
+};
+
+void save_snapshot(struct snapshot *s)
+{ s->reg = reg;
+  s->cycles = cycles;
+  memcpy(s->mem, mem, sizeof(mem));
+}
+
+void restore_snapshot(struct snapshot *s)
+{ reg = s->reg;
+  cycles = s->cycles;
+  memcpy(mem, s->mem, sizeof(mem));
+}
+
+
+// partial evaluation
+
+
+struct mem_range
+{ uint16_t addr, length;
+};
+
+struct abstract
+{ struct registers value;
+  uint16_t known, synced;
+  uint8_t f_known;
+  // register pairs whose real contents are known while unsynced
+  uint16_t real[3];
+  uint8_t real_known;
+  uint8_t *mem_known;
+  uint8_t *mem_value;
+};
+
+
+static inline uint16_t _pair_value(struct registers *r, enum r16 pair)
+{ switch (pair)
+  { case R16_BC: return r->bc;
+    case R16_DE: return r->de;
+    case R16_HL: return r->hl;
+    default: panic;
+  }
+}
+
+struct residual
+{ struct program *program;
+  size_t capacity;
+};
+
+
+static void _emit(struct residual *r, struct instruction x)
+{ if (r->capacity == r->program->length)
+  { r->capacity *= 2;
+    r->program = realloc
+    ( r->program
+    , sizeof(struct program) + r->capacity * sizeof(struct instruction)
+    );
+  }
+  r->program->instructions[r->program->length++] = x;
+}
+
+
+static inline bool _mem_is_known(struct abstract *s, uint16_t addr)
+{ return s->mem_known[addr >> 3] & 1 << (addr & 7); }
+
+static inline void _mem_set_known(struct abstract *s, uint16_t addr, bool known)
+{ if (known) s->mem_known[addr >> 3] |= 1 << (addr & 7);
+  else s->mem_known[addr >> 3] &= ~(1 << (addr & 7));
+}
+
+
+// shortest sequences leaving F with a given high nibble, indexed by F >> 4
+static struct flag_setter
+{ uint8_t length, cycles;
+  bool clobbers_a;
+  struct instruction instructions[4];
+} flag_setters[16];
+
+static void _find_flag_setters()
+{ static bool done = false;
+  if (done) return;
+  done = true;
+
+  struct registers r0 = reg;
+  uint32_t c0 = cycles;
+
+  enum op alu[] = { OP_ADD_A_N8, OP_SUB_A_N8, OP_AND_A_N8, OP_OR_A_N8, OP_XOR_A_N8, OP_CP_A_N8 };
+  enum op suffixes[] = { OP_NOP, OP_SCF, OP_CCF, OP_CPL, OP_DAA };
+
+  struct flag_setter prefixes[] =
+  { { 1, 0, false, { { OP_CP_A_R8, R8_A } } }
+  , { 1, 0, true, { { OP_XOR_A_R8, R8_A } } }
+  , { 1, 0, true, { { OP_SUB_A_R8, R8_A } } }
+  , { 2, 0, true, { { OP_LD_R8_N8, R8_A }, { OP_ADD_A_N8 } } }
+  };
+  int n_prefixes = listsize(prefixes) - 1 + listsize(alu) * 256 * 256;
+
+  for (int i = 0; i < n_prefixes; i++)
+  for (int j = 0; j < listsize(suffixes); j++)
+  for (int k = 0; k < listsize(suffixes); k++)
+  { struct flag_setter s;
+    if (listsize(prefixes) - 1 > i) s = prefixes[i];
+    else
+    { // ld a, x / alu n
+      int m = i - (listsize(prefixes) - 1);
+      s = prefixes[listsize(prefixes) - 1];
+      s.instructions[0].p2 = m & 0xff;
+      s.instructions[1].op = alu[m >> 16];
+      s.instructions[1].p1 = m >> 8 & 0xff;
+    }
+    if (OP_NOP == suffixes[j] && OP_NOP != suffixes[k]) continue;
+    // cp a leaves A unknown, which daa depends on
+    if (!s.clobbers_a && (OP_DAA == suffixes[j] || OP_DAA == suffixes[k])) continue;
+    if (OP_NOP != suffixes[j]) s.instructions[s.length++] = (struct instruction){ suffixes[j] };
+    if (OP_NOP != suffixes[k]) s.instructions[s.length++] = (struct instruction){ suffixes[k] };
+    for (int l = 0; l < s.length; l++)
+      if (OP_CPL == s.instructions[l].op) s.clobbers_a = true;
+
+    reg.a = 0; reg.f = 0; cycles = 0;
+    for (int l = 0; l < s.length; l++)
+      execute(&s.instructions[l], 0);
+    s.cycles = cycles + (s.clobbers_a ? 2 : 0);
+
+    struct flag_setter *best = &flag_setters[reg.f >> 4];
+    if (!best->length || s.cycles < best->cycles) *best = s;
+  }
+
+  reg = r0;
+  cycles = c0;
+}
+
+
+static void _materialize(struct residual *r, struct abstract *s, uint16_t locs)
+{ locs &= s->known & ~s->synced;
+
+  if (LOC_F & locs)
+  { struct flag_setter *f = &flag_setters[s->value.f >> 4];
+    if (!f->length || 0x0f & s->value.f) panic;
+    for (int i = 0; i < f->length; i++)
+      _emit(r, f->instructions[i]);
+    s->synced |= LOC_F;
+    if (f->clobbers_a)
+    { if (!(LOC_A & s->known)) panic;
+      s->synced &= ~LOC_A;
+      locs |= LOC_A;
+    }
+  }
+
+  enum r16 pairs[] = { R16_BC, R16_DE, R16_HL };
+  for (int i = 0; i < listsize(pairs); i++)
+  { uint16_t pair = _loc_r16(pairs[i]);
+    uint16_t value = _pair_value(&s->value, pairs[i]);
+    uint16_t real = s->real[pairs[i]];
+    bool real_known = s->real_known & 1 << pairs[i];
+    if (pair & locs && real_known && (uint16_t)(real + 1) == value)
+      _emit(r, (struct instruction){ OP_INC_R16, pairs[i] });
+    else if (pair & locs && real_known && (uint16_t)(real - 1) == value)
+      _emit(r, (struct instruction){ OP_DEC_R16, pairs[i] });
+    else if (pair == (locs & pair))
+      _emit(r, (struct instruction){ OP_LD_R16_N16, pairs[i], value });
+    else continue;
+    s->real_known &= ~(1 << pairs[i]);
+    s->synced |= pair;
+    locs &= ~pair;
+  }
+
+  for (enum r8 i = R8_A; i <= R8_L; i++)
+  if (_loc_r8(i) & locs)
+  { uint8_t value;
+    switch (i)
+    { case R8_A: value = s->value.a; break;
+      case R8_B: value = s->value.b; break;
+      case R8_C: value = s->value.c; break;
+      case R8_D: value = s->value.d; break;
+      case R8_E: value = s->value.e; break;
+      case R8_H: value = s->value.h; break;
+      case R8_L: value = s->value.l; break;
+      default: panic;
+    }
+    _emit(r, (struct instruction){ OP_LD_R8_N8, i, value });
+    s->synced |= _loc_r8(i);
+  }
+
+  if (LOC_SP & locs)
+  { _emit(r, (struct instruction){ OP_LD_SP_N16, s->value.sp });
+    s->synced |= LOC_SP;
+  }
+}
+
+
+// Whether the first length bytes of two memories match, but for the 256
+// bytes below sp: what a run leaves beneath the stack is dead, and the
+// return addresses pushed by the same calls differ once code is moved.
+static bool _same_memory(uint8_t *a, uint8_t *b, uint16_t sp, uint32_t length)
+{ uint32_t low = sp < 0x100 ? 0 : sp - 0x100;
+  return
+    !memcmp(a, b, low < length ? low : length)
+  && (sp >= length || !memcmp(a + sp, b + sp, length - sp))
+  ;
+}
+
+// instructions dispatched running a program from the current state (which is
+// put back), or UINT64_MAX if it panics or runs for 1 << 20 cycles, leaving
+// the registers and memory it ends with in out and out_mem
+static uint64_t _dispatches
+( struct program *program
+, struct registers *out, uint8_t *out_mem
+)
+{ struct snapshot *s = malloc(sizeof(struct snapshot));
+  save_snapshot(s);
+  jmp_buf *outer = panic_jump;
+  jmp_buf jump;
+  volatile uint64_t n = UINT64_MAX;
+  if (!setjmp(jump))
+  { panic_jump = &jump;
+    cycle_limit = 1 << 20;
+    n = run_program_counting(program);
+  }
+  panic_jump = outer;
+  cycle_limit = UINT32_MAX;
+  *out = reg;
+  memcpy(out_mem, mem, 1 << 16);
+  restore_snapshot(s);
+  free(s);
+  return n;
+}
+
+// Whether two runs ended alike, but for the I/O registers, which move with
+// the cycles taken (and are cleared in the copies of memory for it).
+static bool _same_ending
+( struct registers *a, uint8_t *a_mem
+, struct registers *b, uint8_t *b_mem
+)
+{ if (a->af != b->af || a->bc != b->bc || a->de != b->de || a->hl != b->hl)
+    return false;
+  memset(a_mem + 0xff00, 0, 0x80);
+  memset(b_mem + 0xff00, 0, 0x80);
+  return a->sp == b->sp && _same_memory(a_mem, b_mem, a->sp, 1 << 16);
+}
+
+// Specialize a program for the values currently in the known registers (a
+// mask of enum loc) and in the given memory ranges.  Everything computable
+// from those values is evaluated now, branches on known flags are followed
+// (unrolling counted loops), and what remains is emitted as residual code,
+// with loop idioms fused again.  The result leaves the same registers and
+// memory as the original for any values of the remaining inputs, but not the
+// same cycle count.  Where it would not dispatch fewer instructions than the
+// original from the current state, or does not end there with the same
+// registers, flags and memory, a copy of the original is returned.
+struct program *specialize_program
+( struct program *program, uint16_t known
+, struct mem_range *ranges, size_t n_ranges
+)
+{ const size_t max_steps = 1 << 16;
+  const size_t max_length = 1 << 12;
+
+  _find_flag_setters();
+
+  struct registers r0 = reg;
+  uint32_t c0 = cycles;
+
+  struct abstract s =
+    { .value = reg
+    , .known = known & LOC_ALL & ~LOC_F
+    , .synced = LOC_ALL
+    , .f_known = LOC_F & known ? 0x0f & reg.f ? 0xf0 : 0xff : 0
+    , .mem_known = calloc(1 << 13, 1)
+    , .mem_value = malloc(1 << 16)
+    };
+  memcpy(s.mem_value, mem, 1 << 16);
+  for (int i = 0; i < n_ranges; i++)
+  for (int j = 0; j < ranges[i].length; j++)
+    _mem_set_known(&s, ranges[i].addr + j, true);
+
+  struct residual r = { malloc(sizeof(struct program) + 64 * sizeof(struct instruction)), 64 };
+  r.program->length = 0;
+
+  size_t pc = 0;
+  for (size_t steps = 0; program->length > pc; steps++)
+  { struct instruction x = unfuse(program->instructions[pc]);
+    struct access a = instruction_access(x);
+
+    if (max_steps == steps || max_length <= r.program->length) break;
+
+    if (OP_JR_E8 == x.op)
+    { pc = _jr_target(x, pc);
+      continue;
+    }
+    if (OP_JR_CC_E8 == x.op && a.f_reads == (a.f_reads & s.f_known))
+    { bool flag = _test_condition(x.p1, s.value.f);
+      pc = flag ? _jr_target(x, pc) : pc + 1;
+      continue;
+    }
+    if (a.branch) break;
+    if (OP_DI == x.op || OP_EI == x.op || OP_HALT == x.op || OP_STOP == x.op) break;
+
+    uint16_t addr_locs = _addr_locs(a.addr);
+    bool addr_known = addr_locs == (addr_locs & s.known);
+    bool inputs_known =
+      (a.reads & ~LOC_F) == (a.reads & ~LOC_F & s.known)
+    && a.f_reads == (a.f_reads & s.f_known)
+    ;
+
+    // evaluate on the real simulator state, with known memory swapped in
+    struct registers out = s.value;
+    uint8_t mem_out[2];
+    uint16_t addr = 0;
+    if (addr_known)
+    { reg = s.value;
+      if (a.addr) addr = access_address(x, a);
+      int n = a.mem_reads > a.mem_writes ? a.mem_reads : a.mem_writes;
+      uint8_t saved[2];
+      for (int i = 0; i < n; i++)
+      { uint16_t ai = addr + i;
+        saved[i] = mem[ai];
+        if (a.mem_reads && !_mem_is_known(&s, ai)) inputs_known = false;
+        mem[ai] = s.mem_value[ai];
+      }
+      execute(&x, 0);
+      out = reg;
+      for (int i = 0; i < n; i++)
+      { uint16_t ai = addr + i;
+        mem_out[i] = mem[ai];
+        mem[ai] = saved[i];
+      }
+    }
+    else inputs_known = false;
+
+    uint8_t f_known = s.f_known;
+    if (inputs_known) f_known |= a.f_writes;
+    else f_known &= ~a.f_writes;
+
+    bool fold =
+      inputs_known
+    && !a.mem_writes
+    && (!a.f_writes || 0xff == f_known && !(0x0f & out.f))
+    && ( !a.f_writes || 0xff != f_known || LOC_A & (s.known | a.writes)
+       || !flag_setters[out.f >> 4].clobbers_a
+       )
+    ;
+
+    if (!fold)
+    { // run the instruction for real, with its inputs in registers
+      uint16_t needed = a.reads & ~LOC_F;
+      if
+      (  LOC_F & s.known & ~s.synced
+      && ( a.f_reads
+         || a.f_writes && 0xff != a.f_writes
+         || LOC_A & a.writes && flag_setters[s.value.f >> 4].clobbers_a
+         )
+      ) needed |= LOC_F;
+      _materialize(&r, &s, needed);
+      _emit(&r, x);
+      s.synced |= a.writes;
+      for (enum r16 i = R16_BC; i <= R16_HL; i++)
+        if (_loc_r16(i) & a.writes) s.real_known &= ~(1 << i);
+    }
+    else
+      for (enum r16 i = R16_BC; i <= R16_HL; i++)
+      { uint16_t pair = _loc_r16(i);
+        if (pair & a.writes && pair == (pair & s.known & s.synced))
+        { s.real[i] = _pair_value(&s.value, i);
+          s.real_known |= 1 << i;
+        }
+      }
+
+    // update what is known
+    uint16_t writes = a.writes & ~LOC_F;
+    if (inputs_known) s.known |= writes;
+    else
+    { s.known &= ~writes;
+      // pointer updates only depend on the pointer
+      switch (x.op)
+      { case OP_LD_IHLI_A:
+        case OP_LD_IHLD_A:
+        case OP_LD_A_IHLI:
+        case OP_LD_A_IHLD:
+          if (addr_known) s.known |= LOC_HL;
+          break;
+        case OP_PUSH_AF:
+        case OP_PUSH_R16:
+        case OP_POP_AF:
+        case OP_POP_R16:
+          if (addr_known) s.known |= LOC_SP;
+          break;
+        default:
+          break;
+      }
+    }
+    if (fold) s.synced &= ~writes;
+    s.value = out;
+    s.f_known = f_known;
+    if (0xff == f_known) s.known |= LOC_F;
+    else s.known &= ~LOC_F;
+    if (a.f_writes && fold) s.synced &= ~LOC_F;
+
+    if (a.mem_writes)
+    { if (addr_known)
+        for (int i = 0; i < a.mem_writes; i++)
+        { _mem_set_known(&s, addr + i, inputs_known);
+          s.mem_value[(uint16_t)(addr + i)] = mem_out[i];
+        }
+      else
+        memset(s.mem_known, 0, 1 << 13);
+    }
+
+    pc++;
+  }
+
+  _materialize(&r, &s, LOC_ALL);
+
+  if (program->length > pc)
+  { // continue in an unspecialized copy of the program, moving the targets
+    // of calls and jumps along with it
+    _emit(&r, (struct instruction){ OP_JR_E8, pc });
+    size_t base = r.program->length;
+    for (size_t i = 0; i < program->length; i++)
+    { struct instruction x = unfuse(program->instructions[i]);
+      switch (x.op)
+      { case OP_CALL_N16: case OP_JP_N16: x.p1 += base; break;
+        case OP_CALL_CC_N16: case OP_JP_CC_N16: x.p2 += base; break;
+        default: break;
+      }
+      _emit(&r, x);
+    }
+  }
+
+  free(s.mem_known);
+  free(s.mem_value);
+  reg = r0;
+  cycles = c0;
+
+  // Unrolling a loop which was fused into a bulk operation can leave more
+  // to dispatch than before, so keep the original unless this is quicker,
+  // and unless it ends the same way.
+  fuse_idioms(r.program);
+  struct registers end, specialized_end;
+  uint8_t *end_mem = malloc(1 << 16), *specialized_end_mem = malloc(1 << 16);
+  uint64_t n = _dispatches(program, &end, end_mem);
+  uint64_t specialized_n =
+    _dispatches(r.program, &specialized_end, specialized_end_mem);
+  bool same =
+    _same_ending(&end, end_mem, &specialized_end, specialized_end_mem);
+  free(end_mem);
+  free(specialized_end_mem);
+  if (specialized_n >= n || !same)
+  { size_t size = sizeof(struct program) + program->length * sizeof(struct instruction);
+    r.program = realloc(r.program, size);
+    memcpy(r.program, program, size);
+  }
+  return r.program;
+}
+
+
+// bitsliced evaluation
+
+
+// Programs without branches or memory access can be run over 256 inputs at
+// once, holding each bit of each register as a vector of that bit in every
+// input (a lane per input), and each instruction as boolean logic over those.
+// Cycles are the same in every lane.
+
+typedef uint64_t slice __attribute__((vector_size(32)));
+
+#define SLICE_LANES 256
+#define SLICED_F 7   // after the enum r8 registers
+
+struct sliced
+{ slice r[8][8];     // by register, then bit
+  uint32_t cycles;
+};
+
+// lane j of _lane_bits[i] is bit i of j
+static const slice _lane_bits[8] =
+{ { 0xaaaaaaaaaaaaaaaa, 0xaaaaaaaaaaaaaaaa, 0xaaaaaaaaaaaaaaaa, 0xaaaaaaaaaaaaaaaa }
+, { 0xcccccccccccccccc, 0xcccccccccccccccc, 0xcccccccccccccccc, 0xcccccccccccccccc }
+, { 0xf0f0f0f0f0f0f0f0, 0xf0f0f0f0f0f0f0f0, 0xf0f0f0f0f0f0f0f0, 0xf0f0f0f0f0f0f0f0 }
+, { 0xff00ff00ff00ff00, 0xff00ff00ff00ff00, 0xff00ff00ff00ff00, 0xff00ff00ff00ff00 }
+, { 0xffff0000ffff0000, 0xffff0000ffff0000, 0xffff0000ffff0000, 0xffff0000ffff0000 }
+, { 0xffffffff00000000, 0xffffffff00000000, 0xffffffff00000000, 0xffffffff00000000 }
+, { 0, ~0ull, 0, ~0ull }
+, { 0, 0, ~0ull, ~0ull }
+};
+
+static const slice _slice_zero = { 0, 0, 0, 0 };
+static const slice _slice_ones = { ~0ull, ~0ull, ~0ull, ~0ull };
+
+#define _slice_of(b) ((b) ? _slice_ones : _slice_zero)
+#define _slice_lane(s, lane) (1 & (s)[(lane) / 64] >> (lane) % 64)
+
+
+// whether run_sliced runs an op
+static inline bool sliceable_op(enum op op)
+{ switch (flagged_op(op))
+  { case OP_ADC_A_R8: case OP_ADC_A_N8: case OP_ADD_A_R8: case OP_ADD_A_N8:
+    case OP_AND_A_R8: case OP_AND_A_N8: case OP_CP_A_R8: case OP_CP_A_N8:
+    case OP_DEC_R8: case OP_INC_R8: case OP_OR_A_R8: case OP_OR_A_N8:
+    case OP_SBC_A_R8: case OP_SBC_A_N8: case OP_SUB_A_R8: case OP_SUB_A_N8:
+    case OP_XOR_A_R8: case OP_XOR_A_N8:
+    case OP_ADD_HL_R16: case OP_DEC_R16: case OP_INC_R16:
+    case OP_BIT_U3_R8: case OP_RES_U3_R8: case OP_SET_U3_R8: case OP_SWAP_R8:
+    case OP_RL_R8: case OP_RLA: case OP_RLC_R8: case OP_RLCA:
+    case OP_RR_R8: case OP_RRA: case OP_RRC_R8: case OP_RRCA:
+    case OP_SLA_R8: case OP_SRA_R8: case OP_SRL_R8:
+    case OP_LD_R8_R8: case OP_LD_R8_N8: case OP_LD_R16_N16:
+    case OP_CCF: case OP_CPL: case OP_DAA: case OP_NOP: case OP_SCF:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// whether every instruction of a program can be run by run_sliced
+bool sliceable(struct program *program)
+{ for (int i = 0; i < program->length; i++)
+    if (!sliceable_op(program->instructions[i].op)) return false;
+  return true;
+}
+
+
+// Put the registers into every lane, except for the free ones (F by its high
+// nibble), which count up from first (a multiple of 256) across the lanes, in
+// the order compare_programs uses.
+void set_sliced(struct sliced *s, uint16_t free_locs, uint32_t first)
+{ static const enum r8 order[] = { R8_A, R8_B, R8_C, R8_D, R8_E, R8_H, R8_L, SLICED_F };
+  uint8_t values[8] = { reg.a, reg.b, reg.c, reg.d, reg.e, reg.h, reg.l, reg.f };
+  int bit = 0;
+  for (int i = 0; i < listsize(order); i++)
+  { int r = order[i];
+    bool free = 1 << r & free_locs;   // as in enum loc
+    for (int k = 0; k < 8; k++)
+      if (!free || SLICED_F == r && 4 > k)
+        s->r[r][k] = _slice_of(1 << k & values[i]);
+      else
+      { s->r[r][k] = 8 > bit ? _lane_bits[bit] : _slice_of(1 & first >> bit);
+        bit++;
+      }
+  }
+  s->cycles = 0;
+}
+
+// the registers in a lane
+void get_sliced(struct sliced *s, int lane, struct registers *out)
+{ uint8_t values[8] = { 0 };
+  for (int r = 0; r < 8; r++)
+    for (int k = 0; k < 8; k++)
+      values[r] |= _slice_lane(s->r[r][k], lane) << k;
+  *out = reg;
+  out->a = values[R8_A];
+  out->b = values[R8_B];
+  out->c = values[R8_C];
+  out->d = values[R8_D];
+  out->e = values[R8_E];
+  out->h = values[R8_H];
+  out->l = values[R8_L];
+  out->f = values[SLICED_F];
+}
+
+
+// Slices are passed by pointer, or through macros, as passing them by value
+// has gcc warn about the ABI without AVX.
+
+// z = whether v is zero, over bits
+static inline void _slice_zero_test(slice *z, slice *v, int bits)
+{ slice any = v[0];
+  for (int k = 1; k < bits; k++) any |= v[k];
+  *z = ~any;
+}
+
+// dst = x + y + carry (or x - y - carry), over bits, leaving the carry (or
+// borrow) out in carry and the one into bit half_at in half
+static inline void _slice_add
+( slice *dst, slice *x, slice *y, slice *carry, bool subtract
+, int bits, int half_at, slice *half
+)
+{ slice c = *carry;
+  for (int k = 0; k < bits; k++)
+  { if (half_at == k) *half = c;
+    slice p = x[k] ^ y[k];
+    slice sum = p ^ c;
+    c = subtract ? ~x[k] & y[k] | ~p & c : x[k] & y[k] | p & c;
+    dst[k] = sum;
+  }
+  *carry = c;
+}
+
+#define _slice_flags(s, z, n, h, c) \
+  do \
+  { slice _z = (z), _n = (n), _h = (h), _c = (c); \
+    slice *_f = (s)->r[SLICED_F]; \
+    _f[7] = _z; \
+    _f[6] = _n; \
+    _f[5] = _h; \
+    _f[4] = _c; \
+    _f[3] = _f[2] = _f[1] = _f[0] = _slice_zero; \
+  } while (0)
+
+static inline void _slice_constant(slice *v, uint8_t val)
+{ for (int k = 0; k < 8; k++) v[k] = _slice_of(1 << k & val); }
+
+static inline void _slice_alu(struct sliced *s, enum op op, slice *y)
+{ slice *a = s->r[R8_A];
+  slice *f = s->r[SLICED_F];
+  slice r[8], z, h = _slice_zero, c;
+  switch (op)
+  { case OP_ADD_A_R8:
+    case OP_ADC_A_R8:
+      c = OP_ADC_A_R8 == op ? f[4] : _slice_zero;
+      _slice_add(r, a, y, &c, false, 8, 4, &h);
+      memcpy(a, r, sizeof(r));
+      _slice_zero_test(&z, a, 8);
+      _slice_flags(s, z, _slice_zero, h, c);
+      return;
+    case OP_SUB_A_R8:
+    case OP_SBC_A_R8:
+    case OP_CP_A_R8:
+      c = OP_SBC_A_R8 == op ? f[4] : _slice_zero;
+      _slice_add(r, a, y, &c, true, 8, 4, &h);
+      if (OP_CP_A_R8 != op) memcpy(a, r, sizeof(r));
+      _slice_zero_test(&z, r, 8);
+      _slice_flags(s, z, _slice_ones, h, c);
+      return;
+    case OP_AND_A_R8:
+      for (int k = 0; k < 8; k++) a[k] &= y[k];
+      _slice_zero_test(&z, a, 8);
+      _slice_flags(s, z, _slice_zero, _slice_ones, _slice_zero);
+      return;
+    case OP_OR_A_R8:
+      for (int k = 0; k < 8; k++) a[k] |= y[k];
+      _slice_zero_test(&z, a, 8);
+      _slice_flags(s, z, _slice_zero, _slice_zero, _slice_zero);
+      return;
+    case OP_XOR_A_R8:
+      for (int k = 0; k < 8; k++) a[k] ^= y[k];
+      _slice_zero_test(&z, a, 8);
+      _slice_flags(s, z, _slice_zero, _slice_zero, _slice_zero);
+      return;
+    default: panic;
+  }
+}
+
+// shifts and rotates through a register, as enum shift
+static inline void _slice_shift(struct sliced *s, enum op op, slice *v, bool set_z)
+{ slice *f = s->r[SLICED_F];
+  slice c, in, z = _slice_zero;
+  switch (op)
+  { case OP_RL_R8: c = v[7]; in = f[4]; goto left;
+    case OP_RLC_R8: c = v[7]; in = v[7]; goto left;
+    case OP_SLA_R8: c = v[7]; in = _slice_zero; goto left;
+    left:
+      for (int k = 7; 0 < k; k--) v[k] = v[k-1];
+      v[0] = in;
+      break;
+    case OP_RR_R8: c = v[0]; in = f[4]; goto right;
+    case OP_RRC_R8: c = v[0]; in = v[0]; goto right;
+    case OP_SRA_R8: c = v[0]; in = v[7]; goto right;
+    case OP_SRL_R8: c = v[0]; in = _slice_zero; goto right;
+    right:
+      for (int k = 0; 7 > k; k++) v[k] = v[k+1];
+      v[7] = in;
+      break;
+    default: panic;
+  }
+  if (set_z) _slice_zero_test(&z, v, 8);
+  _slice_flags(s, z, _slice_zero, _slice_zero, c);
+}
+
+static inline void _slice_daa(struct sliced *s)
+{ slice *a = s->r[R8_A];
+  slice *f = s->r[SLICED_F];
+  slice n = f[6], h = f[5], c = f[4];
+  slice low_over = a[3] & (a[2] | a[1]);
+  slice high_over = a[7] & (a[6] | a[5]);
+  slice high_nine = a[7] & ~a[6] & ~a[5] & a[4];
+  slice over = high_over | high_nine & low_over;
+
+  // adding: carry, or more than $99; subtracting: carry alone
+  slice adj60 = c | ~n & over;
+  slice adj06 = h | ~n & low_over;
+  slice adj[8] =
+  { _slice_zero, adj06, adj06, _slice_zero
+  , _slice_zero, adj60, adj60, _slice_zero
+  };
+  slice sum[8], diff[8], carry = _slice_zero, borrow = _slice_zero, unused, z;
+  _slice_add(sum, a, adj, &carry, false, 8, 8, &unused);
+  _slice_add(diff, a, adj, &borrow, true, 8, 8, &unused);
+  for (int k = 0; k < 8; k++) a[k] = n & diff[k] | ~n & sum[k];
+  _slice_zero_test(&z, a, 8);
+  _slice_flags(s, z, n, _slice_zero, adj60);
+}
+
+static const enum r8 _r16_high[] = { R8_B, R8_D, R8_H };
+static const enum r8 _r16_low[] = { R8_C, R8_E, R8_L };
+
+static inline void _slice_r16(struct sliced *s, enum r16 r, slice *v)
+{ memcpy(v, s->r[_r16_low[r]], sizeof(slice[8]));
+  memcpy(v + 8, s->r[_r16_high[r]], sizeof(slice[8]));
+}
+
+static inline void _slice_set_r16(struct sliced *s, enum r16 r, slice *v)
+{ memcpy(s->r[_r16_low[r]], v, sizeof(slice[8]));
+  memcpy(s->r[_r16_high[r]], v + 8, sizeof(slice[8]));
+}
+
+static inline void _slice_instruction(struct sliced *s, struct instruction x)
+{ slice *f = s->r[SLICED_F];
+  slice y[8], r[8], z, h, c;
+  switch (x.op)
+  { case OP_ADC_A_R8: case OP_ADD_A_R8: case OP_AND_A_R8: case OP_CP_A_R8:
+    case OP_OR_A_R8: case OP_SBC_A_R8: case OP_SUB_A_R8: case OP_XOR_A_R8:
+      memcpy(y, s->r[x.p1], sizeof(y));
+      _slice_alu(s, x.op, y);
+      s->cycles += 1;
+      return;
+    case OP_ADC_A_N8: case OP_ADD_A_N8: case OP_AND_A_N8: case OP_CP_A_N8:
+    case OP_OR_A_N8: case OP_SBC_A_N8: case OP_SUB_A_N8: case OP_XOR_A_N8:
+      _slice_constant(y, x.p1);
+      // the n8 ops follow their r8 ops, after the ihl ones
+      _slice_alu(s, x.op - 2, y);
+      s->cycles += 2;
+      return;
+    case OP_DEC_R8:
+    case OP_INC_R8:
+    { slice carry = _slice_ones;
+      _slice_constant(y, 0);
+      _slice_add(r, s->r[x.p1], y, &carry, OP_DEC_R8 == x.op, 8, 4, &h);
+      memcpy(s->r[x.p1], r, sizeof(r));
+      _slice_zero_test(&z, r, 8);
+      _slice_flags(s, z, _slice_of(OP_DEC_R8 == x.op), h, f[4]);
+      s->cycles += 1;
+      return;
+    }
+
+    case OP_ADD_HL_R16:
+    { slice hl[16], v[16], sum[16];
+      _slice_r16(s, R16_HL, hl);
+      _slice_r16(s, x.p1, v);
+      c = _slice_zero;
+      _slice_add(sum, hl, v, &c, false, 16, 12, &h);
+      _slice_set_r16(s, R16_HL, sum);
+      _slice_flags(s, f[7], _slice_zero, h, c);
+      s->cycles += 2;
+      return;
     }
-    case ARGS_A_IHL:
-    case ARGS_A_IC:
-    case ARGS_A_IHLI:
-    case ARGS_A_IHLD:
-    { a_arg(arg_tokens[0]);
-      return (struct instruction){ op, 0, 0 };
+    case OP_DEC_R16:
+    case OP_INC_R16:
+    { slice v[16], zero[16], sum[16];
+      for (int k = 0; k < 16; k++) zero[k] = _slice_zero;
+      _slice_r16(s, x.p1, v);
+      c = _slice_ones;
+      _slice_add(sum, v, zero, &c, OP_DEC_R16 == x.op, 16, 16, &h);
+      _slice_set_r16(s, x.p1, sum);
+      s->cycles += 2;
+      return;
     }
-    case ARGS_A_N8:
-    { a_arg(arg_tokens[0]);
-      n8_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[1].value, 0 };
+
+    case OP_BIT_U3_R8:
+      _slice_flags(s, ~s->r[x.p2][7 & x.p1], _slice_zero, _slice_ones, f[4]);
+      s->cycles += 2;
+      return;
+    case OP_RES_U3_R8:
+    case OP_SET_U3_R8:
+      s->r[x.p2][7 & x.p1] = _slice_of(OP_SET_U3_R8 == x.op);
+      s->cycles += 2;
+      return;
+    case OP_SWAP_R8:
+    { slice *v = s->r[x.p1];
+      memcpy(r, v + 4, sizeof(slice[4]));
+      memcpy(r + 4, v, sizeof(slice[4]));
+      memcpy(v, r, sizeof(r));
+      _slice_zero_test(&z, v, 8);
+      _slice_flags(s, z, _slice_zero, _slice_zero, _slice_zero);
+      s->cycles += 2;
+      return;
     }
-    case ARGS_HL_R16:
-    { hl_arg(arg_tokens[0]);
-      return (struct instruction){ op, arg_tokens[1].value, 0 };
+
+    case OP_RL_R8: case OP_RLC_R8: case OP_RR_R8: case OP_RRC_R8:
+    case OP_SLA_R8: case OP_SRA_R8: case OP_SRL_R8:
+      _slice_shift(s, x.op, s->r[x.p1], true);
+      s->cycles += 2;
+      return;
+    case OP_RLA: _slice_shift(s, OP_RL_R8, s->r[R8_A], false); s->cycles += 1; return;
+    case OP_RLCA: _slice_shift(s, OP_RLC_R8, s->r[R8_A], false); s->cycles += 1; return;
+    case OP_RRA: _slice_shift(s, OP_RR_R8, s->r[R8_A], false); s->cycles += 1; return;
+    case OP_RRCA: _slice_shift(s, OP_RRC_R8, s->r[R8_A], false); s->cycles += 1; return;
+
+    case OP_LD_R8_R8:
+      memcpy(s->r[x.p1], s->r[x.p2], sizeof(slice[8]));
+      s->cycles += 1;
+      return;
+    case OP_LD_R8_N8:
+      _slice_constant(s->r[x.p1], x.p2);
+      s->cycles += 2;
+      return;
+    case OP_LD_R16_N16:
+      _slice_constant(s->r[_r16_low[x.p1]], x.p2);
+      _slice_constant(s->r[_r16_high[x.p1]], x.p2 >> 8);
+      s->cycles += 3;
+      return;
+
+    case OP_CCF:
+      _slice_flags(s, f[7], _slice_zero, _slice_zero, ~f[4]);
+      s->cycles += 1;
+      return;
+    case OP_CPL:
+      for (int k = 0; k < 8; k++) s->r[R8_A][k] = ~s->r[R8_A][k];
+      f[6] = f[5] = _slice_ones;
+      s->cycles += 1;
+      return;
+    case OP_DAA:
+      _slice_daa(s);
+      s->cycles += 1;
+      return;
+    case OP_NOP:
+      s->cycles += 1;
+      return;
+    case OP_SCF:
+      _slice_flags(s, f[7], _slice_zero, _slice_zero, _slice_ones);
+      s->cycles += 1;
+      return;
+
+    default:
+      // the flag-dead variants run as the op they stand in for, but keep F
+      if (flagged_op(x.op) == x.op) panic;
+      memcpy(r, f, sizeof(r));
+      x.op = flagged_op(x.op);
+      _slice_instruction(s, x);
+      memcpy(f, r, sizeof(r));
+      return;
+  }
+}
+
+// Run a sliceable program over every lane.
+void run_sliced(struct program *program, struct sliced *s)
+{ for (int i = 0; i < program->length; i++)
+    _slice_instruction(s, program->instructions[i]);
+}
+
+
+static size_t _compare_sliced
+( struct program *a, struct program *b
+, uint16_t free_locs, bool compare_cycles, uint8_t flags, int bits
+)
+{ struct sliced *in = malloc(sizeof(struct sliced));
+  struct sliced *out = malloc(sizeof(struct sliced));
+  size_t mismatches = 0;
+  uint32_t n = 1 << bits;
+  for (uint32_t first = 0; first < n; first += SLICE_LANES)
+  { set_sliced(in, free_locs, first);
+    *out = *in;
+    run_sliced(a, out);
+    struct sliced *out_a = out;
+    out = malloc(sizeof(struct sliced));
+    *out = *in;
+    run_sliced(b, out);
+
+    slice differ = _slice_of(compare_cycles && out_a->cycles != out->cycles);
+    for (int r = 0; r < 8; r++)
+      for (int k = 0; k < 8; k++)
+        if (SLICED_F != r || 1 << k & flags)
+          differ |= out_a->r[r][k] ^ out->r[r][k];
+    free(out_a);
+
+    for (int lane = 0; lane < SLICE_LANES && lane < n; lane++)
+    { if (!_slice_lane(differ, lane)) continue;
+      if (!mismatches)
+      { printf("programs differ, inputs:\n");
+        struct registers r0 = reg;
+        get_sliced(in, lane, &reg);
+        status();
+        reg = r0;
+      }
+      mismatches++;
     }
-    case ARGS_U3_R8:
-    { u3_arg(arg_tokens[0]);
-      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+  }
+  free(in);
+  free(out);
+  return mismatches;
+}
+
+static void _set_free_mem(struct mem_range *free_mem, size_t n_free_mem, uint8_t *bytes)
+{ for (size_t i = 0; i < n_free_mem; i++)
+  { memcpy(mem + free_mem[i].addr, bytes, free_mem[i].length);
+    bytes += free_mem[i].length;
+  }
+}
+
+// Run two programs from the current simulator state, over every value of the
+// free registers (F by its high nibble) and bytes of free memory, or over a
+// random sample of 1 << 16 of them when there are more.  Other memory is held
+// at its current contents.  Returns the number of inputs leaving different
+// registers (of F, only the given flags) or memory behind, or a different
+// cycle count when asked to compare those.  Programs which are both
+// sliceable are run 256 inputs at a time, exhaustively up to 24 bits of
+// inputs.
+size_t compare_programs_over
+( struct program *a, struct program *b
+, uint16_t free_locs, struct mem_range *free_mem, size_t n_free_mem
+, bool compare_cycles, uint8_t flags
+)
+{ int bits = 0;
+  for (int i = 0; i < 9; i++)
+    if (1 << i & free_locs)
+      bits += LOC_F == 1 << i ? 4 : LOC_SP == 1 << i ? 16 : 8;
+  for (size_t i = 0; i < n_free_mem; i++) bits += 8 * free_mem[i].length;
+  if
+  (  sliceable(a) && sliceable(b) && !(LOC_SP & free_locs) && !n_free_mem
+  && 24 >= bits
+  )
+    return _compare_sliced(a, b, free_locs, compare_cycles, flags, bits);
+  bool sample = bits > 16;
+
+  struct snapshot *s0 = malloc(sizeof(struct snapshot));
+  struct snapshot *s1 = malloc(sizeof(struct snapshot));
+  save_snapshot(s0);
+  uint8_t *bytes = malloc(bits / 8 + 1);
+
+  size_t mismatches = 0;
+  uint64_t n = sample ? 1 << 16 : (uint64_t)1 << bits;
+  for (uint64_t input = 0; input < n; input++)
+  { struct registers r = s0->reg;
+    uint64_t v = sample ? (uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ rand() : input;
+    if (LOC_A & free_locs) r.a = v, v >>= 8;
+    if (LOC_B & free_locs) r.b = v, v >>= 8;
+    if (LOC_C & free_locs) r.c = v, v >>= 8;
+    if (LOC_D & free_locs) r.d = v, v >>= 8;
+    if (LOC_E & free_locs) r.e = v, v >>= 8;
+    if (LOC_H & free_locs) r.h = v, v >>= 8;
+    if (LOC_L & free_locs) r.l = v, v >>= 8;
+    if (LOC_F & free_locs) r.f = (v & 0x0f) << 4 | 0x0f & r.f, v >>= 4;
+    if (LOC_SP & free_locs) r.sp = v, v >>= 16;
+
+    size_t n_bytes = 0;
+    for (size_t i = 0; i < n_free_mem; i++)
+      for (int j = 0; j < free_mem[i].length; j++, v >>= 8)
+        bytes[n_bytes++] = sample ? rand() : v;
+
+    restore_snapshot(s0);
+    _set_free_mem(free_mem, n_free_mem, bytes);
+    reg = r;
+    run_program(a);
+    save_snapshot(s1);
+
+    restore_snapshot(s0);
+    _set_free_mem(free_mem, n_free_mem, bytes);
+    reg = r;
+    run_program(b);
+
+    reg.pc = s1->reg.pc;
+    reg.f = reg.f & flags | s1->reg.f & ~flags;
+    if
+    (  memcmp(&reg, &s1->reg, sizeof(reg))
+    || !_same_memory(mem, s1->mem, reg.sp, sizeof(mem))
+    || compare_cycles && cycles != s1->cycles
+    )
+    { if (!mismatches)
+      { printf("programs differ, inputs:\n");
+        reg = r;
+        status();
+        for (size_t i = 0, at = 0; i < n_free_mem; i++)
+        { printf("%04x:", free_mem[i].addr);
+          for (int j = 0; j < free_mem[i].length; j++) printf(" %02x", bytes[at++]);
+          printf("\n");
+        }
+      }
+      mismatches++;
     }
-    case ARGS_U3_IHL:
-    { u3_arg(arg_tokens[0]);
-      return (struct instruction){ op, arg_tokens[0].value, 0 };
+  }
+
+  restore_snapshot(s0);
+  free(s0);
+  free(s1);
+  free(bytes);
+  return mismatches;
+}
+
+size_t compare_programs
+( struct program *a, struct program *b
+, uint16_t free_locs, bool compare_cycles
+)
+{ return compare_programs_over(a, b, free_locs, NULL, 0, compare_cycles, 0xff); }
+
+
+// Compare a specialized program against the original, over the free
+// registers which the program reads and the given free memory (which should
+// be whatever it reads outside of the known ranges).  Other memory is held
+// at its current contents.  Returns the number of mismatching inputs.
+size_t check_specialization
+( struct program *program, struct program *specialized
+, uint16_t known, struct mem_range *free_mem, size_t n_free_mem
+)
+{ return compare_programs_over
+  ( program, specialized
+  , live_inputs(program) & ~known & LOC_ALL, free_mem, n_free_mem, false, 0xff
+  );
+}
+
+
+// flag liveness
+
+
+// F bits which may be observed after each instruction, by a later read or at
+// the end of the program, indexed by instruction
+uint8_t *live_flags(struct program *program)
+{ size_t n = program->length;
+  uint8_t *live_in = calloc(n + 1, 1);
+  uint8_t *live_out = calloc(n + 1, 1);
+  live_in[n] = 0xff;
+  bool changed = true;
+  while (changed)
+  { changed = false;
+    for (int i = n - 1; 0 <= i; i--)
+    { struct instruction x = program->instructions[i];
+      struct access a = instruction_access(x);
+      uint8_t out = 0;
+      if (OP_JR_E8 != x.op) out |= live_in[i+1];
+      if (OP_JR_E8 == x.op || OP_JR_CC_E8 == x.op)
+      { int t = _jr_target(x, i);
+        out |= 0 <= t && n >= t ? live_in[t] : 0xff;
+      }
+      else if (a.branch) out = 0xff;
+      uint8_t in = a.f_reads | out & ~a.f_writes;
+      live_out[i] = out;
+      if (in != live_in[i]) { live_in[i] = in; changed = true; }
     }
-    case ARGS_R8_R8:
-      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
-    case ARGS_R8_N8:
-    { n8_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+  }
+  free(live_in);
+  return live_out;
+}
+
+
+// Copy a program, substituting variants which skip computing flags wherever
+// none of the flags written are live.
+struct program *optimize_flags(struct program *program)
+{ size_t size = sizeof(struct program) + program->length * sizeof(struct instruction);
+  struct program *optimized = malloc(size);
+  memcpy(optimized, program, size);
+
+  uint8_t *live = live_flags(program);
+  for (int i = 0; i < program->length; i++)
+  { struct instruction *x = &optimized->instructions[i];
+    if (!(instruction_access(*x).f_writes & live[i]))
+      x->op = flagless_op(x->op);
+  }
+  free(live);
+  return optimized;
+}
+
+
+// Compare a flag-optimized program against the original, including cycles.
+size_t check_flags(struct program *program, struct program *optimized)
+{ return compare_programs(program, optimized, live_inputs(program), true); }
+
+
+// fuzzing
+
+
+// fuzz runs a program over inputs mutated from a corpus of those which
+// reached new edges (a conditional branch at an instruction, taken or not),
+// in a forked worker per core sharing the corpus and coverage through shared
+// memory.  Panics, runs over the cycle budget, writes outside the declared
+// memory, and results the oracle rejects are crashes; the first of each kind
+// at each instruction is minimized and written to crash_dir.
+
+enum fuzz_crash
+{ FUZZ_OK
+, FUZZ_PANIC
+, FUZZ_BUDGET
+, FUZZ_WRITE
+, FUZZ_ORACLE
+, N_FUZZ_CRASHES
+};
+
+const char *fuzz_crash_names[] = { "ok", "panic", "budget", "write", "oracle" };
+
+struct fuzz
+{ struct program *program;
+  uint16_t inputs;                // registers to fuzz (enum loc)
+  struct mem_range *input_mem;    // memory to fuzz
+  size_t n_input_mem;
+  struct mem_range *writable;     // memory which may also be written
+  size_t n_writable;
+  uint32_t max_cycles;            // per run, 0 for 1 << 20
+  // Given the inputs (input_mem concatenated) with the results in reg and
+  // mem, whether the results are right.
+  bool (*oracle)(struct registers *in, uint8_t *in_mem);
+  uint64_t runs;                  // in all
+  int workers;                    // 0 for one per core
+  char *crash_dir;
+};
+
+#define FUZZ_MAX_CORPUS 4096
+
+// shared by the workers
+struct _fuzz_shared
+{ uint64_t runs;
+  uint32_t crashes;
+  uint32_t n_corpus;
+  bool lock;
+};
+
+static struct fuzz *_fuzz;
+static struct _fuzz_shared *_fuzz_shared;
+static uint8_t *_fuzz_coverage;   // shared, 2 per instruction
+static uint8_t *_fuzz_seen;       // shared, per crash kind and instruction
+static uint8_t *_fuzz_corpus;     // shared
+static uint8_t *_fuzz_edges;      // of this run
+static bool *_fuzz_branches;      // whether each instruction is conditional
+static size_t _fuzz_input_size;
+static int *_fuzz_mutable;        // offsets of the input bytes to mutate
+static int _fuzz_n_mutable;
+static struct snapshot *_fuzz_base;
+static uint64_t _fuzz_rng;
+static uint16_t _fuzz_isn;
+static int _fuzz_fault_isn;       // of the first stray write, or -1
+static uint8_t *_fuzz_write_pages[256];
+static void (*_fuzz_write_handlers[256])(uint16_t addr, uint8_t val);
+
+static uint64_t _fuzz_random()
+{ _fuzz_rng ^= _fuzz_rng << 13;
+  _fuzz_rng ^= _fuzz_rng >> 7;
+  _fuzz_rng ^= _fuzz_rng << 17;
+  return _fuzz_rng;
+}
+
+static bool _fuzz_writable(uint16_t addr)
+{ struct fuzz *f = _fuzz;
+  for (size_t i = 0; i < f->n_input_mem; i++)
+    if (addr - f->input_mem[i].addr < f->input_mem[i].length) return true;
+  for (size_t i = 0; i < f->n_writable; i++)
+    if (addr - f->writable[i].addr < f->writable[i].length) return true;
+  return false;
+}
+
+static void _fuzz_write(uint16_t addr, uint8_t val)
+{ if (!_fuzz_writable(addr))
+  { if (0 > _fuzz_fault_isn) _fuzz_fault_isn = _fuzz_isn;
+    return;
+  }
+  uint8_t *page = _fuzz_write_pages[addr >> 8];
+  if (page) page[0xff & addr] = val;
+  else _fuzz_write_handlers[addr >> 8](addr, val);
+}
+
+// put the registers which are not inputs back, and F's low nibble
+static void _fuzz_normalize(uint8_t *input)
+{ struct registers r;
+  memcpy(&r, input, sizeof(r));
+  struct registers b = _fuzz_base->reg;
+  uint16_t in = _fuzz->inputs;
+  if (!(LOC_A & in)) r.a = b.a;
+  if (!(LOC_B & in)) r.b = b.b;
+  if (!(LOC_C & in)) r.c = b.c;
+  if (!(LOC_D & in)) r.d = b.d;
+  if (!(LOC_E & in)) r.e = b.e;
+  if (!(LOC_H & in)) r.h = b.h;
+  if (!(LOC_L & in)) r.l = b.l;
+  r.f = LOC_F & in ? 0xf0 & r.f | 0x0f & b.f : b.f;
+  if (!(LOC_SP & in)) r.sp = b.sp;
+  r.pc = b.pc;
+  memcpy(input, &r, sizeof(r));
+}
+
+// run an input, returning how it went and where (program->length for the end)
+static enum fuzz_crash _fuzz_run(uint8_t *input, uint16_t *isn)
+{ struct fuzz *f = _fuzz;
+  struct program *program = f->program;
+
+  for (size_t i = 0; i < f->n_writable; i++)
+  { struct mem_range r = f->writable[i];
+    memcpy(mem + r.addr, _fuzz_base->mem + r.addr, r.length);
+  }
+  uint8_t *in_mem = input + sizeof(struct registers);
+  for (size_t i = 0, at = 0; i < f->n_input_mem; i++)
+  { struct mem_range r = f->input_mem[i];
+    memcpy(mem + r.addr, in_mem + at, r.length);
+    at += r.length;
+  }
+  memcpy(&reg, input, sizeof(reg));
+  memset(_fuzz_edges, 0, 2 * program->length);
+  _fuzz_fault_isn = -1;
+  _fuzz_isn = 0;
+
+  jmp_buf jump;
+  if (setjmp(jump))
+  { panic_jump = NULL;
+    *isn = _fuzz_isn;
+    return FUZZ_PANIC;
+  }
+  panic_jump = &jump;
+
+  enum fuzz_crash crash = FUZZ_OK;
+  start_cycles();
+  running_program = program;
+  uint16_t pc = 0;
+  while (program->length > pc)
+  { _fuzz_isn = pc;
+    running_isn = pc;
+    struct instruction *x = &program->instructions[pc++];
+    pc = execute(x, pc);
+    if (cycles >= event_horizon) service_events();
+    if (_fuzz_branches[_fuzz_isn])
+      _fuzz_edges[2 * _fuzz_isn + (_fuzz_isn + 1 != pc)] = 1;
+    if (cycles >= f->max_cycles)
+    { crash = FUZZ_BUDGET;
+      break;
     }
-    case ARGS_R16_N16:
-    case ARGS_CC_N16:
-    { n16_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+  }
+  panic_jump = NULL;
+
+  *isn = FUZZ_BUDGET == crash ? _fuzz_isn : program->length;
+  if (0 <= _fuzz_fault_isn)
+  { *isn = _fuzz_fault_isn;
+    return FUZZ_WRITE;
+  }
+  if (FUZZ_OK == crash && f->oracle)
+  { struct registers in;
+    memcpy(&in, input, sizeof(in));
+    if (!f->oracle(&in, in_mem)) crash = FUZZ_ORACLE;
+  }
+  return crash;
+}
+
+static void _fuzz_mutate(uint8_t *input)
+{ static const uint8_t interesting[] = { 0x00, 0x01, 0x0f, 0x10, 0x7f, 0x80, 0xff };
+  int n = 1 + _fuzz_random() % 4;
+  for (int i = 0; i < n; i++)
+  { uint8_t *b = &input[_fuzz_mutable[_fuzz_random() % _fuzz_n_mutable]];
+    switch (_fuzz_random() % 5)
+    { case 0: *b = _fuzz_random(); break;
+      case 1: *b ^= 1 << _fuzz_random() % 8; break;
+      case 2: *b += 1 + _fuzz_random() % 16; break;
+      case 3: *b = interesting[_fuzz_random() % listsize(interesting)]; break;
+      case 4:
+      { uint32_t n_corpus = __atomic_load_n(&_fuzz_shared->n_corpus, __ATOMIC_ACQUIRE);
+        if (n_corpus)
+          *b = _fuzz_corpus[_fuzz_random() % n_corpus * _fuzz_input_size + (b - input)];
+        break;
+      }
     }
-    case ARGS_IHL_R8:
-      return (struct instruction){ op, arg_tokens[1].value, 0 };
-    case ARGS_IHL_N8:
-    { n8_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[1].value, 0 };
+  }
+  _fuzz_normalize(input);
+}
+
+static void _fuzz_print_input(FILE *out, uint8_t *input)
+{ struct registers r;
+  memcpy(&r, input, sizeof(r));
+  fprintf
+  ( out, "a=%02x f=%02x b=%02x c=%02x d=%02x e=%02x h=%02x l=%02x sp=%04x\n"
+  , r.a, r.f, r.b, r.c, r.d, r.e, r.h, r.l, r.sp
+  );
+  uint8_t *in_mem = input + sizeof(struct registers);
+  for (size_t i = 0; i < _fuzz->n_input_mem; i++)
+  { struct mem_range m = _fuzz->input_mem[i];
+    fprintf(out, "%04x:", m.addr);
+    for (int j = 0; j < m.length; j++) fprintf(out, " %02x", *in_mem++);
+    fprintf(out, "\n");
+  }
+}
+
+// shrink an input towards 0, a bit at a time, keeping the same crash
+static void _fuzz_minimize(uint8_t *input, enum fuzz_crash crash, uint16_t isn)
+{ bool changed = true;
+  while (changed)
+  { changed = false;
+    for (int i = 0; i < _fuzz_n_mutable; i++)
+    for (int bit = 0; bit < 8; bit++)
+    { uint8_t *b = &input[_fuzz_mutable[i]];
+      if (!(1 << bit & *b)) continue;
+      uint8_t old = *b;
+      *b &= ~(1 << bit);
+      _fuzz_normalize(input);
+      uint16_t isn1;
+      if (crash == _fuzz_run(input, &isn1) && isn == isn1) changed = true;
+      else *b = old;
     }
-    case ARGS_IR16_A:
-    case ARGS_IN16_A:
-    { a_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[0].value, 0 };
+  }
+}
+
+static void _fuzz_crash(uint8_t *input, enum fuzz_crash crash, uint16_t isn)
+{ size_t seen = crash * (_fuzz->program->length + 1) + isn;
+  if (__atomic_exchange_n(&_fuzz_seen[seen], 1, __ATOMIC_RELAXED)) return;
+  __atomic_fetch_add(&_fuzz_shared->crashes, 1, __ATOMIC_RELAXED);
+
+  _fuzz_minimize(input, crash, isn);
+  char path[256];
+  snprintf
+  ( path, sizeof(path), "%s/%s-%d.txt"
+  , _fuzz->crash_dir, fuzz_crash_names[crash], isn
+  );
+  FILE *out = fopen(path, "w");
+  if (!out) panic;
+  _fuzz_print_input(out, input);
+  fclose(out);
+  printf("%s at instruction %d: ", fuzz_crash_names[crash], isn);
+  _fuzz_print_input(stdout, input);
+  fflush(stdout);
+}
+
+static void _fuzz_add_corpus(uint8_t *input)
+{ while (__atomic_test_and_set(&_fuzz_shared->lock, __ATOMIC_ACQUIRE))
+  { }
+  uint32_t n = _fuzz_shared->n_corpus;
+  if (FUZZ_MAX_CORPUS > n)
+  { memcpy(_fuzz_corpus + n * _fuzz_input_size, input, _fuzz_input_size);
+    __atomic_store_n(&_fuzz_shared->n_corpus, n + 1, __ATOMIC_RELEASE);
+  }
+  __atomic_clear(&_fuzz_shared->lock, __ATOMIC_RELEASE);
+}
+
+noreturn
+static void _fuzz_worker(int worker)
+{ struct program *program = _fuzz->program;
+  _fuzz_rng = 0x9e3779b97f4a7c15 * (worker + 1) ^ time(NULL);
+  _fuzz_edges = malloc(2 * program->length);
+
+  // writes go through _fuzz_write, except on pages which are all writable
+  for (int page = 0; page < 256; page++)
+  { bool all = true;
+    for (int i = 0; all && i < 256; i++) all = _fuzz_writable(page << 8 | i);
+    if (all) continue;
+    _fuzz_write_pages[page] = write_pages[page];
+    _fuzz_write_handlers[page] = write_handlers[page];
+    map_handlers(page << 8, 0x100, NULL, _fuzz_write);
+  }
+
+  uint8_t *input = malloc(_fuzz_input_size);
+  while (__atomic_fetch_add(&_fuzz_shared->runs, 1, __ATOMIC_RELAXED) < _fuzz->runs)
+  { uint32_t n_corpus = __atomic_load_n(&_fuzz_shared->n_corpus, __ATOMIC_ACQUIRE);
+    if (!n_corpus || !(_fuzz_random() % 16))
+    { for (size_t i = 0; i < _fuzz_input_size; i++) input[i] = _fuzz_random();
+      _fuzz_normalize(input);
     }
-    case ARGS_IC_A:
-    case ARGS_IHLI_A:
-    case ARGS_IHLD_A:
-    { a_arg(arg_tokens[1]);
-      return (struct instruction){ op, 0, 0 };
+    else
+    { memcpy
+      ( input, _fuzz_corpus + _fuzz_random() % n_corpus * _fuzz_input_size
+      , _fuzz_input_size
+      );
+      _fuzz_mutate(input);
     }
-    case ARGS_N16:
-    { n16_arg(arg_tokens[0]);
-      return (struct instruction){ op, arg_tokens[0].value, 0 };
+
+    // a crashing input goes no further in the corpus, so the edges it took
+    // are left for an input which takes them without crashing
+    uint16_t isn;
+    enum fuzz_crash crash = _fuzz_run(input, &isn);
+    if (FUZZ_OK != crash)
+    { _fuzz_crash(input, crash, isn);
+      continue;
+    }
+    bool new = false;
+    for (size_t i = 0; i < 2 * program->length; i++)
+      if (_fuzz_edges[i] && !_fuzz_coverage[i])
+        new |= !__atomic_exchange_n(&_fuzz_coverage[i], 1, __ATOMIC_RELAXED);
+    if (new) _fuzz_add_corpus(input);
+  }
+  exit(0);
+}
+
+// Fuzz from the current registers and memory, returning the number of
+// distinct crashes found.
+size_t fuzz(struct fuzz *f)
+{ struct program *program = f->program;
+  _fuzz = f;
+  if (!f->max_cycles) f->max_cycles = 1 << 20;
+  int workers = f->workers ? f->workers : sysconf(_SC_NPROCESSORS_ONLN);
+
+  size_t input_mem_size = 0;
+  for (size_t i = 0; i < f->n_input_mem; i++) input_mem_size += f->input_mem[i].length;
+  _fuzz_input_size = sizeof(struct registers) + input_mem_size;
+
+  _fuzz_mutable = malloc(_fuzz_input_size * sizeof(int));
+  _fuzz_n_mutable = 0;
+  static const struct { uint16_t loc; size_t offset; } fields[] =
+  { { LOC_A, offsetof(struct registers, a) }, { LOC_F, offsetof(struct registers, f) }
+  , { LOC_B, offsetof(struct registers, b) }, { LOC_C, offsetof(struct registers, c) }
+  , { LOC_D, offsetof(struct registers, d) }, { LOC_E, offsetof(struct registers, e) }
+  , { LOC_H, offsetof(struct registers, h) }, { LOC_L, offsetof(struct registers, l) }
+  , { LOC_SP, offsetof(struct registers, sp) }, { LOC_SP, offsetof(struct registers, sp) + 1 }
+  };
+  for (int i = 0; i < listsize(fields); i++)
+    if (fields[i].loc & f->inputs) _fuzz_mutable[_fuzz_n_mutable++] = fields[i].offset;
+  for (size_t i = 0; i < input_mem_size; i++)
+    _fuzz_mutable[_fuzz_n_mutable++] = sizeof(struct registers) + i;
+  if (!_fuzz_n_mutable) panic;
+
+  size_t n = program->length;
+  _fuzz_branches = calloc(n, sizeof(bool));
+  size_t n_edges = 0;
+  for (size_t i = 0; i < n; i++)
+  { enum op op = unfuse(program->instructions[i]).op;
+    _fuzz_branches[i] =
+      OP_JR_CC_E8 == op || OP_JP_CC_N16 == op || OP_CALL_CC_N16 == op || OP_RET_CC == op;
+    n_edges += 2 * _fuzz_branches[i];
+  }
+
+  size_t seen_size = N_FUZZ_CRASHES * (n + 1);
+  size_t shared_size =
+    sizeof(struct _fuzz_shared) + 2 * n + seen_size + FUZZ_MAX_CORPUS * _fuzz_input_size;
+  uint8_t *shared = mmap
+    (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == shared) panic;
+  _fuzz_shared = (struct _fuzz_shared *)shared;
+  _fuzz_coverage = shared + sizeof(struct _fuzz_shared);
+  _fuzz_seen = _fuzz_coverage + 2 * n;
+  _fuzz_corpus = _fuzz_seen + seen_size;
+
+  _fuzz_base = malloc(sizeof(struct snapshot));
+  save_snapshot(_fuzz_base);
+  if (mkdir(f->crash_dir, 0755) && EEXIST != errno) panic;
+
+  fflush(stdout);
+  for (int w = 0; w < workers; w++)
+  { pid_t pid = fork();
+    if (0 > pid) panic;
+    if (!pid) _fuzz_worker(w);
+  }
+  for (int w = 0; w < workers; w++)
+  { int status;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      printf("a fuzzing worker died\n");
+  }
+
+  size_t covered = 0;
+  for (size_t i = 0; i < 2 * n; i++) covered += _fuzz_coverage[i];
+  size_t crashes = _fuzz_shared->crashes;
+  printf
+  ( "%llu runs on %d workers, %zu of %zu edges, %u in corpus, %zu crashes\n"
+  , (unsigned long long)f->runs, workers, covered, n_edges
+  , _fuzz_shared->n_corpus, crashes
+  );
+
+  munmap(shared, shared_size);
+  free(_fuzz_base);
+  free(_fuzz_branches);
+  free(_fuzz_mutable);
+  return crashes;
+}
+
+
+// property testing
+
+
+// check_property runs a program over inputs drawn from generators, each a
+// register or a range of memory with every byte between min and max, and
+// checks a property of the results.  A failing case is shrunk towards the
+// minimums, a value at a time, and left in the registers and memory.  Cases
+// are split over a forked worker per core, each reusing its simulator state.
+
+struct generator
+{ uint16_t loc;       // a register (enum loc), or 0 for memory
+  uint16_t addr;      // of memory
+  uint16_t length;
+  uint16_t min, max;  // of the register, or of each byte
+};
+
+struct property
+{ struct program *program;
+  struct generator *generators;
+  size_t n_generators;
+  struct mem_range *scratch;   // put back before each case
+  size_t n_scratch;
+  // Given the inputs (generated memory concatenated) with the results in reg
+  // and mem, whether the property holds.
+  bool (*holds)(struct registers *in, uint8_t *in_mem);
+  uint64_t cases;
+  int workers;                 // 0 for one per core
+  uint64_t seed;               // 0 for the time
+};
+
+#define PROPERTY_BATCH 4096
+
+// a register or byte of memory to generate
+struct _prop_slot
+{ uint8_t *at;
+  bool wide;          // SP
+  uint8_t mask;       // F's high nibble
+  uint16_t min;
+  uint32_t range;     // 1 << 16 for the whole of SP
+};
+
+// shared by the workers
+struct _prop_shared
+{ uint64_t cases;     // handed out
+  uint64_t failed_at;
+  bool failed;
+  bool panicked;
+  uint16_t values[];  // of the counterexample
+};
+
+static struct property *_prop;
+static struct _prop_slot *_prop_slots;
+static size_t _prop_n_slots;
+static struct registers _prop_reg;
+static uint8_t *_prop_scratch;
+static uint8_t *_prop_in_mem;
+static size_t _prop_in_mem_size;
+static bool _prop_panicked;
+
+static void _prop_set(uint16_t *values)
+{ reg = _prop_reg;
+  for (size_t i = 0, at = 0; i < _prop->n_scratch; i++)
+  { struct mem_range r = _prop->scratch[i];
+    memcpy(mem + r.addr, _prop_scratch + at, r.length);
+    at += r.length;
+  }
+  for (size_t i = 0; i < _prop_n_slots; i++)
+  { struct _prop_slot *s = &_prop_slots[i];
+    if (s->wide) memcpy(s->at, &values[i], 2);
+    else *s->at = values[i] | *s->at & ~s->mask;
+  }
+}
+
+// run a case, returning whether the property holds
+static bool _prop_case(uint16_t *values)
+{ _prop_set(values);
+  struct registers in = reg;
+  for (size_t i = 0, at = 0; i < _prop->n_generators; i++)
+  { struct generator g = _prop->generators[i];
+    if (g.loc) continue;
+    memcpy(_prop_in_mem + at, mem + g.addr, g.length);
+    at += g.length;
+  }
+
+  jmp_buf jump;
+  if (setjmp(jump))
+  { panic_jump = NULL;
+    _prop_panicked = true;
+    return false;
+  }
+  panic_jump = &jump;
+  run_program(_prop->program);
+  panic_jump = NULL;
+  _prop_panicked = false;
+  return _prop->holds(&in, _prop_in_mem);
+}
+
+// move each value towards its minimum while the property still fails
+static void _prop_shrink(uint16_t *values)
+{ bool changed = true;
+  while (changed)
+  { changed = false;
+    for (size_t i = 0; i < _prop_n_slots; i++)
+    { uint16_t min = _prop_slots[i].min;
+      uint16_t v = values[i];
+      // the smallest value found to fail is v; look between min and v
+      uint16_t lo = min;
+      while (lo < v)
+      { uint16_t mid = lo + (v - lo) / 2;
+        values[i] = mid;
+        if (!_prop_case(values)) { v = mid; changed = true; }
+        else lo = mid + 1;
+      }
+      values[i] = v;
+    }
+  }
+  _prop_case(values);
+}
+
+noreturn
+static void _prop_worker(struct _prop_shared *shared, int worker)
+{ uint64_t rng = _prop->seed ? _prop->seed : time(NULL);
+  rng = 0x9e3779b97f4a7c15 * (worker + 1) ^ rng;
+  uint16_t *values = malloc(_prop_n_slots * sizeof(uint16_t));
+
+  uint64_t start;
+  while
+  (  !__atomic_load_n(&shared->failed, __ATOMIC_RELAXED)
+  && _prop->cases >
+     (start = __atomic_fetch_add(&shared->cases, PROPERTY_BATCH, __ATOMIC_RELAXED))
+  )
+  { uint64_t end = start + PROPERTY_BATCH;
+    if (end > _prop->cases) end = _prop->cases;
+    for (uint64_t n = start; n < end; n++)
+    { for (size_t i = 0; i < _prop_n_slots; i++)
+      { rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        struct _prop_slot *s = &_prop_slots[i];
+        values[i] = s->min + (uint16_t)(rng % s->range) & (s->wide ? 0xffff : s->mask);
+      }
+      if (_prop_case(values)) continue;
+
+      if (__atomic_exchange_n(&shared->failed, true, __ATOMIC_RELAXED)) exit(0);
+      _prop_shrink(values);
+      shared->failed_at = n;
+      shared->panicked = _prop_panicked;
+      memcpy(shared->values, values, _prop_n_slots * sizeof(uint16_t));
+      exit(0);
+    }
+  }
+  exit(0);
+}
+
+// Check a property of a program from the current simulator state, returning
+// whether it held for every case (not, if a worker died before finishing).
+bool check_property(struct property *p)
+{ _prop = p;
+  int workers = p->workers ? p->workers : sysconf(_SC_NPROCESSORS_ONLN);
+
+  _prop_n_slots = 0;
+  _prop_in_mem_size = 0;
+  for (size_t i = 0; i < p->n_generators; i++)
+  { struct generator g = p->generators[i];
+    _prop_n_slots += g.loc ? 1 : g.length;
+    if (!g.loc) _prop_in_mem_size += g.length;
+  }
+  _prop_slots = malloc(_prop_n_slots * sizeof(struct _prop_slot));
+  _prop_in_mem = malloc(_prop_in_mem_size);
+
+  _prop_reg = reg;
+  size_t n = 0;
+  for (size_t i = 0; i < p->n_generators; i++)
+  { struct generator g = p->generators[i];
+    if (g.min > g.max) panic;
+    if (!g.loc)
+    { if (0xff < g.max || 0x10000 < g.addr + g.length) panic;
+      for (int j = 0; j < g.length; j++)
+        _prop_slots[n++] =
+          (struct _prop_slot){ mem + g.addr + j, false, 0xff, g.min, g.max - g.min + 1 };
+      continue;
+    }
+    uint8_t *at;
+    switch (g.loc)
+    { case LOC_A: at = &_prop_reg.a; break;
+      case LOC_F: at = &_prop_reg.f; break;
+      case LOC_B: at = &_prop_reg.b; break;
+      case LOC_C: at = &_prop_reg.c; break;
+      case LOC_D: at = &_prop_reg.d; break;
+      case LOC_E: at = &_prop_reg.e; break;
+      case LOC_H: at = &_prop_reg.h; break;
+      case LOC_L: at = &_prop_reg.l; break;
+      case LOC_SP: at = (uint8_t *)&_prop_reg.sp; break;
+      default: panic;
+    }
+    bool wide = LOC_SP == g.loc;
+    if (!wide && 0xff < g.max) panic;
+    // point at the live register rather than the saved ones
+    at = (uint8_t *)&reg + (at - (uint8_t *)&_prop_reg);
+    _prop_slots[n++] = (struct _prop_slot)
+      { at, wide, LOC_F == g.loc ? 0xf0 : 0xff, g.min, g.max - g.min + 1 };
+  }
+
+  size_t scratch_size = 0;
+  for (size_t i = 0; i < p->n_scratch; i++) scratch_size += p->scratch[i].length;
+  _prop_scratch = malloc(scratch_size);
+  for (size_t i = 0, at = 0; i < p->n_scratch; i++)
+  { struct mem_range r = p->scratch[i];
+    memcpy(_prop_scratch + at, mem + r.addr, r.length);
+    at += r.length;
+  }
+
+  size_t shared_size = sizeof(struct _prop_shared) + _prop_n_slots * sizeof(uint16_t);
+  struct _prop_shared *shared = mmap
+    (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == shared) panic;
+
+  fflush(stdout);
+  for (int w = 0; w < workers; w++)
+  { pid_t pid = fork();
+    if (0 > pid) panic;
+    if (!pid) _prop_worker(shared, w);
+  }
+  bool died = false;
+  for (int w = 0; w < workers; w++)
+  { int status;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    { printf("a property worker died\n");
+      died = true;
+    }
+  }
+
+  // cases a dead worker never ran can't be said to hold
+  bool failed = shared->failed || died;
+  if (!shared->failed) reg = _prop_reg;
+  else
+  { printf
+    ( "property %s on case %llu, inputs:\n"
+    , shared->panicked ? "panics" : "fails"
+    , (unsigned long long)shared->failed_at + 1
+    );
+    _prop_set(shared->values);
+    status();
+    for (size_t i = 0; i < p->n_generators; i++)
+    { struct generator g = p->generators[i];
+      if (g.loc) continue;
+      printf("%04x:", g.addr);
+      for (int j = 0; j < g.length; j++) printf(" %02x", mem[g.addr + j]);
+      printf("\n");
+    }
+  }
+
+  munmap(shared, shared_size);
+  free(_prop_scratch);
+  free(_prop_in_mem);
+  free(_prop_slots);
+  return !failed;
+}
+
+
+// equivalence checking
+
+
+// check_equivalence runs two programs over every value of their inputs
+// (registers, F by its high nibble or by single flags, and bytes of memory),
+// split over a forked worker per core, and compares the outputs they leave
+// behind: registers, flags and bytes of memory.  Output memory is put back
+// between runs; other memory written is not.  A run that panics (as on a
+// halt that nothing will wake) or goes past max_cycles counts as a mismatch.
+// The difference in cycles (b's less a's) is counted for every input, those
+// beyond EQUIV_MAX_DELTA at the ends.
+
+#define EQUIV_MAX_DELTA 255
+
+struct equivalence
+{ struct program *a, *b;
+  uint16_t inputs;                 // enum loc
+  uint8_t input_flags;             // bits of F, unless F is in inputs
+  struct mem_range *input_mem;
+  size_t n_input_mem;
+  uint16_t outputs;                // enum loc, F aside
+  uint8_t output_flags;            // bits of F
+  struct mem_range *output_mem;
+  size_t n_output_mem;
+  uint32_t max_cycles;             // per run, 0 for 1 << 20
+  int workers;                     // 0 for one per core
+
+  // results
+  uint64_t n;                      // inputs run
+  uint64_t mismatches;
+  uint64_t panics;                 // inputs on which either panicked
+  int workers_died;                // whose inputs went unchecked
+  uint64_t first_mismatch;         // index of the input, or n
+  uint64_t cycles_a, cycles_b;     // in total
+  uint32_t min_a, max_a, min_b, max_b;
+  uint64_t deltas[2 * EQUIV_MAX_DELTA + 1];   // from -EQUIV_MAX_DELTA
+};
+
+static struct registers _equiv_reg;
+static uint8_t *_equiv_mem;        // output memory, as it was
+                                   // (kept for set_equivalence_input)
+
+// the number of bits of input
+int equivalence_bits(struct equivalence *e)
+{ int bits = 0;
+  for (int i = 0; i < 9; i++)
+    if (1 << i & e->inputs)
+      bits += LOC_F == 1 << i ? 4 : LOC_SP == 1 << i ? 16 : 8;
+  if (!(LOC_F & e->inputs)) bits += __builtin_popcount(0xf0 & e->input_flags);
+  for (size_t i = 0; i < e->n_input_mem; i++) bits += 8 * e->input_mem[i].length;
+  return bits;
+}
+
+// Set up the registers and memory for an input, in the order compare_programs
+// uses, followed by the input memory.
+void set_equivalence_input(struct equivalence *e, uint64_t v)
+{ struct registers r = _equiv_reg;
+  uint16_t in = e->inputs;
+  if (LOC_A & in) r.a = v, v >>= 8;
+  if (LOC_B & in) r.b = v, v >>= 8;
+  if (LOC_C & in) r.c = v, v >>= 8;
+  if (LOC_D & in) r.d = v, v >>= 8;
+  if (LOC_E & in) r.e = v, v >>= 8;
+  if (LOC_H & in) r.h = v, v >>= 8;
+  if (LOC_L & in) r.l = v, v >>= 8;
+  if (LOC_F & in) r.f = (v & 0x0f) << 4 | 0x0f & r.f, v >>= 4;
+  else
+    for (uint8_t bit = FLAG_Z; bit >= FLAG_C; bit >>= 1)
+      if (bit & e->input_flags) r.f = v & 1 ? r.f | bit : r.f & ~bit, v >>= 1;
+  if (LOC_SP & in) r.sp = v, v >>= 16;
+  reg = r;
+  for (size_t i = 0, at = 0; i < e->n_output_mem; i++)
+  { struct mem_range m = e->output_mem[i];
+    memcpy(mem + m.addr, _equiv_mem + at, m.length);
+    at += m.length;
+  }
+  for (size_t i = 0; i < e->n_input_mem; i++)
+  { struct mem_range m = e->input_mem[i];
+    for (int j = 0; j < m.length; j++, v >>= 8) mem[m.addr + j] = v;
+  }
+}
+
+// whether the outputs in reg and mem are those in r and out_mem
+bool same_equivalence_outputs(struct equivalence *e, struct registers *r, uint8_t *out_mem)
+{ uint16_t out = e->outputs;
+  if
+  (  LOC_A & out && r->a != reg.a
+  || LOC_B & out && r->b != reg.b
+  || LOC_C & out && r->c != reg.c
+  || LOC_D & out && r->d != reg.d
+  || LOC_E & out && r->e != reg.e
+  || LOC_H & out && r->h != reg.h
+  || LOC_L & out && r->l != reg.l
+  || LOC_SP & out && r->sp != reg.sp
+  || e->output_flags & (r->f ^ reg.f)
+  )
+    return false;
+  for (size_t i = 0, at = 0; i < e->n_output_mem; i++)
+  { struct mem_range m = e->output_mem[i];
+    if (memcmp(mem + m.addr, out_mem + at, m.length)) return false;
+    at += m.length;
+  }
+  return true;
+}
+
+static void _equiv_save_outputs(struct equivalence *e, uint8_t *out_mem)
+{ for (size_t i = 0, at = 0; i < e->n_output_mem; i++)
+  { struct mem_range m = e->output_mem[i];
+    memcpy(out_mem + at, mem + m.addr, m.length);
+    at += m.length;
+  }
+}
+
+// run a program on input v, returning false if it panics or runs too long
+static bool _equiv_run(struct equivalence *e, struct program *program, uint64_t v)
+{ set_equivalence_input(e, v);
+  jmp_buf jump;
+  bool ok = !setjmp(jump);
+  if (ok)
+  { panic_jump = &jump;
+    cycle_limit = e->max_cycles;
+    run_program(program);
+  }
+  panic_jump = NULL;
+  cycle_limit = UINT32_MAX;
+  return ok;
+}
+
+static void _equiv_worker(struct equivalence *e, struct equivalence *result, int w, int workers)
+{ size_t out_size = 0;
+  for (size_t i = 0; i < e->n_output_mem; i++) out_size += e->output_mem[i].length;
+  uint8_t *out_mem = malloc(out_size);
+
+  *result = *e;
+  result->mismatches = result->panics = result->cycles_a = result->cycles_b = 0;
+  result->first_mismatch = e->n;
+  result->min_a = result->min_b = UINT32_MAX;
+  result->max_a = result->max_b = 0;
+  memset(result->deltas, 0, sizeof(result->deltas));
+
+  uint64_t start = e->n * w / workers, end = e->n * (w + 1) / workers;
+  for (uint64_t v = start; v < end; v++)
+  { bool ok = _equiv_run(e, e->a, v);
+    uint32_t cycles_a = cycles;
+    struct registers r = reg;
+    _equiv_save_outputs(e, out_mem);
+
+    ok &= _equiv_run(e, e->b, v);
+    uint32_t cycles_b = cycles;
+    result->panics += !ok;
+    if (!ok || !same_equivalence_outputs(e, &r, out_mem))
+    { if (!result->mismatches) result->first_mismatch = v;
+      result->mismatches++;
+    }
+
+    result->cycles_a += cycles_a;
+    result->cycles_b += cycles_b;
+    if (cycles_a < result->min_a) result->min_a = cycles_a;
+    if (cycles_a > result->max_a) result->max_a = cycles_a;
+    if (cycles_b < result->min_b) result->min_b = cycles_b;
+    if (cycles_b > result->max_b) result->max_b = cycles_b;
+    int64_t delta = (int64_t)cycles_b - cycles_a;
+    if (delta < -EQUIV_MAX_DELTA) delta = -EQUIV_MAX_DELTA;
+    if (delta > EQUIV_MAX_DELTA) delta = EQUIV_MAX_DELTA;
+    result->deltas[EQUIV_MAX_DELTA + delta]++;
+  }
+  free(out_mem);
+}
+
+// Check two programs from the current simulator state, filling in the
+// results.  Returns whether they agree on every input, which they do not if
+// a worker died before checking its share.
+bool check_equivalence(struct equivalence *e)
+{ int bits = equivalence_bits(e);
+  if (32 < bits) panic;
+  e->n = (uint64_t)1 << bits;
+  if (!e->max_cycles) e->max_cycles = 1 << 20;
+  int workers = e->workers ? e->workers : sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > e->n) workers = e->n;
+
+  _equiv_reg = reg;
+  size_t out_size = 0;
+  for (size_t i = 0; i < e->n_output_mem; i++) out_size += e->output_mem[i].length;
+  free(_equiv_mem);
+  _equiv_mem = malloc(out_size);
+  _equiv_save_outputs(e, _equiv_mem);
+
+  size_t shared_size = workers * sizeof(struct equivalence);
+  struct equivalence *results = mmap
+    (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == results) panic;
+
+  fflush(stdout);
+  for (int w = 0; w < workers; w++)
+  { pid_t pid = fork();
+    if (0 > pid) panic;
+    if (!pid)
+    { _equiv_worker(e, &results[w], w, workers);
+      exit(0);
     }
-    case ARGS_HL:
-    case ARGS_HL_SP:
-    { hl_arg(arg_tokens[0]);
-      return (struct instruction){ op, 0, 0 };
+  }
+  e->workers_died = 0;
+  for (int w = 0; w < workers; w++)
+  { int status;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    { printf("an equivalence worker died\n");
+      e->workers_died++;
     }
-    case ARGS_E8:
-    { e8_arg(arg_tokens[0]);
-      return (struct instruction){ op, arg_tokens[0].value, 0 };
+  }
+
+  e->mismatches = e->panics = e->cycles_a = e->cycles_b = 0;
+  e->first_mismatch = e->n;
+  e->min_a = e->min_b = UINT32_MAX;
+  e->max_a = e->max_b = 0;
+  memset(e->deltas, 0, sizeof(e->deltas));
+  for (int w = 0; w < workers; w++)
+  { struct equivalence *r = &results[w];
+    e->mismatches += r->mismatches;
+    e->panics += r->panics;
+    if (r->first_mismatch < e->first_mismatch) e->first_mismatch = r->first_mismatch;
+    e->cycles_a += r->cycles_a;
+    e->cycles_b += r->cycles_b;
+    if (r->min_a < e->min_a) e->min_a = r->min_a;
+    if (r->max_a > e->max_a) e->max_a = r->max_a;
+    if (r->min_b < e->min_b) e->min_b = r->min_b;
+    if (r->max_b > e->max_b) e->max_b = r->max_b;
+    for (int i = 0; i < listsize(e->deltas); i++) e->deltas[i] += r->deltas[i];
+  }
+  munmap(results, shared_size);
+
+  // leave the first mismatching input set up, or the state as it was
+  if (e->mismatches) set_equivalence_input(e, e->first_mismatch);
+  return !e->mismatches && !e->workers_died;
+}
+
+
+// superoptimization
+
+
+// superoptimize searches for the cheapest sequence of register instructions
+// (those run_sliced runs) leaving the same outputs as a reference program or
+// C function, for every value of the inputs.  Sequences are tried in order of
+// cycles, each screened on 256 random inputs before being checked on all of
+// them, so the first to pass is the cheapest.  Registers which are not inputs
+// hold random values, so that nothing comes to depend on them.  Sequences
+// which differ only in the order of independent instructions, or which write
+// something only for the next instruction to overwrite it, are skipped.  The
+// first instruction of each sequence is dealt out to a forked worker per core.
+
+struct superopt
+{ struct program *reference;              // or
+  void (*target)(struct registers *r);    // computing the outputs in place
+  uint16_t inputs;                        // enum loc, F by its high nibble, not SP
+  uint16_t outputs;                       // enum loc, F aside
+  uint8_t output_flags;
+  uint16_t scratch;                       // other registers which may be used
+  uint8_t *constants;                     // for immediate operands
+  size_t n_constants;
+  int max_cycles;
+  int workers;                            // 0 for one per core
+};
+
+static struct superopt *_so;
+static struct instruction *_so_candidates;
+static uint8_t *_so_cycles;
+static uint32_t *_so_reads, *_so_writes;   // enum loc, and F bits above them
+static size_t _so_n;
+static uint32_t _so_outputs;
+static int _so_bits;
+static uint64_t _so_rng;
+static struct sliced *_so_states;          // before each instruction
+static struct sliced *_so_want;            // of the screening inputs
+static uint16_t *_so_sequence;
+static int _so_length;                     // of the sequence found
+
+// what an instruction reads and writes, flags by bit above the registers
+static void _so_access(struct instruction x, uint32_t *reads, uint32_t *writes)
+{ struct access a = instruction_access(x);
+  *reads = a.reads & ~LOC_F | (uint32_t)a.f_reads << 16;
+  *writes = a.writes & ~LOC_F | (uint32_t)a.f_writes << 16;
+}
+
+static void _so_add(struct instruction x, uint16_t usable)
+{ if (OP_NOP == x.op || OP_LD_R8_R8 == x.op && x.p1 == x.p2) return;
+  uint32_t reads, writes;
+  _so_access(x, &reads, &writes);
+  if ((reads | writes) & 0xffff & ~usable) return;
+  for (size_t i = 0; i < _so_n; i++)
+    if (!memcmp(&x, &_so_candidates[i], sizeof(x))) return;
+
+  struct sliced *s = &_so_states[0];
+  s->cycles = 0;
+  _slice_instruction(s, x);
+  _so_candidates[_so_n] = x;
+  _so_cycles[_so_n] = s->cycles;
+  _so_reads[_so_n] = reads;
+  _so_writes[_so_n] = writes;
+  _so_n++;
+}
+
+// every instruction from instruction_signatures over the usable registers
+static void _so_enumerate(uint16_t usable)
+{ size_t max = 1 << 16;
+  _so_candidates = malloc(max * sizeof(struct instruction));
+  _so_cycles = malloc(max);
+  _so_reads = malloc(max * sizeof(uint32_t));
+  _so_writes = malloc(max * sizeof(uint32_t));
+  _so_n = 0;
+
+  struct superopt *so = _so;
+  for (int i = 0; i < N_ISN_TOKEN; i++)
+  for (int t0 = 0; t0 < N_ARG_TOKEN_TYPE; t0++)
+  for (int t1 = 0; t1 < N_ARG_TOKEN_TYPE; t1++)
+  { struct instruction_signature s = instruction_signatures[i][t0][t1];
+    if (ARGS_INVALID == s.args || !sliceable_op(s.op)) continue;
+    for (int p = 0; p < 8; p++)
+    for (int q = 0; q < 8; q++)
+      switch (s.args)
+      { case ARGS_NONE:
+          if (!p && !q) _so_add((struct instruction){ s.op, 0, 0 }, usable);
+          break;
+        case ARGS_R8:
+        case ARGS_A_R8:
+          if (!q && R8_L >= p) _so_add((struct instruction){ s.op, p, 0 }, usable);
+          break;
+        case ARGS_R16:
+        case ARGS_HL_R16:
+          if (!q && R16_HL >= p) _so_add((struct instruction){ s.op, p, 0 }, usable);
+          break;
+        case ARGS_U3_R8:
+          if (R8_L >= q) _so_add((struct instruction){ s.op, p, q }, usable);
+          break;
+        case ARGS_R8_R8:
+          if (R8_L >= p && R8_L >= q) _so_add((struct instruction){ s.op, p, q }, usable);
+          break;
+        case ARGS_N8:
+        case ARGS_A_N8:
+          if (!p && !q)
+            for (size_t c = 0; c < so->n_constants; c++)
+              _so_add((struct instruction){ s.op, so->constants[c], 0 }, usable);
+          break;
+        case ARGS_R8_N8:
+          if (!q && R8_L >= p)
+            for (size_t c = 0; c < so->n_constants; c++)
+              _so_add((struct instruction){ s.op, p, so->constants[c] }, usable);
+          break;
+        case ARGS_R16_N16:
+          if (!q && R16_HL >= p)
+            for (size_t c = 0; c < so->n_constants; c++)
+            for (size_t d = 0; d < so->n_constants; d++)
+            { uint16_t n16 = so->constants[c] << 8 | so->constants[d];
+              _so_add((struct instruction){ s.op, p, n16 }, usable);
+            }
+          break;
+        default:
+          break;
+      }
+  }
+
+  // cheapest first
+  for (size_t i = 1; i < _so_n; i++)
+    for (size_t j = i; j && _so_cycles[j-1] > _so_cycles[j]; j--)
+    { struct instruction x = _so_candidates[j];
+      _so_candidates[j] = _so_candidates[j-1];
+      _so_candidates[j-1] = x;
+      uint8_t c = _so_cycles[j]; _so_cycles[j] = _so_cycles[j-1]; _so_cycles[j-1] = c;
+      uint32_t r = _so_reads[j]; _so_reads[j] = _so_reads[j-1]; _so_reads[j-1] = r;
+      uint32_t w = _so_writes[j]; _so_writes[j] = _so_writes[j-1]; _so_writes[j-1] = w;
     }
-    case ARGS_CC_E8:
-    { e8_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[0].value, arg_tokens[1].value };
+}
+
+static void _so_put_lane(struct sliced *s, int lane, struct registers *r)
+{ uint8_t values[8] = { r->a, r->b, r->c, r->d, r->e, r->h, r->l, r->f };
+  uint64_t bit = (uint64_t)1 << lane % 64;
+  for (int i = 0; i < 8; i++)
+  { int n = SLICED_F == i ? SLICED_F : i;
+    for (int k = 0; k < 8; k++)
+      if (1 << k & values[i]) s->r[n][k][lane / 64] |= bit;
+      else s->r[n][k][lane / 64] &= ~bit;
+  }
+}
+
+// the inputs from first across the lanes, and random values in the rest
+static void _so_inputs(struct sliced *s, uint32_t first, bool random)
+{ set_sliced(s, _so->inputs, first);
+  for (int r = 0; r < 8; r++)
+  { bool input = 1 << r & _so->inputs;   // as in enum loc
+    for (int k = SLICED_F == r ? 4 : 0; k < 8; k++)
+      if (random || !input)
+        for (int w = 0; w < 4; w++)
+        { _so_rng ^= _so_rng << 13;
+          _so_rng ^= _so_rng >> 7;
+          _so_rng ^= _so_rng << 17;
+          s->r[r][k][w] = _so_rng;
+        }
+  }
+}
+
+// the outputs the reference leaves for the inputs in s
+static void _so_reference(struct sliced *s, struct sliced *want)
+{ *want = *s;
+  if (_so->reference && sliceable(_so->reference))
+  { run_sliced(_so->reference, want);
+    return;
+  }
+  struct registers r0 = reg;
+  for (int lane = 0; lane < SLICE_LANES; lane++)
+  { struct registers r;
+    get_sliced(s, lane, &r);
+    if (_so->reference)
+    { reg = r;
+      run_program(_so->reference);
+      r = reg;
     }
-    case ARGS_SP_E8:
-    { e8_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    else _so->target(&r);
+    _so_put_lane(want, lane, &r);
+  }
+  reg = r0;
+}
+
+static bool _so_same(struct sliced *got, struct sliced *want, uint32_t lanes)
+{ slice differ = _slice_zero;
+  for (int r = 0; r < 8; r++)
+    for (int k = 0; k < 8; k++)
+      if (SLICED_F == r ? 1 << k & _so->output_flags : 1 << r & _so->outputs)
+        differ |= got->r[r][k] ^ want->r[r][k];
+  for (int lane = 0; lane < lanes && lane < SLICE_LANES; lane++)
+    if (_slice_lane(differ, lane)) return false;
+  return true;
+}
+
+static bool _so_verify(int length)
+{ struct sliced *in = malloc(sizeof(struct sliced));
+  struct sliced *want = malloc(sizeof(struct sliced));
+  bool same = true;
+  uint32_t n = 1 << _so_bits;
+  for (uint32_t first = 0; same && first < n; first += SLICE_LANES)
+  { _so_inputs(in, first, false);
+    _so_reference(in, want);
+    for (int i = 0; i < length; i++)
+      _slice_instruction(in, _so_candidates[_so_sequence[i]]);
+    same = _so_same(in, want, n - first);
+  }
+  free(in);
+  free(want);
+  return same;
+}
+
+// Look for a sequence of exactly the remaining cycles from depth on.
+static bool _so_search(int depth, int remaining, size_t from, size_t step)
+{ for (size_t c = from; c < _so_n; c += step)
+  { if (_so_cycles[c] > remaining) break;
+    bool last = _so_cycles[c] == remaining;
+    if (last && !(_so_writes[c] & _so_outputs)) continue;
+    if (depth)
+    { size_t prev = _so_sequence[depth - 1];
+      uint32_t rp = _so_reads[prev], wp = _so_writes[prev];
+      uint32_t rc = _so_reads[c], wc = _so_writes[c];
+      // independent instructions go in the order of the candidates
+      if (c < prev && !(wp & (rc | wc)) && !(wc & rp)) continue;
+      // the previous instruction wrote nothing that lasted
+      if (!(wp & ~wc) && !(wp & rc)) continue;
     }
-    case ARGS_SP_N16:
-    { n16_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[1].value, 0 };
+
+    _so_states[depth + 1] = _so_states[depth];
+    _slice_instruction(&_so_states[depth + 1], _so_candidates[c]);
+    _so_sequence[depth] = c;
+    if (last)
+    { _so_length = depth + 1;
+      if (_so_same(&_so_states[depth + 1], _so_want, SLICE_LANES) && _so_verify(_so_length))
+        return true;
     }
-    case ARGS_HL_SPE8:
-    { hl_arg(arg_tokens[0]);
-      e8_arg(arg_tokens[1]);
-      return (struct instruction){ op, arg_tokens[1].value, 0 };
+    else if (_so_search(depth + 1, remaining - _so_cycles[c], 0, 1)) return true;
+  }
+  return false;
+}
+
+// shared by the workers
+struct _so_shared
+{ bool lock;
+  size_t first;         // of the sequence found, by candidate; _so_n if none
+  int length;
+  uint16_t sequence[];
+};
+
+// Returns the cheapest sequence within max_cycles, or NULL.
+struct program *superoptimize(struct superopt *so)
+{ _so = so;
+  int workers = so->workers ? so->workers : sysconf(_SC_NPROCESSORS_ONLN);
+  if (LOC_SP & (so->inputs | so->outputs | so->scratch)) panic;
+  _so_bits = 0;
+  for (int i = 0; i < 8; i++)
+    if (1 << i & so->inputs) _so_bits += LOC_F == 1 << i ? 4 : 8;
+  if (24 < _so_bits) panic;
+  _so_outputs = so->outputs & ~LOC_F | (uint32_t)so->output_flags << 16;
+
+  _so_states = malloc((so->max_cycles + 1) * sizeof(struct sliced));
+  _so_want = malloc(sizeof(struct sliced));
+  _so_sequence = malloc(so->max_cycles * sizeof(uint16_t));
+  set_sliced(&_so_states[0], 0, 0);
+  _so_enumerate((so->inputs | so->outputs | so->scratch) & ~LOC_F);
+
+  size_t shared_size = sizeof(struct _so_shared) + so->max_cycles * sizeof(uint16_t);
+  struct _so_shared *shared = mmap
+    (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == shared) panic;
+  shared->first = _so_n;
+
+  _so_rng = 0x9e3779b97f4a7c15;
+  _so_inputs(&_so_states[0], 0, true);
+  _so_reference(&_so_states[0], _so_want);
+
+  fflush(stdout);
+  for (int cycles = 1; _so_n == shared->first && cycles <= so->max_cycles; cycles++)
+  { for (int w = 0; w < workers; w++)
+    { pid_t pid = fork();
+      if (0 > pid) panic;
+      if (pid) continue;
+      // deal out the first instructions, stopping once one before is found
+      for (size_t c = w; c < _so_n; c += workers)
+      { if (c > __atomic_load_n(&shared->first, __ATOMIC_RELAXED)) break;
+        if (!_so_search(0, cycles, c, _so_n)) continue;
+        while (__atomic_test_and_set(&shared->lock, __ATOMIC_ACQUIRE));
+        if (c < shared->first)
+        { shared->first = c;
+          shared->length = _so_length;
+          memcpy(shared->sequence, _so_sequence, _so_length * sizeof(uint16_t));
+        }
+        __atomic_clear(&shared->lock, __ATOMIC_RELEASE);
+        break;
+      }
+      exit(0);
     }
-    case ARGS_SP_HL:
-    { hl_arg(arg_tokens[1]);
-      return (struct instruction){ op, 0, 0 };
+    for (int w = 0; w < workers; w++)
+    { int status;
+      wait(&status);
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+        printf("a superoptimizer worker died\n");
     }
-    case ARGS_INVALID:
-      parse_error
-      ( "invalid arguments for instruction"
-      , instruction_n, instruction_s
-      );
-    default:
-      panic;
   }
+
+  struct program *program = NULL;
+  if (_so_n != shared->first)
+  { program = malloc(sizeof(struct program) + shared->length * sizeof(struct instruction));
+    program->length = shared->length;
+    for (int i = 0; i < shared->length; i++)
+      program->instructions[i] = _so_candidates[shared->sequence[i]];
+  }
+
+  munmap(shared, shared_size);
+  free(_so_candidates);
+  free(_so_cycles);
+  free(_so_reads);
+  free(_so_writes);
+  free(_so_states);
+  free(_so_want);
+  free(_so_sequence);
+  return program;
 }
 
+// Write a program out as source.
+void write_program(FILE *out, struct program *program)
+{ char buf[32];
+  for (int i = 0; i < program->length; i++)
+    fprintf(out, "  %s\n", format_instruction(buf, program->instructions[i]));
+}
 
-struct program *parse_program
-( struct symbol *symbols, size_t n_symbols
-, char *text
-)
-{ int max_instructions = 255;
-  struct program *program =
-    malloc(sizeof(struct program) + max_instructions * sizeof(struct instruction));
-  program->length = 0;
-  int max_anonymous_labels = max_instructions;
 
-  int labels[max_anonymous_labels];
-  int n_labels = 0;
-  struct label_reference {
-    int isn, arg;
-    int n;
-    char *s;
-  } label_references[max_instructions];
-  int n_label_references = 0;
+// peephole advice
 
-  parse_error_s0 = text;
 
-  { // parse lines
+// A cheaper equivalent for length instructions from isn, which changes only
+// flags that are dead after them.
+struct peephole
+{ size_t isn;
+  int length;
+  struct instruction with[2];
+  int n_with;
+  int cycles_saved;
+  uint8_t flags;   // the flags which the rewrite may leave different
+};
 
-    int l = 1;
-    char *s = text;
-    int n = next_newline(text);
-    while (-1 != n)
-    { char *s1 = s;
-      int n1 = n;
+#define _PEEP(o, a, b) ((struct instruction){ OP_##o, a, b })
+
+// Match a known pattern at x (of up to left instructions), filling in the
+// rewrite and the flags it may change.  Returns the length matched, or 0.
+static int _match_peephole(struct instruction *x, size_t left, struct peephole *p)
+{ p->n_with = 1;
+  p->flags = 0;
+  switch (x[0].op)
+  { case OP_LD_R8_N8:
+      if (R8_A != x[0].p1 || 0 != x[0].p2) return 0;
+      p->with[0] = _PEEP(XOR_A_R8, R8_A, 0);
+      p->flags = 0xf0;
+      return 1;
+    case OP_CP_A_N8:
+      if (0 != x[0].p1) return 0;
+      p->with[0] = _PEEP(OR_A_R8, R8_A, 0);
+      p->flags = FLAG_N;
+      return 1;
+    case OP_SLA_R8:
+      if (R8_A != x[0].p1) return 0;
+      p->with[0] = _PEEP(ADD_A_R8, R8_A, 0);
+      p->flags = FLAG_H;
+      return 1;
+    case OP_RL_R8: case OP_RLC_R8: case OP_RR_R8: case OP_RRC_R8:
+      if (R8_A != x[0].p1) return 0;
+      p->with[0].op =
+        OP_RL_R8 == x[0].op ? OP_RLA : OP_RLC_R8 == x[0].op ? OP_RLCA
+      : OP_RR_R8 == x[0].op ? OP_RRA : OP_RRCA;
+      p->flags = FLAG_Z;
+      return 1;
+    case OP_ADD_A_N8: case OP_SUB_A_N8:
+      if (1 != x[0].p1) return 0;
+      p->with[0] = OP_ADD_A_N8 == x[0].op ? _PEEP(INC_R8, R8_A, 0) : _PEEP(DEC_R8, R8_A, 0);
+      p->flags = FLAG_C;
+      return 1;
+    default: break;
+  }
+  if (2 > left) return 0;
+  struct instruction y = x[1];
+  bool inc = OP_INC_R16 == y.op && R16_HL == y.p1;
+  bool dec = OP_DEC_R16 == y.op && R16_HL == y.p1;
+  if (OP_LD_IHL_R8 == x[0].op && R8_A == x[0].p1 && (inc || dec))
+  { p->with[0] = inc ? _PEEP(LD_IHLI_A, 0, 0) : _PEEP(LD_IHLD_A, 0, 0);
+    return 2;
+  }
+  if (OP_LD_R8_IHL == x[0].op && R8_A == x[0].p1 && (inc || dec))
+  { p->with[0] = inc ? _PEEP(LD_A_IHLI, 0, 0) : _PEEP(LD_A_IHLD, 0, 0);
+    return 2;
+  }
+  // copying a register back where it came from
+  if
+  (  OP_LD_R8_R8 == x[0].op && OP_LD_R8_R8 == y.op
+  && x[0].p1 == y.p2 && x[0].p2 == y.p1
+  )
+  { p->with[0] = x[0];
+    return 2;
+  }
+  return 0;
+}
 
-      { // trim comment
-        int n2 = char_in_range(';', n1, s1);
-        n1 = -1 != n2 ? n2 : n1;
-      }
+#undef _PEEP
 
-      trim_trailing_space(&n1, &s1);
-      trim_leading_space(&n1, &s1);
+static uint32_t _window_cycles(struct program *window)
+{ reg.pc = 0;
+  cycles = 0;
+  run_program(window);
+  return cycles;
+}
 
-      // parse label
-      if (':' == *s1)
-      { if (max_anonymous_labels == n_labels) panic;
-        labels[n_labels++] = program->length;
-        s1++; n1--;
-        trim_leading_space(&n1, &s1);
-      }
+// Find instruction sequences with cheaper equivalents, given which flags are
+// live after them.  Nothing jumps into a rewritten sequence.  Each rewrite is
+// checked against the original by compare_programs_over, over the registers
+// either reads, before it is suggested.  Returns the number of suggestions,
+// in order of isn, in a list to be freed.
+size_t suggest_peepholes(struct program *program, struct peephole **peepholes)
+{ size_t n = program->length, n_found = 0;
+  *peepholes = malloc(n * sizeof(struct peephole));
+  bool *target = jump_targets(program);
+  uint8_t *live = live_flags(program);
+
+  struct snapshot *s = malloc(sizeof(struct snapshot));
+  save_snapshot(s);
+  struct program *a = malloc(sizeof(struct program) + 2 * sizeof(struct instruction));
+  struct program *b = malloc(sizeof(struct program) + 2 * sizeof(struct instruction));
+  for (size_t i = 0; i < n; i++)
+  { struct peephole p = { i };
+    p.length = _match_peephole(&program->instructions[i], n - i, &p);
+    if (!p.length) continue;
+    if (2 == p.length && target[i + 1]) continue;
+    uint8_t live_after = live[i + p.length - 1];
+    if (p.flags & live_after) continue;
+
+    a->length = p.length;
+    memcpy(a->instructions, &program->instructions[i], p.length * sizeof(struct instruction));
+    b->length = p.n_with;
+    memcpy(b->instructions, p.with, p.n_with * sizeof(struct instruction));
+    uint16_t free_locs = (live_inputs(a) | live_inputs(b)) & LOC_ALL;
+    if (compare_programs_over(a, b, free_locs, NULL, 0, false, ~p.flags)) continue;
+
+    restore_snapshot(s);
+    p.cycles_saved = _window_cycles(a);
+    restore_snapshot(s);
+    p.cycles_saved -= _window_cycles(b);
+    (*peepholes)[n_found++] = p;
+    i += p.length - 1;
+  }
+  restore_snapshot(s);
+
+  free(s);
+  free(a);
+  free(b);
+  free(target);
+  free(live);
+  return n_found;
+}
 
-      if (n1)
-      { // parse instruction
 
-        enum isn_token isn_token;
-        struct arg_token arg_tokens[2] = { { 0, 0 }, { 0, 0 } };
-        int n_arg_tokens = 0;
+// mutation testing
 
-        int instruction_n = n1;
-        char *instruction_s = s1;
 
-        int n2 = char_in_range(' ', n1, s1);
-        isn_token = parse_isn_token(-1 != n2 ? n2 : n1, s1);
+enum mutation
+{ MUTATE_REGISTER    // a register operand for another
+, MUTATE_IMMEDIATE   // an immediate operand one up or down
+, MUTATE_CONDITION   // a condition for another
+, MUTATE_DELETE      // the instruction for a nop, so that jumps stay put
+, N_MUTATIONS
+};
 
-        while (-1 != n2)
-        { // parse argument
+const char *mutation_names[] = { "register", "immediate", "condition", "delete" };
 
-          s1 += 1 + n2;
-          n1 -= 1 + n2;
-          trim_leading_space(&n1, &s1);
+struct mutant
+{ size_t isn;
+  enum mutation kind;
+  struct instruction with;
+  bool killed;
+  bool tested;   // false if its worker died first
+};
 
-          if (2 == n_arg_tokens)
-            parse_error("too many argumnets", n1, s1);
+struct mutation_test
+{ struct program *program;
+  // Whether the program passes, run from the simulator state at the start of
+  // test_mutants; the program given is the mutant, not t->program.
+  bool (*test)(struct program *program);
+  uint32_t max_cycles;     // per run, 0 for 1 << 20
+  int workers;             // 0 for one per core
+  // filled in by test_mutants
+  struct mutant *mutants;
+  size_t n_mutants;
+  size_t survivors;
+  size_t untested;         // left by workers which died
+};
 
-          n2 = char_in_range(',', n1, s1);
+// Every mutant of a program, in order of isn, in a list to be freed.
+size_t make_mutants(struct program *program, struct mutant **mutants)
+{ size_t n = 0;
+  *mutants = malloc(20 * program->length * sizeof(struct mutant));
+  #define MUTANT(kind, field, value) \
+    { struct instruction y = x; \
+      y.field = value; \
+      (*mutants)[n++] = (struct mutant){ i, kind, y }; \
+    }
+  for (size_t i = 0; i < program->length; i++)
+  { if (OP_BREAK == program->instructions[i].op) continue;
+    struct instruction x = unfuse(program->instructions[i]);
+    x.op = flagged_op(x.op);
+    switch (op_args(x.op))
+    { case ARGS_R8: case ARGS_A_R8: case ARGS_R8_N8: case ARGS_IHL_R8: case ARGS_R8_IHL:
+        for (int r = 0; r < R8_L + 1; r++)
+          if (r != x.p1) MUTANT(MUTATE_REGISTER, p1, r);
+        break;
+      case ARGS_U3_R8:
+        for (int r = 0; r < R8_L + 1; r++)
+          if (r != x.p2) MUTANT(MUTATE_REGISTER, p2, r);
+        break;
+      case ARGS_R8_R8:
+        for (int r = 0; r < R8_L + 1; r++)
+          if (r != x.p1) MUTANT(MUTATE_REGISTER, p1, r);
+        for (int r = 0; r < R8_L + 1; r++)
+          if (r != x.p2) MUTANT(MUTATE_REGISTER, p2, r);
+        break;
+      case ARGS_HL_R16: case ARGS_R16: case ARGS_R16_N16: case ARGS_IR16_A: case ARGS_A_IR16:
+        for (int r = 0; r < R16_HL + 1; r++)
+          if (r != x.p1) MUTANT(MUTATE_REGISTER, p1, r);
+        break;
+      case ARGS_CC_N16: case ARGS_CC_E8: case ARGS_CC:
+        for (int cc = 0; cc < 4; cc++)
+          if (cc != x.p1) MUTANT(MUTATE_CONDITION, p1, cc);
+        break;
+      default: break;
+    }
+    switch (op_args(x.op))
+    { case ARGS_N8: case ARGS_A_N8: case ARGS_IHL_N8:
+        MUTANT(MUTATE_IMMEDIATE, p1, 0xff & x.p1 + 1);
+        MUTANT(MUTATE_IMMEDIATE, p1, 0xff & x.p1 - 1);
+        break;
+      case ARGS_U3_R8: case ARGS_U3_IHL:
+        MUTANT(MUTATE_IMMEDIATE, p1, 7 & x.p1 + 1);
+        MUTANT(MUTATE_IMMEDIATE, p1, 7 & x.p1 - 1);
+        break;
+      case ARGS_R8_N8:
+        MUTANT(MUTATE_IMMEDIATE, p2, 0xff & x.p2 + 1);
+        MUTANT(MUTATE_IMMEDIATE, p2, 0xff & x.p2 - 1);
+        break;
+      case ARGS_R16_N16:
+        MUTANT(MUTATE_IMMEDIATE, p2, x.p2 + 1);
+        MUTANT(MUTATE_IMMEDIATE, p2, x.p2 - 1);
+        break;
+      case ARGS_IN16_A: case ARGS_A_IN16: case ARGS_SP_N16: case ARGS_IN16_SP:
+      case ARGS_SP_E8: case ARGS_HL_SPE8:
+        MUTANT(MUTATE_IMMEDIATE, p1, x.p1 + 1);
+        MUTANT(MUTATE_IMMEDIATE, p1, x.p1 - 1);
+        break;
+      default: break;
+    }
+    (*mutants)[n++] = (struct mutant){ i, MUTATE_DELETE, { OP_NOP } };
+  }
+  #undef MUTANT
+  return n;
+}
 
-          int n3 = -1 != n2 ? n2 : n1;
-          while (' ' == s1[n3-1]) n3--;
+// whether the test passes on program, from s, with a panic or running out
+// of cycles as a failure
+static bool _mutant_passes
+( struct mutation_test *t, struct program *program
+, struct snapshot *s
+)
+{ restore_snapshot(s);
+  jmp_buf jump;
+  if (setjmp(jump))
+  { panic_jump = NULL;
+    cycle_limit = UINT32_MAX;
+    return false;
+  }
+  panic_jump = &jump;
+  cycle_limit = t->max_cycles;
+  bool pass = t->test(program);
+  panic_jump = NULL;
+  cycle_limit = UINT32_MAX;
+  return pass;
+}
 
-          arg_tokens[n_arg_tokens++] = parse_arg_token(n_symbols, symbols, n3, s1);
-        }
+// Run the test against every mutant of t->program, split over forked
+// workers, and mark the mutants it kills (by failing, panicking or running
+// over max_cycles).  The mutants run unfused, each by changing a single
+// instruction of a copy and putting it back.  Returns false, having tested
+// nothing, if the test fails on the program as it is, and false if a worker
+// dies, with the mutants it had yet to finish untested.
+bool test_mutants(struct mutation_test *t)
+{ struct program *program = t->program;
+  int workers = t->workers ? t->workers : sysconf(_SC_NPROCESSORS_ONLN);
+  if (!t->max_cycles) t->max_cycles = 1 << 20;
+
+  size_t size = sizeof(struct program) + program->length * sizeof(struct instruction);
+  struct program *copy = malloc(size);
+  copy->length = program->length;
+  for (size_t i = 0; i < program->length; i++)
+  { struct instruction x = unfuse(program->instructions[i]);
+    x.op = flagged_op(x.op);
+    copy->instructions[i] = x;
+  }
 
-        if (max_instructions == program->length) panic;
-        program->instructions[program->length++] = parse_instruction
-        ( isn_token, arg_tokens
-        , instruction_n, instruction_s
-        );
+  struct snapshot *s = malloc(sizeof(struct snapshot));
+  save_snapshot(s);
+  t->n_mutants = make_mutants(program, &t->mutants);
+  t->survivors = t->untested = 0;
+  bool passes = _mutant_passes(t, copy, s);
+  if (!passes) printf("the test fails on the program as it is\n");
+
+  size_t n = passes ? t->n_mutants : 0;
+  // killed for each mutant, then whether it was tested
+  struct { size_t next; bool killed[]; } *shared;
+  size_t shared_size = sizeof(*shared) + 2 * n + 1;
+  shared = mmap
+    (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == shared) panic;
+  bool *tested = shared->killed + n;
+
+  fflush(stdout);
+  for (int w = 0; passes && w < workers; w++)
+  { pid_t pid = fork();
+    if (0 > pid) panic;
+    if (pid) continue;
+    for (;;)
+    { size_t i = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED);
+      if (n <= i) break;
+      struct mutant *m = &t->mutants[i];
+      struct instruction x = copy->instructions[m->isn];
+      copy->instructions[m->isn] = m->with;
+      shared->killed[i] = !_mutant_passes(t, copy, s);
+      tested[i] = true;
+      copy->instructions[m->isn] = x;
+    }
+    exit(0);
+  }
+  bool complete = true;
+  for (int w = 0; passes && w < workers; w++)
+  { int status;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    { printf("a mutation worker died\n");
+      complete = false;
+    }
+  }
 
-        switch (program->instructions[program->length-1].op)
-        { case OP_JR_E8:
-            if (max_instructions == n_label_references) panic;
-            label_references[n_label_references++] = (struct label_reference)
-              { .isn = program->length-1
-              , .arg = 0
-              , .n = instruction_n
-              , .s = instruction_s
-              };
-            break;
-          case OP_JR_CC_E8:
-            if (max_instructions == n_label_references) panic;
-            label_references[n_label_references++] = (struct label_reference)
-              { .isn = program->length-1
-              , .arg = 1
-              , .n = instruction_n
-              , .s = instruction_s
-              };
-            break;
-          default:
-            break;
-        }
-      }
+  for (size_t i = 0; i < n; i++)
+  { struct mutant *m = &t->mutants[i];
+    m->tested = tested[i];
+    m->killed = shared->killed[i];
+    t->survivors += m->tested && !m->killed;
+    t->untested += !m->tested;
+  }
+  restore_snapshot(s);
+  munmap(shared, shared_size);
+  free(s);
+  free(copy);
+  return passes && complete;
+}
 
-      l++;
-      s += 1 + n;
-      n = next_newline(s);
+// List the surviving mutants by source line (by instruction index, without
+// a module), under the instruction they mutate.
+void print_survivors(struct module *module, struct mutation_test *t)
+{ char buf[32];
+  size_t line_isn = SIZE_MAX;
+  for (size_t i = 0; i < t->n_mutants; i++)
+  { struct mutant *m = &t->mutants[i];
+    if (m->killed || !m->tested) continue;
+    if (m->isn != line_isn)
+    { line_isn = m->isn;
+      if (module)
+        printf("%s:%d: ", module->files[m->isn] ? module->files[m->isn] : "", module->lines[m->isn]);
+      else printf("%zu: ", m->isn);
+      printf("%s\n", format_instruction(buf, t->program->instructions[m->isn]));
     }
+    if (MUTATE_DELETE == m->kind) printf("  %s\n", mutation_names[m->kind]);
+    else printf("  %-9s %s\n", mutation_names[m->kind], format_instruction(buf, m->with));
+  }
+  printf
+  ( "%zu of %zu mutants survive\n"
+  , t->survivors, t->n_mutants
+  );
+  if (t->untested) printf("%zu mutants were not tested\n", t->untested);
+}
 
-    // patch up anonymous label references
-    for (int i = 0, j = 0; i < n_label_references; i++)
-    { int isn = label_references[i].isn;
-      uint16_t *p;
-      switch (label_references[i].arg)
-      { case 0: p = &program->instructions[isn].p1; break;
-        case 1: p = &program->instructions[isn].p2; break;
-        default: panic;
-      }
 
-      while (n_labels != j && labels[j] < isn)
-        j++;
+// numeric accuracy
+
+
+#define ACCURACY_BINS 64
+#define ACCURACY_WORST 8
+#define ACCURACY_BATCH 256
+
+struct accuracy
+{ struct program *program;
+  uint16_t entry;            // called there, so it may return or run off the end
+  int bits;                  // of input numbers, up to 63 for every one
+  uint64_t samples;          // 0 for every input number, else a random sample
+  // Set up the registers and memory for input number v, returning the value
+  // it stands for.  Each starts from the registers at the start.
+  double (*input)(uint64_t v);
+  // the value that the results in reg and mem stand for
+  double (*output)(void);
+  double (*reference)(double x);
+  double step;               // of the histogram, 0 for 1: the output's resolution, say
+  int workers;               // 0 for one per core
+  uint64_t seed;             // for sampling, 0 for the time
+  uint32_t max_cycles;       // a run taking this many panics, 0 for 1 << 20
+  // filled in by measure_accuracy
+  uint64_t n;
+  uint64_t panics;           // inputs which panicked, left out of the rest
+  int workers_died;          // so some inputs went unmeasured
+  double max_error;          // absolute
+  double mean_error;         // absolute
+  double bias;               // the mean signed error
+  // signed errors in steps from -ACCURACY_BINS / 2, the end bins open
+  uint64_t histogram[ACCURACY_BINS];
+  uint64_t worst[ACCURACY_WORST];       // inputs with the largest errors
+  double worst_error[ACCURACY_WORST];   // signed, output less reference
+  size_t n_worst;
+};
 
-      int k = (int16_t)*p + j;
-      if (0 > k || n_labels <= k)
-        parse_error
-        ( "anonymous label does not exist"
-        , label_references[i].n, label_references[i].s
-        );
+// Interpret the low width bits of v as fixed point with fraction bits after
+// the point, as for signed 8.8 in hl: fixed_point(reg.hl, 16, 8, true).
+double fixed_point(uint64_t v, int width, int fraction, bool is_signed)
+{ uint64_t mask = 64 > width ? ((uint64_t)1 << width) - 1 : ~(uint64_t)0;
+  v &= mask;
+  double x = is_signed && v >> (width - 1) ? -(double)(mask - v + 1) : (double)v;
+  return x / ((uint64_t)1 << fraction);
+}
+
+struct _accuracy_part
+{ uint64_t n, panics;
+  double sum, abs_sum, max;
+  uint64_t histogram[ACCURACY_BINS];
+  uint64_t worst[ACCURACY_WORST];
+  double worst_error[ACCURACY_WORST];
+  size_t n_worst;
+};
+
+typedef double _error_vec __attribute__((vector_size(32)));
+typedef int64_t _error_mask __attribute__((vector_size(32)));
+
+// Fold a batch of signed errors (padded with zeros to a multiple of four)
+// into the sums and maximum, four at a time.
+static void _reduce_errors(double *errors, size_t n, struct _accuracy_part *part)
+{ _error_vec sum = { 0 }, abs_sum = { 0 }, max = { 0 };
+  for (size_t i = 0; i < n; i += 4)
+  { _error_vec e;
+    memcpy(&e, errors + i, sizeof(e));
+    _error_vec a = (_error_vec)((_error_mask)e & INT64_MAX);
+    _error_mask more = a > max;
+    max = (_error_vec)(more & (_error_mask)a | ~more & (_error_mask)max);
+    sum += e;
+    abs_sum += a;
+  }
+  for (int k = 0; k < 4; k++)
+  { part->sum += sum[k];
+    part->abs_sum += abs_sum[k];
+    if (max[k] > part->max) part->max = max[k];
+  }
+}
 
-      *p = labels[k] - isn - 1;
+// keep the inputs with the largest errors, largest first, each once
+static void _note_worst(struct _accuracy_part *part, uint64_t v, double error)
+{ for (size_t i = 0; i < part->n_worst; i++)
+    if (v == part->worst[i]) return;
+  double a = 0 > error ? -error : error;
+  size_t at = part->n_worst;
+  while (at && a > (0 > part->worst_error[at - 1] ? -1 : 1) * part->worst_error[at - 1]) at--;
+  if (ACCURACY_WORST <= at) return;
+  size_t last = ACCURACY_WORST > part->n_worst ? part->n_worst++ : ACCURACY_WORST - 1;
+  memmove(&part->worst[at + 1], &part->worst[at], (last - at) * sizeof(uint64_t));
+  memmove(&part->worst_error[at + 1], &part->worst_error[at], (last - at) * sizeof(double));
+  part->worst[at] = v;
+  part->worst_error[at] = error;
+}
+
+static void _note_error(struct _accuracy_part *part, uint64_t v, double error, double step)
+{ double bin = error / step + ACCURACY_BINS / 2;
+  part->histogram[0 > bin ? 0 : ACCURACY_BINS <= bin ? ACCURACY_BINS - 1 : (int)bin]++;
+  _note_worst(part, v, error);
+}
+
+static void _accuracy_worker(struct accuracy *a, struct _accuracy_part *part, int w, int workers)
+{ struct registers start = reg;
+  double errors[ACCURACY_BATCH];
+  size_t n_batch = 0;
+  uint64_t mask = 64 > a->bits ? ((uint64_t)1 << a->bits) - 1 : ~(uint64_t)0;
+  uint64_t state = a->seed + w * 0x9e3779b97f4a7c15 | 1;
+  uint64_t count = a->samples ? a->samples / workers + (w < a->samples % workers) : 0;
+  for (uint64_t i = w; a->samples ? count-- : i <= mask; i += workers)
+  { uint64_t v = i;
+    if (a->samples)
+    { state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      v = state & mask;
+    }
+    reg = start;
+    double x = a->input(v);
+    if (!_call_guarded(a->program, a->entry, a->max_cycles))
+    { part->panics++;
+      continue;
+    }
+    double error = a->output() - a->reference(x);
+    _note_error(part, v, error, a->step);
+    errors[n_batch++] = error;
+    part->n++;
+    if (ACCURACY_BATCH == n_batch)
+    { _reduce_errors(errors, n_batch, part);
+      n_batch = 0;
     }
   }
+  while (n_batch % 4) errors[n_batch++] = 0;
+  _reduce_errors(errors, n_batch, part);
+}
 
-  return program;
+// Run a routine over every input number of a domain, or a sample of it,
+// split over forked workers, and gather the distribution of its error
+// against a reference.  Inputs on which it panics or runs past max_cycles are
+// counted in panics rather than measured.
+void measure_accuracy(struct accuracy *a)
+{ int workers = a->workers ? a->workers : sysconf(_SC_NPROCESSORS_ONLN);
+  if (!a->step) a->step = 1;
+  if (!a->seed) a->seed = time(NULL);
+  if (!a->max_cycles) a->max_cycles = 1 << 20;
+  a->workers_died = 0;
+
+  size_t shared_size = workers * sizeof(struct _accuracy_part);
+  struct _accuracy_part *parts = mmap
+    (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == parts) panic;
+
+  struct snapshot *s = malloc(sizeof(struct snapshot));
+  save_snapshot(s);
+  fflush(stdout);
+  for (int w = 0; w < workers; w++)
+  { pid_t pid = fork();
+    if (0 > pid) panic;
+    if (pid) continue;
+    _accuracy_worker(a, &parts[w], w, workers);
+    exit(0);
+  }
+  for (int w = 0; w < workers; w++)
+  { int status;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    { printf("an accuracy worker died\n");
+      a->workers_died++;
+    }
+  }
+  restore_snapshot(s);
+  free(s);
+
+  struct _accuracy_part all = { 0 };
+  for (int w = 0; w < workers; w++)
+  { struct _accuracy_part *p = &parts[w];
+    all.n += p->n;
+    all.panics += p->panics;
+    all.sum += p->sum;
+    all.abs_sum += p->abs_sum;
+    if (p->max > all.max) all.max = p->max;
+    for (int i = 0; i < ACCURACY_BINS; i++) all.histogram[i] += p->histogram[i];
+    for (size_t i = 0; i < p->n_worst; i++)
+      _note_worst(&all, p->worst[i], p->worst_error[i]);
+  }
+  munmap(parts, shared_size);
+
+  a->n = all.n;
+  a->panics = all.panics;
+  a->max_error = all.max;
+  a->mean_error = all.n ? all.abs_sum / all.n : 0;
+  a->bias = all.n ? all.sum / all.n : 0;
+  memcpy(a->histogram, all.histogram, sizeof(a->histogram));
+  memcpy(a->worst, all.worst, sizeof(a->worst));
+  memcpy(a->worst_error, all.worst_error, sizeof(a->worst_error));
+  a->n_worst = all.n_worst;
 }
 
+// Write the histogram as CSV, a row per bin: the signed error it starts at
+// (the first open below), and the number of inputs.
+void write_accuracy_csv(FILE *out, struct accuracy *a)
+{ fprintf(out, "error,inputs\n");
+  for (int i = 0; i < ACCURACY_BINS; i++)
+    fprintf(out, "%g,%llu\n", (i - ACCURACY_BINS / 2) * a->step, (unsigned long long)a->histogram[i]);
+}
 
-struct program *parse_program_file
-( struct symbol *symbols, size_t n_symbols
-, char *filename
-)
-{ char code[1 << 16];
-  int f = open(filename, O_RDONLY);
-  if (!f) panic;
-  size_t n = read(f, code, sizeof(code));
-  if (sizeof(code) == n) panic;
-  code[n] = 0;
-  close(f);
-  return parse_program(symbols, n_symbols, code);
+// Write the statistics, histogram and worst inputs as JSON.
+void write_accuracy_json(FILE *out, struct accuracy *a)
+{ fprintf(out, "{\n  \"inputs\": %llu,\n", (unsigned long long)a->n);
+  fprintf(out, "  \"panics\": %llu,\n", (unsigned long long)a->panics);
+  fprintf(out, "  \"workers_died\": %d,\n", a->workers_died);
+  fprintf(out, "  \"max_error\": %g,\n", a->max_error);
+  fprintf(out, "  \"mean_error\": %g,\n", a->mean_error);
+  fprintf(out, "  \"bias\": %g,\n", a->bias);
+  fprintf(out, "  \"step\": %g,\n  \"histogram\": [", a->step);
+  for (int i = 0; i < ACCURACY_BINS; i++)
+    fprintf(out, "%s%llu", i ? ", " : "", (unsigned long long)a->histogram[i]);
+  fprintf(out, "],\n  \"worst\": [\n");
+  for (size_t i = 0; i < a->n_worst; i++)
+    fprintf
+    ( out, "    { \"input\": %llu, \"error\": %g }%s\n"
+    , (unsigned long long)a->worst[i], a->worst_error[i], i + 1 < a->n_worst ? "," : ""
+    );
+  fprintf(out, "  ]\n}\n");
 }
+
+
+// cycle distributions
+
+
+#define CYCLE_BUCKETS (1 << 16)
+#define CYCLE_MAX_INPUTS 8
+
+struct cycle_profile
+{ struct program *program;
+  uint16_t entry;            // called there, so it may return or run off the end
+  int bits;                  // of input numbers, up to 63 for every one
+  uint64_t samples;          // 0 for every input number, else a random sample
+  // Set up the registers and memory for input number v.  Each starts from
+  // the registers at the start.
+  void (*input)(uint64_t v);
+  int workers;               // 0 for one per core
+  uint64_t seed;             // for sampling, 0 for the time
+  uint32_t max_cycles;       // a run taking this many panics, 0 for 1 << 20
+  // filled in by profile_cycles
+  uint64_t n;
+  uint64_t panics;           // inputs which panicked, left out of the rest
+  uint64_t first_panic;      // the first such input, if any
+  int workers_died;          // so some inputs went unprofiled
+  uint32_t min, max;
+  double mean;
+  // runs by cycles taken, the last bucket for CYCLE_BUCKETS - 1 or more
+  uint64_t histogram[CYCLE_BUCKETS];
+  uint64_t n_at_max;
+  uint64_t at_max[CYCLE_MAX_INPUTS];   // the first few inputs taking max
+  size_t n_at_max_listed;
+};
+
+struct _cycle_part
+{ uint64_t n, total;
+  uint64_t panics, first_panic;
+  uint32_t min, max;
+  uint64_t n_at_max;
+  uint64_t at_max[CYCLE_MAX_INPUTS];
+  uint64_t histogram[CYCLE_BUCKETS];
+};
+
+static void _cycle_worker(struct cycle_profile *p, struct _cycle_part *part, int w, int workers)
+{ struct registers start = reg;
+  uint64_t mask = ((uint64_t)1 << p->bits) - 1;
+  uint64_t state = p->seed + w * 0x9e3779b97f4a7c15 | 1;
+  uint64_t count = p->samples ? p->samples / workers + (w < p->samples % workers) : 0;
+  part->min = UINT32_MAX;
+  for (uint64_t i = w; p->samples ? count-- : i <= mask; i += workers)
+  { uint64_t v = i;
+    if (p->samples)
+    { state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      v = state & mask;
+    }
+    reg = start;
+    p->input(v);
+    if (!_call_guarded(p->program, p->entry, p->max_cycles))
+    { if (!part->panics++) part->first_panic = v;
+      continue;
+    }
+    part->histogram[CYCLE_BUCKETS > cycles ? cycles : CYCLE_BUCKETS - 1]++;
+    part->n++;
+    part->total += cycles;
+    if (cycles < part->min) part->min = cycles;
+    if (cycles > part->max)
+    { part->max = cycles;
+      part->n_at_max = 0;
+    }
+    if (cycles == part->max && CYCLE_MAX_INPUTS > part->n_at_max++)
+      part->at_max[part->n_at_max - 1] = v;
+  }
+}
+
+// Run a routine over every input number of a domain, or a sample of it,
+// split over forked workers, and gather the distribution of the cycles it
+// takes.  Each worker keeps a histogram, and they are summed at the end.
+// Inputs on which it panics or runs past max_cycles are counted in panics.
+void profile_cycles(struct cycle_profile *p)
+{ int workers = p->workers ? p->workers : sysconf(_SC_NPROCESSORS_ONLN);
+  if (!p->seed) p->seed = time(NULL);
+  if (!p->max_cycles) p->max_cycles = 1 << 20;
+  p->workers_died = 0;
+
+  size_t shared_size = workers * sizeof(struct _cycle_part);
+  struct _cycle_part *parts = mmap
+    (NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == parts) panic;
+
+  struct snapshot *s = malloc(sizeof(struct snapshot));
+  save_snapshot(s);
+  fflush(stdout);
+  for (int w = 0; w < workers; w++)
+  { pid_t pid = fork();
+    if (0 > pid) panic;
+    if (pid) continue;
+    _cycle_worker(p, &parts[w], w, workers);
+    exit(0);
+  }
+  for (int w = 0; w < workers; w++)
+  { int status;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    { printf("a cycle profile worker died\n");
+      p->workers_died++;
+    }
+  }
+  restore_snapshot(s);
+  free(s);
+
+  uint64_t total = 0;
+  p->n = p->max = p->n_at_max = p->n_at_max_listed = p->panics = 0;
+  p->min = UINT32_MAX;
+  memset(p->histogram, 0, sizeof(p->histogram));
+  for (int w = 0; w < workers; w++)
+    if (parts[w].n && parts[w].max > p->max) p->max = parts[w].max;
+  for (int w = 0; w < workers; w++)
+  { struct _cycle_part *part = &parts[w];
+    p->n += part->n;
+    total += part->total;
+    if (part->panics && !p->panics) p->first_panic = part->first_panic;
+    p->panics += part->panics;
+    if (part->n && part->min < p->min) p->min = part->min;
+    for (int i = 0; i < CYCLE_BUCKETS; i++) p->histogram[i] += part->histogram[i];
+    if (!part->n || part->max != p->max) continue;
+    p->n_at_max += part->n_at_max;
+    for (int i = 0; i < part->n_at_max && i < CYCLE_MAX_INPUTS; i++)
+      if (CYCLE_MAX_INPUTS > p->n_at_max_listed)
+        p->at_max[p->n_at_max_listed++] = part->at_max[i];
+  }
+  p->mean = p->n ? (double)total / p->n : 0;
+  munmap(parts, shared_size);
+}
+
+// the fewest cycles which at least fraction of the runs took no more than
+uint32_t cycle_percentile(struct cycle_profile *p, double fraction)
+{ uint64_t want = fraction * p->n, seen = 0;
+  if (want < fraction * p->n || !want) want++;
+  for (uint32_t c = 0; c < CYCLE_BUCKETS; c++)
+    if (want <= (seen += p->histogram[c])) return c;
+  return p->max;
+}
+
+void print_cycle_profile(struct cycle_profile *p)
+{ if (p->n)
+  { printf
+    ( "%llu inputs, cycles %u to %u, mean %.2f\n"
+    , (unsigned long long)p->n, p->min, p->max, p->mean
+    );
+    printf
+    ( "percentiles: 50%% %u, 90%% %u, 99%% %u, 99.9%% %u\n"
+    , cycle_percentile(p, 0.5), cycle_percentile(p, 0.9)
+    , cycle_percentile(p, 0.99), cycle_percentile(p, 0.999)
+    );
+    printf("%llu inputs take %u cycles:", (unsigned long long)p->n_at_max, p->max);
+    for (size_t i = 0; i < p->n_at_max_listed; i++)
+      printf(" %llx", (unsigned long long)p->at_max[i]);
+    printf("%s\n", p->n_at_max > p->n_at_max_listed ? " ..." : "");
+  }
+  if (p->panics)
+    printf
+    ( "%llu inputs panic or run past %u cycles, first %llx\n"
+    , (unsigned long long)p->panics, p->max_cycles, (unsigned long long)p->first_panic
+    );
+}
+
+
+// shadow memory reports
+
+
+#ifdef SHADOW_MEMORY
+
+// List the instructions which read uninitialized memory, by source line where
+// module has the program (by index otherwise, or by address under
+// run_machine), and the lowest SP reached.
+void print_uninitialized_reads(struct module *module)
+{ char buf[32];
+  for (size_t i = 0; i < n_uninitialized_reads; i++)
+  { struct uninitialized_read *r = &uninitialized_reads[i];
+    if (!r->program) printf("$%04x", r->isn);
+    else if (module && r->program == module->program)
+      printf("%s:%d", module->files[r->isn] ? module->files[r->isn] : "", module->lines[r->isn]);
+    else printf("%d", r->isn);
+    if (r->program) printf(": %s", format_instruction(buf, r->program->instructions[r->isn]));
+    printf(" reads uninitialized $%04x\n", r->addr);
+  }
+  printf
+  ( "%llu uninitialized reads, lowest sp $%04x\n"
+  , (unsigned long long)uninitialized_read_count, lowest_sp
+  );
+}
+
+#endif
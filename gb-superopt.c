@@ -0,0 +1,121 @@
+#include "gb-sim.h"
+
+
+// Find the cheapest sequence of register instructions doing what a routine
+// does, and write it out as source.
+//
+//   gb-superopt routine.asm [in=a] [out=hl,cf] [scratch=b] [max=8] [name=value ...]
+//
+// Registers are a f b c d e h l and the pairs af bc de hl; as outputs, zf nf
+// hf cf are single flags where f is all four.  Inputs default to the
+// registers the routine reads, outputs to those it writes (flags aside), and
+// max to the cycles it takes.  Immediate operands are drawn from those in the
+// routine, and 0, 1 and $ff.  Other assignments are symbols for the routine.
+// Values are hexadecimal.
+
+static bool parse_locs(char *list, uint16_t *locs, uint8_t *flags)
+{ static struct { char *name; uint16_t locs; uint8_t flags; } names[] =
+  { "a", LOC_A, 0, "f", LOC_F, 0xf0
+  , "b", LOC_B, 0, "c", LOC_C, 0
+  , "d", LOC_D, 0, "e", LOC_E, 0
+  , "h", LOC_H, 0, "l", LOC_L, 0
+  , "af", LOC_A | LOC_F, 0xf0, "bc", LOC_BC, 0
+  , "de", LOC_DE, 0, "hl", LOC_HL, 0
+  , "zf", 0, FLAG_Z, "nf", 0, FLAG_N
+  , "hf", 0, FLAG_H, "cf", 0, FLAG_C
+  };
+  for (char *item = strtok(list, ","); item; item = strtok(NULL, ","))
+  { int i = 0;
+    while (i < listsize(names) && strcmp(item, names[i].name)) i++;
+    if (listsize(names) == i) return false;
+    *locs |= names[i].locs;
+    *flags |= names[i].flags;
+  }
+  return true;
+}
+
+
+int main(int argc, char **argv)
+{ if (2 > argc)
+  { printf("usage: %s routine.asm [in=...] [out=...] [scratch=...] [max=n] [name=value ...]\n", argv[0]);
+    return 1;
+  }
+
+  struct symbol symbols[argc];
+  size_t n_symbols = 0;
+  uint16_t inputs = 0, outputs = 0, scratch = 0;
+  uint8_t input_flags = 0, output_flags = 0, scratch_flags = 0;
+  bool in = false, out = false;
+  int max_cycles = 0;
+  for (int i = 2; i < argc; i++)
+  { char *value = strchr(argv[i], '=');
+    bool ok = value;
+    if (!value);
+    else if (!strncmp(argv[i], "in=", 3))
+    { in = true;
+      ok = parse_locs(value + 1, &inputs, &input_flags);
+    }
+    else if (!strncmp(argv[i], "out=", 4))
+    { out = true;
+      ok = parse_locs(value + 1, &outputs, &output_flags);
+    }
+    else if (!strncmp(argv[i], "scratch=", 8))
+      ok = parse_locs(value + 1, &scratch, &scratch_flags);
+    else if (!strncmp(argv[i], "max=", 4))
+      max_cycles = strtol(value + 1, NULL, 10);
+    else if (value - argv[i] < sizeof(symbols->name))
+    { *value = 0;
+      strcpy(symbols[n_symbols].name, argv[i]);
+      symbols[n_symbols++].value = strtol(value + 1, NULL, 16);
+    }
+    else ok = false;
+    if (!ok)
+    { printf("bad argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  struct program *reference = parse_program_file(symbols, n_symbols, argv[1]);
+  if (!in) inputs = live_inputs(reference) & LOC_ALL & ~LOC_SP;
+  if (!out)
+    for (int i = 0; i < reference->length; i++)
+      outputs |= instruction_access(reference->instructions[i]).writes & ~LOC_F & ~LOC_SP;
+  if (!max_cycles)
+  { run_program(reference);
+    max_cycles = cycles;
+  }
+
+  uint8_t constants[256] = { 0x00, 0x01, 0xff };
+  size_t n_constants = 3;
+  for (int i = 0; i < reference->length; i++)
+  { struct instruction x = reference->instructions[i];
+    int n8;
+    switch (flagged_op(x.op))
+    { case OP_ADC_A_N8: case OP_ADD_A_N8: case OP_AND_A_N8: case OP_CP_A_N8:
+      case OP_OR_A_N8: case OP_SBC_A_N8: case OP_SUB_A_N8: case OP_XOR_A_N8:
+        n8 = x.p1;
+        break;
+      case OP_LD_R8_N8:
+        n8 = x.p2;
+        break;
+      default:
+        continue;
+    }
+    if (!memchr(constants, n8, n_constants)) constants[n_constants++] = n8;
+  }
+
+  struct superopt so =
+  { reference, NULL
+  , inputs, outputs & ~LOC_F, output_flags, scratch
+  , constants, n_constants, max_cycles
+  };
+  struct program *program = superoptimize(&so);
+  if (!program)
+  { printf("; nothing within %d cycles\n", max_cycles);
+    return 1;
+  }
+  run_program(program);
+  printf("; %d cycles\n", cycles);
+  write_program(stdout, program);
+  return 0;
+}
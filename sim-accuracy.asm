@@ -0,0 +1,8 @@
+; a = a * a, for a fraction in 0.8 fixed point, rounded to nearest
+square:
+  ld e, a
+  call mul8
+  ld a, h
+  sla l
+  adc a, 0
+  ret
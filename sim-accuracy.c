@@ -0,0 +1,51 @@
+#include "gb-sim.h"
+
+
+double fraction(uint64_t v)
+{ reg.sp = 0xfffe;
+  reg.a = v;
+  return fixed_point(v, 8, 8, false);
+}
+
+double result()
+{ return fixed_point(reg.a, 8, 8, false); }
+
+double square(double x)
+{ return x * x; }
+
+
+int main(int argc, char **argv)
+{ struct module *modules[] =
+  { parse_module_file(NULL, 0, "sim-accuracy.asm")
+  , parse_module_file(NULL, 0, "sim-mul.asm")
+  };
+  struct module *linked = link_modules(listsize(modules), modules);
+
+  struct accuracy a =
+  { .program = linked->program
+  , .entry = find_label(linked, "square")
+  , .bits = 8
+  , .input = fraction
+  , .output = result
+  , .reference = square
+  , .step = 1.0 / 1024
+  };
+  measure_accuracy(&a);
+  if (a.workers_died) return 1;
+  printf
+  ( "%llu inputs, max error %g (%.2f ulp), mean %g, bias %g, %llu panics\n"
+  , (unsigned long long)a.n, a.max_error, a.max_error * 256, a.mean_error, a.bias
+  , (unsigned long long)a.panics
+  );
+  for (size_t i = 0; i < a.n_worst; i++)
+    printf("  $%02llx: %+g\n", (unsigned long long)a.worst[i], a.worst_error[i]);
+
+  FILE *out = fopen("sim-accuracy.json", "w");
+  write_accuracy_json(out, &a);
+  fclose(out);
+  out = fopen("sim-accuracy.csv", "w");
+  write_accuracy_csv(out, &a);
+  fclose(out);
+  printf("wrote sim-accuracy.json and sim-accuracy.csv\n");
+  return 0;
+}
@@ -0,0 +1,9 @@
+  ld e, 0
+  xor a, a
+  ld b, 8
+: sla c
+  adc a, a
+  daa
+  rl e
+  dec b
+  jr nz, :-
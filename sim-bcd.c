@@ -0,0 +1,41 @@
+#include "gb-sim.h"
+#include <time.h>
+
+
+double seconds()
+{ struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+int main(int argc, char **argv)
+{ struct program *program =
+    parse_program_file(NULL, 0, "sim-bcd.asm");
+
+  printf("%zu alu table mismatches\n", build_alu_tables());
+
+  void (*engines[])(struct program *) = { run_program, run_program_alu_tables };
+  char *names[] = { "switch", "tables" };
+  for (int i = 0; i < listsize(engines); i++)
+  { size_t bad = 0;
+    for (int n = 0; n < 256; n++)
+    { reg.c = n;
+      engines[i](program);
+      int bcd = reg.e * 100 + (reg.a >> 4) * 10 + (0x0f & reg.a);
+      bad += n != bcd;
+    }
+
+    double t0 = seconds();
+    for (int j = 0; j < 1000000; j++)
+    { reg.c = j;
+      engines[i](program);
+    }
+    printf
+    ( "%s: %zu wrong, %d cycles, %.0f ns/run\n"
+    , names[i], bad, cycles, (seconds() - t0) * 1e3
+    );
+  }
+
+  return 0;
+}
@@ -0,0 +1,14 @@
+; bc = x * y + u * v
+main:
+  ld a, x
+  ld e, y
+  call mul8
+  push hl
+  ld a, u
+  ld e, v
+  call mul8
+  pop bc
+  add hl, bc
+  ld b, h
+  ld c, l
+  ret
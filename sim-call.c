@@ -0,0 +1,24 @@
+#include "gb-sim.h"
+
+
+int main(int argc, char **argv)
+{ struct symbol symbols[] =
+  { "x", 200
+  , "y", 100
+  , "u", 12
+  , "v", 34
+  };
+
+  struct module *modules[] =
+  { parse_module_file(symbols, listsize(symbols), "sim-call.asm")
+  , parse_module_file(symbols, listsize(symbols), "sim-mul.asm")
+  };
+  struct module *linked = link_modules(listsize(modules), modules);
+
+  reg.sp = 0xfffe;
+  call_program(linked->program, find_label(linked, "main"));
+  printf("%d cycles\n", cycles);
+  status();
+  printf("%d\n", reg.bc);
+  return 0;
+}
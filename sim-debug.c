@@ -0,0 +1,43 @@
+#include "gb-sim.h"
+
+
+void show_break(struct program *program, uint16_t isn)
+{ printf("break at instruction %d:\n", isn);
+  status();
+}
+
+void show_watch(struct watch_hit hit)
+{ printf
+  ( "%s %02x at %04x by instruction %d\n"
+  , hit.write ? "write" : "read", hit.val, hit.addr, hit.isn
+  );
+}
+
+
+int main(int argc, char **argv)
+{ uint16_t dst = 0xc000;
+  uint16_t src = 0x0100;
+  char *hello = "hello";
+  memcpy(&mem[src], hello, strlen(hello));
+
+  struct symbol symbols[] =
+  { "dst", dst
+  , "src", src
+  , "len", strlen(hello)
+  };
+
+  struct module *module =
+    parse_module_file(symbols, listsize(symbols), "sim-hello.asm");
+  struct module *linked = link_modules(1, &module);
+
+  // report each pass through the loop, and the write of the last byte
+  on_breakpoint = show_break;
+  on_watch = show_watch;
+  break_at_line(linked, "sim-hello.asm", 7);
+  watch_memory(dst + 4, 1, false, true);
+
+  run_program(linked->program);
+  printf("%d cycles\n", cycles);
+  printf("%s\n", &mem[dst]);
+  return 0;
+}
@@ -0,0 +1,93 @@
+#include "gb-sim.h"
+
+
+// Lay memory out as the hardware does, and check that a write to ROM and a
+// read of the unusable area after OAM are reported against the instructions
+// making them, both from source and assembled under run_machine, that echo
+// RAM mirrors WRAM, and that a hooked IO register sees what is written to it.
+
+char *source =
+  "  ld a, $42\n"
+  "  ld hl, $e010\n"   // echo RAM
+  "  ld [hl], a\n"
+  "  ld hl, $2000\n"   // ROM
+  "  ld [hl], a\n"
+  "  ld hl, $fea0\n"   // unusable
+  "  ld a, [hl]\n"
+  "  ld hl, $ff01\n"   // hooked
+  "  ld [hl], a\n"
+  ;
+
+uint8_t serial[16];
+int n_serial;
+
+void write_serial(uint16_t addr, uint8_t val)
+{ if (n_serial < listsize(serial)) serial[n_serial] = val;
+  n_serial++;
+}
+
+// the faults expected, with the instruction (or address) of each
+int check(struct program *program, uint16_t rom_write, uint16_t unusable_read)
+{ struct memory_fault expected[] =
+  { { program, rom_write, 0x2000, true }
+  , { program, unusable_read, 0xfea0, false }
+  };
+  int failed = 0;
+  if (listsize(expected) != n_memory_faults)
+  { printf("%zu faults, expected %zu\n", n_memory_faults, listsize(expected));
+    failed++;
+  }
+  for (int i = 0; i < listsize(expected) && i < n_memory_faults; i++)
+  { struct memory_fault *e = &expected[i], *f = &memory_faults[i];
+    if (e->program != f->program || e->isn != f->isn || e->addr != f->addr || e->write != f->write)
+    { printf
+      ( "fault %d: %s of %04x at %d, expected %s of %04x at %d\n", i
+      , f->write ? "write" : "read", f->addr, f->isn
+      , e->write ? "write" : "read", e->addr, e->isn
+      );
+      failed++;
+    }
+  }
+  if (0x42 != mem[0xc010])
+  { printf("echo RAM: c010 is %02x\n", mem[0xc010]);
+    failed++;
+  }
+  if (1 != n_serial || 0xff != serial[0])
+  { printf("serial: %d writes, the first %02x\n", n_serial, serial[0]);
+    failed++;
+  }
+  return failed;
+}
+
+void reset()
+{ memset(mem, 0, sizeof(mem));
+  n_memory_faults = 0;
+  n_serial = 0;
+  map_hardware_layout();
+  hook_io(0xff01, NULL, write_serial);
+}
+
+
+int main(int argc, char **argv)
+{ print_memory_faults = true;
+  int failed = 0;
+
+  printf("from source:\n");
+  reset();
+  struct program *program = parse_program(NULL, 0, source);
+  run_program(program);
+  failed += check(program, 4, 6);
+
+  // ld a, n8 takes two bytes, ld hl, n16 three and ld [hl], a one
+  printf("under run_machine:\n");
+  reset();
+  uint16_t origin = 0x4000;
+  uint16_t end = assemble_program(program, origin);
+  reg.pc = origin;
+  run_machine(end);
+  failed += check(NULL, origin + 9, origin + 13);
+
+  printf("%s\n", failed ? "failed" : "ok");
+  free(program);
+  return failed;
+}
@@ -0,0 +1,77 @@
+#include "gb-sim.h"
+
+
+// Flags are only skipped where nothing can see them: the carry from cp is
+// read after a jr, the carry from sub after a call to a routine which leaves
+// it alone, and the flags from and are read by the caller after a ret.  Only
+// the flags of the add, which cp overwrites, and of the inc d before the sub,
+// are dead.
+
+char *source =
+  "  add a, b\n"        // 0: dead
+  "  cp a, c\n"         // 1: read after the jr
+  "  jr test\n"
+  "  ld a, 0\n"
+  "test:\n"
+  "  jr c, borrow\n"
+  "  inc d\n"           // 5: dead
+  "borrow:\n"
+  "  sub a, b\n"        // 6: read after the call
+  "  call f\n"
+  "  jr nc, :+\n"
+  "  inc d\n"
+  ": call g\n"
+  "  jr z, end\n"
+  "  inc d\n"
+  "  jr end\n"
+  "f:\n"
+  "  inc e\n"
+  "  ret\n"
+  "g:\n"
+  "  and a, e\n"        // 16: read after the ret
+  "  ret\n"
+  "end:\n"
+  ;
+
+int expected[][2] = { { 0, true }, { 1, false }, { 5, true }, { 6, false }, { 16, false } };
+
+
+int main(int argc, char **argv)
+{ struct program *program = parse_program(NULL, 0, source);
+  struct program *optimized = optimize_flags(program);
+  int failed = 0;
+
+  for (int i = 0; i < listsize(expected); i++)
+  { int isn = expected[i][0];
+    bool skipped = program->instructions[isn].op != optimized->instructions[isn].op;
+    char buf[32];
+    printf
+    ( "%2d: %-10s flags %s\n", isn, format_instruction(buf, program->instructions[isn])
+    , skipped ? "skipped" : "kept"
+    );
+    failed += skipped != expected[i][1];
+  }
+
+  reg.sp = 0xfffe;
+  size_t mismatches = check_flags(program, optimized);
+  printf("%zu mismatches\n", mismatches);
+  failed += 0 < mismatches;
+
+  // and from one input, side by side
+  struct registers r0 = { .a = 0x12, .b = 0x34, .c = 0x56, .e = 0xff, .sp = 0xfffe };
+  reg = r0;
+  run_program(program);
+  struct registers r1 = reg;
+  uint32_t c1 = cycles;
+  reg = r0;
+  run_program(optimized);
+  if (memcmp(&r1, &reg, sizeof(reg)) || c1 != cycles)
+  { printf("differs from the original:\n");
+    status();
+    failed++;
+  }
+
+  free(program);
+  free(optimized);
+  return failed;
+}
@@ -0,0 +1,111 @@
+#include "gb-sim.h"
+
+
+// Each fused loop against the loop it stands for, run as written, from the
+// same random registers and memory: pointers close enough for copies to
+// overlap, counts from 1 to 256 (c = 0), strings which mostly match, so that
+// compares run some way before they stop, and copies and fills into a
+// write-only port, which reads as ff and counts any read of it.
+
+char *names[] = { "copy [de] to [hli]", "copy [hli] to [de]", "fill [hli]", "compare [de], [hl]" };
+
+char *loops[] =
+{ ": ld a, [de]\n  ld [hli], a\n  inc de\n  dec c\n  jr nz, :-\n"
+, ": ld a, [hli]\n  ld [de], a\n  inc de\n  dec c\n  jr nz, :-\n"
+, ": ld [hli], a\n  dec c\n  jr nz, :-\n"
+, ": ld a, [de]\n  cp a, [hl]\n  jr nz, :+\n  inc de\n  inc hl\n  dec c\n  jr nz, :-\n:\n"
+};
+
+uint8_t port[0x100];
+int port_reads;
+
+uint8_t read_port(uint16_t addr)
+{ port_reads++;
+  return 0xff;
+}
+
+void write_port(uint16_t addr, uint8_t val)
+{ port[0xff & addr] = val; }
+
+// a copy of a program with its fused loops run as written
+struct program *unfused(struct program *program)
+{ size_t size = sizeof(struct program) + program->length * sizeof(struct instruction);
+  struct program *copy = malloc(size);
+  memcpy(copy, program, size);
+  for (size_t i = 0; i < copy->length; i++)
+    copy->instructions[i] = unfuse(copy->instructions[i]);
+  return copy;
+}
+
+
+int main(int argc, char **argv)
+{ map_handlers(0xd000, 0x100, read_port, write_port);
+  struct snapshot *s0 = malloc(sizeof(struct snapshot));
+  struct snapshot *s1 = malloc(sizeof(struct snapshot));
+  int failed = 0;
+
+  for (int i = 0; i < listsize(loops); i++)
+  { struct program *fused = parse_program(NULL, 0, loops[i]);
+    struct program *loop = unfused(fused);
+    printf("%-20s ", names[i]);
+    if (OP_COPY_DE_HLI > fused->instructions[0].op)
+    { printf("not fused\n");
+      failed++;
+      continue;
+    }
+
+    enum op op = fused->instructions[0].op;
+    int mismatches = 0;
+    for (int trial = 0; trial < 4096; trial++)
+    { for (int j = 0xc000; j < 0xc400; j++) mem[j] = rand();
+      reg.a = rand();
+      reg.f = rand() & 0xf0;
+      reg.bc = rand();
+      reg.de = 0xc000 + rand() % 0x200;
+      reg.hl = 0 == trial % 4 ? reg.de + rand() % 3 - 1 : 0xc000 + rand() % 0x200;
+      if (1 == trial % 4 && OP_COPY_HLI_DE == op)
+      { reg.de = 0xd000;
+        reg.c = rand() % 0x100 + 1;
+      }
+      else if (1 == trial % 4 && OP_CMP_DE_HL != op)
+      { reg.hl = 0xd000;
+        reg.c = rand() % 0x100 + 1;
+      }
+      memset(port, 0, sizeof(port));
+      port_reads = 0;
+      // strings which match up to a random point, or all the way
+      if (OP_CMP_DE_HL == op)
+      { memmove(&mem[reg.hl], &mem[reg.de], 0x100);
+        if (trial % 2) mem[reg.hl + rand() % 0x100] ^= 1 + rand() % 0xff;
+      }
+      save_snapshot(s0);
+
+      run_program(fused);
+      save_snapshot(s1);
+      uint8_t fused_port[0x100];
+      memcpy(fused_port, port, sizeof(port));
+      int fused_port_reads = port_reads;
+      restore_snapshot(s0);
+      memset(port, 0, sizeof(port));
+      port_reads = 0;
+      run_program(loop);
+
+      if
+      (  reg.af != s1->reg.af || reg.bc != s1->reg.bc
+      || reg.de != s1->reg.de || reg.hl != s1->reg.hl
+      || cycles != s1->cycles || memcmp(mem, s1->mem, sizeof(mem))
+      || memcmp(port, fused_port, sizeof(port)) || port_reads != fused_port_reads
+      )
+      { if (!mismatches)
+        { printf("differs from\n");
+          restore_snapshot(s0);
+          status();
+        }
+        mismatches++;
+      }
+    }
+    printf("%d mismatches\n", mismatches);
+    failed += 0 < mismatches;
+  }
+  return failed;
+}
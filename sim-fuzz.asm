@@ -0,0 +1,8 @@
+  swap a
+  and a, $0f
+  ld hl, buf
+  add a, l
+  ld l, a
+  jr nc, :+
+  inc h
+: inc [hl]
@@ -0,0 +1,22 @@
+#include "gb-sim.h"
+
+
+int main(int argc, char **argv)
+{ // count a into one of 8 bins of 32, forgetting that a's high nibble can
+  // index up to 16
+  uint16_t buf = 0xc000;
+  struct symbol symbols[] = { "buf", buf };
+  struct program *program =
+    parse_program_file(symbols, listsize(symbols), "sim-fuzz.asm");
+
+  struct mem_range writable[] = { { buf, 8 } };
+  struct fuzz f =
+  { .program = program
+  , .inputs = LOC_A
+  , .writable = writable
+  , .n_writable = listsize(writable)
+  , .runs = 100000
+  , .crash_dir = "fuzz-crashes"
+  };
+  return !fuzz(&f);
+}
@@ -0,0 +1,89 @@
+#include "gb-sim.h"
+
+
+// LY and the STAT mode at known points in the frame, counted in M-cycles from
+// where start_lcd_at puts it, and VRAM and OAM accesses either side of the
+// mode 2 and mode 3 boundaries, which are timed from the start of the
+// instruction making them.
+
+int failed;
+
+// let n M-cycles pass, a nop at a time
+void advance(int n)
+{ static struct program *nop;
+  if (!nop) nop = parse_program(NULL, 0, "  nop\n");
+  for (int i = 0; i < n; i++) run_program(nop);
+}
+
+void expect(char *what, int ly, int mode)
+{ int got_ly = read8(R_LY), got_mode = 3 & read8(R_STAT);
+  bool ok = got_ly == ly && got_mode == mode;
+  printf("%-28s LY %3d, mode %d%s\n", what, got_ly, got_mode, ok ? "" : ", wrong");
+  if (!ok) failed++;
+}
+
+// run a single access from dot of line ly, and check whether it faulted
+void expect_access(char *what, int ly, int dot, char *source, uint16_t addr, bool blocked)
+{ struct program *program = parse_program(NULL, 0, source);
+  mem[addr] = 0x5a;
+  reg.a = 0xa5;
+  reg.hl = addr;
+  n_memory_faults = 0;
+  start_lcd_at(ly, dot);
+  run_program(program);
+  bool faulted = 1 == n_memory_faults && addr == memory_faults[0].addr;
+  // a blocked read gives ff, and a blocked write is lost
+  bool lost = 0x5a == mem[addr] && (0xa5 == reg.a || 0xff == reg.a);
+  bool ok = blocked ? faulted && lost : !n_memory_faults && !lost;
+  printf("%-28s %s%s\n", what, faulted ? "blocked" : "allowed", ok ? "" : ", wrong");
+  if (!ok) failed++;
+  free(program);
+}
+
+
+int main(int argc, char **argv)
+{ reset_hardware();
+
+  start_lcd_at(0, 0);
+  expect("line 0, start", 0, 2);
+  advance(19);
+  expect("19 cycles in", 0, 2);
+  advance(1);
+  expect("20 cycles in", 0, 3);
+  advance(42);
+  expect("62 cycles in", 0, 3);
+  advance(1);
+  expect("63 cycles in", 0, 0);
+  advance(50);
+  expect("113 cycles in", 0, 0);
+  advance(1);
+  expect("line 1", 1, 2);
+
+  start_lcd_at(143, 452);
+  expect("line 143, dot 452", 143, 0);
+  advance(1);
+  expect("a cycle later", 144, 1);
+  advance(9 * 114);
+  expect("nine lines later", 153, 1);
+  advance(113);
+  expect("end of line 153", 153, 1);
+  advance(1);
+  expect("back to line 0", 0, 2);
+
+  map_lcd_access();
+  expect_access("VRAM read, dot 76 (mode 2)", 0, 76, "  ld a, [hl]\n", 0x8000, false);
+  expect_access("VRAM read, dot 80 (mode 3)", 0, 80, "  ld a, [hl]\n", 0x8000, true);
+  expect_access("VRAM write, dot 248 (mode 3)", 0, 248, "  ld [hl], a\n", 0x9fff, true);
+  expect_access("VRAM write, dot 252 (mode 0)", 0, 252, "  ld [hl], a\n", 0x9fff, false);
+  expect_access("OAM read, dot 0 (mode 2)", 0, 0, "  ld a, [hl]\n", 0xfe00, true);
+  expect_access("OAM write, dot 80 (mode 3)", 0, 80, "  ld [hl], a\n", 0xfe9f, true);
+  expect_access("OAM read, dot 252 (mode 0)", 0, 252, "  ld a, [hl]\n", 0xfe00, false);
+  expect_access("OAM read, line 144 (mode 1)", 144, 80, "  ld a, [hl]\n", 0xfe00, false);
+  // timed from the start of the instruction, which here ends in mode 0
+  expect_access("OAM write, dot 244", 0, 244, "  ld [hl], a\n", 0xfe10, true);
+  // and here starts in mode 0, after the nop
+  expect_access("nop, VRAM read, dot 248", 0, 248, "  nop\n  ld a, [hl]\n", 0x8000, false);
+
+  printf("%s\n", failed ? "failed" : "ok");
+  return failed;
+}
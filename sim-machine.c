@@ -0,0 +1,32 @@
+#include "gb-sim.h"
+
+
+int main(int argc, char **argv)
+{ uint16_t dst = 0xc000;
+  uint16_t src = 0x0100;
+  uint16_t origin = 0x4000;
+  char *hello = "hello";
+  memcpy(&mem[src], hello, strlen(hello));
+  uint8_t len = strlen(hello);
+
+  struct symbol symbols[] =
+  { "dst", dst
+  , "src", src
+  , "len", len
+  };
+
+  struct program *program =
+    parse_program_file(symbols, listsize(symbols), "sim-hello.asm");
+
+  uint16_t end = assemble_program(program, origin);
+  printf("%zu instructions, %d bytes:", program->length, end - origin);
+  for (uint16_t a = origin; a < end; a++) printf(" %02x", mem[a]);
+  printf("\n");
+
+  reg.pc = origin;
+  run_machine(end);
+  printf("%d cycles\n", cycles);
+  status();
+  printf("%s\n", &mem[dst]);
+  return 0;
+}
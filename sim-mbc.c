@@ -0,0 +1,100 @@
+#include "gb-sim.h"
+
+
+// Bank switching on a made-up ROM whose every bank starts with its own
+// number (and ends with it, inverted), through the same register writes a
+// program makes: MBC1's bank 0 reading as 1 and its upper bits register (in
+// both modes), MBC5's ninth bit and real bank 0, and a bank past the end of
+// the ROM.
+
+struct rom *make_rom(uint8_t type, size_t banks)
+{ struct rom *rom = calloc(1, sizeof(struct rom));
+  rom->size = banks * 0x4000;
+  rom->data = calloc(1, rom->size);
+  for (size_t b = 0; b < banks; b++)
+  { uint8_t *bank = rom->data + b * 0x4000;
+    bank[0] = b;
+    bank[1] = b >> 8;
+    bank[0x3fff] = ~b;
+  }
+  rom->data[0x147] = type;
+  return rom;
+}
+
+int failed;
+
+// the bank in 0x4000-0x7fff, as a routine reading both ends of it sees it
+void expect(char *what, unsigned bank)
+{ static struct program *read_bank;
+  if (!read_bank)
+    read_bank = parse_program
+    ( NULL, 0
+    , "  ld hl, $7fff\n"
+      "  ld c, [hl]\n"
+      "  ld hl, $4000\n"
+      "  ld a, [hli]\n"
+      "  ld b, [hl]\n"
+    );
+  run_program(read_bank);
+  unsigned got = reg.b << 8 | reg.a;
+  bool ok = got == bank && (uint8_t)~bank == reg.c;
+  printf("%-32s bank %3u%s\n", what, got, ok ? "" : ", wrong");
+  if (!ok) failed++;
+}
+
+void expect_low(char *what, unsigned bank)
+{ unsigned got = read8(0x0001) << 8 | read8(0x0000);
+  printf("%-32s bank %3u at 0000%s\n", what, got, got == bank ? "" : ", wrong");
+  if (got != bank) failed++;
+}
+
+
+int main(int argc, char **argv)
+{ struct rom *mbc1 = make_rom(0x01, 128);
+  map_cartridge(mbc1);
+  expect("MBC1 at reset", 1);
+  write8(0x2000, 0);
+  expect("MBC1 bank 0", 1);
+  write8(0x2000, 5);
+  expect("MBC1 bank 5", 5);
+  write8(0x4000, 1);
+  expect("MBC1 upper bits 1", 0x25);
+  write8(0x2000, 0x20);
+  expect("MBC1 bank 0x20, upper bits 1", 0x21);
+  write8(0x4000, 3);
+  expect("MBC1 upper bits 3", 0x61);
+  expect_low("MBC1 mode 0", 0);
+  write8(0x6000, 1);
+  expect_low("MBC1 mode 1", 0x60);
+  write8(0x6000, 0);
+  expect_low("MBC1 back to mode 0", 0);
+
+  struct rom *mbc5 = make_rom(0x19, 512);
+  map_cartridge(mbc5);
+  expect("MBC5 at reset", 1);
+  write8(0x2000, 0x34);
+  expect("MBC5 bank 0x34", 0x34);
+  write8(0x3000, 1);
+  expect("MBC5 ninth bit", 0x134);
+  write8(0x2000, 0xff);
+  expect("MBC5 bank 0x1ff", 0x1ff);
+  write8(0x2000, 0);
+  write8(0x3000, 0);
+  expect("MBC5 bank 0", 0);
+
+  select_rom_bank(0x1fe);
+  expect("select_rom_bank 0x1fe", 0x1fe);
+  jmp_buf jump;
+  if (!setjmp(jump))
+  { panic_jump = &jump;
+    select_rom_bank(512);
+    printf("select_rom_bank 512 did not panic\n");
+    failed++;
+  }
+  else printf("select_rom_bank 512 panics\n");
+  panic_jump = NULL;
+  expect("and leaves the bank alone", 0x1fe);
+
+  printf("%s\n", failed ? "failed" : "ok");
+  return failed;
+}
@@ -0,0 +1,14 @@
+; hl = a * e, by shift and add
+mul8:
+  ld hl, 0
+  ld d, h
+  ld b, 8
+loop:
+  add hl, hl
+  add a, a
+  jr nc, skip
+  add hl, de
+skip:
+  dec b
+  jr nz, loop
+  ret
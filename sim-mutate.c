@@ -0,0 +1,51 @@
+#include "gb-sim.h"
+
+
+uint16_t mul8;
+
+uint16_t multiply(struct program *program, uint8_t a, uint8_t e)
+{ reg.sp = 0xfffe;
+  reg.bc = reg.de = 0xa5a5;   // whatever the caller left
+  reg.a = a;
+  reg.e = e;
+  call_program(program, mul8);
+  return reg.hl;
+}
+
+// a few products, as a test might be first written
+bool spot_check(struct program *program)
+{ return multiply(program, 3, 5) == 15 && multiply(program, 0, 7) == 0; }
+
+bool every_product(struct program *program)
+{ for (int a = 0; a < 256; a++)
+    for (int e = 0; e < 256; e++)
+      if (multiply(program, a, e) != a * e || 0xfffe != reg.sp) return false;
+  return true;
+}
+
+
+int main(int argc, char **argv)
+{ struct module *module = parse_module_file(NULL, 0, "sim-mul.asm");
+  module = link_modules(1, &module);
+  mul8 = find_label(module, "mul8");
+
+  struct mutation_test t = { module->program, spot_check };
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (!test_mutants(&t)) return 1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  printf("spot check:\n");
+  print_survivors(module, &t);
+  double seconds = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("%.0f mutants per second\n\n", t.n_mutants / seconds);
+  free(t.mutants);
+
+  // the survivor left is an equivalent mutant: d is loaded from h, while l
+  // is zero too
+  t.test = every_product;
+  if (!test_mutants(&t)) return 1;
+  printf("every product:\n");
+  print_survivors(module, &t);
+  free(t.mutants);
+  return 0;
+}
@@ -0,0 +1,30 @@
+#include "gb-sim.h"
+
+
+// A rewrite may only change flags that nothing reads afterwards.  daa reads
+// N, so cp 0 may not become or a before one (which would leave N clear, and
+// daa adjust as for an addition), though it may before a jr z.
+
+void suggest(char *name, char *source)
+{ struct program *program = parse_program(NULL, 0, source);
+  struct peephole *peepholes;
+  size_t n = suggest_peepholes(program, &peepholes);
+  printf("%s: %zu suggestions\n", name, n);
+  for (size_t i = 0; i < n; i++)
+  { char old[32], new[32];
+    printf
+    ( "  %zu: %s -> %s, saves %d cycles\n", peepholes[i].isn
+    , format_instruction(old, program->instructions[peepholes[i].isn])
+    , format_instruction(new, peepholes[i].with[0]), peepholes[i].cycles_saved
+    );
+  }
+  free(peepholes);
+  free(program);
+}
+
+
+int main(int argc, char **argv)
+{ suggest("before daa", "  cp 0\n  daa\n  and a\n");
+  suggest("before jr z", "  cp 0\n  jr z, :+\n  inc b\n: and a\n");
+  return 0;
+}
@@ -0,0 +1,42 @@
+#include "gb-sim.h"
+
+
+struct program *negate;
+
+bool negates_twice(struct registers *in, uint8_t *in_mem)
+{ run_program(negate);
+  return reg.a == in->a;
+}
+
+// not for -128, which has no positive counterpart
+bool flips_sign(struct registers *in, uint8_t *in_mem)
+{ return !in->a || (int8_t)reg.a < 0 != (int8_t)in->a < 0; }
+
+
+int main(int argc, char **argv)
+{ negate = parse_program_file(NULL, 0, "sim-negate.asm");
+
+  struct generator generators[] = { { LOC_A, .min = 0, .max = 0xff } };
+  struct property p =
+  { .program = negate
+  , .generators = generators
+  , .n_generators = listsize(generators)
+  , .cases = 10000000
+  };
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  p.holds = negates_twice;
+  bool twice = check_property(&p);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double seconds = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf
+  ( "negating twice: %s, %.1f million cases per second\n"
+  , twice ? "holds" : "fails", p.cases / seconds / 1e6
+  );
+
+  p.holds = flips_sign;
+  bool flips = check_property(&p);
+  printf("negating flips the sign: %s\n", flips ? "holds" : "fails");
+  return 0;
+}
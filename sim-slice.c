@@ -0,0 +1,52 @@
+#include "gb-sim.h"
+#include <time.h>
+
+
+double seconds()
+{ struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+int main(int argc, char **argv)
+{ struct program *negate = parse_program_file(NULL, 0, "sim-negate.asm");
+  struct program *extend = parse_program_file(NULL, 0, "sim-extend.asm");
+  struct sliced *s = malloc(sizeof(struct sliced));
+
+  // every value of a, in one pass of each
+  size_t bad = 0;
+  set_sliced(s, LOC_A, 0);
+  run_sliced(negate, s);
+  for (int lane = 0; lane < SLICE_LANES; lane++)
+  { struct registers r;
+    get_sliced(s, lane, &r);
+    bad += (int8_t)r.a != (int8_t)-lane;
+  }
+  set_sliced(s, LOC_A, 0);
+  run_sliced(extend, s);
+  for (int lane = 0; lane < SLICE_LANES; lane++)
+  { struct registers r;
+    get_sliced(s, lane, &r);
+    bad += (int16_t)r.hl != (int8_t)lane;
+  }
+  printf("%zu wrong, %d cycles\n", bad, s->cycles);
+
+  // the same, rotating the sign into carry instead of shifting it
+  struct program *rotate = parse_program
+  ( NULL, 0
+  , "  ld l, a\n"
+    "  rlca\n"
+    "  sbc a\n"
+    "  ld h, a\n"
+  );
+  reg = (struct registers){ 0 };
+  double t0 = seconds();
+  size_t mismatches = compare_programs(extend, rotate, LOC_A | LOC_B | LOC_F, true);
+  printf
+  ( "%zu of %d inputs differ, %.1f ms\n"
+  , mismatches, 1 << 20, (seconds() - t0) * 1e3
+  );
+
+  return 0;
+}
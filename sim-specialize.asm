@@ -0,0 +1,10 @@
+; hl = a * e, by shift and add (sim-mul.asm, run straight through)
+  ld hl, 0
+  ld d, h
+  ld b, 8
+: add hl, hl
+  add a, a
+  jr nc, :+
+  add hl, de
+: dec b
+  jr nz, :--
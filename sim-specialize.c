@@ -0,0 +1,79 @@
+#include "gb-sim.h"
+#include <time.h>
+
+
+double seconds()
+{ struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// time a sweep of every value of e
+void sweep(char *name, struct program *program)
+{ double t0 = seconds();
+  for (int j = 0; j < 4000; j++)
+    for (int e = 0; e < 256; e++)
+    { reg.a = 10;
+      reg.e = e;
+      run_program(program);
+    }
+  printf("%s: %d cycles, %.0f ns/run\n", name, cycles, (seconds() - t0) * 1e9 / 4000 / 256);
+}
+
+
+int main(int argc, char **argv)
+{ // multiplying by a constant: the multiplier in a is known, e is free, and
+  // the loop unrolls to shifts and adds with no branches left
+  struct program *program = parse_program_file(NULL, 0, "sim-specialize.asm");
+  reg.a = 10;
+  struct program *specialized = specialize_program(program, LOC_A | LOC_F, NULL, 0);
+  printf
+  ( "multiply: %zu instructions specialized to %zu, %zu mismatches\n"
+  , program->length, specialized->length
+  , check_specialization(program, specialized, LOC_A | LOC_F, NULL, 0)
+  );
+  sweep("original", program);
+  sweep("specialized", specialized);
+
+  // copying a string of known length: the copy loop is already run as a
+  // single bulk operation, and unrolling it would only be slower, so the
+  // original is kept.  The string itself is free, and the check samples it.
+  struct symbol symbols[] = { "dst", 0xc000, "src", 0x0100, "len", 5 };
+  struct mem_range string = { 0x0100, 5 };
+  struct program *hello = parse_program_file(symbols, listsize(symbols), "sim-hello.asm");
+  struct program *hello_specialized = specialize_program(hello, LOC_F, NULL, 0);
+  printf
+  ( "hello: %zu instructions specialized to %zu, %zu mismatches\n"
+  , hello->length, hello_specialized->length
+  , check_specialization(hello, hello_specialized, LOC_F, &string, 1)
+  );
+
+  // a call left in the unspecialized tail, after the loop counting b up is
+  // worked out: its target has to move with the tail
+  struct program *calls = parse_program
+  ( NULL, 0
+  , "  ld b, 0\n"
+    "  ld c, 4\n"
+    ": inc b\n"
+    "  dec c\n"
+    "  jr nz, :-\n"
+    "  call f\n"
+    "  jr :+\n"
+    "f:\n"
+    "  ld d, b\n"
+    "  ret\n"
+    ":\n"
+  );
+  reg.sp = 0xfffe;
+  reg.d = 0;
+  struct program *calls_specialized = specialize_program(calls, LOC_F, NULL, 0);
+  size_t mismatches =
+    check_specialization(calls, calls_specialized, LOC_F | LOC_SP, NULL, 0);
+  run_program(calls_specialized);
+  printf
+  ( "call: %zu instructions specialized to %zu, %zu mismatches, d=%d\n"
+  , calls->length, calls_specialized->length, mismatches, reg.d
+  );
+  // kept only if the call still lands on f, and ends as the original did
+  return mismatches || 4 != reg.d || calls->length == calls_specialized->length;
+}
@@ -0,0 +1,30 @@
+#include "gb-sim.h"
+
+
+// sign extension of a into hl, as in sim-extend.asm
+void extend(struct registers *r)
+{ r->hl = (int8_t)r->a; }
+
+// a times 3, with b to spare
+void times3(struct registers *r)
+{ r->a *= 3; }
+
+
+int main(int argc, char **argv)
+{ uint8_t constants[] = { 0x00, 0x01, 0xff };
+  struct superopt problems[] =
+  { { .target = extend, .inputs = LOC_A, .outputs = LOC_HL }
+  , { .target = times3, .inputs = LOC_A, .outputs = LOC_A, .scratch = LOC_B }
+  };
+  for (int i = 0; i < listsize(problems); i++)
+  { struct superopt *so = &problems[i];
+    so->constants = constants;
+    so->n_constants = listsize(constants);
+    so->max_cycles = 6;
+    struct program *program = superoptimize(so);
+    run_program(program);
+    printf("; %d cycles\n", cycles);
+    write_program(stdout, program);
+  }
+  return 0;
+}
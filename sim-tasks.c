@@ -0,0 +1,35 @@
+#include "gb-sim.h"
+
+
+// two multiplications, run a slice at a time as if by a scheduler
+int main(int argc, char **argv)
+{ struct module *module = parse_module_file(NULL, 0, "sim-mul.asm");
+  struct program *program = link_modules(1, &module)->program;
+  uint16_t mul8 = find_label(module, "mul8");
+
+  struct run runs[2];
+  reg.sp = 0xd000; reg.a = 200; reg.e = 100;
+  start_call(&runs[0], program, mul8);
+  reg.sp = 0xd100; reg.a = 12; reg.e = 34;
+  start_call(&runs[1], program, mul8);
+
+  int done = 0;
+  for (int slice = 0; 2 > done; slice++)
+  { struct run *run = &runs[slice % 2];
+    if (run->pc == program->length) continue;
+    enum run_status status = advance_run(run, 0, 24);
+    printf
+    ( "task %d: %2u cycles, %s\n"
+    , slice % 2, cycles, RUN_DONE == status ? "done" : "budget"
+    );
+    if (RUN_DONE == status) done++;
+  }
+
+  for (int i = 0; i < 2; i++)
+    printf
+    ( "task %d: hl = %5d, %llu cycles, %llu instructions\n"
+    , i, runs[i].reg.hl
+    , (unsigned long long)runs[i].cycles, (unsigned long long)runs[i].instructions
+    );
+  return 0;
+}
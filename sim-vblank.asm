@@ -0,0 +1,10 @@
+  ld a, $80
+  ldh $ff40, a
+  ld a, $01
+  ldh $ffff, a
+  ld b, frames
+: xor a, a
+  ldh $ff0f, a
+  halt
+  dec b
+  jr nz, :-
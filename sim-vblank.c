@@ -0,0 +1,20 @@
+#include "gb-sim.h"
+
+
+int main(int argc, char **argv)
+{ uint8_t frames = 60;
+
+  struct symbol symbols[] =
+  { "frames", frames
+  };
+
+  struct program *program =
+    parse_program_file(symbols, listsize(symbols), "sim-vblank.asm");
+
+  reset_hardware();
+  run_program(program);
+  printf("%d frames in %d cycles (%d per frame)\n", frames, cycles, FRAME_CYCLES);
+  printf("LY: %d\n", read8(R_LY));
+  status();
+  return 0;
+}